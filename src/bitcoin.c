@@ -92,39 +92,41 @@ out:
 }
 
 static const char *gbt_req = "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"], \"rules\" : [\"segwit\"]}]}\n";
+static const char *gbt_longpoll_req = "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\", \"longpoll\"], \"rules\" : [\"segwit\"], \"longpollid\": \"%s\"}]}\n";
 
-/* Request getblocktemplate from bitcoind already connected with a connsock_t
- * and then summarise the information to the most efficient set of data
- * required to assemble a mining template, storing it in a gbtbase_t structure */
-bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
+/* Request getblocktemplate from bitcoind, returning the whole response with
+ * res_val pointing to its result after checking we understand its rules.
+ * With a longpollid the request is held by bitcoind until it has a template
+ * newer than the one that id came from. */
+static json_t *get_gbt(connsock_t *cs, const char *longpollid, json_t **res_val)
 {
-	json_t *txn_array, *rules_array, *coinbase_aux, *res_val, *val;
-	const char *previousblockhash;
-	const char *witnessdata_check;
-	char hash_swap[32], tmp[32];
-	uint64_t coinbasevalue;
-	const char *target;
-	const char *flags;
-	const char *bits;
+	json_t *val, *rules_array;
 	const char *rule;
-	int version;
-	int curtime;
-	int height;
 	int i;
-	bool ret = false;
 
-	val = json_rpc_call(cs, gbt_req);
+	if (longpollid) {
+		char *req;
+
+		if (unlikely(strpbrk(longpollid, "\"\\"))) {
+			LOGWARNING("Invalid longpollid %s from %s:%s", longpollid, cs->url, cs->port);
+			return NULL;
+		}
+		ASPRINTF(&req, gbt_longpoll_req, longpollid);
+		val = json_rpc_longpoll(cs, req);
+		free(req);
+	} else
+		val = json_rpc_call(cs, gbt_req);
 	if (!val) {
 		LOGWARNING("%s:%s Failed to get valid json response to getblocktemplate", cs->url, cs->port);
-		return ret;
+		return NULL;
 	}
-	res_val = json_object_get(val, "result");
-	if (!res_val) {
+	*res_val = json_object_get(val, "result");
+	if (!*res_val) {
 		LOGWARNING("Failed to get result in json response to getblocktemplate");
-		goto out;
+		goto out_fail;
 	}
 
-	rules_array = json_object_get(res_val, "rules");
+	rules_array = json_object_get(*res_val, "rules");
 	if (rules_array) {
 		int rule_count =  json_array_size(rules_array);
 
@@ -132,74 +134,101 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 			rule = json_string_value(json_array_get(rules_array, i));
 			if (rule && *rule++ == '!' && !check_required_rule(rule)) {
 				LOGERR("Required rule not understood: %s", rule);
-				goto out;
+				goto out_fail;
 			}
 		}
 	}
+	return val;
+
+out_fail:
+	json_decref(val);
+	return NULL;
+}
+
+/* Summarise the fields of a getblocktemplate result needed for a mining
+ * template into gbt */
+static bool parse_gbtbase(json_t *res_val, gbtbase_t *gbt)
+{
+	const char *previousblockhash;
+	char hash_swap[32], tmp[32];
+	uint64_t coinbasevalue;
+	json_t *coinbase_aux;
+	const char *target;
+	const char *flags;
+	const char *bits;
+	int version;
+	int curtime;
+	int height;
 
 	previousblockhash = json_string_value(json_object_get(res_val, "previousblockhash"));
 	target = json_string_value(json_object_get(res_val, "target"));
-	txn_array = json_object_get(res_val, "transactions");
 	version = json_integer_value(json_object_get(res_val, "version"));
 	curtime = json_integer_value(json_object_get(res_val, "curtime"));
 	bits = json_string_value(json_object_get(res_val, "bits"));
 	height = json_integer_value(json_object_get(res_val, "height"));
 	coinbasevalue = json_integer_value(json_object_get(res_val, "coinbasevalue"));
-	witnessdata_check = json_string_value(json_object_get(res_val, "default_witness_commitment"));
 	coinbase_aux = json_object_get(res_val, "coinbaseaux");
 	flags = json_string_value(json_object_get(coinbase_aux, "flags"));
 
 	if (unlikely(!previousblockhash || !target || !version || !curtime || !bits || !coinbase_aux || !flags)) {
 		LOGERR("JSON failed to decode GBT %s %s %d %d %s %s", previousblockhash, target, version, curtime, bits, flags);
-		goto out;
+		return false;
 	}
 
-	gbt->json = json_object();
-
 	hex2bin(hash_swap, previousblockhash, 32);
 	swap_256(tmp, hash_swap);
 	__bin2hex(gbt->prevhash, tmp, 32);
-	json_object_set_new_nocheck(gbt->json, "prevhash", json_string_nocheck(gbt->prevhash));
-
 	strncpy(gbt->target, target, 65);
-	json_object_set_new_nocheck(gbt->json, "target", json_string_nocheck(gbt->target));
-
 	hex2bin(hash_swap, target, 32);
 	bswap_256(tmp, hash_swap);
 	gbt->diff = diff_from_target((uchar *)tmp);
-	json_object_set_new_nocheck(gbt->json, "diff", json_real(gbt->diff));
-
 	gbt->version = version;
-	json_object_set_new_nocheck(gbt->json, "version", json_integer(version));
-
 	gbt->curtime = curtime;
-	json_object_set_new_nocheck(gbt->json, "curtime", json_integer(curtime));
-
 	snprintf(gbt->ntime, 9, "%08x", curtime);
-	json_object_set_new_nocheck(gbt->json, "ntime", json_string_nocheck(gbt->ntime));
-
 	snprintf(gbt->bbversion, 9, "%08x", version);
-	json_object_set_new_nocheck(gbt->json, "bbversion", json_string_nocheck(gbt->bbversion));
-
 	snprintf(gbt->nbit, 9, "%s", bits);
-	json_object_set_new_nocheck(gbt->json, "nbit", json_string_nocheck(gbt->nbit));
-
 	gbt->coinbasevalue = coinbasevalue;
-	json_object_set_new_nocheck(gbt->json, "coinbasevalue", json_integer(coinbasevalue));
-
 	gbt->height = height;
-	json_object_set_new_nocheck(gbt->json, "height", json_integer(height));
-
 	gbt->flags = strdup(flags);
-	json_object_set_new_nocheck(gbt->json, "flags", json_string_nocheck(gbt->flags));
+	return true;
+}
 
-	json_object_set_new_nocheck(gbt->json, "transactions", json_deep_copy(txn_array));
+/* Request getblocktemplate from bitcoind already connected with a connsock_t
+ * and then summarise the information to the most efficient set of data
+ * required to assemble a mining template, storing it in a gbtbase_t structure */
+bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
+{
+	const char *witnessdata_check;
+	json_t *res_val, *val;
+	bool ret = false;
+
+	val = get_gbt(cs, NULL, &res_val);
+	if (!val)
+		return ret;
+	if (!parse_gbtbase(res_val, gbt))
+		goto out;
 
-	json_object_set_new_nocheck(gbt->json, "rules", json_deep_copy(rules_array));
+	gbt->json = json_object();
+	json_object_set_new_nocheck(gbt->json, "prevhash", json_string_nocheck(gbt->prevhash));
+	json_object_set_new_nocheck(gbt->json, "target", json_string_nocheck(gbt->target));
+	json_object_set_new_nocheck(gbt->json, "diff", json_real(gbt->diff));
+	json_object_set_new_nocheck(gbt->json, "version", json_integer(gbt->version));
+	json_object_set_new_nocheck(gbt->json, "curtime", json_integer(gbt->curtime));
+	json_object_set_new_nocheck(gbt->json, "ntime", json_string_nocheck(gbt->ntime));
+	json_object_set_new_nocheck(gbt->json, "bbversion", json_string_nocheck(gbt->bbversion));
+	json_object_set_new_nocheck(gbt->json, "nbit", json_string_nocheck(gbt->nbit));
+	json_object_set_new_nocheck(gbt->json, "coinbasevalue", json_integer(gbt->coinbasevalue));
+	json_object_set_new_nocheck(gbt->json, "height", json_integer(gbt->height));
+	json_object_set_new_nocheck(gbt->json, "flags", json_string_nocheck(gbt->flags));
+	json_object_set_new_nocheck(gbt->json, "transactions",
+				    json_deep_copy(json_object_get(res_val, "transactions")));
+	json_object_set_new_nocheck(gbt->json, "rules",
+				    json_deep_copy(json_object_get(res_val, "rules")));
 
 	// Bitcoind includes the default commitment, though it's not part of the
 	// BIP145 spec. As long as transactions aren't being filtered, it's useful
 	// To check against this during segwit's deployment.
+	witnessdata_check = json_string_value(json_object_get(res_val, "default_witness_commitment"));
 	json_object_set_new_nocheck(gbt->json, "default_witness_commitment", json_string_nocheck(witnessdata_check ? witnessdata_check : ""));
 
 	ret = true;
@@ -209,6 +238,124 @@ out:
 	return ret;
 }
 
+/* Point the template's transactions at the data in a getblocktemplate style
+ * transactions array, decoding their txids and hashes to binary. The array
+ * must be kept alive as long as the template. */
+bool gbttemplate_txns(gbttemplate_t *tmpl, const json_t *txn_array)
+{
+	int i;
+
+	tmpl->txns = json_array_size(txn_array);
+	tmpl->fees = 0;
+	if (!tmpl->txns)
+		return true;
+	tmpl->txn = ckzalloc(sizeof(gbttxn_t) * tmpl->txns);
+	for (i = 0; i < tmpl->txns; i++) {
+		json_t *arr_val = json_array_get(txn_array, i);
+		gbttxn_t *txn = &tmpl->txn[i];
+		char binswap[32];
+
+		if (tmpl->fees >= 0 && json_is_integer(json_object_get(arr_val, "fee")))
+			tmpl->fees += json_integer_value(json_object_get(arr_val, "fee"));
+		else
+			tmpl->fees = -1;
+		txn->data = json_string_value(json_object_get(arr_val, "data"));
+		if (unlikely(!txn->data)) {
+			LOGWARNING("json_string_value fail - cannot find transaction data");
+			return false;
+		}
+		txn->len = strlen(txn->data);
+		// Post-segwit, txid returns the tx hash without witness data
+		txn->hashhex = json_string_value(json_object_get(arr_val, "hash"));
+		txn->txidhex = json_string_value(json_object_get(arr_val, "txid"));
+		if (!txn->txidhex)
+			txn->txidhex = txn->hashhex;
+		if (unlikely(!txn->txidhex || !txn->hashhex)) {
+			LOGERR("Missing txid or hash for transaction in template");
+			return false;
+		}
+		if (unlikely(!hex2bin(binswap, txn->txidhex, 32))) {
+			LOGERR("Failed to hex2bin txid in template");
+			return false;
+		}
+		bswap_256(txn->txid, binswap);
+		if (unlikely(!hex2bin(binswap, txn->hashhex, 32))) {
+			LOGERR("Failed to hex2bin hash in template");
+			return false;
+		}
+		bswap_256(txn->hash, binswap);
+	}
+	return true;
+}
+
+/* As gen_gbtbase but keeping the parsed getblocktemplate response in a
+ * refcounted template that can be handed to the stratifier in process without
+ * copying or rendering the transactions. Longpolls if given a longpollid. */
+gbttemplate_t *gen_gbttemplate(connsock_t *cs, const char *longpollid)
+{
+	gbttemplate_t *tmpl;
+	json_t *res_val, *val, *rules_array;
+	int i;
+
+	val = get_gbt(cs, longpollid, &res_val);
+	if (!val)
+		return NULL;
+	tmpl = ckzalloc(sizeof(gbttemplate_t));
+	tmpl->refcount = 1;
+	tmpl->json = val;
+	if (!parse_gbtbase(res_val, &tmpl->base))
+		goto out_fail;
+	if (!gbttemplate_txns(tmpl, json_object_get(res_val, "transactions")))
+		goto out_fail;
+	rules_array = json_object_get(res_val, "rules");
+	for (i = 0; i < (int)json_array_size(rules_array); i++) {
+		const char *rule = json_string_value(json_array_get(rules_array, i));
+
+		if (rule && *rule == '!')
+			rule++;
+		if (rule && !safecmp(rule, "segwit"))
+			tmpl->segwit = true;
+	}
+	tmpl->witness_commitment = json_string_value(json_object_get(res_val, "default_witness_commitment"));
+	if (!tmpl->witness_commitment)
+		tmpl->witness_commitment = "";
+	tmpl->longpollid = json_string_value(json_object_get(res_val, "longpollid"));
+	return tmpl;
+
+out_fail:
+	gbttemplate_put(tmpl);
+	return NULL;
+}
+
+void gbttemplate_get(gbttemplate_t *tmpl)
+{
+	__sync_add_and_fetch(&tmpl->refcount, 1);
+}
+
+/* Drop a reference, freeing the template with the last one */
+void gbttemplate_put(gbttemplate_t *tmpl)
+{
+	if (__sync_sub_and_fetch(&tmpl->refcount, 1))
+		return;
+	dealloc(tmpl->base.flags);
+	dealloc(tmpl->txn);
+	json_decref(tmpl->json);
+	free(tmpl);
+}
+
+void blocktail_get(blocktail_t *tail)
+{
+	__sync_add_and_fetch(&tail->refcount, 1);
+}
+
+void blocktail_put(blocktail_t *tail)
+{
+	if (__sync_sub_and_fetch(&tail->refcount, 1))
+		return;
+	free(tail->hex);
+	free(tail);
+}
+
 void clear_gbtbase(gbtbase_t *gbt)
 {
 	dealloc(gbt->flags);
@@ -276,6 +423,33 @@ out:
 	return ret;
 }
 
+/* Request getblockheader from bitcoind for the 64 hex char hash, returning
+ * the referenced result object or NULL on failure. */
+json_t *get_blockheader(connsock_t *cs, const char *hash)
+{
+	json_t *val, *res_val = NULL;
+	char rpc_req[128];
+
+	if (unlikely(strlen(hash) != 64 || strspn(hash, "0123456789abcdefABCDEF") != 64)) {
+		LOGWARNING("Invalid hash passed to get_blockheader");
+		return NULL;
+	}
+	sprintf(rpc_req, "{\"method\": \"getblockheader\", \"params\": [\"%s\"]}\n", hash);
+	val = json_rpc_call(cs, rpc_req);
+	if (!val) {
+		LOGWARNING("%s:%s Failed to get valid json response to getblockheader", cs->url, cs->port);
+		return NULL;
+	}
+	res_val = json_object_get(val, "result");
+	if (!json_is_object(res_val)) {
+		LOGINFO("Failed to get result in json response to getblockheader");
+		res_val = NULL;
+	} else
+		json_incref(res_val);
+	json_decref(val);
+	return res_val;
+}
+
 static const char *bestblockhash_req = "{\"method\": \"getbestblockhash\"}\n";
 
 /* Request getbestblockhash from bitcoind. bitcoind 0.9+ only */
@@ -307,20 +481,24 @@ out:
 	return ret;
 }
 
-bool submit_block(connsock_t *cs, char *params)
+static const char submitblock_req[] = "{\"method\": \"submitblock\", \"params\": [\"";
+static const char submitblock_end[] = "\"]}\n";
+
+/* Submit the hex block passed as the pieces of the request between its
+ * beginning and end */
+static bool submit_blockv(connsock_t *cs, struct iovec *iov, const int iovcnt)
 {
 	json_t *val, *res_val;
-	int len, retries = 0;
 	const char *res_ret;
+	int retries = 0;
 	bool ret = false;
-	char *rpc_req;
 
-	len = strlen(params) + 64;
+	iov[0].iov_base = (void *)submitblock_req;
+	iov[0].iov_len = sizeof(submitblock_req) - 1;
+	iov[iovcnt - 1].iov_base = (void *)submitblock_end;
+	iov[iovcnt - 1].iov_len = sizeof(submitblock_end) - 1;
 retry:
-	rpc_req = ckalloc(len);
-	sprintf(rpc_req, "{\"method\": \"submitblock\", \"params\": [\"%s\"]}\n", params);
-	val = json_rpc_call(cs, rpc_req);
-	dealloc(rpc_req);
+	val = json_rpc_callv(cs, iov, iovcnt);
 	if (!val) {
 		LOGWARNING("%s:%s Failed to get valid json response to submitblock", cs->url, cs->port);
 		if (++retries < 5)
@@ -354,3 +532,25 @@ out:
 	json_decref(val);
 	return ret;
 }
+
+bool submit_block(connsock_t *cs, const char *params)
+{
+	struct iovec iov[3];
+
+	iov[1].iov_base = (void *)params;
+	iov[1].iov_len = strlen(params);
+	return submit_blockv(cs, iov, 3);
+}
+
+/* Submit a block made of its header and coinbase in hex followed by the
+ * workbase's precomputed transactions, without joining them. */
+bool submit_blocktail(connsock_t *cs, const char *head, const blocktail_t *tail)
+{
+	struct iovec iov[4];
+
+	iov[1].iov_base = (void *)head;
+	iov[1].iov_len = strlen(head);
+	iov[2].iov_base = tail->hex;
+	iov[2].iov_len = tail->hexlen;
+	return submit_blockv(cs, iov, 4);
+}
@@ -32,12 +32,61 @@ struct gbtbase {
 
 typedef struct gbtbase gbtbase_t;
 
+/* A transaction in a block template, its strings pointing into the template's
+ * json */
+struct gbttxn {
+	const char *data; /* Raw transaction in hex */
+	int len; /* Length of data */
+	const char *txidhex;
+	const char *hashhex;
+	uchar txid[32]; /* Byte swapped binary txid for the merkle tree */
+	uchar hash[32]; /* Byte swapped binary hash with witness data */
+};
+
+typedef struct gbttxn gbttxn_t;
+
+/* A parsed block template passed between threads without copying */
+struct gbttemplate {
+	int refcount;
+	gbtbase_t base; /* Summarised fields, its json unused */
+	json_t *json; /* Owner of every string the template refers to */
+	int txns;
+	gbttxn_t *txn;
+	int64_t fees; /* Total of the transaction fees, -1 if any are missing */
+	bool segwit;
+	const char *witness_commitment;
+	const char *longpollid; /* NULL if bitcoind doesn't support longpoll */
+};
+
+typedef struct gbttemplate gbttemplate_t;
+
+/* The transactions of a workbase serialised once, ready for any block solved
+ * from it: the transaction count including the coinbase which precedes the
+ * coinbase, and every transaction after it. */
+struct blocktail {
+	int refcount;
+	int txns; /* Including the coinbase */
+	char varint[12]; /* Hex transaction count */
+	char *hex; /* Hex transactions after the coinbase */
+	int hexlen;
+};
+
+typedef struct blocktail blocktail_t;
+
 bool validate_address(connsock_t *cs, const char *address);
 bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt);
 void clear_gbtbase(gbtbase_t *gbt);
+bool gbttemplate_txns(gbttemplate_t *tmpl, const json_t *txn_array);
+gbttemplate_t *gen_gbttemplate(connsock_t *cs, const char *longpollid);
+void gbttemplate_get(gbttemplate_t *tmpl);
+void gbttemplate_put(gbttemplate_t *tmpl);
+void blocktail_get(blocktail_t *tail);
+void blocktail_put(blocktail_t *tail);
 int get_blockcount(connsock_t *cs);
 bool get_blockhash(connsock_t *cs, int height, char *hash);
 bool get_bestblockhash(connsock_t *cs, char *hash);
-bool submit_block(connsock_t *cs, char *params);
+json_t *get_blockheader(connsock_t *cs, const char *hash);
+bool submit_block(connsock_t *cs, const char *params);
+bool submit_blocktail(connsock_t *cs, const char *head, const blocktail_t *tail);
 
 #endif /* BITCOIN_H */
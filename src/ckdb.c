@@ -889,6 +889,9 @@ static char *listener_base = "listener";
 static char *process_name = "main";
 static char logname_db[512];
 static char logname_io[512];
+// Hourly log sinks for the above, without flock since only ckdb writes them
+static rotating_log_t *rlog_db;
+static rotating_log_t *rlog_io;
 static char *dbcode;
 static bool no_data_log = false;
 
@@ -1191,29 +1194,6 @@ static char *hour_filename(const char *path, const char *name, time_t when)
 	return filename;
 }
 
-// low spec version of rotating_log() - no locking
-static bool rotating_log_nolock(char *msg, char *prefix)
-{
-	char *filename;
-	FILE *fp;
-	bool ok = false;
-
-	filename = rotating_filename(prefix, time(NULL));
-	fp = fopen(filename, "a+e");
-	if (unlikely(!fp)) {
-		LOGERR("Failed to fopen %s in rotating_log!", filename);
-		goto stageleft;
-	}
-	fprintf(fp, "%s\n", msg);
-	fclose(fp);
-	ok = true;
-
-stageleft:
-	free(filename);
-
-	return ok;
-}
-
 static void log_queue_message(char *msg, bool db)
 {
 	K_ITEM *lq_item;
@@ -1523,6 +1503,71 @@ tamanee:
 	}
 }
 
+static CKSTREAM *stream_get(CKSTREAM *stream)
+{
+	mutex_lock(&stream->lock);
+	stream->refs++;
+	mutex_unlock(&stream->lock);
+	return stream;
+}
+
+void stream_put(CKSTREAM *stream)
+{
+	bool last;
+
+	mutex_lock(&stream->lock);
+	last = (--stream->refs == 0);
+	mutex_unlock(&stream->lock);
+	if (last) {
+		close(stream->sockd);
+		mutex_destroy(&stream->lock);
+		pthread_cond_destroy(&stream->cond);
+		free(stream->buf);
+		free(stream);
+	}
+}
+
+// Stop both stream threads, messages still being processed will be discarded
+static void stream_kill(CKSTREAM *stream)
+{
+	mutex_lock(&stream->lock);
+	if (!stream->dead) {
+		stream->dead = true;
+		shutdown(stream->sockd, SHUT_RDWR);
+		pthread_cond_signal(&stream->cond);
+	}
+	mutex_unlock(&stream->lock);
+}
+
+// Queue a reply frame for the stream writer
+static void stream_reply(CKSTREAM *stream, const char *msg)
+{
+	uint32_t msglen;
+	size_t len;
+
+	len = strlen(msg);
+	if (!len)
+		return;
+	mutex_lock(&stream->lock);
+	if (!stream->dead) {
+		if (stream->len + len + 4 > stream->size) {
+			stream->size = stream->len + len + 4 + STREAM_BUFSIZ;
+			stream->buf = realloc(stream->buf, stream->size);
+			if (!stream->buf) {
+				quithere(1, "realloc (%d) OOM",
+					 (int)(stream->size));
+			}
+		}
+		msglen = htole32(len);
+		memcpy(stream->buf + stream->len, &msglen, 4);
+		memcpy(stream->buf + stream->len + 4, msg, len);
+		stream->len += len + 4;
+		stream->replies++;
+		pthread_cond_signal(&stream->cond);
+	}
+	mutex_unlock(&stream->lock);
+}
+
 #define ckdb_unix_msg(_typ, _sockd, _msg, _ml, _dup) \
 	_ckdb_unix_msg(_typ, _sockd, _msg, _ml, _dup, WHERE_FFL_HERE)
 
@@ -1536,6 +1581,14 @@ static void _ckdb_unix_msg(enum reply_type reply_typ, int sockd, char *msg,
 	char *ptr;
 	tv_t now;
 
+	// Replies to stream messages all go back on the stream
+	if (ml && ml->stream) {
+		stream_reply(ml->stream, msg);
+		if (!dup)
+			free(msg);
+		return;
+	}
+
 	switch(reply_typ) {
 		case REPLIER_POOL:
 			reply_root = replies_pool_root;
@@ -4661,6 +4714,9 @@ static void *breaker(void *arg)
 		DATA_MSGLINE(msgline, bq->ml_item);
 		setnow(&(msgline->broken));
 		copy_tv(&(msgline->accepted), &(bq->accepted));
+		// The msgline now holds the stream reference
+		msgline->stream = bq->stream;
+		bq->stream = NULL;
 		if (SEQALL_LOG) {
 			K_ITEM *seqall;
 			if (bq->ml_item) {
@@ -5744,8 +5800,8 @@ static void *logger(__maybe_unused void *arg)
 	setnow(&now);
 	snprintf(buf, sizeof(buf), "logstart.%ld,%ld",
 				   now.tv_sec, now.tv_usec);
-	LOGFILE(buf, logname_db);
-	LOGFILE(buf, logname_io);
+	LOGFILE(buf, rlog_db);
+	LOGFILE(buf, rlog_io);
 
 	while (!everyone_die) {
 		K_WLOCK(logqueue_free);
@@ -5755,9 +5811,9 @@ static void *logger(__maybe_unused void *arg)
 			DATA_LOGQUEUE(lq, lq_item);
 			if (lq->db) {
 				if (db_logger)
-					LOGFILE(lq->msg, logname_db);
+					rotating_log_add(rlog_db, lq->msg);
 			} else
-				LOGFILE(lq->msg, logname_io);
+				rotating_log_add(rlog_io, lq->msg);
 			FREENULL(lq->msg);
 
 			K_WLOCK(logqueue_free);
@@ -5768,6 +5824,9 @@ static void *logger(__maybe_unused void *arg)
 				lq_item = NULL;
 			K_WUNLOCK(logqueue_free);
 		}
+		// Write everything queued since the last pass in one go
+		rotating_log_flush(rlog_db);
+		rotating_log_flush(rlog_io);
 		cksleep_ms(42);
 	}
 
@@ -5776,8 +5835,8 @@ static void *logger(__maybe_unused void *arg)
 	setnow(&now);
 	snprintf(buf, sizeof(buf), "logstopping.%d.%ld,%ld",
 				   count, now.tv_sec, now.tv_usec);
-	LOGFILE(buf, logname_db);
-	LOGFILE(buf, logname_io);
+	LOGFILE(buf, rlog_db);
+	LOGFILE(buf, rlog_io);
 	if (count)
 		LOGERR("%s", buf);
 	lq_item = STORE_WHEAD(logqueue_store);
@@ -5785,9 +5844,9 @@ static void *logger(__maybe_unused void *arg)
 	while (lq_item) {
 		DATA_LOGQUEUE(lq, lq_item);
 		if (lq->db)
-			LOGFILE(lq->msg, logname_db);
+			rotating_log_add(rlog_db, lq->msg);
 		else
-			LOGFILE(lq->msg, logname_io);
+			rotating_log_add(rlog_io, lq->msg);
 		FREENULL(lq->msg);
 		count--;
 		setnow(&now);
@@ -5798,6 +5857,8 @@ static void *logger(__maybe_unused void *arg)
 		}
 		lq_item = lq_item->next;
 	}
+	rotating_log_flush(rlog_db);
+	rotating_log_flush(rlog_io);
 	K_WUNLOCK(logqueue_free);
 
 	logger_using_data = false;
@@ -5805,8 +5866,8 @@ static void *logger(__maybe_unused void *arg)
 	setnow(&now);
 	snprintf(buf, sizeof(buf), "logstop.%ld,%ld",
 				   now.tv_sec, now.tv_usec);
-	LOGFILE(buf, logname_db);
-	LOGFILE(buf, logname_io);
+	LOGFILE(buf, rlog_db);
+	LOGFILE(buf, rlog_io);
 	LOGWARNING("%s", buf);
 
 	return NULL;
@@ -6645,6 +6706,185 @@ skippy:
 	return NULL;
 }
 
+/* Read frames from a ckpool stream and queue each message in them the same
+ *  as sockrun() does, but all replies return on the stream */
+static void *streamrun(void *arg)
+{
+	CKSTREAM *stream = (CKSTREAM *)arg;
+	K_ITEM *bq_item = NULL;
+	BREAKQUEUE *bq = NULL;
+	char *frame, *line, *next, *end;
+	int ret, count, seqentryflags;
+	char nbuf[64];
+	tv_t now, nowacc;
+
+	pthread_detach(pthread_self());
+
+	snprintf(nbuf, sizeof(nbuf), "db%s_%c%s",
+		 dbcode, stream->source[0], __func__);
+	LOCK_INIT(nbuf);
+	rename_proc(nbuf);
+
+	while (!everyone_die) {
+		ret = wait_read_select(stream->sockd, 1);
+		if (ret == 0)
+			continue;
+		if (ret < 0) {
+			int e = errno;
+			LOGERR("%s() Failed to select on %s stream (%d:%s)",
+				__func__, stream->source, e, strerror(e));
+			break;
+		}
+		setnow(&nowacc);
+		frame = recv_unix_frame(stream->sockd, RECV_UNIX_TIMEOUT2,
+					RECV_UNIX_TIMEOUT2);
+		if (!frame)
+			break;
+		setnow(&now);
+		stream->frames++;
+
+		count = 0;
+		for (line = frame; line; line = next) {
+			next = strchr(line, '\n');
+			if (next)
+				*(next++) = '\0';
+			end = line + strlen(line) - 1;
+			while (end >= line && *end == '\r')
+				*(end--) = '\0';
+			// An empty message wont get a reply
+			if (!*line)
+				continue;
+
+			seqentryflags = SE_SOCKET;
+			// Flag all work for pool0 until the reload completes
+			if (prereload || reloading) {
+				seqentryflags = SE_EARLYSOCK;
+				K_WLOCK(workqueue_free);
+				earlysock_left++;
+				K_WUNLOCK(workqueue_free);
+			}
+
+			K_WLOCK(breakqueue_free);
+			bq_item = k_unlink_head(breakqueue_free);
+			K_WUNLOCK(breakqueue_free);
+			DATA_BREAKQUEUE(bq, bq_item);
+			bq->buf = strdup(line);
+			if (!bq->buf)
+				quithere(1, "strdup (%d) OOM", (int)strlen(line));
+			bq->source = stream->source;
+			bq->access = stream->access;
+			copy_tv(&(bq->accepted), &nowacc);
+			copy_tv(&(bq->now), &now);
+			bq->seqentryflags = seqentryflags;
+			bq->sockd = stream->sockd;
+			bq->stream = stream_get(stream);
+			K_WLOCK(breakqueue_free);
+			if (max_sockd_count < ++sockd_count)
+				max_sockd_count = sockd_count;
+			k_add_tail(cmd_breakqueue_store, bq_item);
+			K_WUNLOCK(breakqueue_free);
+			count++;
+		}
+		free(frame);
+
+		if (count) {
+			stream->msgs += count;
+			mutex_lock(&bq_cmd_waitlock);
+			bq_cmd_signals++;
+			if (count > 1)
+				pthread_cond_broadcast(&bq_cmd_waitcond);
+			else
+				pthread_cond_signal(&bq_cmd_waitcond);
+			mutex_unlock(&bq_cmd_waitlock);
+		}
+	}
+
+	stream_kill(stream);
+
+	LOGWARNING("%s() %s stream closed: frames=%"PRIu64" msgs=%"PRIu64
+		   " replies=%"PRIu64,
+		   __func__, stream->source, stream->frames, stream->msgs,
+		   stream->replies);
+
+	stream_put(stream);
+
+	return NULL;
+}
+
+/* Write queued reply frames to a ckpool stream, swapping buffers so replies
+ *  keep queueing while a batch is written */
+static void *streamreply(void *arg)
+{
+	CKSTREAM *stream = (CKSTREAM *)arg;
+	char *buf = NULL, *tmp;
+	size_t len, size = 0, tmpsiz;
+	char nbuf[64];
+	int ret;
+
+	pthread_detach(pthread_self());
+
+	snprintf(nbuf, sizeof(nbuf), "db%s_%c%s",
+		 dbcode, stream->source[0], __func__);
+	LOCK_INIT(nbuf);
+	rename_proc(nbuf);
+
+	while (42) {
+		mutex_lock(&stream->lock);
+		while (!stream->len && !stream->dead)
+			cond_wait(&stream->cond, &stream->lock);
+		if (stream->dead) {
+			mutex_unlock(&stream->lock);
+			break;
+		}
+		tmp = stream->buf;
+		tmpsiz = stream->size;
+		len = stream->len;
+		stream->buf = buf;
+		stream->size = size;
+		stream->len = 0;
+		buf = tmp;
+		size = tmpsiz;
+		mutex_unlock(&stream->lock);
+
+		ret = write_length(stream->sockd, buf, len);
+		if (ret < (int)len) {
+			LOGERR("%s() %s stream failed to write %d bytes",
+				__func__, stream->source, (int)len);
+			stream_kill(stream);
+			break;
+		}
+	}
+
+	free(buf);
+	stream_put(stream);
+
+	return NULL;
+}
+
+static void stream_start(ckpool_t *this, int sockd)
+{
+	pthread_t run_pt, reply_pt;
+	CKSTREAM *stream;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		quithere(1, "calloc (%d) OOM", (int)sizeof(*stream));
+	stream->sockd = sockd;
+	stream->source = (char *)(this->gdata);
+	stream->access = *(int *)(this->cdata);
+	mutex_init(&stream->lock);
+	cond_init(&stream->cond);
+	// One reference each for streamrun() and streamreply()
+	stream->refs = 2;
+	stream_reply(stream, CKDB_STREAM_OK);
+
+	LOGWARNING("%s() %s stream started on socket %d",
+		   __func__, stream->source, sockd);
+
+	create_pthread(&run_pt, streamrun, stream);
+	create_pthread(&reply_pt, streamreply, stream);
+}
+
 static void *sockrun(void *arg)
 {
 	ckpool_t *this = (ckpool_t *)arg;
@@ -6707,7 +6947,7 @@ static void *sockrun(void *arg)
 		sock_acc[thissock]++;
 
 		setnow(&now1);
-		buf = recv_unix_msg_tmo2(sockd, RECV_UNIX_TIMEOUT1, RECV_UNIX_TIMEOUT2);
+		buf = recv_unix_frame(sockd, RECV_UNIX_TIMEOUT1, RECV_UNIX_TIMEOUT2);
 		// Once we've read the message
 		setnow(&now);
 		sock_recv_us[thissock] += us_tvdiff(&now, &now1);
@@ -6718,6 +6958,13 @@ static void *sockrun(void *arg)
 			while (end >= buf && (*end == '\n' || *end == '\r'))
 				*(end--) = '\0';
 		}
+		// A stream keeps reading, everything else gets one message
+		if (buf && strcmp(buf, CKDB_STREAM) == 0) {
+			free(buf);
+			stream_start(this, sockd);
+			continue;
+		}
+		shutdown(sockd, SHUT_RD);
 		if (!buf || !*buf) {
 			// An empty message wont get a reply
 			if (!buf) {
@@ -6777,6 +7024,7 @@ static void *sockrun(void *arg)
 			copy_tv(&(bq->now), &now);
 			bq->seqentryflags = seqentryflags;
 			bq->sockd = sockd;
+			bq->stream = NULL;
 			K_WLOCK(breakqueue_free);
 			if (max_sockd_count < ++sockd_count)
 				max_sockd_count = sockd_count;
@@ -7220,6 +7468,7 @@ static void reload_line(char *filename, char *buf, uint64_t count)
 		copy_tv(&(bq->now), &now);
 		bq->seqentryflags = SE_RELOAD;
 		bq->sockd = -1;
+		bq->stream = NULL;
 		bq->count = count;
 		bq->filename = filename;
 
@@ -9393,6 +9642,8 @@ int main(int argc, char **argv)
 	// -io is everything else
 	snprintf(logname_io, sizeof(logname_io), "%s%s-io%s-",
 				ckp.logdir, ckp.name, dbcode);
+	rlog_db = create_rotating_log(logname_db, false);
+	rlog_io = create_rotating_log(logname_io, false);
 
 	setnow(&now);
 	srandom((unsigned int)(now.tv_usec * 4096 + now.tv_sec % 4096));
@@ -757,7 +757,7 @@ enum cmd_values {
 #define ROLL_S 3600
 
 #define LOGQUE(_msg, _db) log_queue_message(_msg, _db)
-#define LOGFILE(_msg, _prefix) rotating_log_nolock(_msg, _prefix)
+#define LOGFILE(_msg, _rlog) rotating_log(_rlog, _msg)
 #define LOGDUP "dup."
 
 // ***
@@ -1169,6 +1169,31 @@ extern K_STORE *intransient_store;
 
 extern char *intransient_fields[];
 
+/* CKSTREAM - a persistent connection from ckpool carrying many messages
+ *  per frame, with replies queued back on it as they complete
+ * Freed when the reader, writer and all messages using it are done */
+typedef struct ckstream {
+	int sockd;
+	char *source;
+	int access;
+	mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	bool dead;
+	// reply frames waiting to be written
+	char *buf;
+	size_t len;
+	size_t size;
+	uint64_t frames;
+	uint64_t msgs;
+	uint64_t replies;
+} CKSTREAM;
+
+// Initial and growth size of the stream reply buffer
+#define STREAM_BUFSIZ 65536
+
+extern void stream_put(CKSTREAM *stream);
+
 // MSGLINE
 typedef struct msgline {
 	int which_cmds;
@@ -1192,6 +1217,7 @@ typedef struct msgline {
 	K_TREE *trf_root;
 	K_STORE *trf_store;
 	int sockd;
+	CKSTREAM *stream;
 } MSGLINE;
 
 #define ALLOC_MSGLINE 8192
@@ -1213,6 +1239,7 @@ typedef struct breakqueue {
 	tv_t now; // msg read or line read
 	int seqentryflags;
 	int sockd;
+	CKSTREAM *stream;
 	enum cmd_values cmdnum;
 	K_ITEM *ml_item;
 	uint64_t count;
@@ -47,6 +47,10 @@ void free_msgline_data(K_ITEM *item, bool t_lock, bool t_cull)
 		msgline->trf_store = k_free_store(msgline->trf_store);
 	}
 	FREENULL(msgline->msg);
+	if (msgline->stream) {
+		stream_put(msgline->stream);
+		msgline->stream = NULL;
+	}
 }
 
 void free_users_data(K_ITEM *item)
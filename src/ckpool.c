@@ -9,6 +9,7 @@
 
 #include "config.h"
 
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
@@ -20,6 +21,7 @@
 #include <getopt.h>
 #include <grp.h>
 #include <jansson.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +33,7 @@
 #include "generator.h"
 #include "stratifier.h"
 #include "connector.h"
+#include "sha2.h"
 
 ckpool_t *global_ckp;
 
@@ -53,20 +56,134 @@ static bool open_logfile(ckpool_t *ckp)
 	return true;
 }
 
-static void proclog(ckpool_t *ckp, char *msg)
+/* Bytes of formatted log lines each thread can have waiting for the logger */
+#define LOGRING_SIZE (64 * 1024)
+/* Largest single write the logger batches lines into */
+#define LOGBATCH_SIZE (256 * 1024)
+
+/* Byte ring of formatted lines with a single producer, the thread owning it,
+ * and a single consumer, the logger. Rings of exited threads are handed to
+ * new threads. */
+struct logring {
+	struct logring *next;
+	uint64_t head __attribute__((aligned(64))); /* Bytes written */
+	uint64_t tail __attribute__((aligned(64))); /* Bytes logged */
+	bool inuse;
+	char buf[LOGRING_SIZE];
+};
+
+typedef struct logring logring_t;
+
+static logring_t *logrings;
+static mutex_t logring_lock;
+static pthread_key_t logring_key;
+static bool logger_active;
+static int logger_efd;
+static int logger_sleeping;
+/* Threads waiting for room in a full ring, woken after each drain */
+static mutex_t logring_wait_lock;
+static pthread_cond_t logring_wait_cond;
+static int logring_waiters;
+static int64_t logger_dropped; /* Lines the logger couldn't log itself */
+
+static __thread logring_t *thread_logring;
+static __thread bool logger_thread;
+
+/* Cached timestamp prefix, redone only when the second changes */
+static __thread time_t stamp_sec;
+static __thread char stamp_prefix[64];
+static __thread int stamp_len;
+
+static void release_logring(void *arg)
 {
-	time_t log_t;
+	logring_t *ring = (logring_t *)arg;
 
-	if (unlikely(!msg)) {
-		fprintf(stderr, "Proclog received null message");
-		return;
+	__atomic_store_n(&ring->inuse, false, __ATOMIC_RELEASE);
+}
+
+static logring_t *get_logring(void)
+{
+	logring_t *ring;
+
+	if (likely(thread_logring))
+		return thread_logring;
+
+	mutex_lock(&logring_lock);
+	for (ring = logrings; ring; ring = ring->next) {
+		if (!__atomic_load_n(&ring->inuse, __ATOMIC_ACQUIRE))
+			break;
 	}
-	if (unlikely(!strlen(msg))) {
-		fprintf(stderr, "Proclog received zero length message");
-		free(msg);
-		return;
+	if (!ring) {
+		ring = ckzalloc(sizeof(logring_t));
+		ring->next = logrings;
+		__atomic_store_n(&logrings, ring, __ATOMIC_RELEASE);
+	}
+	ring->inuse = true;
+	mutex_unlock(&logring_lock);
+
+	pthread_setspecific(logring_key, ring);
+	thread_logring = ring;
+	return ring;
+}
+
+static void wake_logger(void)
+{
+	/* Only wake the logger when it's asleep */
+	if (__atomic_load_n(&logger_sleeping, __ATOMIC_SEQ_CST) &&
+	    __sync_bool_compare_and_swap(&logger_sleeping, 1, 0)) {
+		uint64_t val = 1;
+
+		if (unlikely(write(logger_efd, &val, sizeof(val)) != sizeof(val)))
+			fprintf(stderr, "Failed to wake logger\n");
+	}
+}
+
+static bool logring_full(logring_t *ring, const uint64_t head, const int len)
+{
+	return head + len - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) > LOGRING_SIZE;
+}
+
+/* Copy a line into this thread's ring, waiting for the logger to make room if
+ * it's full. The logger itself can't wait on itself so counts the lines it
+ * drops instead. */
+static void logring_add(const char *line, int len)
+{
+	logring_t *ring = get_logring();
+	uint64_t head = ring->head, pos;
+	int first;
+
+	if (unlikely(len > LOGRING_SIZE))
+		len = LOGRING_SIZE;
+	if (unlikely(logring_full(ring, head, len))) {
+		if (logger_thread) {
+			logger_dropped++;
+			return;
+		}
+		mutex_lock(&logring_wait_lock);
+		__atomic_add_fetch(&logring_waiters, 1, __ATOMIC_SEQ_CST);
+		while (logring_full(ring, head, len)) {
+			wake_logger();
+			cond_wait(&logring_wait_cond, &logring_wait_lock);
+		}
+		__atomic_sub_fetch(&logring_waiters, 1, __ATOMIC_SEQ_CST);
+		mutex_unlock(&logring_wait_lock);
+	}
+	pos = head % LOGRING_SIZE;
+	first = LOGRING_SIZE - pos;
+	if (first >= len)
+		memcpy(ring->buf + pos, line, len);
+	else {
+		memcpy(ring->buf + pos, line, first);
+		memcpy(ring->buf, line + first, len - first);
 	}
-	log_t = time(NULL);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+	wake_logger();
+}
+
+static void log_write(ckpool_t *ckp, const char *buf, int len)
+{
+	time_t log_t = time(NULL);
+
 	/* Reopen log file every minute, allowing us to move/rename it and
 	 * create a new logfile */
 	if (log_t > ckp->lastopen_t + 60) {
@@ -75,58 +192,340 @@ static void proclog(ckpool_t *ckp, char *msg)
 	}
 
 	flock(ckp->logfd, LOCK_EX);
-	fprintf(ckp->logfp, "%s", msg);
+	while (len > 0) {
+		int ret = write(ckp->logfd, buf, len);
+
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to write to logfile with errno %d\n", errno);
+			break;
+		}
+		buf += ret;
+		len -= ret;
+	}
 	flock(ckp->logfd, LOCK_UN);
+}
+
+/* Move everything waiting in the rings into buf, writing it out whenever it
+ * fills. Returns how many bytes are left in buf. */
+static int drain_logrings(ckpool_t *ckp, char *buf, int len)
+{
+	logring_t *ring;
+
+	for (ring = __atomic_load_n(&logrings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+
+		while (tail < head) {
+			int pos = tail % LOGRING_SIZE, copy = head - tail;
+
+			if (copy > LOGRING_SIZE - pos)
+				copy = LOGRING_SIZE - pos;
+			if (copy > LOGBATCH_SIZE - len)
+				copy = LOGBATCH_SIZE - len;
+			memcpy(buf + len, ring->buf + pos, copy);
+			len += copy;
+			tail += copy;
+			if (len == LOGBATCH_SIZE) {
+				log_write(ckp, buf, len);
+				len = 0;
+			}
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+	}
+	/* Any thread that found its ring full before the tails moved is
+	 * counted in waiters by now */
+	if (__atomic_load_n(&logring_waiters, __ATOMIC_SEQ_CST)) {
+		mutex_lock(&logring_wait_lock);
+		pthread_cond_broadcast(&logring_wait_cond);
+		mutex_unlock(&logring_wait_lock);
+	}
+	return len;
+}
+
+static void log_stamp(char *stamp);
 
-	free(msg);
+/* Single thread writing out the lines every other thread formats into its
+ * own ring, batching as many as are waiting into each write. */
+static void *logger(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	char *buf = ckalloc(LOGBATCH_SIZE);
+
+	pthread_detach(pthread_self());
+	rename_proc("logger");
+	logger_thread = true;
+
+	while (42) {
+		struct pollfd pfd;
+		uint64_t val;
+		int len;
+
+		if (unlikely(logger_dropped)) {
+			char line[192];
+
+			log_stamp(line);
+			len = strlen(line);
+			len += snprintf(line + len, sizeof(line) - len,
+					" Logger dropped %"PRId64" of its own lines\n", logger_dropped);
+			log_write(ckp, line, len);
+			logger_dropped = 0;
+		}
+		len = drain_logrings(ckp, buf, 0);
+		if (len) {
+			log_write(ckp, buf, len);
+			continue;
+		}
+		/* Announce we're sleeping then look once more so a line added
+		 * in between isn't left waiting */
+		__atomic_store_n(&logger_sleeping, 1, __ATOMIC_SEQ_CST);
+		len = drain_logrings(ckp, buf, 0);
+		if (len) {
+			__atomic_store_n(&logger_sleeping, 0, __ATOMIC_RELAXED);
+			log_write(ckp, buf, len);
+			continue;
+		}
+		pfd.fd = logger_efd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) > 0 && read(logger_efd, &val, sizeof(val)) < 0)
+			fprintf(stderr, "Failed to read logger eventfd\n");
+		__atomic_store_n(&logger_sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return NULL;
 }
 
-/* Log everything to the logfile, but display warnings on the console as well */
-void logmsg(int loglevel, const char *fmt, ...) {
-	if (global_ckp->loglevel >= loglevel && fmt) {
-		int logfd = global_ckp->logfd;
-		char *buf = NULL;
+/* Timestamp in the form [2016-01-01 00:00:00.000] using the cached prefix
+ * for the current second. Stamp needs room for the prefix plus 5 bytes. */
+static void log_stamp(char *stamp)
+{
+	int ms;
+	tv_t now;
+
+	tv_time(&now);
+	if (unlikely(now.tv_sec != stamp_sec)) {
 		struct tm tm;
-		tv_t now_tv;
-		int ms;
+
+		localtime_r(&now.tv_sec, &tm);
+		stamp_len = snprintf(stamp_prefix, sizeof(stamp_prefix),
+				     "[%d-%02d-%02d %02d:%02d:%02d.",
+				     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+				     tm.tm_hour, tm.tm_min, tm.tm_sec);
+		stamp_len = MIN(stamp_len, (int)sizeof(stamp_prefix) - 1);
+		stamp_sec = now.tv_sec;
+	}
+	ms = (int)(now.tv_usec / 1000);
+	memcpy(stamp, stamp_prefix, stamp_len);
+	stamp[stamp_len] = '0' + ms / 100;
+	stamp[stamp_len + 1] = '0' + ms / 10 % 10;
+	stamp[stamp_len + 2] = '0' + ms % 10;
+	stamp[stamp_len + 3] = ']';
+	stamp[stamp_len + 4] = '\0';
+}
+
+/* Log everything to the logfile, but display warnings on the console as well.
+ * Level checks are done by the LOG macros before anything is formatted. */
+void logmsg(int loglevel, const char *fmt, ...) {
+	if (fmt) {
+		int logfd = global_ckp->logfd, err = errno, len;
+		char msg[DEFLOGBUFSIZ + 256], line[DEFLOGBUFSIZ + 512];
+		char *buf = msg, *logline = line;
+		char stamp[72];
 		va_list ap;
-		char stamp[128];
 
 		va_start(ap, fmt);
-		VASPRINTF(&buf, fmt, ap);
+		len = vsnprintf(msg, sizeof(msg), fmt, ap);
 		va_end(ap);
+		/* Only unusually long messages need the heap */
+		if (unlikely(len >= (int)sizeof(msg))) {
+			va_start(ap, fmt);
+			VASPRINTF(&buf, fmt, ap);
+			va_end(ap);
+		}
 
-		tv_time(&now_tv);
-		ms = (int)(now_tv.tv_usec / 1000);
-		localtime_r(&(now_tv.tv_sec), &tm);
-		sprintf(stamp, "[%d-%02d-%02d %02d:%02d:%02d.%03d]",
-				tm.tm_year + 1900,
-				tm.tm_mon + 1,
-				tm.tm_mday,
-				tm.tm_hour,
-				tm.tm_min,
-				tm.tm_sec, ms);
-		if (loglevel <= LOG_WARNING) {
-			fprintf(stderr, "\33[2K\r");
-			if (loglevel <= LOG_ERR && errno != 0)
-				fprintf(stderr, "%s %s with errno %d: %s\n", stamp, buf, errno, strerror(errno));
+		log_stamp(stamp);
+		if (loglevel <= LOG_ERR && err != 0)
+			len = snprintf(line, sizeof(line), "%s %s with errno %d: %s\n", stamp, buf, err, strerror(err));
+		else
+			len = snprintf(line, sizeof(line), "%s %s\n", stamp, buf);
+		if (unlikely(len >= (int)sizeof(line))) {
+			if (loglevel <= LOG_ERR && err != 0)
+				ASPRINTF(&logline, "%s %s with errno %d: %s\n", stamp, buf, err, strerror(err));
 			else
-				fprintf(stderr, "%s %s\n", stamp, buf);
+				ASPRINTF(&logline, "%s %s\n", stamp, buf);
+		}
+
+		if (loglevel <= LOG_WARNING) {
+			fprintf(stderr, "\33[2K\r%s", logline);
 			fflush(stderr);
 		}
 		if (logfd > 0) {
-			char *msg;
-
-			if (loglevel <= LOG_ERR && errno != 0)
-				ASPRINTF(&msg, "%s %s with errno %d: %s\n", stamp, buf, errno, strerror(errno));
+			if (likely(logger_active))
+				logring_add(logline, len);
 			else
-				ASPRINTF(&msg, "%s %s\n", stamp, buf);
-			ckmsgq_add(global_ckp->logger, msg);
+				log_write(global_ckp, logline, len);
 		}
-		free(buf);
+		if (buf != msg)
+			free(buf);
+		if (logline != line)
+			free(logline);
+		errno = err;
 	}
 }
 
+/* Slots in each ckmsgq ring, messages beyond this go on an overflow list */
+#define CKMSGQ_RING 16384
+
+/* Try to put data in the ring, failing if it is full */
+static bool ring_push(ckmsgq_t *ckmsgq, void *data)
+{
+	uint64_t pos = __atomic_load_n(&ckmsgq->head, __ATOMIC_RELAXED);
+	ckmsg_slot_t *slot;
+
+	while (42) {
+		int64_t dif;
+
+		slot = &ckmsgq->ring[pos & ckmsgq->mask];
+		dif = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ckmsgq->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&ckmsgq->head, __ATOMIC_RELAXED);
+	}
+	slot->data = data;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Take the oldest message from the ring, returning NULL if it is empty */
+static void *ring_pop(ckmsgq_t *ckmsgq)
+{
+	uint64_t pos = __atomic_load_n(&ckmsgq->tail, __ATOMIC_RELAXED);
+	ckmsg_slot_t *slot;
+	void *data;
+
+	while (42) {
+		int64_t dif;
+
+		slot = &ckmsgq->ring[pos & ckmsgq->mask];
+		dif = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)(pos + 1);
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ckmsgq->tail, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&ckmsgq->tail, __ATOMIC_RELAXED);
+	}
+	data = slot->data;
+	__atomic_store_n(&slot->seq, pos + ckmsgq->mask + 1, __ATOMIC_RELEASE);
+	return data;
+}
+
+/* Move up to max messages from one of the lists to data. Must hold
+ * list_lock. */
+static int __pop_list(ckmsg_t **list, bool *flag, void **data, const int max)
+{
+	ckmsg_t *msg;
+	int count = 0;
+
+	while (*list && count < max) {
+		msg = *list;
+		DL_DELETE(*list, msg);
+		data[count++] = msg->data;
+		free(msg);
+	}
+	if (!*list)
+		__atomic_store_n(flag, false, __ATOMIC_RELAXED);
+	return count;
+}
+
+/* Take up to max messages, urgent ones first, then the ring, then anything
+ * that overflowed the ring */
+static int ckmsgq_pop(ckmsgq_t *ckmsgq, void **data, const int max)
+{
+	int count = 0;
+
+	if (unlikely(__atomic_load_n(&ckmsgq->urgents, __ATOMIC_RELAXED))) {
+		mutex_lock(&ckmsgq->list_lock);
+		count = __pop_list(&ckmsgq->urgent, &ckmsgq->urgents, data, max);
+		mutex_unlock(&ckmsgq->list_lock);
+	}
+	while (count < max && (data[count] = ring_pop(ckmsgq)) != NULL)
+		count++;
+	if (count < max && unlikely(__atomic_load_n(&ckmsgq->overflowed, __ATOMIC_RELAXED))) {
+		mutex_lock(&ckmsgq->list_lock);
+		count += __pop_list(&ckmsgq->overflow, &ckmsgq->overflowed, data + count,
+				    max - count);
+		mutex_unlock(&ckmsgq->list_lock);
+	}
+	if (count)
+		__sync_add_and_fetch(&ckmsgq->dequeued, count);
+	return count;
+}
+
+/* Wake one sleeping consumer, if there are any, once a message is queued */
+static void ckmsgq_wake(ckmsgq_t *ckmsgq)
+{
+	uint64_t val = 1;
+	int sleepers;
+
+	__sync_synchronize();
+	while ((sleepers = __atomic_load_n(&ckmsgq->sleepers, __ATOMIC_RELAXED)) > 0) {
+		/* Claim one sleeper so concurrent producers don't all wake
+		 * the same one */
+		if (__sync_bool_compare_and_swap(&ckmsgq->sleepers, sleepers, sleepers - 1)) {
+			__sync_add_and_fetch(&ckmsgq->wakeups, 1);
+			if (unlikely(write(ckmsgq->efd, &val, sizeof(val)) != sizeof(val)))
+				LOGERR("Failed to write to %s eventfd", ckmsgq->name);
+			break;
+		}
+	}
+}
+
+/* Take up to max messages, sleeping for up to a second for some to arrive */
+static int ckmsgq_wait(ckmsgq_t *ckmsgq, void **data, const int max)
+{
+	struct pollfd pfd;
+	uint64_t val;
+	int count, sleepers;
+	tv_t start, end;
+
+	count = ckmsgq_pop(ckmsgq, data, max);
+	if (count)
+		return count;
+
+	/* Announce we're going to sleep, then look again so a message queued
+	 * in between can't be missed */
+	__sync_add_and_fetch(&ckmsgq->sleepers, 1);
+	count = ckmsgq_pop(ckmsgq, data, max);
+	if (!count) {
+		pfd.fd = ckmsgq->efd;
+		pfd.events = POLLIN;
+		tv_time(&start);
+		if (poll(&pfd, 1, 1000) > 0 && read(ckmsgq->efd, &val, sizeof(val)) > 0) {
+			/* Our waker already took us off the sleepers */
+			tv_time(&end);
+			__sync_add_and_fetch(&ckmsgq->waitns, (int64_t)(tvdiff(&end, &start) * 1e9));
+			return ckmsgq_pop(ckmsgq, data, max);
+		}
+		tv_time(&end);
+		__sync_add_and_fetch(&ckmsgq->waitns, (int64_t)(tvdiff(&end, &start) * 1e9));
+	}
+	/* Take ourselves off the sleepers unless a waker has already, in which
+	 * case its wakeup goes to the next consumer to sleep */
+	while ((sleepers = __atomic_load_n(&ckmsgq->sleepers, __ATOMIC_RELAXED)) > 0) {
+		if (__sync_bool_compare_and_swap(&ckmsgq->sleepers, sleepers, sleepers - 1))
+			break;
+	}
+	return count;
+}
+
 /* Generic function for creating a message queue receiving and parsing thread */
 static void *ckmsg_queue(void *arg)
 {
@@ -135,74 +534,104 @@ static void *ckmsg_queue(void *arg)
 
 	pthread_detach(pthread_self());
 	rename_proc(ckmsgq->name);
-	ckmsgq->active = true;
 
 	while (42) {
-		ckmsg_t *msg;
-		tv_t now;
-		ts_t abs;
+		void *data;
 
-		mutex_lock(ckmsgq->lock);
-		tv_time(&now);
-		tv_to_ts(&abs, &now);
-		abs.tv_sec++;
-		if (!ckmsgq->msgs)
-			cond_timedwait(ckmsgq->cond, ckmsgq->lock, &abs);
-		msg = ckmsgq->msgs;
-		if (msg)
-			DL_DELETE(ckmsgq->msgs, msg);
-		mutex_unlock(ckmsgq->lock);
-
-		if (!msg)
-			continue;
-		ckmsgq->func(ckp, msg->data);
-		free(msg);
+		if (ckmsgq_wait(ckmsgq, &data, 1))
+			ckmsgq->func(ckp, data);
 	}
 	return NULL;
 }
 
-ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
+/* As ckmsg_queue but removes as many messages as are queued, up to the batch
+ * size, and hands them to the batch function together. It never waits for a
+ * batch to fill. */
+static void *ckmsg_batch_queue(void *arg)
+{
+	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
+	ckpool_t *ckp = ckmsgq->ckp;
+	void **data;
+
+	pthread_detach(pthread_self());
+	rename_proc(ckmsgq->name);
+	data = ckalloc(sizeof(void *) * ckmsgq->batch);
+
+	while (42) {
+		int count = ckmsgq_wait(ckmsgq, data, ckmsgq->batch);
+
+		if (count)
+			ckmsgq->batchfunc(ckp, data, count);
+	}
+	return NULL;
+}
+
+/* Create one queue served by count threads, each running func on single
+ * messages, or batchfunc on up to batch messages at a time if batch is set */
+static ckmsgq_t *__create_ckmsgq(ckpool_t *ckp, const char *name, const void *func,
+				 const int count, const int batch)
 {
 	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
+	pthread_t pth;
+	uint64_t i;
 
 	strncpy(ckmsgq->name, name, 15);
-	ckmsgq->func = func;
 	ckmsgq->ckp = ckp;
-	ckmsgq->lock = ckalloc(sizeof(mutex_t));
-	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(ckmsgq->lock);
-	cond_init(ckmsgq->cond);
-	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
+	if (batch) {
+		ckmsgq->batchfunc = func;
+		ckmsgq->batch = batch;
+	} else
+		ckmsgq->func = func;
+	ckmsgq->threads = count;
+	ckmsgq->ring = ckalloc(sizeof(ckmsg_slot_t) * CKMSGQ_RING);
+	ckmsgq->mask = CKMSGQ_RING - 1;
+	for (i = 0; i < CKMSGQ_RING; i++)
+		ckmsgq->ring[i].seq = i;
+	mutex_init(&ckmsgq->list_lock);
+	ckmsgq->efd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(ckmsgq->efd < 0))
+		quit(1, "Failed to create eventfd for %s", name);
+	tv_time(&ckmsgq->last_stats);
+
+	for (i = 0; i < (uint64_t)count; i++)
+		create_pthread(&pth, batch ? ckmsg_batch_queue : ckmsg_queue, ckmsgq);
+	ckmsgq->active = true;
 
 	return ckmsgq;
 }
 
-ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
+ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 {
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
-	mutex_t *lock;
-	pthread_cond_t *cond;
-	int i;
+	return __create_ckmsgq(ckp, name, func, 1, 0);
+}
 
-	lock = ckalloc(sizeof(mutex_t));
-	cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(lock);
-	cond_init(cond);
+/* Create count threads consuming from one shared message queue */
+ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
+{
+	return __create_ckmsgq(ckp, name, func, count, 0);
+}
 
-	for (i = 0; i < count; i++) {
-		snprintf(ckmsgq[i].name, 15, "%.8s%x", name, i);
-		ckmsgq[i].func = func;
-		ckmsgq[i].ckp = ckp;
-		ckmsgq[i].lock = lock;
-		ckmsgq[i].cond = cond;
-		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
-	}
+/* Create count threads sharing one message queue whose function is passed an
+ * array of up to batch messages at a time. */
+ckmsgq_t *create_ckmsgqs_batch(ckpool_t *ckp, const char *name, const void *func, const int count,
+			       const int batch)
+{
+	return __create_ckmsgq(ckp, name, func, count, batch);
+}
 
-	return ckmsgq;
+/* Append msgs to the overflow list, preserving their order after anything
+ * already there */
+static void ckmsgq_overflow(ckmsgq_t *ckmsgq, ckmsg_t *msgs, const int count)
+{
+	mutex_lock(&ckmsgq->list_lock);
+	DL_CONCAT(ckmsgq->overflow, msgs);
+	__atomic_store_n(&ckmsgq->overflowed, true, __ATOMIC_RELAXED);
+	mutex_unlock(&ckmsgq->list_lock);
+	__sync_add_and_fetch(&ckmsgq->overflows, count);
 }
 
-/* Generic function for adding messages to a ckmsgq linked list and signal the
- * ckmsgq parsing thread(s) to wake up and process it. */
+/* Generic function for adding messages to a ckmsgq and waking one of the
+ * ckmsgq parsing threads to process it. */
 void _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
 {
 	ckmsg_t *msg;
@@ -217,32 +646,146 @@ void _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *fun
 	while (unlikely(!ckmsgq->active))
 		cksleep_ms(10);
 
+	__sync_add_and_fetch(&ckmsgq->messages, 1);
+	/* Once anything has overflowed, keep queueing behind it until the
+	 * consumers have drained it to keep messages in order */
+	if (likely(!__atomic_load_n(&ckmsgq->overflowed, __ATOMIC_RELAXED) &&
+		   ring_push(ckmsgq, data)))
+		goto wake;
+
 	msg = ckalloc(sizeof(ckmsg_t));
 	msg->data = data;
+	msg->next = NULL;
+	msg->prev = msg;
+	ckmsgq_overflow(ckmsgq, msg, 1);
+wake:
+	ckmsgq_wake(ckmsgq);
+}
+
+/* Add a list of messages in order, freeing the ckmsg_t containers of any that
+ * fit in the ring. */
+void ckmsgq_add_list(ckmsgq_t *ckmsgq, ckmsg_t *msgs)
+{
+	ckmsg_t *msg, *tmp;
+	int count = 0;
+
+	if (unlikely(!msgs))
+		return;
+	while (unlikely(!ckmsgq->active))
+		cksleep_ms(10);
+
+	DL_FOREACH_SAFE(msgs, msg, tmp) {
+		if (__atomic_load_n(&ckmsgq->overflowed, __ATOMIC_RELAXED) ||
+		    !ring_push(ckmsgq, msg->data))
+			break;
+		DL_DELETE(msgs, msg);
+		free(msg);
+		count++;
+	}
+	if (msgs) {
+		int overflows = 0;
 
-	mutex_lock(ckmsgq->lock);
-	ckmsgq->messages++;
-	DL_APPEND(ckmsgq->msgs, msg);
-	pthread_cond_broadcast(ckmsgq->cond);
-	mutex_unlock(ckmsgq->lock);
+		DL_COUNT(msgs, msg, overflows);
+		ckmsgq_overflow(ckmsgq, msgs, overflows);
+		count += overflows;
+	}
+	__sync_add_and_fetch(&ckmsgq->messages, count);
+	ckmsgq_wake(ckmsgq);
 }
 
-/* Return whether there are any messages queued in the ckmsgq linked list. */
-bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+/* Add a list of messages to be consumed before anything already queued */
+void ckmsgq_add_urgent(ckmsgq_t *ckmsgq, ckmsg_t *msgs)
 {
-	bool ret = true;
+	int count = 0;
+	ckmsg_t *msg;
+
+	if (unlikely(!msgs))
+		return;
+	while (unlikely(!ckmsgq->active))
+		cksleep_ms(10);
+
+	DL_COUNT(msgs, msg, count);
+	mutex_lock(&ckmsgq->list_lock);
+	DL_CONCAT(msgs, ckmsgq->urgent);
+	ckmsgq->urgent = msgs;
+	__atomic_store_n(&ckmsgq->urgents, true, __ATOMIC_RELAXED);
+	mutex_unlock(&ckmsgq->list_lock);
+
+	__sync_add_and_fetch(&ckmsgq->messages, count);
+	ckmsgq_wake(ckmsgq);
+}
 
+/* Number of messages queued and not yet taken by a consumer */
+int64_t ckmsgq_depth(ckmsgq_t *ckmsgq)
+{
 	if (unlikely(!ckmsgq || !ckmsgq->active))
-		goto out;
+		return 0;
+	return __atomic_load_n(&ckmsgq->messages, __ATOMIC_RELAXED) -
+		__atomic_load_n(&ckmsgq->dequeued, __ATOMIC_RELAXED);
+}
 
-	mutex_lock(ckmsgq->lock);
-	if (ckmsgq->msgs)
-		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
-	mutex_unlock(ckmsgq->lock);
-out:
+/* Return whether there are any messages queued in the ckmsgq. */
+bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+{
+	return ckmsgq_depth(ckmsgq) < 1;
+}
+
+/* Discard and free everything queued, returning how many were discarded. */
+int ckmsgq_flush(ckmsgq_t *ckmsgq)
+{
+	void *data[64];
+	int count, ret = 0;
+
+	if (unlikely(!ckmsgq || !ckmsgq->active))
+		return 0;
+	while ((count = ckmsgq_pop(ckmsgq, data, 64)) > 0) {
+		while (count--) {
+			free(data[count]);
+			ret++;
+		}
+	}
 	return ret;
 }
 
+/* Summarise a ckmsgq's queue, with the rates since the last call. size is the
+ * size of each queued message's data for the memory estimate. */
+json_t *ckmsgq_stats(ckmsgq_t *ckmsgq, const int size)
+{
+	int64_t messages, dequeued, depth;
+	double elapsed;
+	json_t *val;
+	tv_t now;
+
+	messages = __atomic_load_n(&ckmsgq->messages, __ATOMIC_RELAXED);
+	dequeued = __atomic_load_n(&ckmsgq->dequeued, __ATOMIC_RELAXED);
+	depth = messages - dequeued;
+	if (depth < 0)
+		depth = 0;
+	tv_time(&now);
+
+	mutex_lock(&ckmsgq->list_lock);
+	elapsed = tvdiff(&now, &ckmsgq->last_stats);
+	if (elapsed <= 0)
+		elapsed = 1;
+	JSON_CPACK(val, "{sI,sI,sI,sI,sI,sI,si,sf,sf,sf}",
+		   "count", depth,
+		   "memory", depth * (int64_t)(size + sizeof(ckmsg_t)),
+		   "generated", messages,
+		   "dequeued", dequeued,
+		   "overflows", __atomic_load_n(&ckmsgq->overflows, __ATOMIC_RELAXED),
+		   "wakeups", __atomic_load_n(&ckmsgq->wakeups, __ATOMIC_RELAXED),
+		   "threads", ckmsgq->threads,
+		   "waittime", (double)__atomic_load_n(&ckmsgq->waitns, __ATOMIC_RELAXED) / 1e9,
+		   "enqueue_rate", (double)(messages - ckmsgq->last_messages) / elapsed,
+		   "dequeue_rate", (double)(dequeued - ckmsgq->last_dequeued) / elapsed);
+	ckmsgq->last_messages = messages;
+	ckmsgq->last_dequeued = dequeued;
+	copy_tv(&ckmsgq->last_stats, &now);
+	mutex_unlock(&ckmsgq->list_lock);
+
+	return val;
+}
+
 /* Create a standalone thread that queues received unix messages for a proc
  * instance and adds them to linked list of received messages with their
  * associated receive socket, then signal the associated rmsg_cond for the
@@ -423,9 +966,21 @@ retry:
 		LOGDEBUG("Listener received ping request");
 		send_unix_msg(sockd, "pong");
 	} else if (cmdmatch(buf, "loglevel")) {
+		char subsystem[16];
 		int loglevel;
 
-		if (sscanf(buf, "loglevel=%d", &loglevel) != 1) {
+		/* Either loglevel=N for the whole pool or loglevel=name:N for
+		 * one subsystem only, N of -1 removing the subsystem's level */
+		if (sscanf(buf, "loglevel=%15[^:]:%d", subsystem, &loglevel) == 2) {
+			if (loglevel < -1 || loglevel > LOG_DEBUG) {
+				LOGWARNING("Invalid loglevel %d sent", loglevel);
+				send_unix_msg(sockd, "Invalid");
+			} else if (!log_setfilter(subsystem, loglevel)) {
+				LOGWARNING("No room for loglevel of %s", subsystem);
+				send_unix_msg(sockd, "Failed");
+			} else
+				send_unix_msg(sockd, "success");
+		} else if (sscanf(buf, "loglevel=%d", &loglevel) != 1) {
 			LOGWARNING("Failed to parse loglevel message %s", buf);
 			send_unix_msg(sockd, "Failed");
 		} else if (loglevel < LOG_EMERG || loglevel > LOG_DEBUG) {
@@ -433,6 +988,7 @@ retry:
 			send_unix_msg(sockd, "Invalid");
 		} else {
 			ckp->loglevel = loglevel;
+			log_setlevel(loglevel);
 			send_unix_msg(sockd, "success");
 		}
 	} else if (cmdmatch(buf, "getxfd")) {
@@ -823,25 +1379,301 @@ static const char *rpc_method(const char *rpc_req)
 	return rpc_req;
 }
 
-/* All of these calls are made to bitcoind which prefers open/close instead
- * of persistent connections so cs->fd is always invalid. */
-json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
+/* Idle keep-alive connections kept open per bitcoind */
+#define RPC_IDLE_CONNS 4
+/* Seconds an idle connection may be reused for, well under bitcoind's
+ * default rpcservertimeout of 30 */
+#define RPC_IDLE_TIME 15
+
+static void close_rpcconn(rpcconn_t *conn)
+{
+	Close(conn->fd);
+	free(conn->buf);
+	free(conn);
+}
+
+/* Take an idle connection from the pool if one is still usable, otherwise
+ * open a new one. */
+static rpcconn_t *get_rpcconn(connsock_t *cs, bool *reused)
+{
+	time_t now_t = time(NULL);
+	rpcconn_t *conn;
+
+	while (42) {
+		struct pollfd pfd;
+
+		mutex_lock(&cs->rpc_lock);
+		conn = cs->rpc_idle;
+		if (conn) {
+			DL_DELETE(cs->rpc_idle, conn);
+			cs->rpc_idles--;
+		}
+		mutex_unlock(&cs->rpc_lock);
+		if (!conn)
+			break;
+
+		/* Anything to read on an idle connection means it's been
+		 * closed by the other end */
+		pfd.fd = conn->fd;
+		pfd.events = POLLIN | POLLRDHUP;
+		if (now_t - conn->lastused < RPC_IDLE_TIME && !poll(&pfd, 1, 0)) {
+			*reused = true;
+			return conn;
+		}
+		close_rpcconn(conn);
+	}
+
+	conn = ckzalloc(sizeof(rpcconn_t));
+	conn->fd = connect_socket(cs->url, cs->port);
+	if (unlikely(conn->fd < 0)) {
+		LOGWARNING("Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
+		free(conn);
+		return NULL;
+	}
+	*reused = false;
+	return conn;
+}
+
+static void put_rpcconn(connsock_t *cs, rpcconn_t *conn)
+{
+	conn->lastused = time(NULL);
+	conn->buflen = 0;
+
+	mutex_lock(&cs->rpc_lock);
+	if (cs->rpc_idles < RPC_IDLE_CONNS) {
+		DL_PREPEND(cs->rpc_idle, conn);
+		cs->rpc_idles++;
+		conn = NULL;
+	}
+	mutex_unlock(&cs->rpc_lock);
+
+	if (conn)
+		close_rpcconn(conn);
+}
+
+/* Close all idle connections, eg. when the server is killed */
+void close_rpcconns(connsock_t *cs)
+{
+	rpcconn_t *conn, *tmp;
+
+	mutex_lock(&cs->rpc_lock);
+	DL_FOREACH_SAFE(cs->rpc_idle, conn, tmp) {
+		DL_DELETE(cs->rpc_idle, conn);
+		close_rpcconn(conn);
+	}
+	cs->rpc_idles = 0;
+	mutex_unlock(&cs->rpc_lock);
+}
+
+/* Receive whatever is available into the connection's buffer, waiting up to
+ * timeout for something to arrive. Returns bytes received, 0 if the
+ * connection was closed and -1 on timeout or error. */
+static int recv_rpcconn(rpcconn_t *conn, float *timeout)
+{
+	tv_t start, now;
+	int ret;
+
+	if (conn->bufsize - conn->buflen < PAGESIZE) {
+		conn->bufsize = conn->bufsize ? conn->bufsize * 2 : PAGESIZE * 16;
+		conn->buf = realloc(conn->buf, conn->bufsize);
+		if (unlikely(!conn->buf))
+			quit(1, "Failed to realloc rpcconn buf size %d", (int)conn->bufsize);
+	}
+	tv_time(&start);
+	ret = wait_read_select(conn->fd, *timeout);
+	tv_time(&now);
+	*timeout -= tvdiff(&now, &start);
+	if (ret < 1)
+		return -1;
+	/* Leave room to NULL terminate the buffer */
+	ret = recv(conn->fd, conn->buf + conn->buflen, conn->bufsize - conn->buflen - 1, 0);
+	if (ret < 0)
+		return -1;
+	conn->buflen += ret;
+	conn->buf[conn->buflen] = '\0';
+	return ret;
+}
+
+/* Read until the buffer holds at least len bytes */
+static bool recv_rpclen(rpcconn_t *conn, const size_t len, float *timeout)
 {
-	float timeout = RPC_TIMEOUT;
-	char *http_req = NULL;
+	while (conn->buflen < len) {
+		if (recv_rpcconn(conn, timeout) < 1)
+			return false;
+	}
+	return true;
+}
+
+/* Decode a chunked body starting at ofs in place, returning its length or
+ * -1 on failure */
+static int64_t recv_rpcchunks(rpcconn_t *conn, const size_t ofs, float *timeout)
+{
+	size_t pos = ofs, out = ofs;
+
+	while (42) {
+		char *eol = NULL;
+		size_t size;
+
+		while (!(eol = strstr(conn->buf + pos, "\r\n"))) {
+			if (recv_rpcconn(conn, timeout) < 1)
+				return -1;
+		}
+		size = strtoul(conn->buf + pos, NULL, 16);
+		pos = eol + 2 - conn->buf;
+		if (!size)
+			break;
+		/* Chunk data plus its trailing CRLF */
+		if (!recv_rpclen(conn, pos + size + 2, timeout))
+			return -1;
+		memmove(conn->buf + out, conn->buf + pos, size);
+		out += size;
+		pos += size + 2;
+	}
+	/* Skip any trailers up to the blank line ending the message */
+	while (42) {
+		char *eol;
+
+		while (!(eol = strstr(conn->buf + pos, "\r\n"))) {
+			if (recv_rpcconn(conn, timeout) < 1)
+				return -1;
+		}
+		if (eol == conn->buf + pos)
+			break;
+		pos = eol + 2 - conn->buf;
+	}
+	conn->buf[out] = '\0';
+	return out - ofs;
+}
+
+/* Read a whole HTTP response into the connection's buffer, reading the body
+ * by its Content-Length, chunked, or till the connection closes. Returns the
+ * HTTP status or -1 on failure, with body pointing into the buffer. */
+static int recv_rpcresponse(rpcconn_t *conn, float *timeout, char **body, int64_t *bodylen,
+			    bool *keepalive)
+{
+	int64_t contentlen = -1;
+	bool chunked = false;
+	char *hdrend, *line;
+	int status, minor;
+	size_t hdrlen;
+
+	while (!conn->buflen || !(hdrend = strstr(conn->buf, "\r\n\r\n"))) {
+		if (recv_rpcconn(conn, timeout) < 1)
+			return -1;
+	}
+	hdrlen = hdrend + 4 - conn->buf;
+	if (sscanf(conn->buf, "HTTP/1.%d %d", &minor, &status) != 2) {
+		LOGWARNING("Invalid HTTP response status: %.32s", conn->buf);
+		return -1;
+	}
+	*keepalive = minor > 0;
+
+	/* Headers, each on a line after the status */
+	*hdrend = '\0';
+	line = strstr(conn->buf, "\r\n");
+	while (line) {
+		line += 2;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			contentlen = strtoll(line + 15, NULL, 10);
+		else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+			chunked = !!strcasestr(line + 18, "chunked");
+		else if (!strncasecmp(line, "Connection:", 11)) {
+			if (strcasestr(line + 11, "close"))
+				*keepalive = false;
+			else if (strcasestr(line + 11, "keep-alive"))
+				*keepalive = true;
+		}
+		line = strstr(line, "\r\n");
+	}
+	*hdrend = '\r';
+
+	if (chunked) {
+		*bodylen = recv_rpcchunks(conn, hdrlen, timeout);
+		if (*bodylen < 0)
+			return -1;
+	} else if (contentlen >= 0) {
+		if (!recv_rpclen(conn, hdrlen + contentlen, timeout))
+			return -1;
+		/* Anything beyond the body means we've lost track */
+		if (conn->buflen > hdrlen + contentlen)
+			*keepalive = false;
+		conn->buf[hdrlen + contentlen] = '\0';
+		*bodylen = contentlen;
+	} else {
+		int ret;
+
+		/* No length so the body ends when the connection closes */
+		while ((ret = recv_rpcconn(conn, timeout)) > 0);
+		if (ret < 0)
+			return -1;
+		*keepalive = false;
+		*bodylen = conn->buflen - hdrlen;
+	}
+	*body = conn->buf + hdrlen;
+	return status;
+}
+
+/* Write the http request and the pieces of its body in one go so large bodies
+ * needn't be copied together and small pieces aren't delayed by Nagle */
+static bool write_rpcreq(int fd, const char *http_req, const struct iovec *req_iov,
+			 const int iovcnt)
+{
+	struct iovec iov[iovcnt + 1], *cur = iov;
+	int cnt = iovcnt + 1;
+	ssize_t ret;
+
+	iov[0].iov_base = (void *)http_req;
+	iov[0].iov_len = strlen(http_req);
+	memcpy(iov + 1, req_iov, sizeof(struct iovec) * iovcnt);
+	while (cnt) {
+		if (wait_write_select(fd, 5) < 1) {
+			LOGNOTICE("Select failed or timed out in write_rpcreq");
+			return false;
+		}
+		ret = writev(fd, cur, cnt);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			LOGNOTICE("Failed to writev in write_rpcreq");
+			return false;
+		}
+		/* Skip what was written, leaving any partial piece */
+		while (cnt && (size_t)ret >= cur->iov_len) {
+			ret -= cur->iov_len;
+			cur++;
+			cnt--;
+		}
+		if (cnt) {
+			cur->iov_base = (char *)cur->iov_base + ret;
+			cur->iov_len -= ret;
+		}
+	}
+	return true;
+}
+
+/* All of these calls are made to bitcoind over keep-alive connections from
+ * a small pool per server. A pooled connection found closed before any
+ * response arrives is dropped and the request retried on the next idle one,
+ * as bitcoind restarting closes them all, and finally on a freshly opened
+ * connection which is not retried. The request is passed in
+ * pieces that are sent without joining them. A longpoll waits much longer
+ * for its response and is expected to be slow. */
+static json_t *rpc_callv(connsock_t *cs, const struct iovec *iov, const int iovcnt,
+			 const bool longpoll)
+{
+	float timeout = longpoll ? RPC_LONGPOLL_TIMEOUT : RPC_TIMEOUT;
+	char http_req[512], *body;
+	rpcconn_t *conn = NULL;
+	bool reused, keepalive;
+	const char *rpc_req;
 	json_error_t err_val;
 	json_t *val = NULL;
 	tv_t stt_tv, fin_tv;
+	int64_t bodylen;
 	double elapsed;
-	int len, ret;
+	size_t len = 0;
+	int i, ret;
 
-	/* Serialise all calls in case we use cs from multiple threads */
-	cksem_wait(&cs->sem);
-	cs->fd = connect_socket(cs->url, cs->port);
-	if (unlikely(cs->fd < 0)) {
-		LOGWARNING("Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
-		goto out;
-	}
 	if (unlikely(!cs->url)) {
 		LOGWARNING("No URL in %s", __func__);
 		goto out;
@@ -854,82 +1686,113 @@ json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 		LOGWARNING("No auth in %s", __func__);
 		goto out;
 	}
-	if (unlikely(!rpc_req)) {
+	if (unlikely(!iovcnt || !iov[0].iov_base)) {
 		LOGWARNING("Null rpc_req passed to %s", __func__);
 		goto out;
 	}
-	len = strlen(rpc_req);
+	rpc_req = iov[0].iov_base;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 	if (unlikely(!len)) {
 		LOGWARNING("Zero length rpc_req passed to %s", __func__);
 		goto out;
 	}
-	http_req = ckalloc(len + 256); // Leave room for headers
-	sprintf(http_req,
-		 "POST / HTTP/1.1\n"
-		 "Authorization: Basic %s\n"
-		 "Host: %s:%s\n"
-		 "Content-type: application/json\n"
-		 "Content-Length: %d\n\n%s",
-		 cs->auth, cs->url, cs->port, len, rpc_req);
+	snprintf(http_req, sizeof(http_req),
+		 "POST / HTTP/1.1\r\n"
+		 "Authorization: Basic %s\r\n"
+		 "Host: %s:%s\r\n"
+		 "Connection: keep-alive\r\n"
+		 "Content-type: application/json\r\n"
+		 "Content-Length: %lu\r\n\r\n",
+		 cs->auth, cs->url, cs->port, (unsigned long)len);
 
-	len = strlen(http_req);
 	tv_time(&stt_tv);
-	ret = write_socket(cs->fd, http_req, len);
-	if (ret != len) {
+retry:
+	conn = get_rpcconn(cs, &reused);
+	if (unlikely(!conn))
+		goto out;
+	if (!write_rpcreq(conn->fd, http_req, iov, iovcnt)) {
+		if (reused) {
+			close_rpcconn(conn);
+			goto retry;
+		}
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
 		LOGWARNING("Failed to write to socket in %s (%.10s...) %.3fs",
 			   __func__, rpc_method(rpc_req), elapsed);
-		goto out_empty;
+		goto out_close;
 	}
-	ret = read_socket_line(cs, &timeout);
-	if (ret < 1) {
+	ret = recv_rpcresponse(conn, &timeout, &body, &bodylen, &keepalive);
+	if (ret < 0) {
+		if (reused && !conn->buflen) {
+			close_rpcconn(conn);
+			goto retry;
+		}
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
-		LOGWARNING("Failed to read socket line in %s (%.10s...) %.3fs",
+		LOGWARNING("Failed to read http response in %s (%.10s...) %.3fs",
 			   __func__, rpc_method(rpc_req), elapsed);
-		goto out_empty;
-	}
-	if (strncasecmp(cs->buf, "HTTP/1.1 200 OK", 15)) {
-		tv_time(&fin_tv);
-		elapsed = tvdiff(&fin_tv, &stt_tv);
-		LOGWARNING("HTTP response to (%.10s...) %.3fs not ok: %s",
-			   rpc_method(rpc_req), elapsed, cs->buf);
-		goto out_empty;
+		goto out_close;
 	}
-	do {
-		ret = read_socket_line(cs, &timeout);
-		if (ret < 1) {
-			tv_time(&fin_tv);
-			elapsed = tvdiff(&fin_tv, &stt_tv);
-			LOGWARNING("Failed to read http socket lines in %s (%.10s...) %.3fs",
-				   __func__, rpc_method(rpc_req), elapsed);
-			goto out_empty;
-		}
-	} while (strncmp(cs->buf, "{", 1));
 	tv_time(&fin_tv);
 	elapsed = tvdiff(&fin_tv, &stt_tv);
-	if (elapsed > 5.0) {
+	if (ret != 200) {
+		LOGWARNING("HTTP response to (%.10s...) %.3fs not ok: %d %.*s",
+			   rpc_method(rpc_req), elapsed, ret, (int)MIN(bodylen, 256), body);
+		goto out_put;
+	}
+	if (elapsed > 5.0 && !longpoll) {
 		LOGWARNING("HTTP socket read+write took %.3fs in %s (%.10s...)",
 			   elapsed, __func__, rpc_method(rpc_req));
 	}
 
-	val = json_loads(cs->buf, 0, &err_val);
+	val = json_loadb(body, bodylen, 0, &err_val);
 	if (!val) {
 		LOGWARNING("JSON decode (%.10s...) failed(%d): %s",
 			   rpc_method(rpc_req), err_val.line, err_val.text);
 	}
-out_empty:
-	empty_socket(cs->fd);
-	empty_buffer(cs);
+out_put:
+	if (keepalive) {
+		put_rpcconn(cs, conn);
+		conn = NULL;
+	}
+out_close:
+	if (conn)
+		close_rpcconn(conn);
 out:
-	Close(cs->fd);
-	free(http_req);
-	dealloc(cs->buf);
-	cksem_post(&cs->sem);
 	return val;
 }
 
+json_t *json_rpc_callv(connsock_t *cs, const struct iovec *iov, const int iovcnt)
+{
+	return rpc_callv(cs, iov, iovcnt, false);
+}
+
+static json_t *rpc_call(connsock_t *cs, const char *rpc_req, const bool longpoll)
+{
+	struct iovec iov;
+
+	if (unlikely(!rpc_req)) {
+		LOGWARNING("Null rpc_req passed to %s", __func__);
+		return NULL;
+	}
+	iov.iov_base = (void *)rpc_req;
+	iov.iov_len = strlen(rpc_req);
+	return rpc_callv(cs, &iov, 1, longpoll);
+}
+
+json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
+{
+	return rpc_call(cs, rpc_req, false);
+}
+
+/* As json_rpc_call for a request bitcoind holds until it has something new
+ * to return, on a connection of its own for the duration. */
+json_t *json_rpc_longpoll(connsock_t *cs, const char *rpc_req)
+{
+	return rpc_call(cs, rpc_req, true);
+}
+
 static void terminate_oldpid(const ckpool_t *ckp, proc_instance_t *pi, const pid_t oldpid)
 {
 	if (!ckp->killold) {
@@ -1087,7 +1950,17 @@ static void rm_namepid(const proc_instance_t *pi)
 
 static void launch_logger(ckpool_t *ckp)
 {
-	ckp->logger = create_ckmsgq(ckp, "logger", &proclog);
+	pthread_t pth;
+
+	mutex_init(&logring_lock);
+	mutex_init(&logring_wait_lock);
+	cond_init(&logring_wait_cond);
+	pthread_key_create(&logring_key, release_logring);
+	logger_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(logger_efd < 0))
+		quit(1, "Failed to create logger eventfd");
+	create_pthread(&pth, logger, ckp);
+	logger_active = true;
 }
 
 static void clean_up(ckpool_t *ckp)
@@ -1453,9 +2326,11 @@ static void parse_config(ckpool_t *ckp)
 		ckp->btcsig[38] = '\0';
 	}
 	json_get_int(&ckp->blockpoll, json_conf, "blockpoll");
+	json_get_bool(&ckp->longpoll, json_conf, "longpoll");
 	json_get_int(&ckp->nonce1length, json_conf, "nonce1length");
 	json_get_int(&ckp->nonce2length, json_conf, "nonce2length");
 	json_get_int(&ckp->update_interval, json_conf, "update_interval");
+	json_get_bool(&ckp->emptyjobs, json_conf, "emptyjobs");
 	/* Look for an array first and then a single entry */
 	arr_val = json_object_get(json_conf, "serverurl");
 	if (!parse_serverurls(ckp, arr_val)) {
@@ -1473,8 +2348,12 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int64(&ckp->mindiff, json_conf, "mindiff");
 	json_get_int64(&ckp->startdiff, json_conf, "startdiff");
 	json_get_int64(&ckp->maxdiff, json_conf, "maxdiff");
+	json_get_int(&ckp->maxsps, json_conf, "maxsps");
 	json_get_string(&ckp->logdir, json_conf, "logdir");
+	json_get_int(&ckp->sharelog_fsync, json_conf, "sharelog_fsync");
 	json_get_int(&ckp->maxclients, json_conf, "maxclients");
+	json_get_string(&ckp->sha256impl, json_conf, "sha256");
+	json_get_int(&ckp->sha256lanes, json_conf, "sha256lanes");
 	arr_val = json_object_get(json_conf, "proxy");
 	if (arr_val && json_is_array(arr_val)) {
 		arr_size = json_array_size(arr_val);
@@ -1529,6 +2408,7 @@ static void prepare_child(ckpool_t *ckp, proc_instance_t *pi, void *process, cha
 #ifdef USE_CKDB
 static struct option long_options[] = {
 	{"standalone",	no_argument,		0,	'A'},
+	{"benchmark",	no_argument,		0,	'B'},
 	{"config",	required_argument,	0,	'c'},
 	{"daemonise",	no_argument,		0,	'D'},
 	{"ckdb-name",	required_argument,	0,	'd'},
@@ -1552,6 +2432,7 @@ static struct option long_options[] = {
 };
 #else
 static struct option long_options[] = {
+	{"benchmark",	no_argument,		0,	'B'},
 	{"config",	required_argument,	0,	'c'},
 	{"daemonise",	no_argument,		0,	'D'},
 	{"group",	required_argument,	0,	'g'},
@@ -1573,6 +2454,74 @@ static struct option long_options[] = {
 };
 #endif
 
+/* Hash an 80 byte header repeatedly for roughly a second */
+static double bench_sha256d(bool multi)
+{
+	unsigned char data[SHA256_MAX_LANES][80], hash[SHA256_MAX_LANES][32];
+	const unsigned char *msgs[SHA256_MAX_LANES];
+	unsigned char *digs[SHA256_MAX_LANES];
+	tv_t start, now;
+	int64_t hashes = 0;
+	double elapsed;
+	int i;
+
+	for (i = 0; i < SHA256_MAX_LANES; i++) {
+		memset(data[i], i, 80);
+		msgs[i] = data[i];
+		digs[i] = hash[i];
+	}
+	tv_time(&start);
+	do {
+		for (i = 0; i < 1000; i++) {
+			if (multi) {
+				sha256d_multi(msgs, 80, digs, SHA256_MAX_LANES);
+				hashes += SHA256_MAX_LANES;
+			} else {
+				gen_hash(data[0], hash[0], 80);
+				hashes++;
+			}
+			data[0][76]++;
+		}
+		tv_time(&now);
+		elapsed = tvdiff(&now, &start);
+	} while (elapsed < 1);
+	return hashes / elapsed;
+}
+
+/* Print the double sha256 rate of every transform the CPU supports, followed
+ * by the multi buffer path used for batched share processing, after checking
+ * batched share hashing matches hashing shares one at a time. Returns false if
+ * it doesn't. */
+static bool benchmark(ckpool_t *ckp)
+{
+	const char *name;
+	bool ret;
+	int i;
+
+	ret = stratifier_share_test();
+	printf("share batch test %s\n", ret ? "passed" : "FAILED");
+
+	for (i = 0; (name = sha256_impl_name(i)); i++) {
+		if (!sha256_impl_supported(name)) {
+			printf("sha256 %-8s unsupported\n", name);
+			continue;
+		}
+		sha256_set_impl(name);
+		printf("sha256 %-8s %.0f hashes/sec\n", name, bench_sha256d(false));
+	}
+	if (!sha256_set_impl(ckp->sha256impl))
+		sha256_set_impl("auto");
+	printf("sha256 %s x%d lanes %.0f hashes/sec\n", sha256_impl(), sha256_lanes(),
+	       bench_sha256d(true));
+
+	/* Client lookup contention, old write locked path against read locked */
+	for (i = 1; i <= 8; i *= 2) {
+		printf("client refs x%d threads write lock %.0f/sec read lock %.0f/sec\n", i,
+		       connector_ref_bench(true, i, 500), connector_ref_bench(false, i, 500));
+	}
+	return ret;
+}
+
 static bool send_recv_path(const char *path, const char *msg)
 {
 	int sockd = open_unix_client(path);
@@ -1607,16 +2556,20 @@ int main(int argc, char **argv)
 	ckp.starttime = time(NULL);
 	ckp.startpid = getpid();
 	ckp.loglevel = LOG_NOTICE;
+	log_setlevel(ckp.loglevel);
 	ckp.initial_args = ckalloc(sizeof(char *) * (argc + 2)); /* Leave room for extra -H */
 	for (ckp.args = 0; ckp.args < argc; ckp.args++)
 		ckp.initial_args[ckp.args] = strdup(argv[ckp.args]);
 	ckp.initial_args[ckp.args] = NULL;
 
-	while ((c = getopt_long(argc, argv, "Ac:Dd:g:HhkLl:Nn:PpqRS:s:tu", long_options, &i)) != -1) {
+	while ((c = getopt_long(argc, argv, "ABc:Dd:g:HhkLl:Nn:PpqRS:s:tu", long_options, &i)) != -1) {
 		switch (c) {
 			case 'A':
 				ckp.standalone = true;
 				break;
+			case 'B':
+				ckp.benchmark = true;
+				break;
 			case 'c':
 				ckp.config = optarg;
 				break;
@@ -1662,6 +2615,7 @@ int main(int argc, char **argv)
 					quit(1, "Invalid loglevel (range %d - %d): %d",
 					     LOG_EMERG, LOG_DEBUG, ckp.loglevel);
 				}
+				log_setlevel(ckp.loglevel);
 				break;
 			case 'N':
 				if (ckp.proxy || ckp.redirector || ckp.userproxy || ckp.passthrough)
@@ -1768,6 +2722,12 @@ int main(int argc, char **argv)
 		quit(1, "Failed to make directory %s", ckp.socket_dir);
 
 	parse_config(&ckp);
+	if (ckp.sha256impl && !sha256_set_impl(ckp.sha256impl))
+		quit(0, "Invalid or unsupported sha256 implementation %s specified", ckp.sha256impl);
+	if (!sha256_set_lanes(ckp.sha256lanes))
+		quit(0, "Invalid or unsupported sha256lanes %d specified", ckp.sha256lanes);
+	if (ckp.benchmark)
+		exit(benchmark(&ckp) ? 0 : 1);
 	/* Set defaults if not found in config file */
 	if (!ckp.btcds) {
 		ckp.btcds = 1;
@@ -1790,6 +2750,8 @@ int main(int argc, char **argv)
 		ckp.btcaddress = ckp.donaddress;
 	if (!ckp.blockpoll)
 		ckp.blockpoll = 100;
+	if (ckp.sharelog_fsync < 0)
+		quit(0, "Invalid sharelog_fsync %d specified", ckp.sharelog_fsync);
 	if (!ckp.nonce1length)
 		ckp.nonce1length = 4;
 	else if (ckp.nonce1length < 2 || ckp.nonce1length > 8)
@@ -1844,6 +2806,7 @@ int main(int argc, char **argv)
 	if (!open_logfile(&ckp))
 		quit(1, "Failed to make open log file %s", buf);
 	launch_logger(&ckp);
+	LOGNOTICE("Using %s sha256 implementation", sha256_impl());
 
 	ckp.main.ckp = &ckp;
 	ckp.main.processname = strdup("main");
@@ -15,11 +15,13 @@
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "libckpool.h"
 #include "uthash.h"
 
 #define RPC_TIMEOUT 60
+#define RPC_LONGPOLL_TIMEOUT 600
 
 struct ckpool_instance;
 typedef struct ckpool_instance ckpool_t;
@@ -41,15 +43,54 @@ struct unix_msg {
 	char *buf;
 };
 
+/* Slot of the bounded lock free ring behind each ckmsgq. seq tells producers
+ * and consumers whose turn it is to use the slot. */
+struct ckmsg_slot {
+	uint64_t seq;
+	void *data;
+};
+
+typedef struct ckmsg_slot ckmsg_slot_t;
+
 struct ckmsgq {
 	ckpool_t *ckp;
 	char name[16];
-	pthread_t pth;
-	mutex_t *lock;
-	pthread_cond_t *cond;
-	ckmsg_t *msgs;
 	void (*func)(ckpool_t *, void *);
-	int64_t messages;
+	/* Optional variant receiving up to batch messages at a time */
+	void (*batchfunc)(ckpool_t *, void **, int);
+	int batch;
+	int threads;
+
+	/* Multi producer multi consumer ring of messages */
+	ckmsg_slot_t *ring;
+	uint64_t mask;
+	uint64_t head __attribute__((aligned(64))); /* Next slot to fill */
+	uint64_t tail __attribute__((aligned(64))); /* Next slot to empty */
+
+	/* Messages that found the ring full and urgent ones for the front of
+	 * the queue, both consumed before anything else once set */
+	mutex_t list_lock __attribute__((aligned(64)));
+	ckmsg_t *overflow;
+	ckmsg_t *urgent;
+	bool overflowed;
+	bool urgents;
+
+	/* Consumers sleep on a semaphore eventfd so each wakeup releases only
+	 * one of them */
+	int efd;
+	int sleepers;
+
+	/* Statistics, updated atomically */
+	int64_t messages; /* Enqueued */
+	int64_t dequeued;
+	int64_t overflows;
+	int64_t wakeups;
+	int64_t waitns; /* Time consumers spent waiting for messages */
+	/* Last sample for the rates reported by ckmsgq_stats */
+	int64_t last_messages;
+	int64_t last_dequeued;
+	tv_t last_stats;
+
 	bool active;
 };
 
@@ -72,6 +113,21 @@ struct proc_instance {
 	pthread_cond_t rmsg_cond;
 };
 
+/* A keep-alive HTTP/1.1 connection to bitcoind used by json_rpc_call */
+struct rpcconn {
+	struct rpcconn *next;
+	struct rpcconn *prev;
+	int fd;
+	time_t lastused;
+
+	/* Response buffer, grown to fit the largest response seen */
+	char *buf;
+	size_t buflen;
+	size_t bufsize;
+};
+
+typedef struct rpcconn rpcconn_t;
+
 struct connsock {
 	int fd;
 	char *url;
@@ -88,6 +144,12 @@ struct connsock {
 	ckpool_t *ckp;
 	/* Semaphore used to serialise request/responses */
 	sem_t sem;
+
+	/* Idle keep-alive connections for RPC calls, letting calls from
+	 * different threads run concurrently each on their own connection */
+	mutex_t rpc_lock;
+	rpcconn_t *rpc_idle;
+	int rpc_idles;
 };
 
 typedef struct connsock connsock_t;
@@ -119,6 +181,7 @@ struct server_instance {
 	char *pass;
 	bool notify;
 	bool alive;
+	bool longpolling; // A getblocktemplate longpoll is outstanding
 	connsock_t cs;
 
 	void *data; // Private data
@@ -141,6 +204,8 @@ struct ckpool_instance {
 	bool killold;
 	/* Whether to log shares or not */
 	bool logshares;
+	/* Seconds between fsyncs of open sharelogs, 0 to only fsync on close */
+	int sharelog_fsync;
 	/* Logging level */
 	int loglevel;
 	/* Main process name */
@@ -168,12 +233,14 @@ struct ckpool_instance {
 	bool handover;
 	/* How many clients maximum to accept before rejecting further */
 	int maxclients;
+	/* Which sha256 transform to use, auto by default */
+	char *sha256impl;
+	/* Most messages to hash at once in share batches, 0 for the CPU's widest */
+	int sha256lanes;
 
 	/* API message queue */
 	ckmsgq_t *ckpapi;
 
-	/* Logger message queue */
-	ckmsgq_t *logger;
 	/* Process instance data of parent/child processes */
 	proc_instance_t main;
 
@@ -212,6 +279,9 @@ struct ckpool_instance {
 	/* Should we disable the throbber */
 	bool quiet;
 
+	/* Benchmark the sha256 implementations and exit */
+	bool benchmark;
+
 	/* Have we given warnings about the inability to raise buf sizes */
 	bool wmem_warn;
 	bool rmem_warn;
@@ -223,6 +293,7 @@ struct ckpool_instance {
 	char **btcdpass;
 	bool *btcdnotify;
 	int blockpoll; // How frequently in ms to poll bitcoind for block updates
+	bool longpoll; // Get block updates and templates by getblocktemplate longpoll
 	int nonce1length; // Extranonce1 length
 	int nonce2length; // Extranonce2 length
 
@@ -230,6 +301,7 @@ struct ckpool_instance {
 	int64_t mindiff; // Default 1
 	int64_t startdiff; // Default 42
 	int64_t maxdiff; // No default
+	int maxsps; // Pool wide share rate budget, no default
 
 	/* Coinbase data */
 	char *btcaddress; // Address to mine to
@@ -246,6 +318,7 @@ struct ckpool_instance {
 	char *upstream; // Upstream pool in trusted remote mode
 
 	int update_interval; // Seconds between stratum updates
+	bool emptyjobs; // Send coinbase only work as soon as a block changes
 
 	/* Proxy options */
 	int proxies;
@@ -320,9 +393,16 @@ static const char __maybe_unused *stratum_msgs[] = {
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func);
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *create_ckmsgqs_batch(ckpool_t *ckp, const char *name, const void *func, const int count,
+			       const int batch);
 void _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
 #define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
+void ckmsgq_add_list(ckmsgq_t *ckmsgq, ckmsg_t *msgs);
+void ckmsgq_add_urgent(ckmsgq_t *ckmsgq, ckmsg_t *msgs);
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
+int64_t ckmsgq_depth(ckmsgq_t *ckmsgq);
+int ckmsgq_flush(ckmsgq_t *ckmsgq);
+json_t *ckmsgq_stats(ckmsgq_t *ckmsgq, const int size);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
 
 ckpool_t *global_ckp;
@@ -343,7 +423,10 @@ char *_ckdb_msg_call(const ckpool_t *ckp, const char *msg,  const char *file, co
 		     const int line);
 #define ckdb_msg_call(ckp, msg) _ckdb_msg_call(ckp, msg, __FILE__, __func__, __LINE__)
 
+json_t *json_rpc_callv(connsock_t *cs, const struct iovec *iov, const int iovcnt);
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req);
+json_t *json_rpc_longpoll(connsock_t *cs, const char *rpc_req);
+void close_rpcconns(connsock_t *cs);
 bool send_json_msg(connsock_t *cs, const json_t *json_msg);
 json_t *json_msg_result(const char *msg, json_t **res_val, json_t **err_val);
 
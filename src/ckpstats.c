@@ -0,0 +1,119 @@
+/*
+ * Copyright 2014-2016 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Exports the binary user and worker stats store into the per user and per
+ * worker JSON files ckpool used to write for anything that still reads them */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "statstore.h"
+
+static bool write_record(const char *dir, const stats_record_t *record)
+{
+	char *fname, *s;
+	json_t *val;
+	FILE *fp;
+
+	ASPRINTF(&fname, "%s%s/%s", dir, record->type == STATS_USER ? "users" : "workers",
+		 record->name);
+	val = stats_record_json(record);
+	s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL);
+	json_decref(val);
+	fp = fopen(fname, "we");
+	if (unlikely(!fp)) {
+		LOGERR("Failed to fopen %s", fname);
+		free(fname);
+		free(s);
+		return false;
+	}
+	fprintf(fp, "%s", s);
+	fclose(fp);
+	free(fname);
+	free(s);
+	return true;
+}
+
+static void make_dir(const char *dir, const char *sub)
+{
+	char *path;
+
+	ASPRINTF(&path, "%s%s", dir, sub);
+	if (mkdir(path, 0750) && errno != EEXIST)
+		quit(1, "Failed to make directory %s", path);
+	free(path);
+}
+
+int main(int argc, char **argv)
+{
+	char *logdir = NULL, *storename = NULL, *outdir = NULL;
+	int64_t id, users = 0, workers = 0, failed = 0;
+	stats_record_t *record;
+	statstore_t *store;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:l:o:")) != -1) {
+		switch(c) {
+			/* Stats store file, defaults to userstats.dat in the
+			 * logdir */
+			case 'f':
+				storename = strdup(optarg);
+				break;
+			case 'l':
+				logdir = strdup(optarg);
+				break;
+			/* Directory to write users/ and workers/ into,
+			 * defaults to the logdir */
+			case 'o':
+				outdir = strdup(optarg);
+				break;
+		}
+	}
+	if (!logdir)
+		logdir = strdup("logs");
+	trail_slash(&logdir);
+	if (!storename)
+		ASPRINTF(&storename, "%suserstats.dat", logdir);
+	if (!outdir)
+		outdir = strdup(logdir);
+	trail_slash(&outdir);
+
+	store = statstore_open(storename, true);
+	if (!store)
+		quit(1, "Failed to open stats store %s", storename);
+	make_dir(outdir, "");
+	make_dir(outdir, "users");
+	make_dir(outdir, "workers");
+
+	for (id = 1; (record = statstore_record(store, id)) != NULL; id++) {
+		if (record->type != STATS_USER && record->type != STATS_WORKER)
+			continue;
+		if (!write_record(outdir, record))
+			failed++;
+		else if (record->type == STATS_USER)
+			users++;
+		else
+			workers++;
+	}
+	statstore_close(store);
+
+	printf("Exported %"PRId64" users and %"PRId64" workers to %s\n", users, workers, outdir);
+	if (failed) {
+		printf("Failed to export %"PRId64" records\n", failed);
+		return 1;
+	}
+	return 0;
+}
@@ -12,6 +12,8 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <unistd.h>
@@ -24,9 +26,16 @@
 #include "generator.h"
 
 #define MAX_MSGSIZE 1024
+#define RECEIVE_EVENTS 128
+#define SEND_IOVECS 64
+#define BACKLOG_BUCKETS 4
 
 typedef struct client_instance client_instance_t;
 typedef struct sender_send sender_send_t;
+typedef struct payload payload_t;
+typedef struct client_msg client_msg_t;
+typedef struct serializer serializer_t;
+typedef struct receiver receiver_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
 
@@ -59,8 +68,20 @@ struct client_instance {
 	char *buf;
 	unsigned long bufofs;
 
-	/* Are we currently sending a blocked message from this client */
-	sender_send_t *sending;
+	/* Queue of sends pending to this client and the bytes left in them,
+	 * only ever touched by the sender thread */
+	sender_send_t *sends;
+	int64_t backlog;
+
+	/* Is this client on the sender's list to flush */
+	bool flushing;
+	client_instance_t *flush_next;
+
+	/* Is this client blocked waiting on EPOLLOUT in the sender */
+	bool blocked;
+	bool epollout;
+	client_instance_t *blocked_next;
+	client_instance_t *blocked_prev;
 
 	/* Is this a trusted remote server */
 	bool remote;
@@ -89,6 +110,62 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+
+	/* Shared buffer buf points into if this is a broadcast */
+	payload_t *payload;
+};
+
+/* A message rendered once and sent to many clients. References are only
+ * dropped by the sender thread once every send has been queued. */
+struct payload {
+	int refs;
+	char *buf;
+};
+
+/* Messages for the client message processors, either json for one client, a
+ * line already rendered for one client, or one rendered for a list of
+ * clients */
+struct client_msg {
+	json_t *val;
+
+	char *buf;
+	int64_t client_id;
+	int64_t *client_ids;
+	int clients;
+
+	serializer_t *serializer;
+};
+
+/* An outbound message processing thread. Each client is always served by the
+ * same serializer so messages to any one client stay in order. Counters are
+ * only written by the serializer's own thread. */
+struct serializer {
+	ckmsgq_t *cmpq;
+
+	int64_t messages;
+	int64_t bytes;
+
+	/* Values at the last stats report for rates */
+	int64_t last_messages;
+	int64_t last_bytes;
+};
+
+/* An inbound event thread with its own epoll set. Clients are sharded across
+ * receivers when accepted and only ever serviced by that receiver so their
+ * events are never handled concurrently. Counters are only written by the
+ * receiver's own thread. */
+struct receiver {
+	struct connector_data *cdata;
+	int id;
+	int epfd;
+	pthread_t pth;
+
+	int64_t wakeups;
+	int64_t events;
+	int maxbatch;
+
+	/* Values at the last stats report for rates */
+	int64_t last_events;
 };
 
 struct share {
@@ -118,7 +195,7 @@ struct connector_data {
 	int *serverfd;
 	/* All time count of clients connected */
 	int nfds;
-	/* The epoll fd */
+	/* The epoll fd for the server sockets */
 	int epfd;
 
 	bool accept;
@@ -137,23 +214,40 @@ struct connector_data {
 
 	int64_t client_id;
 
-	/* client message process queue */
-	ckmsgq_t *cmpq;
+	/* client message process queues, one per serializer thread */
+	serializer_t *serializers;
+	int serializer_count;
+	time_t serializer_stats;
 
-	/* client message event process queue */
-	ckmsgq_t *cevents;
+	/* Client event receivers, each with their own epoll set */
+	receiver_t *receivers;
+	int receiver_count;
 
 	/* For the linked list of pending sends */
 	sender_send_t *sender_sends;
 
 	int64_t sends_generated;
+	int64_t broadcasts;
 	int64_t sends_delayed;
 	int64_t sends_queued;
 	int64_t sends_size;
 
+	/* Backlog of blocked clients as of the sender's last check */
+	int blocked_clients;
+	int64_t backlog_bytes;
+	int64_t backlog_max;
+	int64_t backlog_max_id;
+	int64_t backlog_highwater;
+	int backlog_hist[BACKLOG_BUCKETS]; /* Blocked clients by backlog size */
+
 	/* For protecting the pending sends list */
 	mutex_t sender_lock;
-	pthread_cond_t sender_cond;
+
+	/* The sender's epoll for blocked clients and the eventfd in it used to
+	 * wake the sender when new sends are added */
+	int sender_epfd;
+	int sender_efd;
+	bool sender_woken;
 
 	/* Hash list of all redirected IP address in redirector mode */
 	redirect_t *redirects;
@@ -167,30 +261,24 @@ struct connector_data {
 
 typedef struct connector_data cdata_t;
 
-/* Increase the reference count of instance */
-static void __inc_instance_ref(client_instance_t *client)
+/* Reference counts are atomic so they can be taken under the read lock and
+ * dropped without any lock. A client is only recycled under the write lock
+ * once it is off the clients hashtable with no references left, so no new
+ * reference can be taken to it by then. */
+static void inc_instance_ref(client_instance_t *client)
 {
-	client->ref++;
+	__sync_add_and_fetch(&client->ref, 1);
 }
 
-static void inc_instance_ref(cdata_t *cdata, client_instance_t *client)
+/* Client must not be touched after dropping what may be the last reference */
+static void dec_instance_refs(client_instance_t *client, const int refs)
 {
-	ck_wlock(&cdata->lock);
-	__inc_instance_ref(client);
-	ck_wunlock(&cdata->lock);
+	__sync_sub_and_fetch(&client->ref, refs);
 }
 
-/* Increase the reference count of instance */
-static void __dec_instance_ref(client_instance_t *client)
+static void dec_instance_ref(client_instance_t *client)
 {
-	client->ref--;
-}
-
-static void dec_instance_ref(cdata_t *cdata, client_instance_t *client)
-{
-	ck_wlock(&cdata->lock);
-	__dec_instance_ref(client);
-	ck_wunlock(&cdata->lock);
+	dec_instance_refs(client, 1);
 }
 
 /* Recruit a client structure from a recycled one if available, creating a
@@ -235,11 +323,12 @@ static void recycle_client(cdata_t *cdata, client_instance_t *client)
 
 /* Accepts incoming connections on the server socket and generates client
  * instances */
-static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
+static int accept_client(cdata_t *cdata, const uint64_t server)
 {
 	int fd, port, no_clients, sockd;
 	ckpool_t *ckp = cdata->ckp;
 	client_instance_t *client;
+	receiver_t *receiver;
 	struct epoll_event event;
 	socklen_t address_len;
 	socklen_t optlen;
@@ -308,17 +397,20 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	/* We increase the ref count on this client as epoll creates a pointer
 	 * to it. We drop that reference when the socket is closed which
 	 * removes it automatically from the epoll list. */
-	__inc_instance_ref(client);
+	inc_instance_ref(client);
 	client->fd = fd;
 	optlen = sizeof(client->sendbufsize);
 	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
 	LOGDEBUG("Client sendbufsize detected as %d", client->sendbufsize);
 
+	/* Shard the client to a receiver by id. Only that receiver waits on
+	 * its fd so it does not need to be oneshot and rearmed. */
+	receiver = &cdata->receivers[client->id % cdata->receiver_count];
 	event.data.u64 = client->id;
-	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+	event.events = EPOLLIN | EPOLLRDHUP;
+	if (unlikely(epoll_ctl(receiver->epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
 		LOGERR("Failed to epoll_ctl add in accept_client");
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		return 0;
 	}
 
@@ -339,7 +431,7 @@ static int __drop_client(cdata_t *cdata, client_instance_t *client)
 	DL_APPEND(cdata->dead_clients, client);
 	/* This is the reference to this client's presence in the
 	 * epoll list. */
-	__dec_instance_ref(client);
+	dec_instance_ref(client);
 	cdata->dead_generated++;
 out:
 	return ret;
@@ -552,36 +644,139 @@ static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
 {
 	client_instance_t *client;
 
-	ck_wlock(&cdata->lock);
+	ck_rlock(&cdata->lock);
 	HASH_FIND_I64(cdata->clients, &id, client);
 	if (client) {
 		if (!client->invalid)
-			__inc_instance_ref(client);
+			inc_instance_ref(client);
 		else
 			client = NULL;
 	}
+	ck_runlock(&cdata->lock);
+
+	return client;
+}
+
+#define REFBENCH_CLIENTS 100000
+
+/* The write locked lookup and reference ref_client_by_id used before client
+ * references were atomic, kept only to compare against in the benchmark */
+static client_instance_t *ref_client_by_id_wlock(cdata_t *cdata, int64_t id)
+{
+	client_instance_t *client;
+
+	ck_wlock(&cdata->lock);
+	HASH_FIND_I64(cdata->clients, &id, client);
+	if (client)
+		client->ref++;
 	ck_wunlock(&cdata->lock);
 
 	return client;
 }
 
-static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
+typedef struct refbench {
+	cdata_t *cdata;
+	bool wlock;
+	tv_t end;
+	unsigned int seed;
+	int64_t refs;
+} refbench_t;
+
+static void *refbench_thread(void *arg)
+{
+	refbench_t *rb = (refbench_t *)arg;
+	cdata_t *cdata = rb->cdata;
+	client_instance_t *client;
+	tv_t now;
+
+	while (42) {
+		int64_t id = rand_r(&rb->seed) % REFBENCH_CLIENTS;
+
+		if (rb->wlock) {
+			client = ref_client_by_id_wlock(cdata, id);
+			ck_wlock(&cdata->lock);
+			client->ref--;
+			ck_wunlock(&cdata->lock);
+		} else {
+			client = ref_client_by_id(cdata, id);
+			dec_instance_ref(client);
+		}
+		if (++rb->refs % 1024)
+			continue;
+		tv_time(&now);
+		if (ms_tvdiff(&rb->end, &now) <= 0)
+			break;
+	}
+	return NULL;
+}
+
+/* Take and drop references to random clients out of REFBENCH_CLIENTS from
+ * threads at once for ms milliseconds, through the old write locked path if
+ * wlock is set, returning references per second. */
+double connector_ref_bench(const bool wlock, const int threads, const int ms)
+{
+	cdata_t *cdata = ckzalloc(sizeof(cdata_t));
+	refbench_t *rbs = ckzalloc(sizeof(refbench_t) * threads);
+	pthread_t *pths = ckalloc(sizeof(pthread_t) * threads);
+	client_instance_t *clients;
+	int64_t refs = 0;
+	tv_t start, end;
+	int i;
+
+	cklock_init(&cdata->lock);
+	clients = ckzalloc(sizeof(client_instance_t) * REFBENCH_CLIENTS);
+	for (i = 0; i < REFBENCH_CLIENTS; i++) {
+		client_instance_t *client = &clients[i];
+
+		client->id = i;
+		HASH_ADD_I64(cdata->clients, id, client);
+	}
+
+	tv_time(&start);
+	for (i = 0; i < threads; i++) {
+		refbench_t *rb = &rbs[i];
+
+		rb->cdata = cdata;
+		rb->wlock = wlock;
+		rb->seed = i + 1;
+		rb->end = start;
+		rb->end.tv_sec += ms / 1000;
+		rb->end.tv_usec += ms % 1000 * 1000;
+		if (rb->end.tv_usec >= 1000000) {
+			rb->end.tv_sec++;
+			rb->end.tv_usec -= 1000000;
+		}
+		create_pthread(&pths[i], refbench_thread, rb);
+	}
+	for (i = 0; i < threads; i++) {
+		join_pthread(pths[i]);
+		refs += rbs[i].refs;
+	}
+	tv_time(&end);
+
+	HASH_CLEAR(hh, cdata->clients);
+	cklock_destroy(&cdata->lock);
+	free(clients);
+	free(pths);
+	free(rbs);
+	free(cdata);
+	return refs * 1000.0 / ms_tvdiff(&end, &start);
+}
+
+static void client_event(ckpool_t *ckp, cdata_t *cdata, const struct epoll_event *event)
 {
 	const uint32_t events = event->events;
 	const uint64_t id = event->data.u64;
-	cdata_t *cdata = ckp->cdata;
 	client_instance_t *client;
 
 	client = ref_client_by_id(cdata, id);
 	if (unlikely(!client)) {
 		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
-		goto outnoclient;
+		return;
 	}
 	/* We can have both messages and read hang ups so process the
 	 * message first. */
 	if (likely(events & EPOLLIN)) {
-		/* Rearm the client for epoll events if we have successfully
-		 * parsed a message from it */
 		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
 			invalidate_client(ckp, cdata, client);
 			goto out;
@@ -612,26 +807,52 @@ static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
 		invalidate_client(cdata->pi->ckp, cdata, client);
 	}
 out:
-	if (likely(!client->invalid)) {
-		/* Rearm the fd in the epoll list if it's still active */
-		event->data.u64 = id;
-		event->events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-		epoll_ctl(cdata->epfd, EPOLL_CTL_MOD, client->fd, event);
-	}
-	dec_instance_ref(cdata, client);
-outnoclient:
-	free(event);
+	dec_instance_ref(client);
+}
+
+/* Drains a batch of events at a time from this receiver's epoll set and
+ * handles each client in place. */
+static void *client_receiver(void *arg)
+{
+	struct epoll_event events[RECEIVE_EVENTS];
+	receiver_t *receiver = (receiver_t *)arg;
+	cdata_t *cdata = receiver->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	char name[16];
+	int ret, i;
+
+	pthread_detach(pthread_self());
+	snprintf(name, 15, "crecv%x", receiver->id);
+	rename_proc(name);
+
+	while (42) {
+		ret = epoll_wait(receiver->epfd, events, RECEIVE_EVENTS, 1000);
+		if (unlikely(ret < 1)) {
+			if (unlikely(ret == -1 && errno != EINTR)) {
+				LOGEMERG("FATAL: Failed to epoll_wait in client_receiver");
+				break;
+			}
+			continue;
+		}
+		receiver->wakeups++;
+		receiver->events += ret;
+		if (ret > receiver->maxbatch)
+			receiver->maxbatch = ret;
+		for (i = 0; i < ret; i++)
+			client_event(ckp, cdata, &events[i]);
+	}
+	return NULL;
 }
 
-/* Waits on fds ready to read on from the list stored in conn_instance and
- * handles the incoming messages */
+/* Waits on the server fds for new connections and hands the accepted clients
+ * to the receivers */
 static void *receiver(void *arg)
 {
+	struct epoll_event events[RECEIVE_EVENTS], event;
 	cdata_t *cdata = (cdata_t *)arg;
-	struct epoll_event *event = ckzalloc(sizeof(struct epoll_event));
 	ckpool_t *ckp = cdata->ckp;
 	uint64_t serverfds, i;
-	int ret, epfd;
+	int ret, epfd, j;
 	char *buf;
 
 	rename_proc("creceiver");
@@ -644,10 +865,9 @@ static void *receiver(void *arg)
 	serverfds = ckp->serverurls;
 	/* Add all the serverfds to the epoll */
 	for (i = 0; i < serverfds; i++) {
-		/* The small values will be less than the first client ids */
-		event->data.u64 = i;
-		event->events = EPOLLIN | EPOLLRDHUP;
-		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], event);
+		event.data.u64 = i;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], &event);
 		if (ret < 0) {
 			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
 			goto out;
@@ -661,141 +881,332 @@ static void *receiver(void *arg)
 	free(buf);
 
 	while (42) {
-		uint64_t edu64;
-
 		while (unlikely(!cdata->accept))
 			cksleep_ms(10);
-		ret = epoll_wait(epfd, event, 1, 1000);
+		ret = epoll_wait(epfd, events, RECEIVE_EVENTS, 1000);
 		if (unlikely(ret < 1)) {
-			if (unlikely(ret == -1)) {
+			if (unlikely(ret == -1 && errno != EINTR)) {
 				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
 				break;
 			}
 			/* Nothing to service, still very unlikely */
 			continue;
 		}
-		edu64 = event->data.u64;
-		if (edu64 < serverfds) {
-			ret = accept_client(cdata, epfd, edu64);
-			if (unlikely(ret < 0)) {
+		for (j = 0; j < ret; j++) {
+			if (unlikely(accept_client(cdata, events[j].data.u64) < 0)) {
 				LOGEMERG("FATAL: Failed to accept_client in receiver");
-				break;
+				goto out;
 			}
-			continue;
 		}
-		/* Event structure is handed off to client_event_processor
-		 * here to be freed so we need to allocate a new one */
-		ckmsgq_add(cdata->cevents, event);
-		event = ckzalloc(sizeof(struct epoll_event));
 	}
 out:
 	/* We shouldn't get here unless there's an error */
 	return NULL;
 }
 
-/* Send a sender_send message and return true if we've finished sending it or
- * are unable to send any more. */
-static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
+/* Wake the sender if it has not already been woken since it last collected
+ * the pending sends. Must hold sender_lock. */
+static void __wake_sender(cdata_t *cdata)
 {
-	client_instance_t *client = sender_send->client;
-	time_t now_t;
+	uint64_t wake = 1;
 
-	if (unlikely(client->invalid))
-		goto out_true;
+	if (cdata->sender_woken)
+		return;
+	cdata->sender_woken = true;
+	if (unlikely(write(cdata->sender_efd, &wake, sizeof(wake)) != sizeof(wake)))
+		LOGWARNING("Failed to write to sender eventfd");
+}
 
-	/* Make sure we only send one message at a time to each client */
-	if (unlikely(client->sending && client->sending != sender_send))
-		return false;
+static void free_sender_send(sender_send_t *sender_send)
+{
+	payload_t *payload = sender_send->payload;
 
-	client->sending = sender_send;
-	now_t = time(NULL);
+	if (payload) {
+		if (!--payload->refs) {
+			free(payload->buf);
+			free(payload);
+		}
+	} else
+		free(sender_send->buf);
+	free(sender_send);
+}
+
+/* Take a client off the blocked list once it has nothing left to send */
+static void unblock_client(client_instance_t **blocked, client_instance_t *client)
+{
+	if (!client->blocked)
+		return;
+	DL_DELETE2(*blocked, client, blocked_prev, blocked_next);
+	client->blocked = false;
+	client->blocked_time = 0;
+}
 
-	/* Increase sendbufsize to match large messages sent to clients - this
-	 * usually only applies to clients as mining nodes. */
-	if (unlikely(!ckp->wmem_warn && sender_send->len > client->sendbufsize))
-		client->sendbufsize = set_sendbufsize(ckp, client->fd, sender_send->len);
+/* Discard everything queued to a client we can no longer send to */
+static void drain_client(cdata_t *cdata, client_instance_t **blocked, client_instance_t *client)
+{
+	sender_send_t *sender_send, *tmp;
+	int sends = 0;
+
+	unblock_client(blocked, client);
+	DL_FOREACH_SAFE(client->sends, sender_send, tmp) {
+		DL_DELETE(client->sends, sender_send);
+		free_sender_send(sender_send);
+		sends++;
+	}
+	client->backlog = 0;
 
-	while (sender_send->len) {
-		int ret = write(client->fd, sender_send->buf + sender_send->ofs, sender_send->len);
+	dec_instance_refs(client, sends);
+}
 
+/* Write out as much of a client's queue as we can with one writev per batch
+ * of sends. Clients that would block are armed for EPOLLOUT on the sender's
+ * epoll and put on the blocked list. The client may be recycled once we
+ * return if its queue was emptied. */
+static void flush_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t **blocked,
+			 client_instance_t *client)
+{
+	struct iovec iov[SEND_IOVECS];
+	sender_send_t *sender_send, *tmp;
+	struct epoll_event event;
+	int iovcnt, sends = 0;
+	ssize_t ret;
+
+	while (client->sends) {
+		if (unlikely(client->invalid))
+			goto drain;
+
+		iovcnt = 0;
+		DL_FOREACH(client->sends, sender_send) {
+			iov[iovcnt].iov_base = sender_send->buf + sender_send->ofs;
+			iov[iovcnt].iov_len = sender_send->len;
+			if (++iovcnt == SEND_IOVECS)
+				break;
+		}
+		ret = writev(client->fd, iov, iovcnt);
 		if (ret < 1) {
-			/* Invalidate clients that block for more than 60 seconds */
-			if (unlikely(client->blocked_time && now_t - client->blocked_time >= 60)) {
-				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
-					  client->id, client->fd);
-				invalidate_client(ckp, cdata, client);
-				goto out_true;
-			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret) {
-				if (!client->blocked_time)
-					client->blocked_time = now_t;
-				return false;
-			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret)
+				goto block;
 			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
 				client->id, client->fd, errno, strerror(errno));
 			invalidate_client(ckp, cdata, client);
-			goto out_true;
+			goto drain;
 		}
-		sender_send->ofs += ret;
-		sender_send->len -= ret;
+		client->backlog -= ret;
 		client->blocked_time = 0;
+		DL_FOREACH_SAFE(client->sends, sender_send, tmp) {
+			if (ret < sender_send->len) {
+				sender_send->ofs += ret;
+				sender_send->len -= ret;
+				break;
+			}
+			ret -= sender_send->len;
+			DL_DELETE(client->sends, sender_send);
+			free_sender_send(sender_send);
+			sends++;
+		}
 	}
-out_true:
-	client->sending = NULL;
-	return true;
+	unblock_client(blocked, client);
+	if (sends) {
+		dec_instance_refs(client, sends);
+	}
+	return;
+
+block:
+	/* Any progress resets the time this client has been blocked */
+	if (!client->blocked_time)
+		client->blocked_time = time(NULL);
+	if (!client->blocked) {
+		client->blocked = true;
+		DL_APPEND2(*blocked, client, blocked_prev, blocked_next);
+		mutex_lock(&cdata->sender_lock);
+		cdata->sends_delayed++;
+		mutex_unlock(&cdata->sender_lock);
+	}
+	/* Oneshot so we never need to delete the fd from the sender's epoll,
+	 * closing the fd removes it. */
+	event.data.ptr = client;
+	event.events = EPOLLOUT | EPOLLONESHOT;
+	if (epoll_ctl(cdata->sender_epfd, client->epollout ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		      client->fd, &event) < 0) {
+		LOGINFO("Failed to epoll_ctl client id %"PRId64" fd %d in sender",
+			client->id, client->fd);
+		invalidate_client(ckp, cdata, client);
+		goto drain;
+	}
+	client->epollout = true;
+	if (sends) {
+		dec_instance_refs(client, sends);
+	}
+	return;
+
+drain:
+	if (sends) {
+		dec_instance_refs(client, sends);
+	}
+	drain_client(cdata, blocked, client);
 }
 
-static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
+/* Histogram bucket for a client's backlog, each 16 times larger than the
+ * last starting with under 4kB */
+static int backlog_bucket(int64_t backlog)
 {
-	dec_instance_ref(cdata, sender_send->client);
-	free(sender_send->buf);
-	free(sender_send);
+	int bucket = 0;
+
+	for (backlog >>= 12; backlog && bucket < BACKLOG_BUCKETS - 1; backlog >>= 4)
+		bucket++;
+	return bucket;
 }
 
-/* Use a thread to send queued messages, appending them to the sends list and
- * iterating over all of them, attempting to send them all non-blocking to
- * only send to those clients ready to receive data. */
+/* Drop invalid and long blocked clients from the blocked list, and update
+ * the backlog stats. */
+static void check_blocked(ckpool_t *ckp, cdata_t *cdata, client_instance_t **blocked)
+{
+	int64_t sends_queued = 0, sends_size = 0, backlog_bytes = 0, backlog_max = 0;
+	int backlog_hist[BACKLOG_BUCKETS] = {0};
+	int64_t backlog_max_id = 0;
+	client_instance_t *client, *tmp;
+	sender_send_t *sender_send;
+	time_t now_t = time(NULL);
+	int blocked_clients = 0;
+
+	DL_FOREACH_SAFE2(*blocked, client, tmp, blocked_next) {
+		/* Invalidate clients that block for more than 60 seconds */
+		if (unlikely(!client->invalid && now_t - client->blocked_time >= 60)) {
+			LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+				  client->id, client->fd);
+			invalidate_client(ckp, cdata, client);
+		}
+		if (client->invalid) {
+			drain_client(cdata, blocked, client);
+			continue;
+		}
+		blocked_clients++;
+		DL_FOREACH(client->sends, sender_send) {
+			sends_queued++;
+			sends_size += sizeof(sender_send_t);
+			if (!sender_send->payload)
+				sends_size += sender_send->len + 1;
+		}
+		backlog_bytes += client->backlog;
+		backlog_hist[backlog_bucket(client->backlog)]++;
+		if (client->backlog > backlog_max) {
+			backlog_max = client->backlog;
+			backlog_max_id = client->id;
+		}
+	}
+
+	mutex_lock(&cdata->sender_lock);
+	cdata->sends_queued = sends_queued;
+	cdata->sends_size = sends_size;
+	cdata->blocked_clients = blocked_clients;
+	cdata->backlog_bytes = backlog_bytes;
+	cdata->backlog_max = backlog_max;
+	cdata->backlog_max_id = backlog_max_id;
+	memcpy(cdata->backlog_hist, backlog_hist, sizeof(backlog_hist));
+	if (backlog_bytes > cdata->backlog_highwater)
+		cdata->backlog_highwater = backlog_bytes;
+	mutex_unlock(&cdata->sender_lock);
+}
+
+static bool setup_sender(cdata_t *cdata)
+{
+	struct epoll_event event;
+
+	cdata->sender_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (cdata->sender_epfd < 0) {
+		LOGEMERG("FATAL: Failed to create epoll for sender");
+		return false;
+	}
+	cdata->sender_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cdata->sender_efd < 0) {
+		LOGEMERG("FATAL: Failed to create eventfd for sender");
+		return false;
+	}
+	/* The eventfd is the only entry without a client */
+	event.data.ptr = NULL;
+	event.events = EPOLLIN;
+	if (epoll_ctl(cdata->sender_epfd, EPOLL_CTL_ADD, cdata->sender_efd, &event) < 0) {
+		LOGEMERG("FATAL: Failed to add sender eventfd to epoll");
+		return false;
+	}
+	return true;
+}
+
+/* Use a thread to send queued messages. Each client has its own queue of
+ * sends written out together, and only clients that would block are waited
+ * on for EPOLLOUT so new sends never wait behind blocked clients. */
 static void *sender(void *arg)
 {
+	struct epoll_event events[RECEIVE_EVENTS];
 	cdata_t *cdata = (cdata_t *)arg;
-	sender_send_t *sends = NULL;
+	client_instance_t *blocked = NULL;
 	ckpool_t *ckp = cdata->ckp;
+	time_t last_check = 0;
 
 	rename_proc("csender");
 
 	while (42) {
-		int64_t sends_queued = 0, sends_size = 0;
-		sender_send_t *sending, *tmp;
-
-		/* Check all sends to see if they can be written out */
-		DL_FOREACH_SAFE(sends, sending, tmp) {
-			if (send_sender_send(ckp, cdata, sending)) {
-				DL_DELETE(sends, sending);
-				clear_sender_send(sending, cdata);
-			} else {
-				sends_queued++;
-				sends_size += sizeof(sender_send_t) + sending->len + 1;
+		client_instance_t *client, *flush = NULL;
+		sender_send_t *sends, *sending, *tmp;
+		int ret, i;
+		time_t now_t;
+
+		ret = epoll_wait(cdata->sender_epfd, events, RECEIVE_EVENTS, 1000);
+		if (unlikely(ret == -1 && errno != EINTR)) {
+			LOGEMERG("FATAL: Failed to epoll_wait in sender");
+			break;
+		}
+		/* Flush any blocked clients that are now writable */
+		for (i = 0; i < ret; i++) {
+			uint64_t wake;
+
+			client = events[i].data.ptr;
+			if (!client) {
+				if (read(cdata->sender_efd, &wake, sizeof(wake)) < 0 && errno != EAGAIN)
+					LOGWARNING("Failed to read sender eventfd");
+				continue;
 			}
+			if (likely(client->blocked))
+				flush_client(ckp, cdata, &blocked, client);
 		}
 
 		mutex_lock(&cdata->sender_lock);
-		cdata->sends_delayed += sends_queued;
-		cdata->sends_queued = sends_queued;
-		cdata->sends_size = sends_size;
-		/* Poll every 10ms if there are no new sends. */
-		if (!cdata->sender_sends) {
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&cdata->sender_cond, &cdata->sender_lock, &timeout_ts);
+		sends = cdata->sender_sends;
+		cdata->sender_sends = NULL;
+		cdata->sender_woken = false;
+		mutex_unlock(&cdata->sender_lock);
+
+		/* Queue new sends to their clients, flushing those not already
+		 * blocked in the order they had messages queued */
+		DL_FOREACH_SAFE(sends, sending, tmp) {
+			client = sending->client;
+			DL_DELETE(sends, sending);
+			DL_APPEND(client->sends, sending);
+			client->backlog += sending->len;
+			/* Increase sendbufsize to match large messages sent to
+			 * clients - this usually only applies to clients as
+			 * mining nodes. */
+			if (unlikely(!ckp->wmem_warn && !client->invalid &&
+				     sending->len > client->sendbufsize))
+				client->sendbufsize = set_sendbufsize(ckp, client->fd, sending->len);
+			if (client->blocked || client->flushing)
+				continue;
+			client->flushing = true;
+			client->flush_next = flush;
+			flush = client;
 		}
-		if (cdata->sender_sends) {
-			DL_CONCAT(sends, cdata->sender_sends);
-			cdata->sender_sends = NULL;
+		while (flush) {
+			client = flush;
+			flush = client->flush_next;
+			client->flushing = false;
+			flush_client(ckp, cdata, &blocked, client);
+		}
+
+		now_t = time(NULL);
+		if (now_t != last_check) {
+			last_check = now_t;
+			check_blocked(ckp, cdata, &blocked);
 		}
-		mutex_unlock(&cdata->sender_lock);
 	}
 	/* We shouldn't get here unless there's an error */
 	return NULL;
@@ -846,12 +1257,12 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = strlen(buf);
-	inc_instance_ref(cdata, client);
+	inc_instance_ref(client);
 
 	mutex_lock(&cdata->sender_lock);
 	cdata->sends_generated++;
 	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
+	__wake_sender(cdata);
 	mutex_unlock(&cdata->sender_lock);
 }
 
@@ -954,7 +1365,7 @@ static void send_client(cdata_t *cdata, const int64_t id, char *buf)
 			client = ref_client_by_id(cdata, client_id);
 			if (client) {
 				invalidate_client(ckp, cdata, client);
-				dec_instance_ref(cdata, client);
+				dec_instance_ref(client);
 			} else
 				stratifier_drop_id(ckp, id);
 			free(buf);
@@ -990,7 +1401,7 @@ out:
 	mutex_lock(&cdata->sender_lock);
 	cdata->sends_generated++;
 	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
+	__wake_sender(cdata);
 	mutex_unlock(&cdata->sender_lock);
 }
 
@@ -1223,11 +1634,89 @@ out:
 	return ret;
 }
 
-static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
+/* Queue one shared buffer to every client in the list, taking all the client
+ * references under one read lock. */
+static void send_clients(cdata_t *cdata, char *buf, const int64_t *client_ids, const int clients)
 {
+	ckpool_t *ckp = cdata->ckp;
+	sender_send_t *sends = NULL, *sender_send;
+	int64_t *dropped = NULL;
+	int i, len, drops = 0;
+	client_instance_t *client;
+	payload_t *payload;
+
+	len = strlen(buf);
+	if (unlikely(!len || !clients)) {
+		free(buf);
+		return;
+	}
+	payload = ckzalloc(sizeof(payload_t));
+	payload->buf = buf;
+
+	ck_rlock(&cdata->lock);
+	for (i = 0; i < clients; i++) {
+		int64_t id = client_ids[i];
+
+		HASH_FIND_I64(cdata->clients, &id, client);
+		if (unlikely(!client || client->invalid)) {
+			if (!client) {
+				if (!dropped)
+					dropped = ckalloc(sizeof(int64_t) * clients);
+				dropped[drops++] = id;
+			}
+			continue;
+		}
+		inc_instance_ref(client);
+		sender_send = ckzalloc(sizeof(sender_send_t));
+		sender_send->client = client;
+		sender_send->buf = buf;
+		sender_send->len = len;
+		sender_send->payload = payload;
+		DL_APPEND(sends, sender_send);
+		payload->refs++;
+	}
+	ck_runlock(&cdata->lock);
+
+	for (i = 0; i < drops; i++) {
+		LOGINFO("Connector failed to find client id %"PRId64" to send to", dropped[i]);
+		stratifier_drop_id(ckp, dropped[i]);
+	}
+	free(dropped);
+
+	if (unlikely(!sends)) {
+		free(buf);
+		free(payload);
+		return;
+	}
+
+	mutex_lock(&cdata->sender_lock);
+	cdata->sends_generated += payload->refs;
+	cdata->broadcasts++;
+	DL_CONCAT(cdata->sender_sends, sends);
+	__wake_sender(cdata);
+	mutex_unlock(&cdata->sender_lock);
+}
+
+static void client_message_processor(ckpool_t *ckp, client_msg_t *client_msg)
+{
+	serializer_t *serializer = client_msg->serializer;
+	json_t *json_msg = client_msg->val;
 	int64_t client_id;
 	char *msg;
 
+	serializer->messages++;
+	if (client_msg->client_ids) {
+		serializer->bytes += strlen(client_msg->buf) * client_msg->clients;
+		send_clients(ckp->cdata, client_msg->buf, client_msg->client_ids,
+			     client_msg->clients);
+		goto out;
+	}
+	if (client_msg->buf) {
+		serializer->bytes += strlen(client_msg->buf);
+		send_client(ckp->cdata, client_msg->client_id, client_msg->buf);
+		goto out;
+	}
+
 	/* Extract the client id from the json message and remove its entry */
 	client_id = json_integer_value(json_object_get(json_msg, "client_id"));
 	json_object_del(json_msg, "client_id");
@@ -1237,15 +1726,95 @@ static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 		json_object_set_new_nocheck(json_msg, "client_id", json_integer(client_id & 0xffffffffll));
 
 	msg = json_dumps(json_msg, JSON_EOL | JSON_COMPACT);
+	if (likely(msg))
+		serializer->bytes += strlen(msg);
 	send_client(ckp->cdata, client_id, msg);
 	json_decref(json_msg);
+out:
+	free(client_msg->client_ids);
+	free(client_msg);
+}
+
+static serializer_t *client_serializer(cdata_t *cdata, const int64_t client_id)
+{
+	uint64_t id = client_id;
+
+	return &cdata->serializers[id % cdata->serializer_count];
+}
+
+static void add_client_msg(cdata_t *cdata, client_msg_t *client_msg, const int64_t client_id)
+{
+	client_msg->serializer = client_serializer(cdata, client_id);
+	ckmsgq_add(client_msg->serializer->cmpq, client_msg);
 }
 
 void connector_add_message(ckpool_t *ckp, json_t *val)
 {
 	cdata_t *cdata = ckp->cdata;
+	client_msg_t *client_msg;
+
+	client_msg = ckzalloc(sizeof(client_msg_t));
+	client_msg->val = val;
+	add_client_msg(cdata, client_msg, json_integer_value(json_object_get(val, "client_id")));
+}
+
+/* Send a line already rendered, including its trailing newline, to one
+ * client without any json processing, taking ownership of buf. */
+void connector_add_rendered(ckpool_t *ckp, const int64_t client_id, char *buf)
+{
+	cdata_t *cdata = ckp->cdata;
+	client_msg_t *client_msg;
+
+	client_msg = ckzalloc(sizeof(client_msg_t));
+	client_msg->buf = buf;
+	client_msg->client_id = client_id;
+	add_client_msg(cdata, client_msg, client_id);
+}
 
-	ckmsgq_add(cdata->cmpq, val);
+/* Send the same rendered line to every client in client_ids, taking ownership
+ * of buf and client_ids. The list is split between the serializers so each
+ * client's share is queued in order with its other messages. */
+void connector_add_broadcast(ckpool_t *ckp, char *buf, int64_t *client_ids, const int clients)
+{
+	cdata_t *cdata = ckp->cdata;
+	int i, j, count = cdata->serializer_count;
+	client_msg_t **client_msgs;
+
+	if (count == 1) {
+		client_msgs = ckzalloc(sizeof(client_msg_t *));
+		client_msgs[0] = ckzalloc(sizeof(client_msg_t));
+		client_msgs[0]->buf = buf;
+		client_msgs[0]->client_ids = client_ids;
+		client_msgs[0]->clients = clients;
+		add_client_msg(cdata, client_msgs[0], 0);
+		free(client_msgs);
+		return;
+	}
+
+	client_msgs = ckzalloc(sizeof(client_msg_t *) * count);
+	for (i = 0; i < clients; i++) {
+		j = client_serializer(cdata, client_ids[i]) - cdata->serializers;
+		if (!client_msgs[j]) {
+			client_msgs[j] = ckzalloc(sizeof(client_msg_t));
+			client_msgs[j]->client_ids = ckalloc(sizeof(int64_t) * clients);
+		}
+		client_msgs[j]->client_ids[client_msgs[j]->clients++] = client_ids[i];
+	}
+	/* Each serializer gets its own copy of the buffer to share out */
+	for (i = 0, j = 0; i < count; i++) {
+		if (!client_msgs[i])
+			continue;
+		client_msgs[i]->buf = j++ ? strdup(buf) : buf;
+		client_msgs[i]->serializer = &cdata->serializers[i];
+	}
+	for (i = 0; i < count; i++) {
+		if (client_msgs[i])
+			ckmsgq_add(client_msgs[i]->serializer->cmpq, client_msgs[i]);
+	}
+	if (!j)
+		free(buf);
+	free(client_ids);
+	free(client_msgs);
 }
 
 /* Send the passthrough the terminate node.method */
@@ -1268,8 +1837,10 @@ static char *connector_stats(cdata_t *cdata, const int runtime)
 	client_instance_t *client;
 	int objects, generated;
 	sender_send_t *send;
+	time_t now_t, elapsed;
 	int64_t memsize;
 	char *buf;
+	int i;
 
 	/* If called in passthrough mode we log stats instead of the stratifier */
 	if (runtime)
@@ -1299,15 +1870,62 @@ static char *connector_stats(cdata_t *cdata, const int runtime)
 	mutex_lock(&cdata->sender_lock);
 	DL_FOREACH(cdata->sender_sends, send) {
 		objects++;
-		memsize += sizeof(sender_send_t) + send->len + 1;
+		memsize += sizeof(sender_send_t);
+		if (!send->payload)
+			memsize += send->len + 1;
 	}
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", cdata->sends_generated);
+	JSON_CPACK(subval, "{si,si,si,si}", "count", objects, "memory", memsize, "generated", cdata->sends_generated,
+		   "broadcasts", cdata->broadcasts);
 	json_set_object(val, "sends", subval);
 
 	JSON_CPACK(subval, "{si,si,si}", "count", cdata->sends_queued, "memory", cdata->sends_size, "generated", cdata->sends_delayed);
+	json_set_object(val, "delays", subval);
+
+	/* Blocked clients with backlogs under 4k, 64k, 1M and 1M or more */
+	JSON_CPACK(subval, "{si,sI,sI,sI,sI,s[iiii]}", "clients", cdata->blocked_clients,
+		   "bytes", cdata->backlog_bytes, "maxbytes", cdata->backlog_max, "maxclient", cdata->backlog_max_id,
+		   "highwater", cdata->backlog_highwater, "histogram", cdata->backlog_hist[0],
+		   cdata->backlog_hist[1], cdata->backlog_hist[2], cdata->backlog_hist[3]);
 	mutex_unlock(&cdata->sender_lock);
 
-	json_set_object(val, "delays", subval);
+	json_set_object(val, "backlog", subval);
+
+	/* Throughput of each serializer since the last stats */
+	now_t = time(NULL);
+	elapsed = now_t - (cdata->serializer_stats ? cdata->serializer_stats : cdata->start_time);
+	if (elapsed < 1)
+		elapsed = 1;
+	cdata->serializer_stats = now_t;
+	subval = json_array();
+	for (i = 0; i < cdata->serializer_count; i++) {
+		serializer_t *serializer = &cdata->serializers[i];
+		int64_t messages = serializer->messages, bytes = serializer->bytes;
+		json_t *serval;
+
+		JSON_CPACK(serval, "{sI,sI,sf,sf}", "messages", messages, "bytes", bytes,
+			   "msgrate", (double)(messages - serializer->last_messages) / elapsed,
+			   "byterate", (double)(bytes - serializer->last_bytes) / elapsed);
+		serializer->last_messages = messages;
+		serializer->last_bytes = bytes;
+		json_array_append_new(subval, serval);
+	}
+	json_set_object(val, "serializers", subval);
+
+	/* Event throughput and batching of each receiver */
+	subval = json_array();
+	for (i = 0; i < cdata->receiver_count; i++) {
+		receiver_t *receiver = &cdata->receivers[i];
+		int64_t events = receiver->events, wakeups = receiver->wakeups;
+		json_t *recval;
+
+		JSON_CPACK(recval, "{sI,sI,sf,sf,si}", "events", events, "wakeups", wakeups,
+			   "eventrate", (double)(events - receiver->last_events) / elapsed,
+			   "batch", wakeups ? (double)events / wakeups : 0.0,
+			   "maxbatch", receiver->maxbatch);
+		receiver->last_events = events;
+		json_array_append_new(subval, recval);
+	}
+	json_set_object(val, "receivers", subval);
 
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
@@ -1359,7 +1977,7 @@ retry:
 	if (likely(buf[0] == '{')) {
 		json_t *val = json_loads(buf, JSON_DISABLE_EOF_CHECK, NULL);
 
-		ckmsgq_add(cdata->cmpq, val);
+		connector_add_message(ckp, val);
 	} else if (cmdmatch(buf, "upstream=")) {
 		char *msg = strdup(buf + 9);
 
@@ -1385,7 +2003,7 @@ retry:
 			goto retry;
 		}
 		ret = invalidate_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		if (ret >= 0)
 			LOGINFO("Connector dropped client id: %"PRId64, client_id);
 	} else if (cmdmatch(buf, "testclient")) {
@@ -1417,7 +2035,8 @@ retry:
 		msg = connector_stats(cdata, 0);
 		send_unix_msg(umsg->sockd, msg);
 	} else if (cmdmatch(buf, "loglevel")) {
-		sscanf(buf, "loglevel=%d", &ckp->loglevel);
+		if (sscanf(buf, "loglevel=%d", &ckp->loglevel) == 1)
+			log_setlevel(ckp->loglevel);
 	} else if (cmdmatch(buf, "passthrough")) {
 		client_instance_t *client;
 
@@ -1432,7 +2051,7 @@ retry:
 			goto retry;
 		}
 		passthrough_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	} else if (cmdmatch(buf, "remote")) {
 		client_instance_t *client;
 
@@ -1447,7 +2066,7 @@ retry:
 			goto retry;
 		}
 		remote_server(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
 
@@ -1560,7 +2179,16 @@ void *connector(void *arg)
 	if (tries)
 		LOGWARNING("Connector successfully bound to socket");
 
-	cdata->cmpq = create_ckmsgq(ckp, "cmpq", &client_message_processor);
+	/* Serialise outbound messages on as many threads as the events */
+	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
+	cdata->serializer_count = threads;
+	cdata->serializers = ckzalloc(sizeof(serializer_t) * threads);
+	for (i = 0; i < threads; i++) {
+		char name[16];
+
+		snprintf(name, 15, "cmpq%x", i);
+		cdata->serializers[i].cmpq = create_ckmsgq(ckp, name, &client_message_processor);
+	}
 
 	if (ckp->remote && !setup_upstream(ckp, cdata))
 		goto out;
@@ -1572,10 +2200,24 @@ void *connector(void *arg)
 	 * them from the server fds in epoll. */
 	cdata->client_id = ckp->serverurls;
 	mutex_init(&cdata->sender_lock);
-	cond_init(&cdata->sender_cond);
+	if (!setup_sender(cdata))
+		goto out;
 	create_pthread(&cdata->pth_sender, sender, cdata);
-	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
+	/* Shard client events across as many receivers as serializers */
+	cdata->receiver_count = threads;
+	cdata->receivers = ckzalloc(sizeof(receiver_t) * threads);
+	for (i = 0; i < threads; i++) {
+		receiver_t *receiver = &cdata->receivers[i];
+
+		receiver->cdata = cdata;
+		receiver->id = i;
+		receiver->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (receiver->epfd < 0) {
+			LOGEMERG("FATAL: Failed to create epoll for receiver %d", i);
+			goto out;
+		}
+		create_pthread(&receiver->pth, client_receiver, receiver);
+	}
 	create_pthread(&cdata->pth_receiver, receiver, cdata);
 	cdata->start_time = time(NULL);
 
@@ -11,6 +11,9 @@
 #define CONNECTOR_H
 
 void connector_add_message(ckpool_t *ckp, json_t *val);
+void connector_add_rendered(ckpool_t *ckp, const int64_t client_id, char *buf);
+void connector_add_broadcast(ckpool_t *ckp, char *buf, int64_t *client_ids, const int clients);
+double connector_ref_bench(const bool wlock, const int threads, const int ms);
 void *connector(void *arg);
 
 #endif /* CONNECTOR_H */
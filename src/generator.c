@@ -18,6 +18,7 @@
 #include "ckpool.h"
 #include "libckpool.h"
 #include "generator.h"
+#include "stratifier.h"
 #include "bitcoin.h"
 #include "uthash.h"
 #include "utlist.h"
@@ -165,10 +166,38 @@ struct generator_data {
 	int64_t share_id;
 
 	proxy_instance_t *current_proxy;
+
+	/* Solved blocks, submitted to every bitcoind outside of gen_loop */
+	ckmsgq_t *blocksubmits;
+
+	mutex_t longpoll_lock;
+	int longpoll_height; // Highest block template height pushed by longpoll
 };
 
 typedef struct generator_data gdata_t;
 
+/* One solved block being submitted to all bitcoinds at once */
+struct block_submit {
+	ckpool_t *ckp;
+	mutex_t lock;
+	char *buf; /* Original "submitblock:hash,data" message */
+	char *head; /* Or the hex header and coinbase followed by tail */
+	blocktail_t *tail;
+	char hash[68];
+	tv_t start;
+	int pending; /* Servers still submitting */
+	bool accepted;
+};
+
+typedef struct block_submit block_submit_t;
+
+struct server_submit {
+	block_submit_t *bs;
+	server_instance_t *si;
+};
+
+typedef struct server_submit server_submit_t;
+
 /* Use a temporary fd when testing server_alive to avoid races on cs->fd */
 static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 {
@@ -275,6 +304,7 @@ static void kill_server(server_instance_t *si)
 	LOGNOTICE("Killing server");
 	cs = &si->cs;
 	Close(cs->fd);
+	close_rpcconns(cs);
 	empty_buffer(cs);
 	dealloc(cs->url);
 	dealloc(cs->port);
@@ -297,6 +327,7 @@ static void gen_loop(proc_instance_t *pi)
 	server_instance_t *si = NULL, *old_si;
 	unix_msg_t *umsg = NULL;
 	ckpool_t *ckp = pi->ckp;
+	gdata_t *gdata = ckp->gdata;
 	bool started = false;
 	char *buf = NULL;
 	connsock_t *cs;
@@ -313,6 +344,7 @@ reconnect:
 		started = true;
 		LOGWARNING("%s generator ready", ckp->name);
 	}
+	gdata->si = si;
 
 	gbt = si->data;
 	cs = &si->cs;
@@ -360,6 +392,18 @@ retry:
 		} else {
 			send_unix_msg(umsg->sockd, hash);
 		}
+	} else if (cmdmatch(buf, "getheader:")) {
+		json_t *header = get_blockheader(cs, buf + 10);
+
+		if (!header)
+			send_unix_msg(umsg->sockd, "failed");
+		else {
+			char *s = json_dumps(header, JSON_COMPACT);
+
+			send_unix_msg(umsg->sockd, s);
+			free(s);
+			json_decref(header);
+		}
 	} else if (cmdmatch(buf, "getlast")) {
 		int height;
 
@@ -397,7 +441,8 @@ retry:
 	} else if (cmdmatch(buf, "reconnect")) {
 		goto reconnect;
 	} else if (cmdmatch(buf, "loglevel")) {
-		sscanf(buf, "loglevel=%d", &ckp->loglevel);
+		if (sscanf(buf, "loglevel=%d", &ckp->loglevel) == 1)
+			log_setlevel(ckp->loglevel);
 	} else if (cmdmatch(buf, "ping")) {
 		LOGDEBUG("Generator received ping request");
 		send_unix_msg(umsg->sockd, "pong");
@@ -2779,7 +2824,8 @@ retry:
 		sprintf(blockmsg, "%sblock:%s", ret ? "" : "no", buf + 12);
 		send_proc(ckp->stratifier, blockmsg);
 	} else if (cmdmatch(buf, "loglevel")) {
-		sscanf(buf, "loglevel=%d", &ckp->loglevel);
+		if (sscanf(buf, "loglevel=%d", &ckp->loglevel) == 1)
+			log_setlevel(ckp->loglevel);
 	} else if (cmdmatch(buf, "ping")) {
 		LOGDEBUG("Proxy received ping request");
 		send_unix_msg(umsg->sockd, "pong");
@@ -2828,8 +2874,284 @@ static void *server_watchdog(void *arg)
 	return NULL;
 }
 
+/* Free a block submission once no bitcoind submission still uses it */
+static void clear_block_submit(block_submit_t *bs)
+{
+	if (bs->tail)
+		blocktail_put(bs->tail);
+	free(bs->head);
+	free(bs->buf);
+	free(bs);
+}
+
+/* Submit a block to one bitcoind, telling the stratifier as soon as the first
+ * server accepts it, or once all of them have rejected it. */
+static void *server_submitblock(void *arg)
+{
+	server_submit_t *ss = (server_submit_t *)arg;
+	block_submit_t *bs = ss->bs;
+	connsock_t *cs = &ss->si->cs;
+	bool ret, first = false, last;
+	char blockmsg[80];
+	tv_t now;
+
+	pthread_detach(pthread_self());
+	rename_proc("blocksubmit");
+
+	if (bs->tail)
+		ret = submit_blocktail(cs, bs->head, bs->tail);
+	else
+		ret = submit_block(cs, bs->buf + 12 + 64 + 1);
+	tv_time(&now);
+	LOGWARNING("Block %s %s by %s:%s in %.3fs", bs->hash, ret ? "accepted" : "rejected",
+		   cs->url, cs->port, tvdiff(&now, &bs->start));
+
+	mutex_lock(&bs->lock);
+	if (ret && !bs->accepted)
+		bs->accepted = first = true;
+	last = !--bs->pending;
+	mutex_unlock(&bs->lock);
+
+	if (first) {
+		sprintf(blockmsg, "block:%s", bs->hash);
+		send_proc(bs->ckp->stratifier, blockmsg);
+	}
+	if (last) {
+		if (!bs->accepted) {
+			sprintf(blockmsg, "noblock:%s", bs->hash);
+			send_proc(bs->ckp->stratifier, blockmsg);
+		}
+		clear_block_submit(bs);
+	}
+	free(ss);
+	return NULL;
+}
+
+/* Submit a solved block to every alive bitcoind in parallel, or to every
+ * configured one if none are flagged alive. */
+static void submit_blocks(ckpool_t *ckp, block_submit_t *bs)
+{
+	server_instance_t *servers[ckp->btcds];
+	int i, count = 0;
+	pthread_t pth;
+
+	for (i = 0; i < ckp->btcds; i++) {
+		if (ckp->servers[i]->alive)
+			servers[count++] = ckp->servers[i];
+	}
+	if (!count) {
+		for (i = 0; i < ckp->btcds; i++) {
+			if (ckp->servers[i]->cs.url)
+				servers[count++] = ckp->servers[i];
+		}
+	}
+	if (unlikely(!count)) {
+		LOGEMERG("No bitcoind to submit block to!");
+		clear_block_submit(bs);
+		return;
+	}
+
+	bs->pending = count;
+	LOGNOTICE("Submitting block %s to %d bitcoind%s", bs->hash, count, count > 1 ? "s" : "");
+
+	for (i = 0; i < count; i++) {
+		server_submit_t *ss = ckalloc(sizeof(server_submit_t));
+
+		ss->bs = bs;
+		ss->si = servers[i];
+		create_pthread(&pth, server_submitblock, ss);
+	}
+}
+
+static block_submit_t *new_block_submit(ckpool_t *ckp, const char *hash)
+{
+	block_submit_t *bs = ckzalloc(sizeof(block_submit_t));
+
+	bs->ckp = ckp;
+	mutex_init(&bs->lock);
+	sprintf(bs->hash, "%.64s", hash);
+	tv_time(&bs->start);
+	return bs;
+}
+
+/* Submit a solved block directly instead of queueing it behind other requests
+ * to the generator, which is used only if there are no bitcoinds set up. */
+void generator_submitblock(ckpool_t *ckp, const char *buf)
+{
+	gdata_t *gdata = ckp->gdata;
+	block_submit_t *bs;
+
+	if (unlikely(!gdata || !gdata->blocksubmits)) {
+		send_proc(ckp->generator, buf);
+		return;
+	}
+	bs = new_block_submit(ckp, buf + 12);
+	bs->buf = strdup(buf);
+	ckmsgq_add(gdata->blocksubmits, bs);
+}
+
+/* As generator_submitblock for a block solved from a workbase with its
+ * transactions precomputed, submitting them without copying. */
+void generator_submitblocktail(ckpool_t *ckp, const char *hash, const char *head,
+			       blocktail_t *tail)
+{
+	gdata_t *gdata = ckp->gdata;
+	block_submit_t *bs;
+
+	if (unlikely(!gdata || !gdata->blocksubmits)) {
+		char *buf;
+
+		ASPRINTF(&buf, "submitblock:%s,%s%s", hash, head, tail->hex);
+		send_proc(ckp->generator, buf);
+		free(buf);
+		return;
+	}
+	bs = new_block_submit(ckp, hash);
+	bs->head = strdup(head);
+	blocktail_get(tail);
+	bs->tail = tail;
+	ckmsgq_add(gdata->blocksubmits, bs);
+}
+
+/* Whether the stratifier can take templates directly from a bitcoind in
+ * process instead of asking the generator for them as a string. */
+bool generator_templates(ckpool_t *ckp)
+{
+	return !ckp->proxy && ckp->gdata && ckp->servers;
+}
+
+/* Fetch a block template from the current bitcoind in the calling thread,
+ * returning it parsed and referenced, or NULL on failure. */
+gbttemplate_t *generator_gettemplate(ckpool_t *ckp)
+{
+	gdata_t *gdata = ckp->gdata;
+	server_instance_t *si = gdata->si;
+	gbttemplate_t *tmpl;
+	connsock_t *cs;
+	int i;
+
+	if (!si || !si->alive) {
+		for (si = NULL, i = 0; i < ckp->btcds; i++) {
+			if (ckp->servers[i]->alive) {
+				si = ckp->servers[i];
+				break;
+			}
+		}
+	}
+	if (unlikely(!si)) {
+		LOGWARNING("No live bitcoind to get block template from");
+		sleep(1);
+		return NULL;
+	}
+	cs = &si->cs;
+	tmpl = gen_gbttemplate(cs, NULL);
+	if (unlikely(!tmpl)) {
+		LOGWARNING("Failed to get block template from %s:%s",
+			   cs->url, cs->port);
+		si->alive = false;
+		send_proc(ckp->generator, "reconnect");
+	}
+	return tmpl;
+}
+
+/* Whether block changes and templates are arriving by longpoll from the
+ * current bitcoind, making polling it for its best block unnecessary. */
+bool generator_longpolling(ckpool_t *ckp)
+{
+	gdata_t *gdata = ckp->gdata;
+	server_instance_t *si;
+
+	if (!ckp->longpoll || !gdata)
+		return false;
+	si = gdata->si;
+	return si && si->alive && si->longpolling;
+}
+
+/* Push a template returned by a longpoll to the stratifier. Templates from
+ * the current bitcoind are always used, but those from the others only when
+ * they're for a block higher than any pushed so far, so the first bitcoind
+ * to see a new block gets it to miners. Takes the template's reference. */
+static void push_longpoll(ckpool_t *ckp, server_instance_t *si, gbttemplate_t *tmpl)
+{
+	gdata_t *gdata = ckp->gdata;
+	bool push = false;
+
+	mutex_lock(&gdata->longpoll_lock);
+	if (si == gdata->si || tmpl->base.height > gdata->longpoll_height) {
+		if (tmpl->base.height > gdata->longpoll_height)
+			gdata->longpoll_height = tmpl->base.height;
+		push = true;
+	}
+	mutex_unlock(&gdata->longpoll_lock);
+
+	if (push) {
+		LOGINFO("Longpoll returned template at height %d from %s:%s",
+			tmpl->base.height, si->cs.url, si->cs.port);
+		stratifier_template(ckp, tmpl);
+	} else
+		gbttemplate_put(tmpl);
+}
+
+/* Keep a getblocktemplate longpoll outstanding on one bitcoind, pushing each
+ * template it returns straight to the stratifier. Falls back to block polling
+ * for this bitcoind if it doesn't offer a longpollid. */
+static void *server_longpoll(void *arg)
+{
+	server_instance_t *si = (server_instance_t *)arg;
+	connsock_t *cs = &si->cs;
+	ckpool_t *ckp = cs->ckp;
+	char *longpollid = NULL;
+
+	rename_proc("longpoll");
+
+	pthread_detach(pthread_self());
+
+	while (42) {
+		gbttemplate_t *tmpl;
+
+		if (!si->alive) {
+			si->longpolling = false;
+			dealloc(longpollid);
+			cksleep_ms(1000);
+			continue;
+		}
+		tmpl = gen_gbttemplate(cs, longpollid);
+		if (unlikely(!tmpl)) {
+			/* Start again with a fresh template, polling for blocks
+			 * in the meantime */
+			LOGINFO("Longpoll failed on %s:%s", cs->url, cs->port);
+			si->longpolling = false;
+			dealloc(longpollid);
+			cksleep_ms(1000);
+			continue;
+		}
+		if (unlikely(!tmpl->longpollid)) {
+			LOGWARNING("No longpoll support from %s:%s, polling for blocks instead",
+				   cs->url, cs->port);
+			gbttemplate_put(tmpl);
+			break;
+		}
+		si->longpolling = true;
+
+		/* Only a longpoll's response is news to the stratifier */
+		if (longpollid) {
+			free(longpollid);
+			longpollid = strdup(tmpl->longpollid);
+			push_longpoll(ckp, si, tmpl);
+		} else {
+			LOGNOTICE("Longpolling for block templates from %s:%s", cs->url, cs->port);
+			longpollid = strdup(tmpl->longpollid);
+			gbttemplate_put(tmpl);
+		}
+	}
+	si->longpolling = false;
+	free(longpollid);
+	return NULL;
+}
+
 static void setup_servers(ckpool_t *ckp)
 {
+	gdata_t *gdata = ckp->gdata;
 	pthread_t pth_watchdog;
 	int i;
 
@@ -2849,17 +3171,29 @@ static void setup_servers(ckpool_t *ckp)
 		cs->ckp = ckp;
 		cksem_init(&cs->sem);
 		cksem_post(&cs->sem);
+		mutex_init(&cs->rpc_lock);
 	}
+	gdata->blocksubmits = create_ckmsgq(ckp, "blocksubmit", &submit_blocks);
 
 	create_pthread(&pth_watchdog, server_watchdog, ckp);
 }
 
 static void server_mode(ckpool_t *ckp, proc_instance_t *pi)
 {
+	gdata_t *gdata = ckp->gdata;
 	int i;
 
 	setup_servers(ckp);
 
+	if (ckp->longpoll) {
+		mutex_init(&gdata->longpoll_lock);
+		for (i = 0; i < ckp->btcds; i++) {
+			pthread_t pth;
+
+			create_pthread(&pth, server_longpoll, ckp->servers[i]);
+		}
+	}
+
 	gen_loop(pi);
 
 	for (i = 0; i < ckp->btcds; i++) {
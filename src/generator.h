@@ -12,7 +12,15 @@
 
 #include "config.h"
 
+#include "bitcoin.h"
+
 void generator_add_send(ckpool_t *ckp, json_t *val);
+void generator_submitblock(ckpool_t *ckp, const char *buf);
+void generator_submitblocktail(ckpool_t *ckp, const char *hash, const char *head,
+			       blocktail_t *tail);
+bool generator_templates(ckpool_t *ckp);
+gbttemplate_t *generator_gettemplate(ckpool_t *ckp);
+bool generator_longpolling(ckpool_t *ckp);
 void *generator(void *arg);
 
 #endif /* GENERATOR_H */
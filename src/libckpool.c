@@ -41,6 +41,108 @@
 #define UNIX_PATH_MAX 108
 #endif
 
+/* Programs that don't set a log level get everything passed to logmsg */
+int log_level = LOG_DEBUG;
+int log_gate = LOG_DEBUG;
+
+#define LOG_FILTERS 8
+
+/* Per subsystem log levels, the subsystem being the source file name without
+ * its extension. Entries are never removed, only set back to -1. */
+struct log_filter {
+	char subsystem[16];
+	int loglevel;
+};
+
+static struct log_filter log_filter[LOG_FILTERS];
+static int log_nfilters;
+static pthread_mutex_t log_filter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Is a message at loglevel from file enabled by its subsystem's filter */
+bool log_filtered(const int loglevel, const char *file)
+{
+	const char *base = strrchr(file, '/');
+	int i, nfilters;
+	size_t len;
+
+	base = base ? base + 1 : file;
+	len = strcspn(base, ".");
+	nfilters = __atomic_load_n(&log_nfilters, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nfilters; i++) {
+		struct log_filter *filter = &log_filter[i];
+
+		if (loglevel > __atomic_load_n(&filter->loglevel, __ATOMIC_RELAXED))
+			continue;
+		if (!strncmp(filter->subsystem, base, len) && !filter->subsystem[len])
+			return true;
+	}
+	return false;
+}
+
+/* Must hold log_filter_lock */
+static void __update_log_gate(void)
+{
+	int i, gate = log_level;
+
+	for (i = 0; i < log_nfilters; i++) {
+		if (log_filter[i].loglevel > gate)
+			gate = log_filter[i].loglevel;
+	}
+	log_gate = gate;
+}
+
+void log_setlevel(const int loglevel)
+{
+	pthread_mutex_lock(&log_filter_lock);
+	log_level = loglevel;
+	__update_log_gate();
+	pthread_mutex_unlock(&log_filter_lock);
+}
+
+/* Set the log level of one subsystem, or remove its filter with a negative
+ * loglevel. Returns false if there is no room for another filter. */
+bool log_setfilter(const char *subsystem, const int loglevel)
+{
+	bool ret = true;
+	int i;
+
+	pthread_mutex_lock(&log_filter_lock);
+	for (i = 0; i < log_nfilters; i++) {
+		if (!strcmp(log_filter[i].subsystem, subsystem))
+			break;
+	}
+	if (i == log_nfilters) {
+		if (loglevel < 0)
+			goto out_unlock;
+		if (unlikely(i == LOG_FILTERS)) {
+			ret = false;
+			goto out_unlock;
+		}
+		snprintf(log_filter[i].subsystem, sizeof(log_filter[i].subsystem), "%s", subsystem);
+		log_filter[i].loglevel = loglevel;
+		__atomic_store_n(&log_nfilters, i + 1, __ATOMIC_RELEASE);
+	} else
+		__atomic_store_n(&log_filter[i].loglevel, loglevel < 0 ? -1 : loglevel, __ATOMIC_RELAXED);
+	__update_log_gate();
+out_unlock:
+	pthread_mutex_unlock(&log_filter_lock);
+	return ret;
+}
+
+json_t *log_filters(void)
+{
+	json_t *val = json_object();
+	int i;
+
+	pthread_mutex_lock(&log_filter_lock);
+	for (i = 0; i < log_nfilters; i++) {
+		if (log_filter[i].loglevel >= 0)
+			json_set_int(val, log_filter[i].subsystem, log_filter[i].loglevel);
+	}
+	pthread_mutex_unlock(&log_filter_lock);
+	return val;
+}
+
 /* We use a weak function as a simple printf within the library that can be
  * overridden by however the outside executable wishes to do its logging. */
 void __attribute__((weak)) logmsg(int __maybe_unused loglevel, const char *fmt, ...)
@@ -1005,8 +1107,9 @@ int read_length(int sockd, void *buf, int len)
 
 /* Use a standard message across the unix sockets:
  * 4 byte length of message as little endian encoded uint32_t followed by the
- * string. Return NULL in case of failure. */
-char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line)
+ * string. Return NULL in case of failure. Leaves the socket open for further
+ * messages as used by persistent streams. */
+char *_recv_unix_frame(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line)
 {
 	char *buf = NULL;
 	uint32_t msglen;
@@ -1044,12 +1147,20 @@ char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, co
 		dealloc(buf);
 	}
 out:
-	shutdown(sockd, SHUT_RD);
 	if (unlikely(!buf))
 		LOGERR("Failure in recv_unix_msg from %s %s:%d", file, func, line);
 	return buf;
 }
 
+/* As recv_unix_frame but for a single message per connection */
+char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line)
+{
+	char *buf = _recv_unix_frame(sockd, timeout1, timeout2, file, func, line);
+
+	shutdown(sockd, SHUT_RD);
+	return buf;
+}
+
 /* Emulate a select write wait for high fds that select doesn't support */
 int wait_write_select(int sockd, float timeout)
 {
@@ -1094,7 +1205,9 @@ int _write_length(int sockd, const void *buf, int len, const char *file, const c
 	return ofs;
 }
 
-bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line)
+/* Send a message in the same format as send_unix_msg but leave the socket
+ * open for further messages */
+bool _send_unix_frame(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line)
 {
 	uint32_t msglen, len;
 	bool retval = false;
@@ -1138,12 +1251,19 @@ bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, c
 	}
 	retval = true;
 out:
-	shutdown(sockd, SHUT_WR);
 	if (unlikely(!retval))
 		LOGERR("Failure in send_unix_msg from %s %s:%d", file, func, line);
 	return retval;
 }
 
+bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line)
+{
+	bool ret = _send_unix_frame(sockd, buf, timeout, file, func, line);
+
+	shutdown(sockd, SHUT_WR);
+	return ret;
+}
+
 bool _send_unix_data(int sockd, const struct msghdr *msg, const char *file, const char *func, const int line)
 {
 	bool retval = false;
@@ -1316,42 +1436,132 @@ char *rotating_filename(const char *path, time_t when)
 	return filename;
 }
 
-/* Creates a logfile entry which changes filename hourly with exclusive access */
-bool rotating_log(const char *path, const char *msg)
+/* Batch size at which rotating_log_add flushes on its own */
+#define ROTATING_LOG_BATCH 65536
+
+/* Create a log sink for hourly files starting with path, taking an exclusive
+ * flock for each batch written if flock is set */
+rotating_log_t *create_rotating_log(const char *path, const bool flock)
+{
+	rotating_log_t *rlog = ckzalloc(sizeof(rotating_log_t));
+
+	mutex_init(&rlog->lock);
+	rlog->path = strdup(path);
+	rlog->flock = flock;
+	rlog->fd = -1;
+	return rlog;
+}
+
+/* Only ever called by the one thread writing a batch */
+static bool rotating_log_write(rotating_log_t *rlog, const char *buf, size_t len)
 {
 	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-	char *filename;
-	FILE *fp;
-	int fd;
+	time_t hour = time(NULL) / 3600;
 	bool ok = false;
+	ssize_t ret;
 
-	filename = rotating_filename(path, time(NULL));
-	fd = open(filename, O_CREAT | O_RDWR | O_CLOEXEC , mode);
-	if (unlikely(fd == -1)) {
-		LOGERR("Failed to open %s in rotating_log!", filename);
-		goto stageleft;
-	}
-	fp = fdopen(fd, "ae");
-	if (unlikely(!fp)) {
-		Close(fd);
-		LOGERR("Failed to fdopen %s in rotating_log!", filename);
-		goto stageleft;
-	}
-	if (unlikely(flock(fd, LOCK_EX))) {
-		fclose(fp);
-		LOGERR("Failed to flock %s in rotating_log!", filename);
-		goto stageleft;
-	}
-	fprintf(fp, "%s\n", msg);
-	fclose(fp);
+	if (rlog->fd == -1 || hour != rlog->hour) {
+		char *filename = rotating_filename(rlog->path, hour * 3600);
+
+		if (rlog->fd != -1)
+			Close(rlog->fd);
+		rlog->fd = open(filename, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, mode);
+		if (unlikely(rlog->fd == -1)) {
+			LOGERR("Failed to open %s in rotating_log!", filename);
+			free(filename);
+			return false;
+		}
+		free(filename);
+		rlog->hour = hour;
+	}
+	if (rlog->flock && unlikely(flock(rlog->fd, LOCK_EX))) {
+		LOGERR("Failed to flock %s in rotating_log!", rlog->path);
+		return false;
+	}
+	while (len) {
+		ret = write(rlog->fd, buf, len);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Failed to write to %s in rotating_log!", rlog->path);
+			goto out;
+		}
+		buf += ret;
+		len -= ret;
+	}
 	ok = true;
+out:
+	if (rlog->flock)
+		flock(rlog->fd, LOCK_UN);
+	return ok;
+}
+
+/* Write out all buffered lines. If another thread is already writing a batch,
+ * it picks up anything queued here before it finishes so we return at once. */
+bool rotating_log_flush(rotating_log_t *rlog)
+{
+	bool ok = true;
+
+	mutex_lock(&rlog->lock);
+	if (rlog->writing) {
+		mutex_unlock(&rlog->lock);
+		return true;
+	}
+	rlog->writing = true;
+	while (rlog->len) {
+		char *buf = rlog->buf;
+		size_t len = rlog->len, size = rlog->size;
+
+		rlog->buf = rlog->spare;
+		rlog->size = rlog->sparesize;
+		rlog->len = 0;
+		mutex_unlock(&rlog->lock);
 
-stageleft:
-	free(filename);
+		if (!rotating_log_write(rlog, buf, len))
+			ok = false;
+
+		mutex_lock(&rlog->lock);
+		rlog->spare = buf;
+		rlog->sparesize = size;
+	}
+	rlog->writing = false;
+	mutex_unlock(&rlog->lock);
 
 	return ok;
 }
 
+/* Queue a line without writing it unless the batch is full */
+void rotating_log_add(rotating_log_t *rlog, const char *msg)
+{
+	size_t len = strlen(msg);
+	bool flush;
+
+	mutex_lock(&rlog->lock);
+	if (rlog->len + len + 1 > rlog->size) {
+		rlog->size = rlog->len + len + 1 + ROTATING_LOG_BATCH;
+		rlog->buf = realloc(rlog->buf, rlog->size);
+		if (unlikely(!rlog->buf))
+			quit(1, "Failed to realloc rotating_log buffer of size %lu",
+			     (unsigned long)rlog->size);
+	}
+	memcpy(rlog->buf + rlog->len, msg, len);
+	rlog->len += len;
+	rlog->buf[rlog->len++] = '\n';
+	flush = rlog->len >= ROTATING_LOG_BATCH;
+	mutex_unlock(&rlog->lock);
+
+	if (flush)
+		rotating_log_flush(rlog);
+}
+
+/* Creates a logfile entry which changes filename hourly, grouped with any
+ * other entries queued concurrently */
+bool rotating_log(rotating_log_t *rlog, const char *msg)
+{
+	rotating_log_add(rlog, msg);
+	return rotating_log_flush(rlog);
+}
+
 /* Align a size_t to 4 byte boundaries for fussy arches */
 void align_len(size_t *len)
 {
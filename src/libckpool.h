@@ -192,16 +192,36 @@ static inline void flip_80(void *dest_p, const void *src_p)
 
 void logmsg(int loglevel, const char *fmt, ...);
 
+/* Messages are only formatted when they will be logged. log_level applies
+ * everywhere while log_gate is the most verbose level enabled for any
+ * subsystem, so a disabled level costs one comparison and only levels enabled
+ * for some subsystem need to check the filters. */
+extern int log_level;
+extern int log_gate;
+
+bool log_filtered(const int loglevel, const char *file);
+void log_setlevel(const int loglevel);
+bool log_setfilter(const char *subsystem, const int loglevel);
+json_t *log_filters(void);
+
+#define LOG_WANTED(__lvl) ((__lvl) <= log_gate && \
+	((__lvl) <= log_level || log_filtered(__lvl, __FILE__)))
+
 #define DEFLOGBUFSIZ 1000
 
 #define LOGMSGBUF(__lvl, __buf) do { \
-		logmsg(__lvl, "%s", __buf); \
+		if (LOG_WANTED(__lvl)) \
+			logmsg(__lvl, "%s", __buf); \
 	} while(0)
-#define LOGMSGSIZ(__siz, __lvl, __fmt, ...) do { \
+#define __LOGMSGSIZ(__siz, __lvl, __fmt, ...) do { \
 		char tmp42[__siz]; \
 		snprintf(tmp42, sizeof(tmp42), __fmt, ##__VA_ARGS__); \
 		logmsg(__lvl, "%s", tmp42); \
 	} while(0)
+#define LOGMSGSIZ(__siz, __lvl, __fmt, ...) do { \
+		if (LOG_WANTED(__lvl)) \
+			__LOGMSGSIZ(__siz, __lvl, __fmt, ##__VA_ARGS__); \
+	} while(0)
 
 #define LOGMSG(_lvl, _fmt, ...) \
 	LOGMSGSIZ(DEFLOGBUFSIZ, _lvl, _fmt, ##__VA_ARGS__)
@@ -242,6 +262,13 @@ void logmsg(int loglevel, const char *fmt, ...);
 #define UNIX_READ_TIMEOUT 5
 #define UNIX_WRITE_TIMEOUT 10
 
+/* Handshake sent by ckpool to turn a ckdb connection into a persistent stream
+ * of frames, each holding one or more newline separated messages. ckdb answers
+ * with CKDB_STREAM_OK then one frame per reply, each starting with the seqall
+ * id of the message it answers. */
+#define CKDB_STREAM "stream"
+#define CKDB_STREAM_OK "ok.stream"
+
 /* Share error values */
 
 enum share_err {
@@ -318,6 +345,28 @@ struct unixsock {
 
 typedef struct unixsock unixsock_t;
 
+/* Log sink appending lines to a file named after the current hour, kept open
+ * until the hour changes. Lines are buffered and whichever thread flushes
+ * writes everything queued in one write, taking flock once per batch. */
+struct rotating_log {
+	mutex_t lock;
+	char *path;
+	bool flock;
+	int fd;
+	time_t hour; /* Hour of the open file, seconds / 3600 */
+
+	/* Lines waiting to be written and a spare buffer swapped in while a
+	 * batch is written, protected by lock */
+	char *buf;
+	size_t len;
+	size_t size;
+	char *spare;
+	size_t sparesize;
+	bool writing;
+};
+
+typedef struct rotating_log rotating_log_t;
+
 void _json_check(json_t *val, json_error_t *err, const char *file, const char *func, const int line);
 #define json_check(VAL, ERR) _json_check(VAL, ERR,  __FILE__, __func__, __LINE__)
 
@@ -511,11 +560,15 @@ char *_recv_unix_msg(int sockd, int timeout1, int timeout2, const char *file, co
 #define recv_unix_msg(sockd) _recv_unix_msg(sockd, UNIX_READ_TIMEOUT, UNIX_READ_TIMEOUT, __FILE__, __func__, __LINE__)
 #define recv_unix_msg_tmo(sockd, tmo) _recv_unix_msg(sockd, tmo, UNIX_READ_TIMEOUT, __FILE__, __func__, __LINE__)
 #define recv_unix_msg_tmo2(sockd, tmo1, tmo2) _recv_unix_msg(sockd, tmo1, tmo2, __FILE__, __func__, __LINE__)
+char *_recv_unix_frame(int sockd, int timeout1, int timeout2, const char *file, const char *func, const int line);
+#define recv_unix_frame(sockd, tmo1, tmo2) _recv_unix_frame(sockd, tmo1, tmo2, __FILE__, __func__, __LINE__)
 int wait_write_select(int sockd, float timeout);
 #define write_length(sockd, buf, len) _write_length(sockd, buf, len, __FILE__, __func__, __LINE__)
 int _write_length(int sockd, const void *buf, int len, const char *file, const char *func, const int line);
 bool _send_unix_msg(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line);
 #define send_unix_msg(sockd, buf) _send_unix_msg(sockd, buf, UNIX_WRITE_TIMEOUT, __FILE__, __func__, __LINE__)
+bool _send_unix_frame(int sockd, const char *buf, int timeout, const char *file, const char *func, const int line);
+#define send_unix_frame(sockd, buf) _send_unix_frame(sockd, buf, UNIX_WRITE_TIMEOUT, __FILE__, __func__, __LINE__)
 bool _send_unix_data(int sockd, const struct msghdr *msg, const char *file, const char *func, const int line);
 #define send_unix_data(sockd, msg) _send_unix_data(sockd, msg, __FILE__, __func__, __LINE__)
 bool _recv_unix_data(int sockd, struct msghdr *msg, const char *file, const char *func, const int line);
@@ -530,7 +583,10 @@ char *json_array_string(json_t *val, unsigned int entry);
 json_t *json_object_dup(json_t *val, const char *entry);
 
 char *rotating_filename(const char *path, time_t when);
-bool rotating_log(const char *path, const char *msg);
+rotating_log_t *create_rotating_log(const char *path, const bool flock);
+void rotating_log_add(rotating_log_t *rlog, const char *msg);
+bool rotating_log_flush(rotating_log_t *rlog);
+bool rotating_log(rotating_log_t *rlog, const char *msg);
 
 void align_len(size_t *len);
 void realloc_strcat(char **ptr, const char *s);
@@ -85,33 +85,8 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-#ifdef USE_AVX2
-extern void sha256_rorx(const void *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_rorx(message, ctx->h, block_nb);
-}
-#elif defined(USE_AVX1)
-extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_avx(message, ctx->h, block_nb);
-}
-#elif defined(USE_SSE4)
-extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_sse4(message, ctx->h, block_nb);
-}
-#else
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_transf_generic(sha256_ctx *ctx, const unsigned char *message,
+                                  unsigned int block_nb)
 {
     uint32_t w[64];
     uint32_t wv[8];
@@ -155,7 +130,520 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
     }
 }
+
+#ifdef USE_AVX2
+extern void sha256_rorx(const void *, uint32_t[8], uint64_t);
+
+static void sha256_transf_avx2(sha256_ctx *ctx, const unsigned char *message,
+			       unsigned int block_nb)
+{
+	sha256_rorx(message, ctx->h, block_nb);
+}
 #endif
+#ifdef USE_AVX1
+extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
+
+static void sha256_transf_avx(sha256_ctx *ctx, const unsigned char *message,
+			      unsigned int block_nb)
+{
+	sha256_avx(message, ctx->h, block_nb);
+}
+#endif
+#ifdef USE_SSE4
+extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
+
+static void sha256_transf_sse4(sha256_ctx *ctx, const unsigned char *message,
+			       unsigned int block_nb)
+{
+	sha256_sse4(message, ctx->h, block_nb);
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* Intel SHA extensions. The state is kept as ABEF/CDGH pairs as required by
+ * sha256rnds2 and each iteration does four rounds, extending the message
+ * schedule with sha256msg1/2 from the fifth group on. */
+__attribute__((target("sha,sse4.1")))
+static void sha256_transf_shani(sha256_ctx *ctx, const unsigned char *message,
+				unsigned int block_nb)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg[4], tmp;
+	unsigned int b;
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&ctx->h[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&ctx->h[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1); /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B); /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8); /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); /* CDGH */
+
+	for (b = 0; b < block_nb; b++, message += SHA256_BLOCK_SIZE) {
+		abef = state0;
+		cdgh = state1;
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				tmp = _mm_loadu_si128((const __m128i *)(message + (i << 4)));
+				msg[i] = _mm_shuffle_epi8(tmp, mask);
+			} else {
+				tmp = _mm_alignr_epi8(msg[(i - 1) & 3], msg[(i - 2) & 3], 4);
+				msg[i & 3] = _mm_sha256msg1_epu32(msg[i & 3], msg[(i - 3) & 3]);
+				msg[i & 3] = _mm_add_epi32(msg[i & 3], tmp);
+				msg[i & 3] = _mm_sha256msg2_epu32(msg[i & 3], msg[(i - 1) & 3]);
+			}
+			tmp = _mm_loadu_si128((const __m128i *)&sha256_k[i << 2]);
+			tmp = _mm_add_epi32(msg[i & 3], tmp);
+			state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+			tmp = _mm_shuffle_epi32(tmp, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, tmp);
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B); /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1); /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8); /* HGFE */
+	_mm_storeu_si128((__m128i *)&ctx->h[0], state0);
+	_mm_storeu_si128((__m128i *)&ctx->h[4], state1);
+}
+
+#define CPU_SHA		(1 << 0)
+#define CPU_AVX512	(1 << 1)
+#define CPU_AVX2	(1 << 2)
+#define CPU_AVX		(1 << 3)
+#define CPU_SSE4	(1 << 4)
+
+/* Probe the CPU features once */
+static int sha256_cpu_features(void)
+{
+	static int features = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (features > -1)
+		return features;
+
+	__builtin_cpu_init();
+	features = 0;
+	if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3")) {
+		features |= CPU_SSE4;
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+			features |= CPU_SHA;
+	}
+	if (__builtin_cpu_supports("avx"))
+		features |= CPU_AVX;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2"))
+		features |= CPU_AVX2;
+	if (__builtin_cpu_supports("avx512f"))
+		features |= CPU_AVX512;
+	return features;
+}
+#else /* __x86_64__ */
+#define CPU_SHA		0
+#define CPU_AVX512	0
+#define CPU_AVX2	0
+#define CPU_AVX		0
+#define CPU_SSE4	0
+
+static int sha256_cpu_features(void)
+{
+	return 0;
+}
+#endif /* __x86_64__ */
+
+typedef void (*sha256_transf_fn)(sha256_ctx *, const unsigned char *, unsigned int);
+
+struct sha256_impl {
+	const char *name;
+	sha256_transf_fn transf;
+	int features; /* CPU features required */
+};
+
+/* Transforms in order of preference */
+static const struct sha256_impl sha256_impls[] = {
+#if defined(__x86_64__) && defined(__GNUC__)
+	{"shani", sha256_transf_shani, CPU_SHA},
+#endif
+#ifdef USE_AVX2
+	{"avx2", sha256_transf_avx2, CPU_AVX2},
+#endif
+#ifdef USE_AVX1
+	{"avx", sha256_transf_avx, CPU_AVX},
+#endif
+#ifdef USE_SSE4
+	{"sse4", sha256_transf_sse4, CPU_SSE4},
+#endif
+	{"generic", sha256_transf_generic, 0},
+	{NULL, NULL, 0}
+};
+
+static void sha256_transf_auto(sha256_ctx *ctx, const unsigned char *message,
+			       unsigned int block_nb);
+
+static sha256_transf_fn sha256_transf = sha256_transf_auto;
+static const struct sha256_impl *sha256_impl_used;
+
+static const struct sha256_impl *sha256_find_impl(const char *name)
+{
+	const struct sha256_impl *impl;
+
+	for (impl = sha256_impls; impl->name; impl++) {
+		if (!strcmp(impl->name, name))
+			return impl;
+	}
+	return NULL;
+}
+
+const char *sha256_impl_name(const int i)
+{
+	if (i < 0 || i >= (int)(sizeof(sha256_impls) / sizeof(sha256_impls[0])))
+		return NULL;
+	return sha256_impls[i].name;
+}
+
+int sha256_impl_supported(const char *name)
+{
+	const struct sha256_impl *impl = sha256_find_impl(name);
+
+	if (!impl)
+		return 0;
+	return (sha256_cpu_features() & impl->features) == impl->features;
+}
+
+/* Select the sha256 transform by name, or the fastest one this CPU supports
+ * with "auto". Returns 0 if the name is unknown or not supported. */
+int sha256_set_impl(const char *name)
+{
+	const struct sha256_impl *impl;
+
+	if (!name || !strcmp(name, "auto")) {
+		for (impl = sha256_impls; impl->name; impl++) {
+			if (sha256_impl_supported(impl->name))
+				break;
+		}
+	} else {
+		if (!sha256_impl_supported(name))
+			return 0;
+		impl = sha256_find_impl(name);
+	}
+	sha256_impl_used = impl;
+	sha256_transf = impl->transf;
+	return 1;
+}
+
+const char *sha256_impl(void)
+{
+	if (!sha256_impl_used)
+		sha256_set_impl("auto");
+	return sha256_impl_used->name;
+}
+
+/* Used until a transform is explicitly selected */
+static void sha256_transf_auto(sha256_ctx *ctx, const unsigned char *message,
+			       unsigned int block_nb)
+{
+	if (!sha256_impl_used)
+		sha256_set_impl("auto");
+	sha256_impl_used->transf(ctx, message, block_nb);
+}
+
+/* Double sha256 a message continuing from a midstate, or the initial state if
+ * NULL, that has already hashed prefix bytes in whole blocks */
+static void sha256d_mid(const uint32_t *midstate, unsigned int prefix,
+			const unsigned char *message, unsigned int len,
+			unsigned char *digest)
+{
+	unsigned char hash1[SHA256_DIGEST_SIZE];
+	sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	if (midstate) {
+		memcpy(ctx.h, midstate, sizeof(ctx.h));
+		ctx.tot_len = prefix;
+	}
+	sha256_update(&ctx, message, len);
+	sha256_final(&ctx, hash1);
+	sha256(hash1, SHA256_DIGEST_SIZE, digest);
+}
+
+/* Multi-buffer SHA256d. The same 64 round transform is run on LANES
+ * independent messages of equal length at once, one message per 32 bit
+ * element of a vector, using the widest vector unit the CPU supports. Each
+ * lane may continue from a midstate that has already hashed prefix bytes in
+ * whole blocks. */
+#if defined(__x86_64__) && defined(__GNUC__)
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef uint32_t v16u32 __attribute__((vector_size(64)));
+
+#define VROTR(x, n)   ((x >> n) | (x << (32 - n)))
+#define VSHA256_F1(x) (VROTR(x,  2) ^ VROTR(x, 13) ^ VROTR(x, 22))
+#define VSHA256_F2(x) (VROTR(x,  6) ^ VROTR(x, 11) ^ VROTR(x, 25))
+#define VSHA256_F3(x) (VROTR(x,  7) ^ VROTR(x, 18) ^ (x >> 3))
+#define VSHA256_F4(x) (VROTR(x, 17) ^ VROTR(x, 19) ^ (x >> 10))
+
+#define SHA256D_LANES(NAME, VEC, LANES, TARGET)				\
+static TARGET void NAME##_transf(VEC *h, VEC *w)			\
+{									\
+	VEC wv[8], t1, t2;						\
+	int j;								\
+									\
+	for (j = 16; j < 64; j++)					\
+		w[j] = VSHA256_F4(w[j - 2]) + w[j - 7] +		\
+		       VSHA256_F3(w[j - 15]) + w[j - 16];		\
+	for (j = 0; j < 8; j++)						\
+		wv[j] = h[j];						\
+	for (j = 0; j < 64; j++) {					\
+		t1 = wv[7] + VSHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6]) \
+		     + sha256_k[j] + w[j];				\
+		t2 = VSHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);	\
+		wv[7] = wv[6];						\
+		wv[6] = wv[5];						\
+		wv[5] = wv[4];						\
+		wv[4] = wv[3] + t1;					\
+		wv[3] = wv[2];						\
+		wv[2] = wv[1];						\
+		wv[1] = wv[0];						\
+		wv[0] = t1 + t2;					\
+	}								\
+	for (j = 0; j < 8; j++)						\
+		h[j] += wv[j];						\
+}									\
+									\
+static TARGET void NAME(const uint32_t **midstates, unsigned int prefix, \
+			const unsigned char **messages, unsigned int len, \
+			unsigned char **digests)			\
+{									\
+	unsigned int full = len / SHA256_BLOCK_SIZE, block_nb, b;	\
+	unsigned int rem = len % SHA256_BLOCK_SIZE;			\
+	unsigned char tail[LANES][2 * SHA256_BLOCK_SIZE];		\
+	VEC h[8], w[64];						\
+	int i, j;							\
+									\
+	/* Pad the final partial block(s) of each lane as sha256_final	\
+	 * would */							\
+	block_nb = 1 + ((SHA256_BLOCK_SIZE - 9) < rem);			\
+	for (i = 0; i < LANES; i++) {					\
+		memcpy(tail[i], messages[i] + (full << 6), rem);	\
+		memset(tail[i] + rem, 0, (block_nb << 6) - rem);	\
+		tail[i][rem] = 0x80;					\
+		UNPACK32((prefix + len) << 3, tail[i] + (block_nb << 6) - 4); \
+	}								\
+	for (j = 0; j < 8; j++) {					\
+		if (!midstates) {					\
+			h[j] = (VEC){} + sha256_h0[j];			\
+			continue;					\
+		}							\
+		for (i = 0; i < LANES; i++)				\
+			h[j][i] = midstates[i][j];			\
+	}								\
+	for (b = 0; b < full + block_nb; b++) {				\
+		for (i = 0; i < LANES; i++) {				\
+			const unsigned char *sub_block;			\
+			uint32_t word;					\
+									\
+			if (b < full)					\
+				sub_block = messages[i] + (b << 6);	\
+			else						\
+				sub_block = tail[i] + ((b - full) << 6); \
+			for (j = 0; j < 16; j++) {			\
+				PACK32(&sub_block[j << 2], &word);	\
+				w[j][i] = word;				\
+			}						\
+		}							\
+		NAME##_transf(h, w);					\
+	}								\
+									\
+	/* Second hash of the 32 byte digest is a single block with the	\
+	 * digest words already in the message schedule order */	\
+	for (j = 0; j < 8; j++)						\
+		w[j] = h[j];						\
+	w[8] = (VEC){} + 0x80000000;					\
+	for (j = 9; j < 15; j++)					\
+		w[j] = (VEC){};						\
+	w[15] = (VEC){} + 256;						\
+	for (j = 0; j < 8; j++)						\
+		h[j] = (VEC){} + sha256_h0[j];				\
+	NAME##_transf(h, w);						\
+	for (i = 0; i < LANES; i++) {					\
+		for (j = 0; j < 8; j++)					\
+			UNPACK32(h[j][i], &digests[i][j << 2]);		\
+	}								\
+}
+
+SHA256D_LANES(sha256d_sse2, v4u32, 4, )
+SHA256D_LANES(sha256d_avx2, v8u32, 8, __attribute__((target("avx2"))))
+SHA256D_LANES(sha256d_avx512, v16u32, 16, __attribute__((target("avx512f"))))
+
+/* Cap on the multi buffer lanes independent of the transform, 0 for the
+ * widest the CPU supports */
+static int sha256_lanes_max;
+
+/* The widest multi buffer kernel the CPU supports */
+static int sha256_cpu_lanes(void)
+{
+	const int features = sha256_cpu_features();
+
+	if (features & CPU_AVX512)
+		return 16;
+	if (features & CPU_AVX2)
+		return 8;
+	return 4;
+}
+
+/* Limit batches to lanes messages, 1 disabling batching altogether. Returns 0
+ * if the CPU can't run that many lanes at once. */
+int sha256_set_lanes(const int lanes)
+{
+	if (lanes && lanes != 1 && lanes != 4 && lanes != 8 && lanes != 16)
+		return 0;
+	if (lanes > sha256_cpu_lanes())
+		return 0;
+	sha256_lanes_max = lanes;
+	return 1;
+}
+
+/* The widest multi buffer kernel the CPU supports, capped by any lanes set */
+int sha256_lanes(void)
+{
+	int lanes = sha256_cpu_lanes();
+
+	if (sha256_lanes_max && lanes > sha256_lanes_max)
+		lanes = sha256_lanes_max;
+	return lanes;
+}
+
+/* Double sha256 count messages all of length len into digests, in groups of
+ * as many lanes as the CPU can process at once, continuing from midstates
+ * that have hashed prefix bytes if they're given. Partial groups are padded
+ * by repeating the first message with the results discarded, and a lone
+ * message is hashed with the scalar code. */
+void sha256d_multi_mid(const uint32_t **midstates, unsigned int prefix,
+		       const unsigned char **messages, unsigned int len,
+		       unsigned char **digests, int count)
+{
+	const int maxlanes = sha256_lanes();
+
+	while (count > 0) {
+		unsigned char discard[SHA256_MAX_LANES][SHA256_DIGEST_SIZE];
+		const unsigned char *msgs[SHA256_MAX_LANES];
+		const uint32_t *mids[SHA256_MAX_LANES];
+		unsigned char *digs[SHA256_MAX_LANES];
+		int lanes, chunk, i;
+
+		if (count == 1 || maxlanes < 4) {
+			sha256d_mid(midstates ? midstates[0] : NULL, prefix, messages[0],
+				    len, digests[0]);
+			if (midstates)
+				midstates++;
+			messages++;
+			digests++;
+			count--;
+			continue;
+		}
+		chunk = count < maxlanes ? count : maxlanes;
+		if (chunk > 8)
+			lanes = 16;
+		else if (chunk > 4)
+			lanes = 8;
+		else
+			lanes = 4;
+		for (i = 0; i < lanes; i++) {
+			const int src = i < chunk ? i : 0;
+
+			msgs[i] = messages[src];
+			if (midstates)
+				mids[i] = midstates[src];
+			digs[i] = i < chunk ? digests[i] : discard[i];
+		}
+		if (lanes == 16)
+			sha256d_avx512(midstates ? mids : NULL, prefix, msgs, len, digs);
+		else if (lanes == 8)
+			sha256d_avx2(midstates ? mids : NULL, prefix, msgs, len, digs);
+		else
+			sha256d_sse2(midstates ? mids : NULL, prefix, msgs, len, digs);
+		if (midstates)
+			midstates += chunk;
+		messages += chunk;
+		digests += chunk;
+		count -= chunk;
+	}
+}
+#else /* __x86_64__ */
+int sha256_lanes(void)
+{
+	return 1;
+}
+
+void sha256d_multi_mid(const uint32_t **midstates, unsigned int prefix,
+		       const unsigned char **messages, unsigned int len,
+		       unsigned char **digests, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		sha256d_mid(midstates ? midstates[i] : NULL, prefix, messages[i], len, digests[i]);
+}
+#endif /* __x86_64__ */
+
+void sha256d_multi(const unsigned char **messages, unsigned int len,
+		   unsigned char **digests, int count)
+{
+	sha256d_multi_mid(NULL, 0, messages, len, digests, count);
+}
+
+/* Compare the multi buffer path against the scalar code for every group size
+ * and a range of message lengths crossing the block padding boundaries, both
+ * from the initial state and from a midstate one block in.
+ * Returns 1 if all digests are identical. */
+int sha256d_multi_test(void)
+{
+	static const unsigned int lens[] = {32, 55, 56, 64, 80, 119, 120, 137, 300};
+	unsigned char buf[SHA256_MAX_LANES + 1][320 + SHA256_BLOCK_SIZE];
+	unsigned char digests[SHA256_MAX_LANES + 1][SHA256_DIGEST_SIZE];
+	unsigned char hash1[SHA256_DIGEST_SIZE], check[SHA256_DIGEST_SIZE];
+	const unsigned char *msgs[SHA256_MAX_LANES + 1], *tails[SHA256_MAX_LANES + 1];
+	const uint32_t *mids[SHA256_MAX_LANES + 1];
+	sha256_ctx ctx[SHA256_MAX_LANES + 1];
+	unsigned char *digs[SHA256_MAX_LANES + 1];
+	unsigned int l, i, j, count;
+
+	for (i = 0; i <= SHA256_MAX_LANES; i++) {
+		for (j = 0; j < sizeof(buf[i]); j++)
+			buf[i][j] = (i * 131 + j * 7 + (j >> 3)) & 0xff;
+		msgs[i] = buf[i];
+		digs[i] = digests[i];
+		sha256_init(&ctx[i]);
+		sha256_update(&ctx[i], buf[i], SHA256_BLOCK_SIZE);
+		mids[i] = ctx[i].h;
+		tails[i] = buf[i] + SHA256_BLOCK_SIZE;
+	}
+	for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		for (count = 1; count <= SHA256_MAX_LANES + 1; count++) {
+			sha256d_multi(msgs, lens[l], digs, count);
+			for (i = 0; i < count; i++) {
+				sha256(msgs[i], lens[l], hash1);
+				sha256(hash1, SHA256_DIGEST_SIZE, check);
+				if (memcmp(check, digests[i], SHA256_DIGEST_SIZE))
+					return 0;
+			}
+			sha256d_multi_mid(mids, SHA256_BLOCK_SIZE, tails, lens[l], digs, count);
+			for (i = 0; i < count; i++) {
+				sha256(msgs[i], lens[l] + SHA256_BLOCK_SIZE, hash1);
+				sha256(hash1, SHA256_DIGEST_SIZE, check);
+				if (memcmp(check, digests[i], SHA256_DIGEST_SIZE))
+					return 0;
+			}
+		}
+	}
+	return 1;
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
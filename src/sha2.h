@@ -66,4 +66,23 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+/* Runtime selection of the sha256 transform: "auto" or one of the names
+ * returned by sha256_impl_name() */
+const char *sha256_impl_name(const int i);
+int sha256_impl_supported(const char *name);
+int sha256_set_impl(const char *name);
+const char *sha256_impl(void);
+
+/* Maximum number of messages hashed at once by sha256d_multi */
+#define SHA256_MAX_LANES 16
+
+int sha256_set_lanes(const int lanes);
+int sha256_lanes(void);
+void sha256d_multi(const unsigned char **messages, unsigned int len,
+                   unsigned char **digests, int count);
+void sha256d_multi_mid(const uint32_t **midstates, unsigned int prefix,
+                       const unsigned char **messages, unsigned int len,
+                       unsigned char **digests, int count);
+int sha256d_multi_test(void);
+
 #endif /* !SHA2_H */
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2014-2016 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "statstore.h"
+
+/* Records to make room for when creating or growing the store */
+#define STATSTORE_GROW 4096
+
+static const double nonces = 4294967296;
+
+static size_t store_size(const int64_t capacity)
+{
+	return sizeof(stats_header_t) + sizeof(stats_record_t) * capacity;
+}
+
+static bool map_store(statstore_t *store, const size_t size)
+{
+	int prot = PROT_READ;
+
+	if (!store->readonly)
+		prot |= PROT_WRITE;
+	store->header = mmap(NULL, size, prot, MAP_SHARED, store->fd, 0);
+	if (unlikely(store->header == MAP_FAILED)) {
+		LOGERR("Failed to mmap stats store %s", store->path);
+		store->header = NULL;
+		return false;
+	}
+	store->mapsize = size;
+	store->records = (stats_record_t *)(store->header + 1);
+	return true;
+}
+
+/* Open the stats store at path, creating it if it doesn't exist unless
+ * opening it readonly. */
+statstore_t *statstore_open(const char *path, const bool readonly)
+{
+	statstore_t *store = ckzalloc(sizeof(statstore_t));
+	stats_header_t *header;
+	struct stat st;
+
+	store->path = strdup(path);
+	store->readonly = readonly;
+	store->fd = open(path, readonly ? O_RDONLY | O_CLOEXEC : O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (store->fd < 0) {
+		LOGERR("Failed to open stats store %s", path);
+		goto out_free;
+	}
+	if (unlikely(fstat(store->fd, &st))) {
+		LOGERR("Failed to fstat stats store %s", path);
+		goto out_close;
+	}
+	if (!st.st_size && !readonly) {
+		stats_header_t new_header;
+
+		memset(&new_header, 0, sizeof(new_header));
+		new_header.magic = STATSTORE_MAGIC;
+		new_header.version = STATSTORE_VERSION;
+		new_header.recsize = sizeof(stats_record_t);
+		new_header.capacity = STATSTORE_GROW;
+		if (unlikely(ftruncate(store->fd, store_size(STATSTORE_GROW)) ||
+			     pwrite(store->fd, &new_header, sizeof(new_header), 0) != sizeof(new_header))) {
+			LOGERR("Failed to create stats store %s", path);
+			goto out_close;
+		}
+		st.st_size = store_size(STATSTORE_GROW);
+	}
+	if ((size_t)st.st_size < sizeof(stats_header_t)) {
+		LOGWARNING("Stats store %s is too small to be valid", path);
+		goto out_close;
+	}
+	if (!map_store(store, st.st_size))
+		goto out_close;
+	header = store->header;
+	if (header->magic != STATSTORE_MAGIC || header->version != STATSTORE_VERSION ||
+	    header->recsize != sizeof(stats_record_t)) {
+		LOGWARNING("Stats store %s has an unrecognised format", path);
+		goto out_unmap;
+	}
+	if (header->records > header->capacity || store_size(header->capacity) > (size_t)st.st_size) {
+		LOGWARNING("Stats store %s is truncated", path);
+		goto out_unmap;
+	}
+	return store;
+
+out_unmap:
+	munmap(store->header, store->mapsize);
+out_close:
+	close(store->fd);
+out_free:
+	free(store->path);
+	free(store);
+	return NULL;
+}
+
+void statstore_close(statstore_t *store)
+{
+	if (!store)
+		return;
+	if (!store->readonly)
+		msync(store->header, store->mapsize, MS_SYNC);
+	munmap(store->header, store->mapsize);
+	close(store->fd);
+	free(store->path);
+	free(store);
+}
+
+/* Double the room in the store. Moves the mapping so any pointers to records
+ * are invalid afterwards. */
+static bool grow_store(statstore_t *store)
+{
+	int64_t capacity = store->header->capacity * 2;
+	size_t size = store_size(capacity);
+	void *map;
+
+	if (unlikely(ftruncate(store->fd, size))) {
+		LOGERR("Failed to grow stats store %s to %"PRId64" records", store->path, capacity);
+		return false;
+	}
+	map = mremap(store->header, store->mapsize, size, MREMAP_MAYMOVE);
+	if (unlikely(map == MAP_FAILED)) {
+		LOGERR("Failed to remap stats store %s", store->path);
+		return false;
+	}
+	store->header = map;
+	store->records = (stats_record_t *)(store->header + 1);
+	store->mapsize = size;
+	store->header->capacity = capacity;
+	return true;
+}
+
+/* Add a new record returning its id, or 0 if it can't be stored. Ids start
+ * from 1 so that 0 can mean an entity has no record yet. */
+int64_t statstore_add(statstore_t *store, const int type, const char *name)
+{
+	stats_header_t *header = store->header;
+	stats_record_t *record;
+
+	if (unlikely(strlen(name) >= STATSTORE_NAMELEN)) {
+		LOGINFO("Name %s too long for the stats store", name);
+		return 0;
+	}
+	if (header->records >= header->capacity) {
+		if (!grow_store(store))
+			return 0;
+		header = store->header;
+	}
+	record = &store->records[header->records];
+	memset(record, 0, sizeof(stats_record_t));
+	strcpy(record->name, name);
+	record->type = type;
+	return ++header->records;
+}
+
+stats_record_t *statstore_record(statstore_t *store, const int64_t id)
+{
+	if (unlikely(id < 1 || id > store->header->records))
+		return NULL;
+	return &store->records[id - 1];
+}
+
+/* Schedule the dirty pages to be written back without waiting on them */
+void statstore_sync(statstore_t *store)
+{
+	msync(store->header, store->mapsize, MS_ASYNC);
+}
+
+/* The JSON layout of the per user and per worker log files */
+json_t *stats_record_json(const stats_record_t *record)
+{
+	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
+	json_t *val;
+
+	suffix_string(record->dsps1 * nonces, suffix1, 16, 0);
+	suffix_string(record->dsps5 * nonces, suffix5, 16, 0);
+	suffix_string(record->dsps60 * nonces, suffix60, 16, 0);
+	suffix_string(record->dsps1440 * nonces, suffix1440, 16, 0);
+	suffix_string(record->dsps10080 * nonces, suffix10080, 16, 0);
+
+	if (record->type == STATS_USER) {
+		JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,si,sI,sf}",
+			   "hashrate1m", suffix1,
+			   "hashrate5m", suffix5,
+			   "hashrate1hr", suffix60,
+			   "hashrate1d", suffix1440,
+			   "hashrate7d", suffix10080,
+			   "lastupdate", (int)record->lastupdate,
+			   "workers", record->workers,
+			   "shares", record->shares,
+			   "bestshare", record->bestshare);
+	} else {
+		JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,sI,sf,sI}",
+			   "hashrate1m", suffix1,
+			   "hashrate5m", suffix5,
+			   "hashrate1hr", suffix60,
+			   "hashrate1d", suffix1440,
+			   "hashrate7d", suffix10080,
+			   "lastupdate", (int)record->lastupdate,
+			   "shares", record->shares,
+			   "bestshare", record->bestshare,
+			   "lastdiff", record->lastdiff);
+	}
+	return val;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2014-2016 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef STATSTORE_H
+#define STATSTORE_H
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "libckpool.h"
+
+/* A single memory mapped file of fixed size records holding the stats of
+ * every user and worker, updated in place instead of one file per entity. */
+
+#define STATSTORE_MAGIC 0x53504b43 /* "CKPS" */
+#define STATSTORE_VERSION 1
+#define STATSTORE_NAMELEN 256
+
+/* Record types, zero being a record not yet in use */
+#define STATS_USER 1
+#define STATS_WORKER 2
+
+struct stats_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t recsize;
+	uint32_t reserved;
+	int64_t records; /* Records in use */
+	int64_t capacity; /* Records the file has room for */
+	char pad[32];
+};
+
+typedef struct stats_header stats_header_t;
+
+struct stats_record {
+	char name[STATSTORE_NAMELEN]; /* Username or workername */
+	int32_t type;
+	int32_t workers; /* Users only */
+	int64_t lastupdate;
+	int64_t shares;
+	int64_t lastdiff; /* Workers only */
+	double dsps1;
+	double dsps5;
+	double dsps60;
+	double dsps1440;
+	double dsps10080;
+	double bestshare;
+};
+
+typedef struct stats_record stats_record_t;
+
+struct statstore {
+	char *path;
+	int fd;
+	bool readonly;
+	size_t mapsize;
+	stats_header_t *header;
+	stats_record_t *records;
+};
+
+typedef struct statstore statstore_t;
+
+statstore_t *statstore_open(const char *path, const bool readonly);
+void statstore_close(statstore_t *store);
+int64_t statstore_add(statstore_t *store, const int type, const char *name);
+stats_record_t *statstore_record(statstore_t *store, const int64_t id);
+void statstore_sync(statstore_t *store);
+json_t *stats_record_json(const stats_record_t *record);
+
+#endif /* STATSTORE_H */
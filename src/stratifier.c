@@ -24,6 +24,7 @@
 #include "libckpool.h"
 #include "bitcoin.h"
 #include "sha2.h"
+#include "statstore.h"
 #include "stratifier.h"
 #include "uthash.h"
 #include "utlist.h"
@@ -85,6 +86,37 @@ struct pool_stats {
 
 typedef struct pool_stats pool_stats_t;
 
+/* Share counts accumulated lock free by each thread submitting shares, only
+ * ever incremented by their owner and folded into the pool stats by
+ * statsupdate. */
+typedef struct stat_accumulator stat_accumulator_t;
+
+struct stat_accumulator {
+	stat_accumulator_t *next;
+
+	int64_t shares;
+	double diff_shares;
+	double rejects;
+
+	/* Totals already folded into the pool stats, owned by statsupdate */
+	int64_t folded_shares;
+	double folded_diff_shares;
+	double folded_rejects;
+};
+
+typedef struct txntable txntable_t;
+
+struct txntable {
+	UT_hash_handle hh;
+	int id; /* Position in the workbase that added it */
+	uchar hash[32]; /* Byte swapped binary hash with witness, the key */
+	uchar txid[32]; /* Byte swapped binary txid for the merkle tree */
+	uchar *data; /* Raw transaction */
+	int len;
+	int refcount; /* Updates left before it expires if unused */
+	int refs; /* Workbases referencing it */
+};
+
 struct workbase {
 	/* Hash table data */
 	UT_hash_handle hh;
@@ -106,22 +138,29 @@ struct workbase {
 	char bbversion[12];
 	char nbit[12];
 	uint64_t coinbasevalue;
+	uint64_t subsidy; /* Coinbasevalue without fees, 0 if unknown */
 	int height;
 	char *flags;
 	int txns;
-	char *txn_data;
+	txntable_t **txn; /* Referenced transactions */
+	char *txn_data; /* Only from remote servers using the old format */
 	char *txn_hashes;
 	char witnessdata[80]; //null-terminated ascii
 	bool insert_witness;
 	int merkles;
-	char merklehash[16][68];
-	char merklebin[16][32];
+	char (*merklehash)[68];
+	char (*merklebin)[32];
 	json_t *merkle_array;
+	blocktail_t *tail; /* Transactions ready for block submission */
 
 	/* Template variables, lengths are binary lengths! */
 	char *coinb1; // coinbase1
 	uchar *coinb1bin;
 	int coinb1len; // length of above
+	sha256_ctx coinb1ctx; // sha256 context having hashed coinb1
+
+	/* Unique amongst all workbases, identifies it in midstate caches */
+	int64_t generation;
 
 	char enonce1const[32]; // extranonce1 section that is constant
 	uchar enonce1constbin[16];
@@ -141,6 +180,8 @@ struct workbase {
 
 	ckpool_t *ckp;
 	bool proxy; /* This workbase is proxied work */
+	bool empty; /* Coinbase only work sent ahead of a new block's template */
+	char parent[68]; /* Prevhash of the work an empty job replaces */
 };
 
 typedef struct workbase workbase_t;
@@ -150,14 +191,21 @@ struct json_params {
 	json_t *params;
 	json_t *id_val;
 	int64_t client_id;
+	ts_t received; /* When the message was received, before being queued */
 };
 
 typedef struct json_params json_params_t;
 
-/* Stratum json messages with their associated client id */
+/* Stratum json messages with their associated client id, or a message
+ * rendered once for a list of client ids */
 struct smsg {
 	json_t *json_msg;
 	int64_t client_id;
+	ts_t received; /* When a client message was handed to the stratifier */
+
+	char *buf;
+	int64_t *client_ids;
+	int clients;
 };
 
 typedef struct smsg smsg_t;
@@ -189,6 +237,7 @@ struct user_instance {
 	double best_diff; /* Best share found by this user */
 
 	int64_t shares;
+	double pending_diff; /* Diff not yet decayed, folded by statsupdate */
 	double dsps1; /* Diff shares per second, 1 minute rolling average */
 	double dsps5; /* ... 5 minute ... */
 	double dsps60;/* etc */
@@ -198,6 +247,8 @@ struct user_instance {
 	tv_t last_decay;
 	tv_t last_update;
 
+	int64_t stats_id; /* Record in the stats store, 0 if not stored yet */
+
 	bool authorised; /* Has this username ever been authorised? */
 	time_t auth_time;
 	time_t failed_authtime; /* Last time this username failed to authorise */
@@ -217,6 +268,7 @@ struct worker_instance {
 	worker_instance_t *prev;
 
 	int64_t shares;
+	double pending_diff; /* As per user_instance */
 	double dsps1;
 	double dsps5;
 	double dsps60;
@@ -229,6 +281,8 @@ struct worker_instance {
 
 	double best_diff; /* Best share found by this worker */
 	int mindiff; /* User chosen mindiff */
+	int64_t lastdiff; /* Diff vardiff last settled a client of this worker on */
+	int64_t stats_id; /* As per user_instance */
 
 	bool idle;
 	bool notified_idle;
@@ -236,6 +290,14 @@ struct worker_instance {
 
 typedef struct stratifier_data sdata_t;
 
+typedef struct stats_index stats_index_t;
+
+struct stats_index {
+	UT_hash_handle hh;
+	char *name;
+	int64_t id;
+};
+
 typedef struct proxy_base proxy_t;
 
 /* Per client stratum instance == workers */
@@ -249,8 +311,8 @@ struct stratum_instance {
 	/* Descriptive of ID number and passthrough if any */
 	char identity[128];
 
-	/* Reference count for when this instance is used outside of the
-	 * instance_lock */
+	/* Reference count for when this instance is used outside of its
+	 * shard lock */
 	int ref;
 
 	char enonce1[36]; /* Fit up to 16 byte binary enonce1 */
@@ -259,6 +321,13 @@ struct stratum_instance {
 	uint64_t enonce1_64;
 	int session_id;
 
+	/* Coinbase midstate after coinb1 and enonce1 of the last workbase
+	 * generation this client submitted shares to */
+	mutex_t cbmid_lock;
+	sha256_ctx cbmid;
+	int64_t cbmid_generation;
+	uchar cbmid_enonce1[16];
+
 	int64_t diff; /* Current diff */
 	int64_t old_diff; /* Previous diff */
 	int64_t diff_change_job_id; /* Last job_id we changed diff */
@@ -277,9 +346,10 @@ struct stratum_instance {
 	time_t start_time;
 
 	char address[INET6_ADDRSTRLEN];
+	int loglevel; /* Log level of this client alone when more verbose */
 	bool node; /* Is this a mining node */
 	bool subscribed;
-	bool authorising; /* In progress, protected by instance_lock */
+	bool authorising; /* In progress, protected by the shard lock */
 	bool authorised;
 	bool dropped;
 	bool idle;
@@ -318,13 +388,134 @@ struct stratum_instance {
 	bool remote; /* Is this a trusted remote server */
 };
 
-struct share {
+/* Log messages about a client when the pool, the stratifier or that client
+ * alone has a log level that verbose */
+#define CLIENT_LOG_WANTED(client, lvl) (LOG_WANTED(lvl) || unlikely((client)->loglevel >= (lvl)))
+#define LOGCLIENT(client, lvl, fmt, ...) do { \
+		if (CLIENT_LOG_WANTED(client, lvl)) \
+			__LOGMSGSIZ(DEFLOGBUFSIZ, lvl, fmt, ##__VA_ARGS__); \
+	} while (0)
+
+#define SHARE_SHARDS 16
+#define SHARE_SHARD_SLOTS 64 /* Initial slots per shard, doubled at half full */
+
+/* Open addressed set of accepted share hashes where all zeroes is empty */
+struct share_shard {
+	mutex_t lock;
+	uint64_t (*hashes)[4];
+	int slots;
+	int count;
+	int64_t generated;
+};
+
+typedef struct share_shard share_shard_t;
+
+/* Accepted shares of one workbase for detecting duplicates, sharded on the
+ * hash so share processing threads rarely contend, and dropped whole when the
+ * workbase is retired. */
+struct share_table {
 	UT_hash_handle hh;
-	uchar hash[32];
 	int64_t workbase_id;
+	tv_t retired; /* When a block change made its shares stale */
+	struct share_table *next; /* For dropping outside of share_lock */
+	share_shard_t shards[SHARE_SHARDS];
+};
+
+typedef struct share_table share_table_t;
+
+/* Results of checking a share hash against its workbase's share table */
+enum share_check {
+	SHARE_NEW,
+	SHARE_DUPE,
+	SHARE_NOTABLE /* Table already dropped, too late to check */
+};
+
+/* A line queued for the sharelog of a workbase, or a request to close that
+ * sharelog if line is NULL */
+struct sharelog {
+	struct sharelog *next;
+	struct sharelog *prev;
+	char *fname;
+	char *line;
+	int len;
+};
+
+typedef struct sharelog sharelog_t;
+
+/* A sharelog held open by the sharelog writer */
+struct sharelog_file {
+	UT_hash_handle hh;
+	char *fname;
+	FILE *fp;
+	time_t last_write;
+};
+
+typedef struct sharelog_file sharelog_file_t;
+
+#define SHARELOG_BUFSIZE 65536 /* Flushed when this much is buffered... */
+#define SHARELOG_FLUSH_INTERVAL 2 /* ...or this many seconds have passed */
+#define SHARELOG_IDLE 600 /* Close sharelogs not written to for this long */
+#define SHARELOG_MAXQUEUE 1000000 /* Stall share processing beyond this backlog */
+
+/* A message sent on the ckdb stream that is yet to be answered, kept in
+ * seqall order so it can be resent if the stream drops */
+struct ckdb_pending {
+	UT_hash_handle hh;
+	struct ckdb_pending *next;
+	struct ckdb_pending *prev;
+	int64_t seqall;
+	char *msg;
+	int len;
+};
+
+typedef struct ckdb_pending ckdb_pending_t;
+
+#define CKDB_STREAM_BATCH 64 /* Most queued ckdb messages sent per frame */
+#define CKDB_STREAM_INFLIGHT 8192 /* Most unanswered messages on the stream */
+#define CKDB_STREAM_STALL 30 /* Reconnect if nothing is answered for this long */
+
+/* Most coinbase bytes after the midstate hashed together in a share batch */
+#define SUBMISSION_TAIL_LEN 320
+
+/* State of a mining.submit as it passes through parsing, hashing and
+ * accounting, allowing shares to be hashed in batches. */
+struct submission {
+	stratum_instance_t *client;
+	json_t *json_msg;
+	const json_t *params_val;
+	json_t *err_val;
+
+	bool share;
+	bool result;
+	bool invalid;
+	bool submit;
+	enum share_err err;
+
+	const char *workername;
+	const char *job_id;
+	const char *ntime;
+	const char *nonce;
+	char *nonce2;
+	char nonce2buf[36];
+	char *fname;
+	char idstring[20];
+	char hexhash[68];
+	char cdfield[64];
+	ts_t now;
+
+	workbase_t *wb;
+	int64_t id;
+	uint32_t ntime32;
+	double wdiff;
+	double sdiff;
+	sha256_ctx cbctx; // Coinbase midstate up to cbtail
+	uchar cbtail[SUBMISSION_TAIL_LEN]; // Remainder of the coinbase
+	int cbtaillen;
+	uchar swap[80];
+	uchar hash[32];
 };
 
-typedef struct share share_t;
+typedef struct submission submission_t;
 
 struct proxy_base {
 	UT_hash_handle hh;
@@ -383,14 +574,26 @@ struct session {
 	char address[INET6_ADDRSTRLEN];
 };
 
-typedef struct txntable txntable_t;
+/* Time spent waiting on a write lock */
+typedef struct lock_stat lock_stat_t;
 
-struct txntable {
-	UT_hash_handle hh;
-	int id;
-	char hash[68];
-	char *data;
-	int refcount;
+struct lock_stat {
+	int64_t locks;
+	double wait;
+	double maxwait;
+};
+
+/* Stratum instances are split across shards by client id so clients on
+ * different shards never contend. Each shard lock protects its hashtable and
+ * the ref and dropped state of the instances on it. */
+#define INSTANCE_SHARDS 16
+
+typedef struct instance_shard instance_shard_t;
+
+struct instance_shard {
+	cklock_t lock;
+	stratum_instance_t *instances;
+	lock_stat_t stat;
 };
 
 #define ID_AUTH 0
@@ -443,11 +646,28 @@ struct stratifier_data {
 	pool_stats_t stats;
 	/* Protects changes to pool stats */
 	mutex_t stats_lock;
+	/* List of per thread share accumulators, added to under stats_lock */
+	stat_accumulator_t *accumulators;
+
+	/* Binary store of user and worker stats, protects the mapping moving
+	 * as it grows with statstore_lock */
+	statstore_t *statstore;
+	mutex_t statstore_lock;
+	/* Record ids by name of the users and workers loaded from the store */
+	stats_index_t *stored_users;
+	stats_index_t *stored_workers;
+
+	/* Pool wide share rate budget controller, updated by statsupdate.
+	 * rate_scale multiplies the diff vardiff aims for per client */
+	double rate_scale;
+	int64_t rate_adjustments;
+	int64_t rate_faststarts; /* New clients started at their worker's rate */
 
 	/* Serialises sends/receives to ckdb if possible */
 	mutex_t ckdb_lock;
 	/* Protects sequence numbers */
 	mutex_t ckdb_msg_lock;
+	rotating_log_t *ckdb_log; /* Hourly log of all messages to ckdb */
 	/* Incrementing global sequence number */
 	uint64_t ckdb_seq;
 	/* Incrementing ckdb_ids[] sequence numbers */
@@ -456,6 +676,20 @@ struct stratifier_data {
 	bool ckdb_offline;
 	bool verbose;
 
+	/* Persistent pipelined connection carrying the ckdbq messages */
+	mutex_t ckdb_stream_lock;
+	pthread_cond_t ckdb_stream_cond;
+	int ckdb_stream_fd;		/* -1 if not connected */
+	bool ckdb_stream_dead;		/* Reader has stopped using the fd */
+	bool ckdb_stream_unsupported;	/* Old ckdb, one connection per message */
+	ckdb_pending_t *ckdb_pending_hash; /* Unanswered messages by seqall */
+	ckdb_pending_t *ckdb_pending;	/* Unanswered messages in order */
+	int ckdb_inflight;
+	int64_t ckdb_stream_frames;
+	int64_t ckdb_stream_sent;
+	int64_t ckdb_stream_replies;
+	int64_t ckdb_stream_connects;
+
 	uint64_t enonce1_64;
 
 	/* For protecting the hashtable data */
@@ -467,6 +701,12 @@ struct stratifier_data {
 	int workbases_generated;
 	txntable_t *txns;
 
+	/* Merkle tree of the last workbase built, to reuse the branches of
+	 * transactions unchanged since then */
+	mutex_t merkle_lock;
+	uchar *merkle_tree;
+	int merkle_leaves;
+
 	/* Is this a node and unable to rebuild workinfos due to lack of txns */
 	bool wbincomplete;
 
@@ -480,18 +720,32 @@ struct stratifier_data {
 	int session_id;
 	char lasthash[68];
 	char lastswaphash[68];
+	/* Previous block hash replaced by an empty job, under workbase_lock,
+	 * until a full template for another block arrives or it expires */
+	char stalehash[68];
+	time_t stalehash_time;
+
+	/* How long empty jobs were live before their full template */
+	int64_t empty_jobs;
+	double empty_last;
+	double empty_total;
+	double empty_max;
 
 	ckmsgq_t *ssends;	// Stratum sends
 	ckmsgq_t *srecvs;	// Stratum receives
 	ckmsgq_t *ckdbq;	// ckdb
-	ckmsgq_t *sshareq;	// Stratum share sends
+	ckmsgq_t **sshareqs;	// Stratum share processors, one per thread
+	int sshareq_count;
 	ckmsgq_t *sauthq;	// Stratum authorisations
 	ckmsgq_t *stxnq;	// Transaction requests
+	mutex_t postponed_lock;
 	ckmsg_t *postponed;	// List of messages postponed till next update
 
 	int user_instance_id;
 
-	stratum_instance_t *stratum_instances;
+	/* Lock order is a shard lock, then instance_lock, then user_lock */
+	instance_shard_t shards[INSTANCE_SHARDS];
+
 	stratum_instance_t *recycled_instances;
 	stratum_instance_t *node_instances;
 	stratum_instance_t *remote_instances;
@@ -500,15 +754,35 @@ struct stratifier_data {
 	int disconnected_generated;
 	session_t *disconnected_sessions;
 
+	/* Protects the lists of instances above, sessions and enonce1 */
+	cklock_t instance_lock;
+	lock_stat_t instance_stat;
+
 	user_instance_t *user_instances;
 
-	/* Protects both stratum and user instances */
-	cklock_t instance_lock;
+	/* Protects the user and worker instances, their client lists and
+	 * the user and worker counts */
+	cklock_t user_lock;
+	lock_stat_t user_stat;
 
-	share_t *shares;
-	mutex_t share_lock;
+	/* Share tables by workbase id, protected by share_lock */
+	share_table_t *share_tables;
+	rwlock_t share_lock;
 
 	int64_t shares_generated;
+	int latency_max; /* Highest latency of any mining node in ms */
+
+	/* Sharelog lines queued for the sharelog writer */
+	mutex_t sharelog_lock;
+	pthread_cond_t sharelog_cond;
+	sharelog_t *sharelogs;
+	int sharelogs_queued;
+	int64_t sharelogs_generated;
+	pthread_cond_t sharelog_space_cond; /* Signalled when the writer drains */
+	int64_t sharelog_stalls; /* Times queueing waited for the writer */
+	int64_t sharelog_stall_ms; /* Total time spent waiting */
+	time_t sharelog_warned; /* Last time we warned about stalling */
+	int sharelog_files; /* Open sharelogs, only written by the writer */
 
 	/* Linked list of block solves, added to during submission, removed on
 	 * accept/reject. It is likely we only ever have one solve on here but
@@ -516,6 +790,13 @@ struct stratifier_data {
 	mutex_t block_lock;
 	ckmsg_t *block_solves;
 
+	/* Seconds from receiving block solves to dispatching them, under
+	 * block_lock */
+	int64_t blocks_dispatched;
+	double dispatch_last;
+	double dispatch_total;
+	double dispatch_max;
+
 	/* Generator message priority */
 	int gen_priority;
 
@@ -526,6 +807,44 @@ struct stratifier_data {
 	proxy_t *subproxy; /* Which subproxy this sdata belongs to in proxy mode */
 };
 
+/* Write lock accounting for the time spent waiting on the lock */
+static void _ck_wlock_stat(cklock_t *lock, lock_stat_t *stat, const char *file,
+			   const char *func, const int line)
+{
+	tv_t start, end;
+	double wait;
+
+	/* Only time the wait when the lock is actually contended */
+	if (!_mutex_trylock(&lock->mutex, file, func, line)) {
+		if (!_wr_trylock(&lock->rwlock, file, func, line)) {
+			stat->locks++;
+			return;
+		}
+		tv_time(&start);
+		_wr_lock(&lock->rwlock, file, func, line);
+	} else {
+		tv_time(&start);
+		_ck_wlock(lock, file, func, line);
+	}
+	tv_time(&end);
+	wait = tvdiff(&end, &start);
+	stat->locks++;
+	stat->wait += wait;
+	if (wait > stat->maxwait)
+		stat->maxwait = wait;
+}
+
+#define ck_wlock_stat(lock, stat) _ck_wlock_stat(lock, stat, __FILE__, __func__, __LINE__)
+
+static instance_shard_t *id_shard(sdata_t *sdata, const int64_t id)
+{
+	/* Fold in the high bits which hold the passthrough id */
+	return &sdata->shards[(id ^ (id >> 32)) & (INSTANCE_SHARDS - 1)];
+}
+
+#define shard_wlock(shard) ck_wlock_stat(&(shard)->lock, &(shard)->stat)
+#define shard_wunlock(shard) ck_wunlock(&(shard)->lock)
+
 typedef struct json_entry json_entry_t;
 
 struct json_entry {
@@ -707,6 +1026,15 @@ static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, bool
 
 static void clear_workbase(workbase_t *wb)
 {
+	int i;
+
+	for (i = 0; wb->txn && i < wb->txns; i++)
+		__sync_sub_and_fetch(&wb->txn[i]->refs, 1);
+	free(wb->txn);
+	if (wb->tail)
+		blocktail_put(wb->tail);
+	free(wb->merklehash);
+	free(wb->merklebin);
 	free(wb->flags);
 	free(wb->txn_data);
 	free(wb->txn_hashes);
@@ -719,54 +1047,136 @@ static void clear_workbase(workbase_t *wb)
 	free(wb);
 }
 
-/* Remove all shares with a workbase id less than wb_id for block changes */
-static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+/* Create the empty share table for a new workbase. Must be called before
+ * the workbase can receive shares. */
+static void add_share_table(sdata_t *sdata, const int64_t wb_id)
 {
-	share_t *share, *tmp;
-	int purged = 0;
+	share_table_t *table = ckzalloc(sizeof(share_table_t)), *old;
+	int i;
+
+	table->workbase_id = wb_id;
+	for (i = 0; i < SHARE_SHARDS; i++) {
+		share_shard_t *shard = &table->shards[i];
+
+		mutex_init(&shard->lock);
+		shard->slots = SHARE_SHARD_SLOTS;
+		shard->hashes = ckzalloc(sizeof(*shard->hashes) * shard->slots);
+	}
+
+	wr_lock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_tables, &wb_id, old);
+	if (likely(!old))
+		HASH_ADD_I64(sdata->share_tables, workbase_id, table);
+	wr_unlock(&sdata->share_lock);
+
+	if (unlikely(old)) {
+		for (i = 0; i < SHARE_SHARDS; i++)
+			free(table->shards[i].hashes);
+		free(table);
+	}
+}
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id < wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			purged++;
+/* Free a list of share tables unlinked under share_lock, returning how many
+ * shares they held. Costs nothing per share. */
+static int free_share_tables(share_table_t *tables)
+{
+	share_table_t *table;
+	int i, shares = 0;
+
+	while (tables) {
+		table = tables;
+		tables = table->next;
+		for (i = 0; i < SHARE_SHARDS; i++) {
+			shares += table->shards[i].count;
+			free(table->shards[i].hashes);
 		}
+		free(table);
 	}
-	mutex_unlock(&sdata->share_lock);
+	return shares;
+}
+
+/* Must be entered with share_lock held for writing */
+static void __unlink_share_table(sdata_t *sdata, share_table_t *table, share_table_t **tables)
+{
+	int i;
+
+	HASH_DEL(sdata->share_tables, table);
+	for (i = 0; i < SHARE_SHARDS; i++)
+		sdata->shares_generated += table->shards[i].generated;
+	table->next = *tables;
+	*tables = table;
+}
 
+/* Remove the shares of workbases with an id less than wb_id once they have
+ * been stale for longer than the latency of any mining node, as their late
+ * shares are still accepted till then and need checking for duplicates. */
+static void retire_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+{
+	int window = __atomic_load_n(&sdata->latency_max, __ATOMIC_RELAXED);
+	share_table_t *table, *tmp, *tables = NULL;
+	int purged;
+	tv_t now;
+
+	tv_time(&now);
+	wr_lock(&sdata->share_lock);
+	HASH_ITER(hh, sdata->share_tables, table, tmp) {
+		if (table->workbase_id >= wb_id)
+			continue;
+		if (!table->retired.tv_sec)
+			table->retired = now;
+		if (ms_tvdiff(&now, &table->retired) >= window)
+			__unlink_share_table(sdata, table, &tables);
+	}
+	wr_unlock(&sdata->share_lock);
+
+	purged = free_share_tables(tables);
 	if (purged)
 		LOGINFO("Cleared %d shares from share hashtable", purged);
 }
 
-/* Remove all shares with a workbase id == wb_id being discarded */
-static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+/* Remove the shares of all workbases with an id less than wb_id */
+static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
 {
-	share_t *share, *tmp;
-	int aged = 0;
+	share_table_t *table, *tmp, *tables = NULL;
+	int purged;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id == wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			aged++;
-		}
+	wr_lock(&sdata->share_lock);
+	HASH_ITER(hh, sdata->share_tables, table, tmp) {
+		if (table->workbase_id < wb_id)
+			__unlink_share_table(sdata, table, &tables);
 	}
-	mutex_unlock(&sdata->share_lock);
+	wr_unlock(&sdata->share_lock);
 
+	purged = free_share_tables(tables);
+	if (purged)
+		LOGINFO("Cleared %d shares from share hashtable", purged);
+}
+
+/* Remove the shares of workbase id wb_id being discarded */
+static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+{
+	share_table_t *table, *tables = NULL;
+	int aged;
+
+	wr_lock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_tables, &wb_id, table);
+	if (table)
+		__unlink_share_table(sdata, table, &tables);
+	wr_unlock(&sdata->share_lock);
+
+	aged = free_share_tables(tables);
 	if (aged)
 		LOGINFO("Aged %d shares from share hashtable", aged);
 }
 
 static char *status_chars = "|/-\\";
 
-/* Absorbs the json and generates a ckdb json message, logs it to the ckdb
- * log and returns the malloced message. */
+/* Absorbs the json and generates a ckdb json message, queues it for the ckdb
+ * log and returns the malloced message. The log is written in batches when
+ * full or once a second by the heartbeat, taking the flock once per batch. */
 static char *ckdb_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, const int idtype)
 {
 	char *json_msg;
-	char logname[512];
 	char *ret = NULL;
 	uint64_t seqall;
 
@@ -786,8 +1196,8 @@ static char *ckdb_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, const int idty
 	free(json_msg);
 out:
 	json_decref(val);
-	snprintf(logname, 511, "%s%s", ckp->logdir, ckp->ckdb_name);
-	rotating_log(logname, ret);
+	if (likely(ret))
+		rotating_log_add(sdata->ckdb_log, ret);
 	return ret;
 }
 
@@ -838,55 +1248,37 @@ static void _ckdbq_add(ckpool_t *ckp, const int idtype, json_t *val, const char
 /* Append a bulk list already created to the ssends list */
 static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-
-	mutex_lock(ssends->lock);
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, bulk_send);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	ckmsgq_add_list(sdata->ssends, bulk_send);
 }
 
 /* As ssend_bulk_append but for high priority messages to be put at the front
  * of the list. */
 static void ssend_bulk_prepend(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-	ckmsg_t *tmp;
-
-	mutex_lock(ssends->lock);
-	tmp = ssends->msgs;
-	ssends->msgs = bulk_send;
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, tmp);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	ckmsgq_add_urgent(sdata->ssends, bulk_send);
 }
 
 /* List of messages we intentionally want to postpone till after the next bulk
  * update - eg. workinfo which is large and we don't want to delay updates */
 static void ssend_bulk_postpone(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-
-	mutex_lock(ssends->lock);
+	mutex_lock(&sdata->postponed_lock);
 	DL_CONCAT(sdata->postponed, bulk_send);
-	ssends->messages += messages;
-	mutex_unlock(ssends->lock);
+	mutex_unlock(&sdata->postponed_lock);
 }
 
 /* Send any postponed bulk messages */
 static void send_postponed(sdata_t *sdata)
 {
-	ckmsgq_t *ssends = sdata->ssends;
+	ckmsg_t *postponed;
 
-	mutex_lock(ssends->lock);
-	if (sdata->postponed) {
-		DL_CONCAT(ssends->msgs, sdata->postponed);
-		sdata->postponed = NULL;
-		pthread_cond_signal(ssends->cond);
-	}
-	mutex_unlock(ssends->lock);
+	mutex_lock(&sdata->postponed_lock);
+	postponed = sdata->postponed;
+	sdata->postponed = NULL;
+	mutex_unlock(&sdata->postponed_lock);
+
+	if (postponed)
+		ckmsgq_add_list(sdata->ssends, postponed);
 }
 
 static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
@@ -1004,16 +1396,168 @@ static void send_ageworkinfo(ckpool_t *ckp, const int64_t id)
 	ckdbq_add(ckp, ID_AGEWORKINFO, val);
 }
 
+/* Hand a line for the sharelog fname, or a request to close it if line is
+ * NULL, to the sharelog writer which takes ownership of both. If the writer
+ * falls behind by SHARELOG_MAXQUEUE lines, wait for it to drain them rather
+ * than queueing without limit. */
+static void queue_sharelog(ckpool_t *ckp, char *fname, char *line)
+{
+	sdata_t *sdata = ckp->sdata;
+	bool warn = false;
+	sharelog_t *log;
+	int64_t stalls;
+	tv_t start, end;
+
+	log = ckalloc(sizeof(sharelog_t));
+	log->fname = fname;
+	log->line = line;
+	log->len = line ? strlen(line) : 0;
+
+	mutex_lock(&sdata->sharelog_lock);
+	if (unlikely(line && sdata->sharelogs_queued >= SHARELOG_MAXQUEUE)) {
+		tv_time(&start);
+		stalls = ++sdata->sharelog_stalls;
+		if (start.tv_sec - sdata->sharelog_warned >= 60) {
+			sdata->sharelog_warned = start.tv_sec;
+			warn = true;
+		}
+		do {
+			cond_wait(&sdata->sharelog_space_cond, &sdata->sharelog_lock);
+		} while (sdata->sharelogs_queued >= SHARELOG_MAXQUEUE);
+		tv_time(&end);
+		sdata->sharelog_stall_ms += ms_tvdiff(&end, &start);
+	}
+	DL_APPEND(sdata->sharelogs, log);
+	sdata->sharelogs_queued++;
+	sdata->sharelogs_generated++;
+	pthread_cond_signal(&sdata->sharelog_cond);
+	mutex_unlock(&sdata->sharelog_lock);
+
+	if (unlikely(warn))
+		LOGWARNING("Sharelog writer backlogged by %d lines, share processing stalled %"PRId64" times",
+			   SHARELOG_MAXQUEUE, stalls);
+}
+
+static void close_sharelog(sdata_t *sdata, sharelog_file_t **files, sharelog_file_t *file)
+{
+	HASH_DEL(*files, file);
+	sdata->sharelog_files--;
+	fflush(file->fp);
+	fsync(fileno(file->fp));
+	if (unlikely(fclose(file->fp)))
+		LOGERR("Failed to fclose %s", file->fname);
+	free(file->fname);
+	free(file);
+}
+
+static void write_sharelog(sdata_t *sdata, sharelog_file_t **files, sharelog_t *log,
+			   const time_t now_t)
+{
+	sharelog_file_t *file;
+
+	HASH_FIND_STR(*files, log->fname, file);
+	if (!log->line) {
+		if (file)
+			close_sharelog(sdata, files, file);
+		return;
+	}
+	if (!file) {
+		FILE *fp = fopen(log->fname, "ae");
+
+		if (unlikely(!fp)) {
+			LOGERR("Failed to fopen %s", log->fname);
+			return;
+		}
+		setvbuf(fp, NULL, _IOFBF, SHARELOG_BUFSIZE);
+		file = ckalloc(sizeof(sharelog_file_t));
+		file->fp = fp;
+		file->fname = log->fname;
+		log->fname = NULL;
+		HASH_ADD_KEYPTR(hh, *files, file->fname, strlen(file->fname), file);
+		sdata->sharelog_files++;
+	}
+	if (unlikely(fwrite(log->line, log->len, 1, file->fp) != 1))
+		LOGERR("Failed to fwrite to %s", file->fname);
+	file->last_write = now_t;
+}
+
+/* Appends sharelog lines to files kept open per workbase, flushing them when
+ * their buffers fill or every SHARELOG_FLUSH_INTERVAL, so share processing
+ * never touches the filesystem. Files are fsynced when closed once their
+ * workbase is aged or they've been idle for SHARELOG_IDLE, and while open
+ * every sharelog_fsync seconds if it's set. */
+static void *sharelogger(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+	sharelog_file_t *files = NULL;
+	time_t last_flush = time(NULL), last_fsync = last_flush;
+
+	pthread_detach(pthread_self());
+	rename_proc("sharelogger");
+
+	while (42) {
+		sharelog_t *logs, *log, *tmp;
+		sharelog_file_t *file, *tmpfile;
+		bool sync = false;
+		time_t now_t;
+		ts_t abs;
+
+		mutex_lock(&sdata->sharelog_lock);
+		if (!sdata->sharelogs) {
+			ts_realtime(&abs);
+			abs.tv_sec += SHARELOG_FLUSH_INTERVAL;
+			cond_timedwait(&sdata->sharelog_cond, &sdata->sharelog_lock, &abs);
+		}
+		logs = sdata->sharelogs;
+		sdata->sharelogs = NULL;
+		sdata->sharelogs_queued = 0;
+		pthread_cond_broadcast(&sdata->sharelog_space_cond);
+		mutex_unlock(&sdata->sharelog_lock);
+
+		now_t = time(NULL);
+		DL_FOREACH_SAFE(logs, log, tmp) {
+			write_sharelog(sdata, &files, log, now_t);
+			free(log->fname);
+			free(log->line);
+			free(log);
+		}
+		if (now_t - last_flush < SHARELOG_FLUSH_INTERVAL)
+			continue;
+		last_flush = now_t;
+		if (ckp->sharelog_fsync && now_t - last_fsync >= ckp->sharelog_fsync) {
+			last_fsync = now_t;
+			sync = true;
+		}
+		HASH_ITER(hh, files, file, tmpfile) {
+			if (now_t - file->last_write >= SHARELOG_IDLE)
+				close_sharelog(sdata, &files, file);
+			else if (unlikely(fflush(file->fp)))
+				LOGERR("Failed to fflush %s", file->fname);
+			else if (sync && unlikely(fsync(fileno(file->fp))))
+				LOGERR("Failed to fsync %s", file->fname);
+		}
+	}
+	return NULL;
+}
+
 /* Add a new workbase to the table of workbases. Sdata is the global data in
- * pool mode but unique to each subproxy in proxy mode */
-static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_block)
+ * pool mode but unique to each subproxy in proxy mode. Returns false without
+ * adding it if it's an empty job whose parent is no longer current work, work
+ * for the block an empty job replaced, or work below the current height, and
+ * the caller must clear it. */
+static bool add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_block)
 {
 	workbase_t *tmp, *tmpa, *aged = NULL;
 	sdata_t *ckp_sdata = ckp->sdata;
+	int64_t blockchange_id;
+	double live = 0;
 	int len, ret;
 
 	ts_realtime(&wb->gentime);
 	wb->network_diff = diff_from_nbits(wb->headerbin + 72);
+	sha256_init(&wb->coinb1ctx);
+	sha256_update(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
 
 	len = strlen(ckp->logdir) + 8 + 1 + 16 + 1;
 	wb->logdir = ckzalloc(len);
@@ -1022,11 +1566,43 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	 * we set workbase_id from it. In server mode the stratifier is
 	 * setting the workbase_id */
 	ck_wlock(&sdata->workbase_lock);
-	ckp_sdata->workbases_generated++;
+	/* Don't let a template that was overtaken while it was being fetched
+	 * switch miners back a block, unless templates have only gone back for
+	 * longer than update_interval */
+	if (!wb->empty && !ckp->proxy && sdata->current_workbase &&
+	    wb->height < sdata->current_workbase->height &&
+	    wb->gentime.tv_sec - sdata->current_workbase->gentime.tv_sec < ckp->update_interval) {
+		ck_wunlock(&sdata->workbase_lock);
+		LOGINFO("Discarding template for height %d below the current work", wb->height);
+		return false;
+	}
+	if (wb->empty) {
+		workbase_t *current = sdata->current_workbase;
+
+		if (!current || strncmp(current->prevhash, wb->parent, 64)) {
+			ck_wunlock(&sdata->workbase_lock);
+			LOGINFO("Discarding empty job for a block that already has work");
+			return false;
+		}
+		memcpy(sdata->stalehash, wb->parent, 65);
+		sdata->stalehash_time = wb->gentime.tv_sec;
+	} else if (unlikely(sdata->stalehash[0])) {
+		/* Don't go back to the previous block if an empty job for a
+		 * new block was sent while we were getting this template */
+		if (!strncmp(wb->prevhash, sdata->stalehash, 64) &&
+		    wb->gentime.tv_sec - sdata->stalehash_time < ckp->update_interval) {
+			ck_wunlock(&sdata->workbase_lock);
+			LOGINFO("Discarding template for the block before the empty job");
+			return false;
+		}
+		sdata->stalehash[0] = '\0';
+	}
+	wb->generation = ++ckp_sdata->workbases_generated;
 	if (!ckp->proxy)
 		wb->id = sdata->workbase_id++;
 	else
 		sdata->workbase_id = wb->id;
+	add_share_table(sdata, wb->id);
 	if (strncmp(wb->prevhash, sdata->lasthash, 64)) {
 		char bin[32], swap[32];
 
@@ -1063,13 +1639,28 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 		}
 	}
 	HASH_ADD_I64(sdata->workbases, id, wb);
-	if (sdata->current_workbase)
-		tv_time(&sdata->current_workbase->retired);
+	if (sdata->current_workbase) {
+		workbase_t *current = sdata->current_workbase;
+
+		tv_time(&current->retired);
+		if (current->empty) {
+			live = (double)(wb->gentime.tv_sec - current->gentime.tv_sec) +
+			       (double)(wb->gentime.tv_nsec - current->gentime.tv_nsec) / 1000000000;
+			sdata->empty_jobs++;
+			sdata->empty_last = live;
+			sdata->empty_total += live;
+			if (live > sdata->empty_max)
+				sdata->empty_max = live;
+		}
+	}
 	sdata->current_workbase = wb;
+	blockchange_id = sdata->blockchange_id;
 	ck_wunlock(&sdata->workbase_lock);
 
-	if (*new_block)
-		purge_share_hashtable(sdata, wb->id);
+	if (live > 0)
+		LOGNOTICE("Empty job at height %d was live for %.3fs", wb->height, live);
+
+	retire_share_hashtable(sdata, blockchange_id);
 
 	if (!ckp->passthrough)
 		send_workinfo(ckp, sdata, wb);
@@ -1079,8 +1670,15 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	if (aged) {
 		send_ageworkinfo(ckp, aged->id);
 		age_share_hashtable(sdata, aged->id);
+		if (ckp->logshares) {
+			char *fname;
+
+			ASPRINTF(&fname, "%s.sharelog", aged->logdir);
+			queue_sharelog(ckp, fname, NULL);
+		}
 		clear_workbase(aged);
 	}
+	return true;
 }
 
 /* Mandatory send_recv to the generator which sets the message priority if this
@@ -1138,42 +1736,81 @@ struct update_req {
 	pthread_t *pth;
 	ckpool_t *ckp;
 	int prio;
+	gbttemplate_t *tmpl; // Template already fetched, eg. by longpoll
 };
 
 static void broadcast_ping(sdata_t *sdata);
 
-/* Build a hashlist of all transactions, allowing us to compare with the list of
- * existing transactions to determine which need to be propagated */
-static void add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char *hash,
-		    const char *data)
+static inline int txn_refcount(const ckpool_t *ckp)
+{
+	return ckp->node ? 100 : 20;
+}
+
+static void txn_hashhex(const txntable_t *txn, char *hashhex)
+{
+	uchar binswap[32];
+
+	bswap_256(binswap, txn->hash);
+	__bin2hex(hashhex, binswap, 32);
+}
+
+/* Find a transaction in the table by its hex hash */
+static txntable_t *__find_txn(sdata_t *sdata, const char *hashhex)
+{
+	uchar binswap[32], hash[32];
+	txntable_t *txn;
+
+	if (unlikely(!hex2bin(binswap, hashhex, 32)))
+		return NULL;
+	bswap_256(hash, binswap);
+	HASH_FIND(hh, sdata->txns, hash, 32, txn);
+	return txn;
+}
+
+static txntable_t *new_txn(const uchar *hash, const uchar *txid, const char *data, const int len)
+{
+	txntable_t *txn = ckzalloc(sizeof(txntable_t));
+
+	memcpy(txn->hash, hash, 32);
+	memcpy(txn->txid, txid, 32);
+	txn->len = len / 2;
+	txn->data = ckalloc(txn->len);
+	if (unlikely(!hex2bin(txn->data, data, txn->len))) {
+		free(txn->data);
+		free(txn);
+		return NULL;
+	}
+	return txn;
+}
+
+/* Reference a template transaction we already know about, refreshing its
+ * expiry, or decode it into the list of new transactions. */
+static txntable_t *add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns,
+			   const gbttxn_t *gtxn, const int pos)
 {
-	bool found = false;
 	txntable_t *txn;
 
-	/* Look for transactions we already know about and increment their
-	 * refcount if we're still using them. */
 	ck_rlock(&sdata->workbase_lock);
-	HASH_FIND_STR(sdata->txns, hash, txn);
+	HASH_FIND(hh, sdata->txns, gtxn->hash, 32, txn);
 	if (txn) {
-		if (ckp->node)
-			txn->refcount = 100;
-		else
-			txn->refcount = 20;
-		found = true;
+		txn->refcount = txn_refcount(ckp);
+		__sync_add_and_fetch(&txn->refs, 1);
 	}
 	ck_runlock(&sdata->workbase_lock);
 
-	if (found)
-		return;
+	if (txn)
+		return txn;
 
-	txn = ckzalloc(sizeof(txntable_t));
-	memcpy(txn->hash, hash, 65);
-	txn->data = strdup(data);
-	if (ckp->node)
-		txn->refcount = 100;
-	else
-		txn->refcount = 20;
-	HASH_ADD_STR(*txns, hash, txn);
+	txn = new_txn(gtxn->hash, gtxn->txid, gtxn->data, gtxn->len);
+	if (unlikely(!txn)) {
+		LOGERR("Failed to hex2bin transaction data in add_txn");
+		return NULL;
+	}
+	txn->id = pos;
+	txn->refcount = txn_refcount(ckp);
+	txn->refs = 1;
+	HASH_ADD(hh, *txns, hash, 32, txn);
+	return txn;
 }
 
 static void send_node_transactions(sdata_t *sdata, const json_t *txn_val)
@@ -1205,90 +1842,61 @@ static void send_node_transactions(sdata_t *sdata, const json_t *txn_val)
 	}
 }
 
-/* Distill down a set of transactions into an efficient tree arrangement for
- * stratum messages and fast work assembly. */
-static void wb_merkle_bins(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, json_t *txn_array)
+/* Hex varint of a block's transaction count */
+static void txn_varint(char *varint, const int txns)
 {
-	int i, j, binleft, binlen, added = 0, purged = 0;
-	txntable_t *txns = NULL, *tmp, *tmpa;
-	json_t *arr_val, *val;
-	uchar *hashbin;
+	if (txns < 0xfd) {
+		uint8_t val8 = txns;
 
-	wb->txns = json_array_size(txn_array);
-	wb->merkles = 0;
-	binlen = wb->txns * 32 + 32;
-	hashbin = alloca(binlen + 32);
-	memset(hashbin, 0, 32);
-	binleft = binlen / 32;
-	if (wb->txns) {
-		int len = 1, ofs = 0;
-		const char *txn;
+		__bin2hex(varint, (const unsigned char *)&val8, 1);
+	} else if (txns <= 0xffff) {
+		uint16_t val16 = htole16(txns);
 
-		for (i = 0; i < wb->txns; i++) {
-			arr_val = json_array_get(txn_array, i);
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			if (!txn) {
-				LOGWARNING("json_string_value fail - cannot find transaction data");
-				return;
-			}
-			len += strlen(txn);
-		}
+		strcpy(varint, "fd");
+		__bin2hex(varint + 2, (const unsigned char *)&val16, 2);
+	} else {
+		uint32_t val32 = htole32(txns);
+
+		strcpy(varint, "fe");
+		__bin2hex(varint + 2, (const unsigned char *)&val32, 4);
+	}
+}
 
-		wb->txn_data = ckzalloc(len + 1);
-		wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
-		memset(wb->txn_hashes, 0x20, wb->txns * 65); // Spaces
+/* Serialise the workbase's transactions once for any block solved from it */
+static void wb_blocktail(workbase_t *wb)
+{
+	blocktail_t *tail = ckzalloc(sizeof(blocktail_t));
+	int i, ofs = 0;
 
+	tail->refcount = 1;
+	tail->txns = wb->txns + 1;
+	txn_varint(tail->varint, tail->txns);
+	if (wb->txn) {
+		for (i = 0; i < wb->txns; i++)
+			tail->hexlen += wb->txn[i]->len * 2;
+		tail->hex = ckalloc(tail->hexlen + 1);
 		for (i = 0; i < wb->txns; i++) {
-			const char *txid, *hash;
-			char binswap[32];
-
-			arr_val = json_array_get(txn_array, i);
-
-			// Post-segwit, txid returns the tx hash without witness data
-			txid = json_string_value(json_object_get(arr_val, "txid"));
-			hash = json_string_value(json_object_get(arr_val, "hash"));
-			if (!txid)
-				txid = hash;
-			if (unlikely(!txid)) {
-				LOGERR("Missing txid for transaction in wb_merkle_bins");
-				return;
-			}
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			add_txn(ckp, sdata, &txns, hash, txn);
-			len = strlen(txn);
-			memcpy(wb->txn_data + ofs, txn, len);
-			ofs += len;
-			if (!hex2bin(binswap, txid, 32)) {
-				LOGERR("Failed to hex2bin hash in gbt_merkle_bins");
-				return;
-			}
-			memcpy(wb->txn_hashes + i * 65, txid, 64);
-			bswap_256(hashbin + 32 + 32 * i, binswap);
+			__bin2hex(tail->hex + ofs, wb->txn[i]->data, wb->txn[i]->len);
+			ofs += wb->txn[i]->len * 2;
 		}
+		tail->hex[ofs] = '\0';
+	} else if (wb->txn_data) {
+		/* Old format remote workbases have the transactions in hex */
+		tail->hex = wb->txn_data;
+		tail->hexlen = strlen(tail->hex);
+		wb->txn_data = NULL;
 	} else
-		wb->txn_hashes = ckzalloc(1);
-	wb->merkle_array = json_array();
-	if (binleft > 1) {
-		while (42) {
-			if (binleft == 1)
-				break;
-			memcpy(&wb->merklebin[wb->merkles][0], hashbin + 32, 32);
-			__bin2hex(&wb->merklehash[wb->merkles][0], &wb->merklebin[wb->merkles][0], 32);
-			json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[wb->merkles][0]));
-			LOGDEBUG("MerkleHash %d %s",wb->merkles, &wb->merklehash[wb->merkles][0]);
-			wb->merkles++;
-			if (binleft % 2) {
-				memcpy(hashbin + binlen, hashbin + binlen - 32, 32);
-				binlen += 32;
-				binleft++;
-			}
-			for (i = 32, j = 64; j < binlen; i += 32, j += 64)
-				gen_hash(hashbin + j, hashbin + i, 64);
-			binleft /= 2;
-			binlen = binleft * 32;
-		}
-	}
-	LOGNOTICE("Stored %d transactions", wb->txns);
+		tail->hex = ckzalloc(1);
+	wb->tail = tail;
+}
+
+/* Expire transactions no longer used by any workbase and move any new ones
+ * into the transaction table, propagating them to nodes. */
+static void update_txns(sdata_t *sdata, workbase_t *wb, txntable_t *txns)
+{
+	txntable_t *tmp, *tmpa, *txn;
+	int added = 0, purged = 0;
+	json_t *txn_array, *val;
 
 	txn_array = json_array();
 
@@ -1296,7 +1904,7 @@ static void wb_merkle_bins(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, json_t
 	 * and remove them. */
 	ck_wlock(&sdata->workbase_lock);
 	HASH_ITER(hh, sdata->txns, tmp, tmpa) {
-		if (tmp->refcount-- > 0)
+		if (tmp->refcount-- > 0 || tmp->refs)
 			continue;
 		HASH_DEL(sdata->txns, tmp);
 		dealloc(tmp->data);
@@ -1306,55 +1914,191 @@ static void wb_merkle_bins(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, json_t
 	/* Add the new transactions to the transaction table */
 	HASH_ITER(hh, txns, tmp, tmpa) {
 		json_t *txn_val;
+		char hashhex[68];
+		char *data;
 
+		HASH_DEL(txns, tmp);
+		/* Added by a node since we looked for it */
+		HASH_FIND(hh, sdata->txns, tmp->hash, 32, txn);
+		if (unlikely(txn)) {
+			txn->refcount = tmp->refcount;
+			__sync_add_and_fetch(&txn->refs, 1);
+			wb->txn[tmp->id] = txn;
+			dealloc(tmp->data);
+			dealloc(tmp);
+			continue;
+		}
 		/* Propagate transaction here */
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", tmp->hash, "data", tmp->data);
+		txn_hashhex(tmp, hashhex);
+		data = bin2hex(tmp->data, tmp->len);
+		JSON_CPACK(txn_val, "{ss,ss}", "hash", hashhex, "data", data);
+		free(data);
 		json_array_append_new(txn_array, txn_val);
 		/* Move to the sdata transaction table */
-		HASH_DEL(txns, tmp);
-		HASH_ADD_STR(sdata->txns, hash, tmp);
+		HASH_ADD(hh, sdata->txns, hash, 32, tmp);
 		added++;
 	}
 	ck_wunlock(&sdata->workbase_lock);
 
-	JSON_CPACK(val, "{so}", "transaction", txn_array);
-	send_node_transactions(sdata, val);
-	json_decref(val);
+	if (added) {
+		JSON_CPACK(val, "{so}", "transaction", txn_array);
+		send_node_transactions(sdata, val);
+		json_decref(val);
+	} else
+		json_decref(txn_array);
 
 	if (added || purged)
 		LOGINFO("Stratifier added %d transactions and purged %d", added, purged);
 }
 
+/* Offsets of each level of a merkle tree with this many leaves, levels with
+ * an odd count having room to duplicate their last node */
+static int merkle_levels(int leaves, int *ofs)
+{
+	int levels = 0, total = 0;
+
+	while (leaves > 1) {
+		ofs[levels++] = total;
+		total += leaves + (leaves % 2);
+		leaves = (leaves + 1) / 2;
+	}
+	ofs[levels] = total;
+	return levels;
+}
+
+/* Build the merkle tree of the workbase's txids with a placeholder for the
+ * coinbase as the first leaf, storing the branch of hashes needed to find the
+ * merkle root from the coinbase. Nodes covering only leading transactions
+ * unchanged since the last tree built are reused instead of rehashed. */
+static void wb_merkle_tree(sdata_t *sdata, workbase_t *wb)
+{
+	int ofs[34], oldofs[34], i, k, level, levels, oldlevels, leaves, same;
+	int reused = 0, hashed = 0;
+	uchar *tree, *old;
+
+	leaves = wb->txns + 1;
+	levels = merkle_levels(leaves, ofs);
+	wb->merkles = levels;
+	wb->merklehash = ckalloc(sizeof(*wb->merklehash) * (levels + 1));
+	wb->merklebin = ckalloc(sizeof(*wb->merklebin) * (levels + 1));
+	wb->merkle_array = json_array();
+	if (!levels)
+		return;
+
+	tree = ckzalloc(ofs[levels] * 32);
+	mutex_lock(&sdata->merkle_lock);
+	old = sdata->merkle_tree;
+	oldlevels = merkle_levels(sdata->merkle_leaves, oldofs);
+
+	/* Leaves, counting how many lead the same as the last tree */
+	same = old ? 1 : 0;
+	for (i = 1; i < leaves; i++) {
+		uchar *leaf = tree + 32 * i;
+
+		memcpy(leaf, wb->txn[i - 1]->txid, 32);
+		if (same == i && i < sdata->merkle_leaves && !memcmp(leaf, old + 32 * i, 32))
+			same++;
+	}
+
+	for (level = 0; level < levels; level++) {
+		uchar *nodes = tree + ofs[level] * 32, *next = tree + ofs[level + 1] * 32;
+
+		memcpy(&wb->merklebin[level][0], nodes + 32, 32);
+		__bin2hex(&wb->merklehash[level][0], &wb->merklebin[level][0], 32);
+		json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[level][0]));
+		if (level + 1 == levels)
+			break;
+
+		if (leaves % 2) {
+			memcpy(nodes + 32 * leaves, nodes + 32 * (leaves - 1), 32);
+			leaves++;
+		}
+		leaves /= 2;
+		/* Nodes made only of unchanged nodes are unchanged themselves */
+		same /= 2;
+		if (level + 1 >= oldlevels)
+			same = 0;
+		/* Node 0 is on the coinbase's path and never needed */
+		for (k = 1; k < leaves; k++) {
+			if (k < same) {
+				memcpy(next + 32 * k, old + (oldofs[level + 1] + k) * 32, 32);
+				reused++;
+			} else {
+				gen_hash(nodes + 64 * k, next + 32 * k, 64);
+				hashed++;
+			}
+		}
+	}
+	free(old);
+	sdata->merkle_tree = tree;
+	sdata->merkle_leaves = wb->txns + 1;
+	mutex_unlock(&sdata->merkle_lock);
+
+	LOGDEBUG("Merkle tree of %d transactions hashed %d nodes and reused %d",
+		 wb->txns, hashed, reused);
+}
+
+/* Distill down the workbase's referenced transactions into an efficient tree
+ * arrangement for stratum messages and fast work assembly. */
+static void wb_merkle_bins(sdata_t *sdata, workbase_t *wb)
+{
+	int i;
+
+	wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
+	memset(wb->txn_hashes, 0x20, wb->txns * 65); // Spaces
+	for (i = 0; i < wb->txns; i++) {
+		uchar binswap[32];
+
+		bswap_256(binswap, wb->txn[i]->txid);
+		__bin2hex(wb->txn_hashes + i * 65, binswap, 32);
+		wb->txn_hashes[i * 65 + 64] = 0x20;
+	}
+	wb->txn_hashes[wb->txns * 65] = '\0';
+	wb_merkle_tree(sdata, wb);
+	wb_blocktail(wb);
+	LOGNOTICE("Stored %d transactions", wb->txns);
+}
+
+/* Reference the template's transactions in the workbase, only decoding those
+ * not already in the transaction table. */
+static bool wb_template_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb,
+			     const gbttemplate_t *tmpl)
+{
+	txntable_t *txns = NULL;
+	int i;
+
+	wb->txns = tmpl->txns;
+	wb->txn = ckalloc(sizeof(txntable_t *) * (wb->txns + 1));
+	for (i = 0; i < wb->txns; i++) {
+		wb->txn[i] = add_txn(ckp, sdata, &txns, &tmpl->txn[i], i);
+		if (unlikely(!wb->txn[i])) {
+			wb->txns = i;
+			break;
+		}
+	}
+	update_txns(sdata, wb, txns);
+	if (unlikely(wb->txns != tmpl->txns))
+		return false;
+	wb_merkle_bins(sdata, wb);
+	return true;
+}
+
 static const unsigned char witness_nonce[32] = {0};
 static const int witness_nonce_size = sizeof(witness_nonce);
 static const unsigned char witness_header[] = {0xaa, 0x21, 0xa9, 0xed};
+static const int witness_header_size = sizeof(witness_header);
 
-static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
+static void gbt_witness_data(workbase_t *wb, const gbttxn_t *txn, int txncount)
 {
-	int i, binlen, txncount = json_array_size(txn_array);
-	const char* hash;
-	json_t *arr_val;
+	int i, binlen;
 	uchar *hashbin;
 
 	binlen = txncount * 32 + 32;
 	hashbin = alloca(binlen + 32);
 	memset(hashbin, 0, 32);
 
-	for (i = 0; i < txncount; i++) {
-		char binswap[32];
-
-		arr_val = json_array_get(txn_array, i);
-		hash = json_string_value(json_object_get(arr_val, "hash"));
-		if (unlikely(!hash)) {
-			LOGERR("Hash missing for transaction");
-			return;
-		}
-		if (!hex2bin(binswap, hash, 32)) {
-			LOGERR("Failed to hex2bin hash in gbt_witness_data");
-			return;
-		}
-		bswap_256(hashbin + 32 + 32 * i, binswap);
-	}
+	for (i = 0; i < txncount; i++)
+		memcpy(hashbin + 32 + 32 * i, txn[i].hash, 32);
 
 	// Build merkle root (copied from libblkmaker)
 	for (txncount++ ; txncount > 1 ; txncount /= 2) {
@@ -1371,27 +2115,105 @@ static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
 
 	memcpy(hashbin + 32, &witness_nonce, witness_nonce_size);
 	gen_hash(hashbin, hashbin + witness_nonce_size, 32 + witness_nonce_size);
-	memcpy(hashbin, witness_header, witness_nonce_size);
-	__bin2hex(wb->witnessdata, hashbin, 32 + witness_nonce_size);
+	memcpy(hashbin + witness_nonce_size - witness_header_size, witness_header, witness_header_size);
+	__bin2hex(wb->witnessdata, hashbin + witness_nonce_size - witness_header_size, 32 + witness_header_size);
 	wb->insert_witness = true;
 }
 
-/* This function assumes it will only receive a valid json gbt base template
- * since checking should have been done earlier, and creates the base template
+/* Turn a gbt base sent as a string by the generator back into a template,
+ * taking ownership of val. */
+static gbttemplate_t *json_gbttemplate(json_t *val)
+{
+	gbttemplate_t *tmpl = ckzalloc(sizeof(gbttemplate_t));
+	gbtbase_t *gbt = &tmpl->base;
+	json_t *rules_array;
+	int i;
+
+	tmpl->refcount = 1;
+	tmpl->json = val;
+	json_strcpy(gbt->target, val, "target");
+	json_dblcpy(&gbt->diff, val, "diff");
+	json_uintcpy(&gbt->version, val, "version");
+	json_uintcpy(&gbt->curtime, val, "curtime");
+	json_strcpy(gbt->prevhash, val, "prevhash");
+	json_strcpy(gbt->ntime, val, "ntime");
+	json_strcpy(gbt->bbversion, val, "bbversion");
+	json_strcpy(gbt->nbit, val, "nbit");
+	json_uint64cpy(&gbt->coinbasevalue, val, "coinbasevalue");
+	json_intcpy(&gbt->height, val, "height");
+	json_strdup(&gbt->flags, val, "flags");
+	if (!gbttemplate_txns(tmpl, json_object_get(val, "transactions"))) {
+		gbttemplate_put(tmpl);
+		return NULL;
+	}
+	rules_array = json_object_get(val, "rules");
+	for (i = 0; i < (int)json_array_size(rules_array); i++) {
+		const char *rule = json_string_value(json_array_get(rules_array, i));
+
+		if (rule && *rule == '!')
+			rule++;
+		if (rule && !safecmp(rule, "segwit"))
+			tmpl->segwit = true;
+	}
+	tmpl->witness_commitment = json_string_value(json_object_get(val, "default_witness_commitment"));
+	if (!tmpl->witness_commitment)
+		tmpl->witness_commitment = "";
+	return tmpl;
+}
+
+/* Get a block template, straight from bitcoind in process when the generator
+ * allows it, otherwise as a string from the generator. */
+static gbttemplate_t *get_gbttemplate(ckpool_t *ckp, const int prio, bool *failed)
+{
+	gbttemplate_t *tmpl = NULL;
+	json_t *val;
+	char *buf;
+
+	*failed = false;
+	if (generator_templates(ckp)) {
+		tmpl = generator_gettemplate(ckp);
+		*failed = !tmpl;
+		return tmpl;
+	}
+
+	buf = send_recv_generator(ckp, "getbase", prio);
+	if (unlikely(!buf)) {
+		LOGNOTICE("Get base in update_base delayed due to higher priority request");
+		return NULL;
+	}
+	if (unlikely(cmdmatch(buf, "failed"))) {
+		*failed = true;
+		goto out;
+	}
+	val = json_loads(buf, 0, NULL);
+	if (unlikely(!val)) {
+		LOGWARNING("Failed to decode generator base %s", buf);
+		*failed = true;
+		goto out;
+	}
+	tmpl = json_gbttemplate(val);
+	*failed = !tmpl;
+out:
+	free(buf);
+	return tmpl;
+}
+
+/* This function assumes it will only receive a valid gbt template since
+ * checking should have been done earlier, and creates the base template
  * for generating work templates. */
 static void *do_update(void *arg)
 {
 	struct update_req *ur = (struct update_req *)arg;
-	json_t *val, *txn_array, *rules_array;
-	const char* witnessdata_check, *rule;
-	int i, prio = ur->prio, retries = 0;
+	int prio = ur->prio, retries = 0;
 	ckpool_t *ckp = ur->ckp;
 	sdata_t *sdata = ckp->sdata;
+	gbttemplate_t *tmpl;
 	bool new_block = false;
 	bool ret = false;
+	bool failed;
 	workbase_t *wb;
+	gbtbase_t *gbt;
 	time_t now_t;
-	char *buf;
 
 	pthread_detach(pthread_self());
 	rename_proc("updater");
@@ -1407,12 +2229,13 @@ static void *do_update(void *arg)
 	} else
 		cksem_wait(&sdata->update_sem);
 retry:
-	buf = send_recv_generator(ckp, "getbase", prio);
-	if (unlikely(!buf)) {
-		LOGNOTICE("Get base in update_base delayed due to higher priority request");
-		goto out;
-	}
-	if (unlikely(cmdmatch(buf, "failed"))) {
+	if (ur->tmpl) {
+		tmpl = ur->tmpl;
+		ur->tmpl = NULL;
+		failed = false;
+	} else
+		tmpl = get_gbttemplate(ckp, prio, &failed);
+	if (unlikely(failed)) {
 		if (retries++ < 5 || prio == GEN_PRIORITY) {
 			LOGWARNING("Generator returned failure in update_base, retry #%d", retries);
 			goto retry;
@@ -1420,56 +2243,55 @@ retry:
 		LOGWARNING("Generator failed in update_base after retrying");
 		goto out;
 	}
+	if (unlikely(!tmpl))
+		goto out;
 	if (unlikely(retries))
 		LOGWARNING("Generator succeeded in update_base after retrying");
 
 	wb = ckzalloc(sizeof(workbase_t));
 	wb->ckp = ckp;
-	val = json_loads(buf, 0, NULL);
-
-	json_strcpy(wb->target, val, "target");
-	json_dblcpy(&wb->diff, val, "diff");
-	json_uintcpy(&wb->version, val, "version");
-	json_uintcpy(&wb->curtime, val, "curtime");
-	json_strcpy(wb->prevhash, val, "prevhash");
-	json_strcpy(wb->ntime, val, "ntime");
+	gbt = &tmpl->base;
+
+	strcpy(wb->target, gbt->target);
+	wb->diff = gbt->diff;
+	wb->version = gbt->version;
+	wb->curtime = gbt->curtime;
+	strcpy(wb->prevhash, gbt->prevhash);
+	strcpy(wb->ntime, gbt->ntime);
 	sscanf(wb->ntime, "%x", &wb->ntime32);
-	json_strcpy(wb->bbversion, val, "bbversion");
-	json_strcpy(wb->nbit, val, "nbit");
-	json_uint64cpy(&wb->coinbasevalue, val, "coinbasevalue");
-	json_intcpy(&wb->height, val, "height");
-	json_strdup(&wb->flags, val, "flags");
-	txn_array = json_object_get(val, "transactions");
-	wb_merkle_bins(ckp, sdata, wb, txn_array);
+	strcpy(wb->bbversion, gbt->bbversion);
+	strcpy(wb->nbit, gbt->nbit);
+	wb->coinbasevalue = gbt->coinbasevalue;
+	if (tmpl->fees >= 0 && (uint64_t)tmpl->fees <= wb->coinbasevalue)
+		wb->subsidy = wb->coinbasevalue - tmpl->fees;
+	wb->height = gbt->height;
+	wb->flags = strdup(gbt->flags ? gbt->flags : "");
+	if (unlikely(!wb_template_txns(ckp, sdata, wb, tmpl))) {
+		LOGWARNING("Failed to add template transactions in update_base");
+		clear_workbase(wb);
+		gbttemplate_put(tmpl);
+		goto out;
+	}
 
 	wb->insert_witness = false;
 	memset(wb->witnessdata, 0, sizeof(wb->witnessdata));
-	rules_array = json_object_get(val, "rules");
-
-	if (rules_array) {
-		int rule_count = json_array_size(rules_array);
+	if (tmpl->segwit) {
+		const char *witnessdata_check = tmpl->witness_commitment;
 
-		for (i = 0; i < rule_count; i++) {
-			rule = json_string_value(json_array_get(rules_array, i));
-			if (!rule)
-				continue;
-			if (*rule == '!')
-				rule++;
-			if (safecmp(rule, "segwit")) {
-				witnessdata_check = json_string_value(json_object_get(val, "default_witness_commitment"));
-				gbt_witness_data(wb, txn_array);
-				// Verify against the pre-calculated value if it exists. Skip the size/OP_RETURN bytes.
-				if (wb->insert_witness && witnessdata_check[0] && safecmp(witnessdata_check + 4, wb->witnessdata) != 0)
-					LOGERR("Witness from btcd: %s. Calculated Witness: %s", witnessdata_check + 4, wb->witnessdata);
-				break;
-			}
-		}
+		gbt_witness_data(wb, tmpl->txn, tmpl->txns);
+		// Verify against the pre-calculated value if it exists. Skip the size/OP_RETURN bytes.
+		if (wb->insert_witness && witnessdata_check[0] && safecmp(witnessdata_check + 4, wb->witnessdata) != 0)
+			LOGERR("Witness from btcd: %s. Calculated Witness: %s", witnessdata_check + 4, wb->witnessdata);
 	}
 
-	json_decref(val);
+	gbttemplate_put(tmpl);
 	generate_coinbase(ckp, wb);
 
-	add_base(ckp, sdata, wb, &new_block);
+	if (unlikely(!add_base(ckp, sdata, wb, &new_block))) {
+		clear_workbase(wb);
+		ret = true;
+		goto out;
+	}
 	/* Reset the update time to avoid stacked low priority notifies. Bring
 	 * forward the next notify in case of a new block. */
 	now_t = time(NULL);
@@ -1491,17 +2313,17 @@ out:
 		LOGINFO("Broadcast ping due to failed stratum base update");
 		broadcast_ping(sdata);
 	}
-	dealloc(buf);
 out_free:
+	if (ur->tmpl)
+		gbttemplate_put(ur->tmpl);
 	free(ur->pth);
 	free(ur);
 	return NULL;
 }
 
-static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, json_t *txnhashes)
+static bool rebuild_txns(sdata_t *sdata, workbase_t *wb, json_t *txnhashes)
 {
 	const char *hashes = json_string_value(txnhashes);
-	json_t *txn_array;
 	txntable_t *txn;
 	bool ret = true;
 	int i, len;
@@ -1517,34 +2339,30 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, json_t *
 		LOGERR("Truncated transactions in rebuild_txns only %d long", len);
 		return false;
 	}
-	txn_array = json_array();
+	wb->txn = ckalloc(sizeof(txntable_t *) * (wb->txns + 1));
 
 	ck_rlock(&sdata->workbase_lock);
 	for (i = 0; i < wb->txns; i++) {
-		json_t *txn_val;
-		char hash[68];
-
-		memcpy(hash, hashes + i * 65, 64);
-		hash[64] = '\0';
-		HASH_FIND_STR(sdata->txns, hash, txn);
+		txn = __find_txn(sdata, hashes + i * 65);
 		if (unlikely(!txn)) {
 			LOGNOTICE("Failed to find txn in rebuild_txns");
 			ret = false;
-			goto out_unlock;
+			break;
 		}
 		txn->refcount = 100;
-		JSON_CPACK(txn_val, "{ss,ss}",
-			   "hash", hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
+		__sync_add_and_fetch(&txn->refs, 1);
+		wb->txn[i] = txn;
 	}
-out_unlock:
 	ck_runlock(&sdata->workbase_lock);
 
-	if (ret) {
-		LOGINFO("Rebuilt txns into workbase with %d transactions", (int)i);
-		wb_merkle_bins(ckp, sdata, wb, txn_array);
+	if (!ret) {
+		/* Only release the transactions referenced */
+		wb->txns = i;
+		return ret;
 	}
-	json_decref(txn_array);
+	LOGINFO("Rebuilt txns into workbase with %d transactions", (int)i);
+	update_txns(sdata, wb, NULL);
+	wb_merkle_bins(sdata, wb);
 
 	return ret;
 }
@@ -1579,19 +2397,22 @@ static void add_node_base(ckpool_t *ckp, json_t *val)
 		json_strdup(&wb->txn_data, val, "txn_data");
 		json_intcpy(&wb->merkles, val, "merkles");
 		wb->merkle_array = json_object_dup(val, "merklehash");
+		wb->merklehash = ckalloc(sizeof(*wb->merklehash) * (wb->merkles + 1));
+		wb->merklebin = ckalloc(sizeof(*wb->merklebin) * (wb->merkles + 1));
 		for (i = 0; i < wb->merkles; i++) {
 			strcpy(&wb->merklehash[i][0], json_string_value(json_array_get(wb->merkle_array, i)));
 			hex2bin(&wb->merklebin[i][0], &wb->merklehash[i][0], 32);
 		}
+		wb_blocktail(wb);
 	} else {
 		json_intcpy(&wb->txns, val, "txns");
 		txnhashes = json_object_get(val, "txn_hashes");
-		if (!rebuild_txns(ckp, sdata, wb, txnhashes)) {
+		if (!rebuild_txns(sdata, wb, txnhashes)) {
 			if (!sdata->wbincomplete) {
 				sdata->wbincomplete = true;
 				LOGWARNING("Unable to rebuild transactions to create workinfo, ignore displayed hashrate");
 			}
-			free(wb);
+			clear_workbase(wb);
 			return;
 		}
 		if (sdata->wbincomplete) {
@@ -1620,38 +2441,41 @@ static void add_node_base(ckpool_t *ckp, json_t *val)
 	LOGDEBUG("Header: %s", header);
 	hex2bin(wb->headerbin, header, 112);
 
-	add_base(ckp, sdata, wb, &new_block);
+	if (unlikely(!add_base(ckp, sdata, wb, &new_block))) {
+		clear_workbase(wb);
+		return;
+	}
 	if (new_block)
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
 }
 
-/* Calculate share diff and fill in hash and swap */
-static double
-share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
-	   const uint32_t ntime32, const char *nonce, uchar *hash, uchar *swap, int *cblen)
+/* Build the coinbase of a share into coinbase, returning its length */
+static int share_coinbase(char *coinbase, const uchar *enonce1bin, const workbase_t *wb,
+			  const char *nonce2)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32, benonce32;
-	uchar hash1[32];
-	char data[80];
-	int i;
+	int cblen;
 
 	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
-	*cblen = wb->coinb1len;
-	memcpy(coinbase + *cblen, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
-	*cblen += wb->enonce1constlen + wb->enonce1varlen;
-	hex2bin(coinbase + *cblen, nonce2, wb->enonce2varlen);
-	*cblen += wb->enonce2varlen;
-	memcpy(coinbase + *cblen, wb->coinb2bin, wb->coinb2len);
-	*cblen += wb->coinb2len;
+	cblen = wb->coinb1len;
+	memcpy(coinbase + cblen, enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
+	cblen += wb->enonce1constlen + wb->enonce1varlen;
+	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
+	cblen += wb->enonce2varlen;
+	memcpy(coinbase + cblen, wb->coinb2bin, wb->coinb2len);
+	cblen += wb->coinb2len;
+
+	return cblen;
+}
+
+/* Fill in swap with the byte swapped header of a share given the first 32
+ * bytes of merkle_sha as its final merkle root hash */
+static void share_header(const workbase_t *wb, uchar *merkle_sha, const uint32_t ntime32,
+			 const char *nonce, uchar *swap)
+{
+	uint32_t *data32, *swap32, benonce32;
+	uchar merkle_root[32];
+	char data[80];
 
-	gen_hash((uchar *)coinbase, merkle_root, *cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
 	data32 = (uint32_t *)merkle_sha;
 	swap32 = (uint32_t *)merkle_root;
 	flip_32(swap32, data32);
@@ -1669,10 +2493,32 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	data32 = (uint32_t *)(data + 68);
 	*data32 = htobe32(ntime32);
 
-	/* Hash the share */
 	data32 = (uint32_t *)data;
 	swap32 = (uint32_t *)swap;
 	flip_80(swap32, data32);
+}
+
+/* Calculate share diff and fill in hash and swap */
+static double
+share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
+	   const uint32_t ntime32, const char *nonce, uchar *hash, uchar *swap, int *cblen)
+{
+	unsigned char merkle_root[32], merkle_sha[64];
+	uchar hash1[32];
+	int i;
+
+	*cblen = share_coinbase(coinbase, enonce1bin, wb, nonce2);
+
+	gen_hash((uchar *)coinbase, merkle_root, *cblen);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < wb->merkles; i++) {
+		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+	share_header(wb, merkle_sha, ntime32, nonce, swap);
+
+	/* Hash the share */
 	sha256(swap, 80, hash1);
 	sha256(hash1, 32, hash);
 
@@ -1791,40 +2637,56 @@ static void downstream_blocksubmits(ckpool_t *ckp, const char *gbt_block, const
 
 static void
 process_block(ckpool_t *ckp, const workbase_t *wb, const char *coinbase, const int cblen,
-	      const uchar *data, const uchar *hash, uchar *swap32, char *blockhash)
+	      const uchar *data, const uchar *hash, uchar *swap32, char *blockhash,
+	      const ts_t *received)
 {
-	int txns = wb->txns + 1;
-	char *gbt_block, varint[12];
-	char hexcoinbase[1024];
+	sdata_t *sdata = ckp->sdata;
+	char *head, *gbt_block;
+	char varint[12];
+	double elapsed;
+	ts_t now;
+	int ofs;
 
-	gbt_block = ckalloc(1024);
 	flip_32(swap32, hash);
 	__bin2hex(blockhash, swap32, 32);
 
-	/* Message format: "submitblock:hash,data" */
-	sprintf(gbt_block, "submitblock:%s,", blockhash);
-	__bin2hex(gbt_block + 12 + 64 + 1, data, 80);
-	if (txns < 0xfd) {
-		uint8_t val8 = txns;
-
-		__bin2hex(varint, (const unsigned char *)&val8, 1);
-	} else if (txns <= 0xffff) {
-		uint16_t val16 = htole16(txns);
+	/* The block ahead of the workbase's transactions */
+	head = ckalloc(160 + sizeof(varint) + cblen * 2 + 1);
+	__bin2hex(head, data, 80);
+	if (wb->tail)
+		strcpy(varint, wb->tail->varint);
+	else
+		txn_varint(varint, wb->txns + 1);
+	strcpy(head + 160, varint);
+	ofs = 160 + strlen(varint);
+	__bin2hex(head + ofs, coinbase, cblen);
+	if (wb->tail)
+		generator_submitblocktail(ckp, blockhash, head, wb->tail);
 
-		strcat(gbt_block, "fd");
-		__bin2hex(varint, (const unsigned char *)&val16, 2);
-	} else {
-		uint32_t val32 = htole32(txns);
+	ts_realtime(&now);
+	elapsed = (double)(now.tv_sec - received->tv_sec) +
+		  (double)(now.tv_nsec - received->tv_nsec) / 1000000000;
+	mutex_lock(&sdata->block_lock);
+	sdata->blocks_dispatched++;
+	sdata->dispatch_last = elapsed;
+	sdata->dispatch_total += elapsed;
+	if (elapsed > sdata->dispatch_max)
+		sdata->dispatch_max = elapsed;
+	mutex_unlock(&sdata->block_lock);
+	LOGWARNING("Block %s dispatched %.6fs after receiving its share", blockhash, elapsed);
 
-		strcat(gbt_block, "fe");
-		__bin2hex(varint, (const unsigned char *)&val32, 4);
+	/* Only assemble the whole block as a message if something needs it */
+	if (wb->tail && !ckp->remote && !sdata->remote_instances) {
+		free(head);
+		return;
 	}
-	strcat(gbt_block, varint);
-	__bin2hex(hexcoinbase, coinbase, cblen);
-	strcat(gbt_block, hexcoinbase);
-	if (wb->txns)
-		realloc_strcat(&gbt_block, wb->txn_data);
-	send_generator(ckp, gbt_block, GEN_PRIORITY);
+
+	/* Message format: "submitblock:hash,data" */
+	ASPRINTF(&gbt_block, "submitblock:%s,%s%s", blockhash, head,
+		 wb->tail ? wb->tail->hex : "");
+	free(head);
+	if (!wb->tail)
+		generator_submitblock(ckp, gbt_block);
 	if (ckp->remote)
 		upstream_blocksubmit(ckp, gbt_block);
 	else
@@ -1888,7 +2750,7 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 
 	/* Fill in the hashes */
 	share_diff(coinbase, enonce1bin, wb, nonce2, ntime32, nonce, hash, swap, &cblen);
-	process_block(ckp, wb, coinbase, cblen, swap, hash, swap32, blockhash);
+	process_block(ckp, wb, coinbase, cblen, swap, hash, swap32, blockhash, &ts_now);
 
 	JSON_CPACK(bval, "{si,ss,ss,sI,ss,ss,ss,sI,sf,ss,ss,ss,ss}",
 			 "height", wb->height,
@@ -1927,9 +2789,123 @@ out:
 	free(enonce1);
 }
 
+/* Minimum difficulty bits, which testnet's special rule allows blocks to use
+ * so the bits of the block after them can't be predicted */
+#define POW_LIMIT_BITS "1d00ffff"
+
+/* Send miners coinbase only work on a new block as soon as its hash is known,
+ * based on the last template, until the full template arrives. The new block
+ * is looked up first to confirm it directly follows the last template's, and
+ * no empty job is sent unless its height, bits and subsidy can be carried
+ * over. */
+static void empty_base(ckpool_t *ckp, const char *swaphash)
+{
+	char bin[32], swap[32], prevhash[68], parent[68];
+	const char *bits, *prevswap;
+	sdata_t *sdata = ckp->sdata;
+	json_t *header = NULL;
+	bool new_block = false;
+	uint32_t curtime = 0;
+	int64_t blocktime = 0;
+	workbase_t *wb, *last;
+	char *msg, *buf;
+	int height = 0;
+
+	ASPRINTF(&msg, "getheader:%s", swaphash);
+	buf = send_recv_generator(ckp, msg, GEN_PRIORITY);
+	free(msg);
+	if (buf && buf[0] == '{')
+		header = json_loads(buf, 0, NULL);
+	free(buf);
+	if (unlikely(!header)) {
+		LOGINFO("Failed to get block header, not sending an empty job");
+		return;
+	}
+	json_get_int(&height, header, "height");
+	json_get_int64(&blocktime, header, "time");
+	bits = json_string_value(json_object_get(header, "bits"));
+	prevswap = json_string_value(json_object_get(header, "previousblockhash"));
+	if (unlikely(!bits || !prevswap || strlen(prevswap) != 64 ||
+		     !hex2bin(bin, prevswap, 32))) {
+		LOGINFO("Invalid block header, not sending an empty job");
+		goto out;
+	}
+	if (!strcmp(bits, POW_LIMIT_BITS)) {
+		LOGINFO("Not sending an empty job after a minimum difficulty block");
+		goto out;
+	}
+	swap_256(swap, bin);
+	__bin2hex(parent, swap, 32);
+	hex2bin(bin, swaphash, 32);
+	swap_256(swap, bin);
+	__bin2hex(prevhash, swap, 32);
+
+	wb = ckzalloc(sizeof(workbase_t));
+	wb->ckp = ckp;
+	wb->empty = true;
+
+	/* Only build on the last template if the new block follows it */
+	ck_rlock(&sdata->workbase_lock);
+	last = sdata->current_workbase;
+	if (likely(last && !last->proxy && !strncmp(last->prevhash, parent, 64) &&
+		   last->height == height && !strcmp(last->nbit, bits) && last->subsidy)) {
+		strcpy(wb->target, last->target);
+		wb->diff = last->diff;
+		wb->version = last->version;
+		strcpy(wb->bbversion, last->bbversion);
+		strcpy(wb->nbit, last->nbit);
+		wb->height = height + 1;
+		wb->flags = strdup(last->flags);
+		wb->coinbasevalue = last->subsidy;
+		curtime = last->curtime;
+	}
+	ck_runlock(&sdata->workbase_lock);
+
+	if (unlikely(!wb->height)) {
+		LOGINFO("Block %s does not follow the last template, not sending an empty job",
+			swaphash);
+		goto out_clear;
+	}
+	/* Difficulty may change at a retarget so wait for the template */
+	if (!(wb->height % 2016)) {
+		LOGINFO("Not sending an empty job at retarget height %d", wb->height);
+		goto out_clear;
+	}
+	/* The subsidy halves every 210000 blocks, or every 150 on regtest, so
+	 * it can only be carried over from the last template between them */
+	if (!(wb->height % 150)) {
+		LOGINFO("Not sending an empty job at possible halving height %d", wb->height);
+		goto out_clear;
+	}
+	wb->curtime = MAX((uint32_t)time(NULL), curtime);
+	/* Testnet allows minimum difficulty once 20 minutes pass a block */
+	if (wb->curtime > blocktime + 1200) {
+		LOGINFO("Not sending an empty job 20 minutes after its block's time");
+		goto out_clear;
+	}
+
+	memcpy(wb->prevhash, prevhash, 65);
+	memcpy(wb->parent, parent, 65);
+	snprintf(wb->ntime, 9, "%08x", wb->curtime);
+	wb->ntime32 = wb->curtime;
+	wb_merkle_bins(sdata, wb);
+	generate_coinbase(ckp, wb);
+
+	if (!add_base(ckp, sdata, wb, &new_block))
+		goto out_clear;
+	LOGNOTICE("Block hash changed to %s, sending empty job", swaphash);
+	stratum_broadcast_update(sdata, wb, true);
+	goto out;
+
+out_clear:
+	clear_workbase(wb);
+out:
+	json_decref(header);
+}
+
 static void update_base(ckpool_t *ckp, const int prio)
 {
-	struct update_req *ur = ckalloc(sizeof(struct update_req));
+	struct update_req *ur = ckzalloc(sizeof(struct update_req));
 	pthread_t *pth = ckalloc(sizeof(pthread_t));
 
 	ur->pth = pth;
@@ -1938,8 +2914,37 @@ static void update_base(ckpool_t *ckp, const int prio)
 	create_pthread(pth, do_update, ur);
 }
 
+/* Update the stratum base with a template pushed by the generator as soon as
+ * a longpoll returns it, taking its reference. Templates arriving before the
+ * first update has created a workbase are dropped. */
+void stratifier_template(ckpool_t *ckp, gbttemplate_t *tmpl)
+{
+	sdata_t *sdata = ckp->sdata;
+	struct update_req *ur;
+	bool ready = false;
+	pthread_t *pth;
+
+	if (likely(sdata)) {
+		ck_rlock(&sdata->workbase_lock);
+		ready = !!sdata->current_workbase;
+		ck_runlock(&sdata->workbase_lock);
+	}
+	if (unlikely(!ready)) {
+		gbttemplate_put(tmpl);
+		return;
+	}
+	ur = ckzalloc(sizeof(struct update_req));
+	pth = ckalloc(sizeof(pthread_t));
+	ur->pth = pth;
+	ur->ckp = ckp;
+	ur->prio = GEN_PRIORITY;
+	ur->tmpl = tmpl;
+	create_pthread(pth, do_update, ur);
+}
+
 /* Instead of removing the client instance, we add it to a list of recycled
- * clients allowing us to reuse it instead of callocing a new one */
+ * clients allowing us to reuse it instead of callocing a new one. Enter with
+ * instance_lock held. */
 static void __kill_instance(sdata_t *sdata, stratum_instance_t *client)
 {
 	if (client->proxy) {
@@ -1953,8 +2958,8 @@ static void __kill_instance(sdata_t *sdata, stratum_instance_t *client)
 	DL_APPEND(sdata->recycled_instances, client);
 }
 
-/* Called with instance_lock held. Note stats.users is protected by
- * instance lock to avoid recursive locking. */
+/* Called with user_lock held. Note stats.users is protected by user_lock to
+ * avoid recursive locking. */
 static void __inc_worker(sdata_t *sdata, user_instance_t *user, worker_instance_t *worker)
 {
 	sdata->stats.workers++;
@@ -2002,16 +3007,18 @@ static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *clien
 	sdata->disconnected_generated++;
 }
 
-/* Removes a client instance we know is on the stratum_instances list and from
- * the user client list if it's been placed on it */
-static void __del_client(sdata_t *sdata, stratum_instance_t *client)
+/* Removes a client instance we know is on the shard's list and from the user
+ * client list if it's been placed on it. Enter with the shard lock held. */
+static void __del_client(sdata_t *sdata, instance_shard_t *shard, stratum_instance_t *client)
 {
 	user_instance_t *user = client->user_instance;
 
-	HASH_DEL(sdata->stratum_instances, client);
+	HASH_DEL(shard->instances, client);
 	if (user) {
+		ck_wlock_stat(&sdata->user_lock, &sdata->user_stat);
 		DL_DELETE(user->clients, client);
 		__dec_worker(sdata, user, client->worker_instance);
+		ck_wunlock(&sdata->user_lock);
 	}
 }
 
@@ -2028,22 +3035,30 @@ static void drop_allclients(ckpool_t *ckp)
 {
 	stratum_instance_t *client, *tmp;
 	sdata_t *sdata = ckp->sdata;
-	int kills = 0;
+	int kills = 0, i;
 
-	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		int64_t client_id = client->id;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
 
-		if (!client->ref) {
-			__del_client(sdata, client);
-			__kill_instance(sdata, client);
-		} else
-			client->dropped = true;
-		kills++;
-		connector_drop_client(ckp, client_id);
+		shard_wlock(shard);
+		HASH_ITER(hh, shard->instances, client, tmp) {
+			int64_t client_id = client->id;
+
+			if (!client->ref) {
+				__del_client(sdata, shard, client);
+				ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
+				__kill_instance(sdata, client);
+				ck_wunlock(&sdata->instance_lock);
+			} else
+				client->dropped = true;
+			kills++;
+			connector_drop_client(ckp, client_id);
+		}
+		shard_wunlock(shard);
 	}
+	ck_wlock_stat(&sdata->user_lock, &sdata->user_stat);
 	sdata->stats.users = sdata->stats.workers = 0;
-	ck_wunlock(&sdata->instance_lock);
+	ck_wunlock(&sdata->user_lock);
 
 	if (kills)
 		LOGNOTICE("Dropped %d instances for dropall request", kills);
@@ -2064,12 +3079,14 @@ static sdata_t *duplicate_sdata(const sdata_t *sdata)
 	dsdata->ssends = sdata->ssends;
 	dsdata->srecvs = sdata->srecvs;
 	dsdata->ckdbq = sdata->ckdbq;
-	dsdata->sshareq = sdata->sshareq;
+	dsdata->sshareqs = sdata->sshareqs;
+	dsdata->sshareq_count = sdata->sshareq_count;
 	dsdata->sauthq = sdata->sauthq;
 	dsdata->stxnq = sdata->stxnq;
 
 	/* Give the sbuproxy its own workbase list and lock */
 	cklock_init(&dsdata->workbase_lock);
+	rwlock_init(&dsdata->share_lock);
 	cksem_init(&dsdata->update_sem);
 	cksem_post(&dsdata->update_sem);
 	return dsdata;
@@ -2292,7 +3309,7 @@ static void generator_recruit(const ckpool_t *ckp, const int proxyid, const int
 static void reconnect_clients(sdata_t *sdata)
 {
 	stratum_instance_t *client, *tmpclient;
-	int reconnects = 0;
+	int reconnects = 0, i;
 	int64_t headroom;
 	proxy_t *proxy;
 
@@ -2300,26 +3317,30 @@ static void reconnect_clients(sdata_t *sdata)
 	if (!proxy)
 		return;
 
-	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmpclient) {
-		if (client->dropped)
-			continue;
-		if (!client->authorised)
-			continue;
-		/* Is this client bound to a dead proxy? */
-		if (!client->reconnect) {
-			/* This client is bound to a user proxy */
-			if (client->proxy->userid)
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		HASH_ITER(hh, shard->instances, client, tmpclient) {
+			if (client->dropped)
 				continue;
-			if (client->proxyid == proxy->id)
+			if (!client->authorised)
 				continue;
+			/* Is this client bound to a dead proxy? */
+			if (!client->reconnect) {
+				/* This client is bound to a user proxy */
+				if (client->proxy->userid)
+					continue;
+				if (client->proxyid == proxy->id)
+					continue;
+			}
+			if (headroom-- < 1)
+				continue;
+			reconnects++;
+			reconnect_client(sdata, client);
 		}
-		if (headroom-- < 1)
-			continue;
-		reconnects++;
-		reconnect_client(sdata, client);
+		ck_runlock(&shard->lock);
 	}
-	ck_runlock(&sdata->instance_lock);
 
 	if (reconnects) {
 		LOGINFO("%d clients flagged for reconnect to global proxy %d",
@@ -2374,7 +3395,7 @@ static void check_bestproxy(sdata_t *sdata)
 static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bool replaced, const bool deleted)
 {
 	stratum_instance_t *client, *tmp;
-	int reconnects = 0, proxyid = 0;
+	int reconnects = 0, proxyid = 0, i;
 	int64_t headroom;
 	proxy_t *proxy;
 
@@ -2390,21 +3411,25 @@ static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bo
 	if (proxy)
 		proxyid = proxy->id;
 
-	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		if (client->proxyid != id || client->subproxyid != subid)
-			continue;
-		/* Clients could remain connected to a dead connection here
-		 * but should be picked up when we recruit enough slots after
-		 * another notify. */
-		if (headroom-- < 1) {
-			client->reconnect = true;
-			continue;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		HASH_ITER(hh, shard->instances, client, tmp) {
+			if (client->proxyid != id || client->subproxyid != subid)
+				continue;
+			/* Clients could remain connected to a dead connection
+			 * here but should be picked up when we recruit enough
+			 * slots after another notify. */
+			if (headroom-- < 1) {
+				client->reconnect = true;
+				continue;
+			}
+			reconnects++;
+			reconnect_client(sdata, client);
 		}
-		reconnects++;
-		reconnect_client(sdata, client);
+		ck_runlock(&shard->lock);
 	}
-	ck_runlock(&sdata->instance_lock);
 
 	if (reconnects) {
 		LOGINFO("%d clients flagged to reconnect from dead proxy %d:%d", reconnects,
@@ -2547,25 +3572,29 @@ static void check_userproxies(sdata_t *sdata, const int userid)
 {
 	int64_t headroom = proxy_headroom(sdata, userid);
 	stratum_instance_t *client, *tmpclient;
-	int reconnects = 0;
+	int reconnects = 0, i;
 
-	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmpclient) {
-		if (client->dropped)
-			continue;
-		if (!client->authorised)
-			continue;
-		if (client->user_id != userid)
-			continue;
-		/* Is this client bound to a dead proxy? */
-		if (!client->reconnect && client->proxy->userid == userid)
-			continue;
-		if (headroom-- < 1)
-			continue;
-		reconnects++;
-		reconnect_client(sdata, client);
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		HASH_ITER(hh, shard->instances, client, tmpclient) {
+			if (client->dropped)
+				continue;
+			if (!client->authorised)
+				continue;
+			if (client->user_id != userid)
+				continue;
+			/* Is this client bound to a dead proxy? */
+			if (!client->reconnect && client->proxy->userid == userid)
+				continue;
+			if (headroom-- < 1)
+				continue;
+			reconnects++;
+			reconnect_client(sdata, client);
+		}
+		ck_runlock(&shard->lock);
 	}
-	ck_runlock(&sdata->instance_lock);
 
 	if (reconnects) {
 		LOGINFO("%d clients flagged for reconnect to user %d proxies",
@@ -2636,6 +3665,8 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	hex2bin(wb->coinb2bin, wb->coinb2, wb->coinb2len);
 	wb->merkle_array = json_object_dup(val, "merklehash");
 	wb->merkles = json_array_size(wb->merkle_array);
+	wb->merklehash = ckalloc(sizeof(*wb->merklehash) * (wb->merkles + 1));
+	wb->merklebin = ckalloc(sizeof(*wb->merklebin) * (wb->merkles + 1));
 	for (i = 0; i < wb->merkles; i++) {
 		strcpy(&wb->merklehash[i][0], json_string_value(json_array_get(wb->merkle_array, i)));
 		hex2bin(&wb->merklebin[i][0], &wb->merklehash[i][0], 32);
@@ -2667,7 +3698,10 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	wb->diff = proxy->diff;
 	ck_runlock(&dsdata->workbase_lock);
 
-	add_base(ckp, dsdata, wb, &new_block);
+	if (unlikely(!add_base(ckp, dsdata, wb, &new_block))) {
+		clear_workbase(wb);
+		goto out;
+	}
 	if (new_block) {
 		if (subid)
 			LOGINFO("Block hash on proxy %d:%d changed to %s", id, subid, dsdata->lastswaphash);
@@ -2696,7 +3730,7 @@ static void update_diff(ckpool_t *ckp, const char *cmd)
 	sdata_t *sdata = ckp->sdata, *dsdata;
 	stratum_instance_t *client, *tmp;
 	double old_diff, diff;
-	int id = 0, subid = 0;
+	int id = 0, subid = 0, i;
 	const char *buf;
 	proxy_t *proxy;
 	json_t *val;
@@ -2747,18 +3781,22 @@ static void update_diff(ckpool_t *ckp, const char *cmd)
 
 	/* If the diff has dropped, iterate over all the clients and check
 	 * they're at or below the new diff, and update it if not. */
-	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		if (client->proxyid != id)
-			continue;
-		if (client->subproxyid != subid)
-			continue;
-		if (client->diff > diff) {
-			client->diff = diff;
-			stratum_send_diff(sdata, client);
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		HASH_ITER(hh, shard->instances, client, tmp) {
+			if (client->proxyid != id)
+				continue;
+			if (client->subproxyid != subid)
+				continue;
+			if (client->diff > diff) {
+				client->diff = diff;
+				stratum_send_diff(sdata, client);
+			}
 		}
+		ck_runlock(&shard->lock);
 	}
-	ck_runlock(&sdata->instance_lock);
 }
 
 #if 0
@@ -2773,6 +3811,7 @@ static void generator_drop_proxy(ckpool_t *ckp, const int64_t id, const int subi
 
 static void free_proxy(proxy_t *proxy)
 {
+	purge_share_hashtable(proxy->sdata, INT64_MAX);
 	free(proxy->sdata);
 	free(proxy);
 }
@@ -2829,12 +3868,12 @@ static void reap_proxies(ckpool_t *ckp, sdata_t *sdata)
 		LOGINFO("Stratifier discarded %d dead proxies", dead);
 }
 
-/* Enter with instance_lock held */
-static stratum_instance_t *__instance_by_id(sdata_t *sdata, const int64_t id)
+/* Enter with the shard lock of id held */
+static stratum_instance_t *__instance_by_id(instance_shard_t *shard, const int64_t id)
 {
 	stratum_instance_t *client;
 
-	HASH_FIND_I64(sdata->stratum_instances, &id, client);
+	HASH_FIND_I64(shard->instances, &id, client);
 	return client;
 }
 
@@ -2845,33 +3884,32 @@ static void __inc_instance_ref(stratum_instance_t *client)
 }
 
 /* Find an __instance_by_id and increase its reference count allowing us to
- * use this instance outside of instance_lock without fear of it being
+ * use this instance outside of its shard lock without fear of it being
  * dereferenced. Does not return dropped clients still on the list. */
 static inline stratum_instance_t *ref_instance_by_id(sdata_t *sdata, const int64_t id)
 {
+	instance_shard_t *shard = id_shard(sdata, id);
 	stratum_instance_t *client;
 
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, id);
+	shard_wlock(shard);
+	client = __instance_by_id(shard, id);
 	if (client) {
 		if (unlikely(client->dropped))
 			client = NULL;
 		else
 			__inc_instance_ref(client);
 	}
-	ck_wunlock(&sdata->instance_lock);
+	shard_wunlock(shard);
 
 	return client;
 }
 
-static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazily, char **msg)
+/* Enter with the client's shard lock held */
+static void __drop_client(sdata_t *sdata, instance_shard_t *shard, stratum_instance_t *client,
+			  bool lazily, char **msg)
 {
 	user_instance_t *user = client->user_instance;
 
-	if (unlikely(client->node))
-		DL_DELETE(sdata->node_instances, client);
-	if (unlikely(client->remote))
-		DL_DELETE(sdata->remote_instances, client);
 	if (client->workername) {
 		if (user) {
 			ASPRINTF(msg, "Dropped client %s %s %suser %s worker %s %s",
@@ -2886,8 +3924,15 @@ static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazil
 		ASPRINTF(msg, "Dropped workerless client %s %s %s",
 			 client->identity, client->address, lazily ? "lazily" : "");
 	}
-	__del_client(sdata, client);
+	__del_client(sdata, shard, client);
+
+	ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
+	if (unlikely(client->node))
+		DL_DELETE(sdata->node_instances, client);
+	if (unlikely(client->remote))
+		DL_DELETE(sdata->remote_instances, client);
 	__kill_instance(sdata, client);
+	ck_wunlock(&sdata->instance_lock);
 }
 
 static int __dec_instance_ref(stratum_instance_t *client)
@@ -2899,21 +3944,22 @@ static int __dec_instance_ref(stratum_instance_t *client)
 static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const char *file,
 			      const char *func, const int line)
 {
+	instance_shard_t *shard = id_shard(sdata, client->id);
 	char_entry_t *entries = NULL;
 	bool dropped = false;
 	char *msg;
 	int ref;
 
-	ck_wlock(&sdata->instance_lock);
+	shard_wlock(shard);
 	ref = __dec_instance_ref(client);
 	/* See if there are any instances that were dropped that could not be
 	 * moved due to holding a reference and drop them now. */
 	if (unlikely(client->dropped && !ref)) {
 		dropped = true;
-		__drop_client(sdata, client, true, &msg);
+		__drop_client(sdata, shard, client, true, &msg);
 		add_msg_entry(&entries, &msg);
 	}
-	ck_wunlock(&sdata->instance_lock);
+	shard_wunlock(shard);
 
 	notice_msg_entries(&entries);
 	/* This should never happen */
@@ -2927,7 +3973,7 @@ static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const
 #define dec_instance_ref(sdata, instance) _dec_instance_ref(sdata, instance, __FILE__, __func__, __LINE__)
 
 /* If we have a no longer used stratum instance in the recycled linked list,
- * use that, otherwise calloc a fresh one. */
+ * use that, otherwise calloc a fresh one. Enter with instance_lock held. */
 static stratum_instance_t *__recruit_stratum_instance(sdata_t *sdata)
 {
 	stratum_instance_t *client = sdata->recycled_instances;
@@ -2941,17 +3987,20 @@ static stratum_instance_t *__recruit_stratum_instance(sdata_t *sdata)
 	return client;
 }
 
-/* Enter with write instance_lock held */
-static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, const char *address,
-						  int server)
+/* Enter with write lock of the id's shard held */
+static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, instance_shard_t *shard,
+						  int64_t id, const char *address, int server)
 {
 	stratum_instance_t *client;
 	sdata_t *sdata = ckp->sdata;
 
+	ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
 	client = __recruit_stratum_instance(sdata);
+	client->session_id = ++sdata->session_id;
+	ck_wunlock(&sdata->instance_lock);
+
 	client->start_time = time(NULL);
 	client->id = id;
-	client->session_id = ++sdata->session_id;
 	strcpy(client->address, address);
 	/* Sanity check to not overflow lookup in ckp->serverurl[] */
 	if (server >= ckp->serverurls)
@@ -2960,31 +4009,43 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 	client->diff = client->old_diff = ckp->startdiff;
 	client->ckp = ckp;
 	tv_time(&client->ldc);
-	HASH_ADD_I64(sdata->stratum_instances, id, client);
+	mutex_init(&client->cbmid_lock);
+	HASH_ADD_I64(shard->instances, id, client);
 	/* Points to ckp sdata in ckpool mode, but is changed later in proxy
 	 * mode . */
 	client->sdata = sdata;
 	if (passthrough_subclient(id)) {
-		stratum_instance_t *passthrough;
 		int64_t pass_id = id >> 32;
 
 		id &= 0xffffffffll;
-		passthrough = __instance_by_id(sdata, pass_id);
-		if (passthrough && passthrough->node) {
-			client->latency = passthrough->latency;
-			LOGINFO("Client %s inherited node latency of %d",
-				client->identity, client->latency);
-			sprintf(client->identity, "node:%"PRId64" subclient:%"PRId64,
-				pass_id, id);
-		} else {
-			sprintf(client->identity, "passthrough:%"PRId64" subclient:%"PRId64,
-				pass_id, id);
-		}
+		sprintf(client->identity, "passthrough:%"PRId64" subclient:%"PRId64,
+			pass_id, id);
 	} else
 		sprintf(client->identity, "%"PRId64, id);
 	return client;
 }
 
+/* Subclients of a mining node inherit its latency. The node is on its own
+ * shard so this is done once the new client's shard lock is released. Client
+ * must hold a reference. */
+static void inherit_node(sdata_t *sdata, stratum_instance_t *client)
+{
+	int64_t pass_id = client->id >> 32, id = client->id & 0xffffffffll;
+	stratum_instance_t *passthrough;
+
+	passthrough = ref_instance_by_id(sdata, pass_id);
+	if (!passthrough)
+		return;
+	if (passthrough->node) {
+		client->latency = passthrough->latency;
+		LOGINFO("Client %s inherited node latency of %d",
+			client->identity, client->latency);
+		sprintf(client->identity, "node:%"PRId64" subclient:%"PRId64,
+			pass_id, id);
+	}
+	dec_instance_ref(sdata, passthrough);
+}
+
 static uint64_t disconnected_sessionid_exists(sdata_t *sdata, const int session_id,
 					      const int64_t id)
 {
@@ -2992,7 +4053,7 @@ static uint64_t disconnected_sessionid_exists(sdata_t *sdata, const int session_
 	int64_t old_id = 0;
 	uint64_t ret = 0;
 
-	ck_wlock(&sdata->instance_lock);
+	ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
 	HASH_FIND_INT(sdata->disconnected_sessions, &session_id, session);
 	if (!session)
 		goto out_unlock;
@@ -3027,14 +4088,18 @@ static void connector_test_client(ckpool_t *ckp, const int64_t id)
 
 /* For creating a list of sends without locking that can then be concatenated
  * to the stratum_sends list. Minimises locking and avoids taking recursive
- * locks. Sends only to sdata bound clients (everyone in ckpool) */
+ * locks. Sends only to sdata bound clients (everyone in ckpool). The message
+ * is rendered once and shared by all regular clients while passthrough
+ * subclients get their own copy with their node.method and client_id. */
 static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 {
 	ckpool_t *ckp = sdata->ckp;
 	sdata_t *ckp_sdata = ckp->sdata;
 	stratum_instance_t *client, *tmp;
+	int messages = 0, clients = 0, i;
+	int64_t *client_ids = NULL;
 	ckmsg_t *bulk_send = NULL;
-	int messages = 0;
+	smsg_t *msg;
 
 	if (unlikely(!val)) {
 		LOGERR("Sent null json to stratum_broadcast");
@@ -3046,33 +4111,60 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		return;
 	}
 
-	ck_rlock(&ckp_sdata->instance_lock);
-	HASH_ITER(hh, ckp_sdata->stratum_instances, client, tmp) {
-		ckmsg_t *client_msg;
-		smsg_t *msg;
+	/* Walk one shard at a time so share processing on the other shards
+	 * is never held up */
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &ckp_sdata->shards[i];
+		size_t len;
 
-		if (sdata != ckp_sdata && client->sdata != sdata)
-			continue;
+		ck_rlock(&shard->lock);
+		len = sizeof(int64_t) * (clients + HASH_COUNT(shard->instances) + 1);
+		client_ids = realloc(client_ids, len);
+		if (unlikely(!client_ids))
+			quit(1, "Failed to realloc client_ids of size %lu in stratum_broadcast",
+			     (unsigned long)len);
+		HASH_ITER(hh, shard->instances, client, tmp) {
+			ckmsg_t *client_msg;
 
-		if (!client_active(client) || client->node || client->remote)
-			continue;
+			if (sdata != ckp_sdata && client->sdata != sdata)
+				continue;
 
-		/* Only send messages to whitelisted clients */
-		if (msg_type == SM_MSG && !client->messages)
-			continue;
+			if (!client_active(client) || client->node || client->remote)
+				continue;
+
+			/* Only send messages to whitelisted clients */
+			if (msg_type == SM_MSG && !client->messages)
+				continue;
+
+			if (!passthrough_subclient(client->id)) {
+				client_ids[clients++] = client->id;
+				continue;
+			}
+
+			client_msg = ckalloc(sizeof(ckmsg_t));
+			msg = ckzalloc(sizeof(smsg_t));
+			msg->json_msg = json_deep_copy(val);
+			json_set_string(msg->json_msg, "node.method", stratum_msgs[msg_type]);
+			msg->client_id = client->id;
+			client_msg->data = msg;
+			DL_APPEND(bulk_send, client_msg);
+			messages++;
+		}
+		ck_runlock(&shard->lock);
+	}
+
+	if (clients) {
+		ckmsg_t *client_msg = ckalloc(sizeof(ckmsg_t));
 
-		client_msg = ckalloc(sizeof(ckmsg_t));
 		msg = ckzalloc(sizeof(smsg_t));
-		if (passthrough_subclient(client->id))
-			json_set_string(val, "node.method", stratum_msgs[msg_type]);
-		msg->json_msg = json_deep_copy(val);
-		msg->client_id = client->id;
+		msg->buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
+		msg->client_ids = client_ids;
+		msg->clients = clients;
 		client_msg->data = msg;
-		DL_APPEND(bulk_send, client_msg);
+		DL_PREPEND(bulk_send, client_msg);
 		messages++;
-	}
-	ck_runlock(&ckp_sdata->instance_lock);
-
+	} else
+		free(client_ids);
 	json_decref(val);
 
 	if (likely(bulk_send))
@@ -3105,25 +4197,28 @@ static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_i
 
 static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
 {
+	instance_shard_t *shard = id_shard(sdata, id);
 	char_entry_t *entries = NULL;
 	stratum_instance_t *client;
 	char *msg;
 
 	LOGINFO("Stratifier asked to drop client %"PRId64, id);
 
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, id);
+	shard_wlock(shard);
+	client = __instance_by_id(shard, id);
 	if (client && !client->dropped) {
+		ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
 		__disconnect_session(sdata, client);
+		ck_wunlock(&sdata->instance_lock);
 		/* If the client is still holding a reference, don't drop them
 		 * now but wait till the reference is dropped */
 		if (!client->ref) {
-			__drop_client(sdata, client, false, &msg);
+			__drop_client(sdata, shard, client, false, &msg);
 			add_msg_entry(&entries, &msg);
 		} else
 			client->dropped = true;
 	}
-	ck_wunlock(&sdata->instance_lock);
+	shard_wunlock(shard);
 
 	notice_msg_entries(&entries);
 	reap_proxies(ckp, sdata);
@@ -3145,6 +4240,7 @@ static void request_reconnect(sdata_t *sdata, const char *cmd)
 	char *port = strdupa(cmd), *url = NULL;
 	stratum_instance_t *client, *tmp;
 	json_t *json_msg;
+	int i;
 
 	strsep(&port, ":");
 	if (port)
@@ -3159,22 +4255,56 @@ static void request_reconnect(sdata_t *sdata, const char *cmd)
 
 	/* Tag all existing clients as dropped now so they can be removed
 	 * lazily */
-	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		client->dropped = true;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		shard_wlock(shard);
+		HASH_ITER(hh, shard->instances, client, tmp) {
+			client->dropped = true;
+		}
+		shard_wunlock(shard);
 	}
-	ck_wunlock(&sdata->instance_lock);
+}
+
+/* Set the log level of one client, eg. clientloglevel=1234:6 to see its
+ * shares at LOG_INFO while the rest of the pool stays quiet. */
+static void client_loglevel(sdata_t *sdata, const char *buf)
+{
+	stratum_instance_t *client;
+	int64_t client_id;
+	int loglevel;
+
+	if (sscanf(buf, "clientloglevel=%"PRId64":%d", &client_id, &loglevel) != 2) {
+		LOGWARNING("Failed to parse clientloglevel message %s", buf);
+		return;
+	}
+	client = ref_instance_by_id(sdata, client_id);
+	if (!client) {
+		LOGNOTICE("Failed to find client %"PRId64" to set loglevel", client_id);
+		return;
+	}
+	client->loglevel = loglevel;
+	LOGNOTICE("Set client %s loglevel to %d", client->identity, loglevel);
+	dec_instance_ref(sdata, client);
 }
 
 static void reset_bestshares(sdata_t *sdata)
 {
 	user_instance_t *user, *tmpuser;
 	stratum_instance_t *client, *tmp;
+	int i;
 
-	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		client->best_diff = 0;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		HASH_ITER(hh, shard->instances, client, tmp) {
+			client->best_diff = 0;
+		}
+		ck_runlock(&shard->lock);
 	}
+
+	ck_rlock(&sdata->user_lock);
 	HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
 		worker_instance_t *worker;
 
@@ -3183,7 +4313,7 @@ static void reset_bestshares(sdata_t *sdata)
 			worker->best_diff = 0;
 		}
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 }
 
 static user_instance_t *get_user(sdata_t *sdata, const char *username);
@@ -3341,10 +4471,10 @@ static void block_solve(ckpool_t *ckp, const char *blockhash)
 		user = user_by_workername(sdata, workername);
 		worker = get_worker(sdata, user, workername);
 
-		ck_rlock(&sdata->instance_lock);
+		ck_rlock(&sdata->user_lock);
 		user_val = user_stats(user);
 		worker_val = worker_stats(worker);
-		ck_runlock(&sdata->instance_lock);
+		ck_runlock(&sdata->user_lock);
 
 		s = json_dumps(user_val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 		json_decref(user_val);
@@ -3417,25 +4547,22 @@ static void broadcast_ping(sdata_t *sdata)
 	stratum_broadcast(sdata, json_msg, SM_PING);
 }
 
-static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
+static json_t *lock_stat_json(const lock_stat_t *stat)
 {
-	int objects, generated;
-	int64_t memsize;
-	ckmsg_t *msg;
-
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
+	json_t *val;
 
-	memsize = (sizeof(ckmsg_t) + size) * objects;
-	JSON_CPACK(*val, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
+	JSON_CPACK(val, "{sI,sf,sf,sf}", "locks", stat->locks, "wait", stat->wait,
+		   "avgwait", stat->locks ? stat->wait / stat->locks : 0.0,
+		   "maxwait", stat->maxwait);
+	return val;
 }
 
 static char *stratifier_stats(ckpool_t *ckp, sdata_t *sdata)
 {
+	lock_stat_t shard_stat, instance_stat, user_stat;
 	json_t *val = json_object(), *subval;
-	int objects, generated;
+	share_table_t *table, *tmptable;
+	int objects, generated, i;
 	int64_t memsize;
 	char *buf;
 
@@ -3448,14 +4575,24 @@ static char *stratifier_stats(ckpool_t *ckp, sdata_t *sdata)
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "workbases", subval);
 
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	objects = HASH_COUNT(sdata->user_instances);
 	memsize = SAFE_HASH_OVERHEAD(sdata->user_instances) + sizeof(stratum_instance_t) * objects;
+	ck_runlock(&sdata->user_lock);
 	JSON_CPACK(subval, "{si,si}", "count", objects, "memory", memsize);
 	json_set_object(val, "users", subval);
 
-	objects = HASH_COUNT(sdata->stratum_instances);
-	memsize = SAFE_HASH_OVERHEAD(sdata->stratum_instances);
+	objects = 0;
+	memsize = 0;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		objects += HASH_COUNT(shard->instances);
+		memsize += SAFE_HASH_OVERHEAD(shard->instances);
+		ck_runlock(&shard->lock);
+	}
+	ck_rlock(&sdata->instance_lock);
 	generated = sdata->stratum_generated;
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "clients", subval);
@@ -3466,29 +4603,123 @@ static char *stratifier_stats(ckpool_t *ckp, sdata_t *sdata)
 	memsize += sizeof(session_t) * sdata->stats.disconnected;
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "disconnected", subval);
+	instance_stat = sdata->instance_stat;
 	ck_runlock(&sdata->instance_lock);
 
-	mutex_lock(&sdata->share_lock);
+	/* Write lock waits on the shards combined, and the other locks */
+	memset(&shard_stat, 0, sizeof(shard_stat));
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		shard_stat.locks += shard->stat.locks;
+		shard_stat.wait += shard->stat.wait;
+		if (shard->stat.maxwait > shard_stat.maxwait)
+			shard_stat.maxwait = shard->stat.maxwait;
+		ck_runlock(&shard->lock);
+	}
+	ck_rlock(&sdata->user_lock);
+	user_stat = sdata->user_stat;
+	ck_runlock(&sdata->user_lock);
+
+	ck_rlock(&sdata->workbase_lock);
+	JSON_CPACK(subval, "{sI,sf,sf,sf}", "count", sdata->empty_jobs,
+		   "last", sdata->empty_last,
+		   "avg", sdata->empty_jobs ? sdata->empty_total / sdata->empty_jobs : 0.0,
+		   "max", sdata->empty_max);
+	ck_runlock(&sdata->workbase_lock);
+	json_set_object(val, "emptyjobs", subval);
+
+	mutex_lock(&sdata->block_lock);
+	JSON_CPACK(subval, "{sI,sf,sf,sf}", "count", sdata->blocks_dispatched,
+		   "last", sdata->dispatch_last,
+		   "avg", sdata->blocks_dispatched ? sdata->dispatch_total / sdata->blocks_dispatched : 0.0,
+		   "max", sdata->dispatch_max);
+	mutex_unlock(&sdata->block_lock);
+	json_set_object(val, "blockdispatch", subval);
+
+	subval = json_object();
+	json_set_object(subval, "shards", lock_stat_json(&shard_stat));
+	json_set_object(subval, "instance", lock_stat_json(&instance_stat));
+	json_set_object(subval, "user", lock_stat_json(&user_stat));
+	json_set_object(val, "locks", subval);
+
+	mutex_lock(&sdata->stats_lock);
+	JSON_CPACK(subval, "{si,sf,sf,sb,sI,sI}", "maxsps", ckp->maxsps,
+		   "sps1", sdata->stats.sps1, "scale", sdata->rate_scale,
+		   "throttled", sdata->rate_scale > 1, "adjustments", sdata->rate_adjustments,
+		   "faststarts", sdata->rate_faststarts);
+	mutex_unlock(&sdata->stats_lock);
+	json_set_object(val, "budget", subval);
+
+	rd_lock(&sdata->share_lock);
 	generated = sdata->shares_generated;
-	objects = HASH_COUNT(sdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(sdata->shares) + sizeof(share_t) * objects;
-	mutex_unlock(&sdata->share_lock);
+	objects = 0;
+	memsize = SAFE_HASH_OVERHEAD(sdata->share_tables);
+	HASH_ITER(hh, sdata->share_tables, table, tmptable) {
+		for (i = 0; i < SHARE_SHARDS; i++) {
+			share_shard_t *shard = &table->shards[i];
+
+			mutex_lock(&shard->lock);
+			generated += shard->generated;
+			objects += shard->count;
+			memsize += sizeof(*shard->hashes) * shard->slots;
+			mutex_unlock(&shard->lock);
+		}
+		memsize += sizeof(share_table_t);
+	}
+	rd_unlock(&sdata->share_lock);
 
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "shares", subval);
 
-	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval);
+	subval = ckmsgq_stats(sdata->ssends, sizeof(smsg_t));
 	json_set_object(val, "ssends", subval);
 	/* Don't know exactly how big the string is so just count the pointer for now */
-	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval);
+	subval = ckmsgq_stats(sdata->srecvs, sizeof(smsg_t));
 	json_set_object(val, "srecvs", subval);
 	if (!CKP_STANDALONE(ckp)) {
-		ckmsgq_stats(sdata->ckdbq, sizeof(char *), &subval);
+		int64_t frames, sent, replies, connects;
+		bool connected;
+
+		subval = ckmsgq_stats(sdata->ckdbq, sizeof(char *));
 		json_set_object(val, "ckdbq", subval);
-	}
-	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
+
+		mutex_lock(&sdata->ckdb_stream_lock);
+		connected = sdata->ckdb_stream_fd >= 0 && !sdata->ckdb_stream_dead;
+		objects = sdata->ckdb_inflight;
+		frames = sdata->ckdb_stream_frames;
+		sent = sdata->ckdb_stream_sent;
+		replies = sdata->ckdb_stream_replies;
+		connects = sdata->ckdb_stream_connects;
+		mutex_unlock(&sdata->ckdb_stream_lock);
+
+		JSON_CPACK(subval, "{sb,si,sI,sI,sI,sI}", "connected", connected,
+			   "inflight", objects, "frames", frames, "sent", sent,
+			   "replies", replies, "connects", connects);
+		json_set_object(val, "ckdbstream", subval);
+	}
+	subval = ckmsgq_stats(sdata->stxnq, sizeof(json_params_t));
 	json_set_object(val, "stxnq", subval);
 
+	if (ckp->logshares) {
+		int64_t sharelogs, stalls, stall_ms;
+		int files;
+
+		mutex_lock(&sdata->sharelog_lock);
+		objects = sdata->sharelogs_queued;
+		sharelogs = sdata->sharelogs_generated;
+		stalls = sdata->sharelog_stalls;
+		stall_ms = sdata->sharelog_stall_ms;
+		files = sdata->sharelog_files;
+		mutex_unlock(&sdata->sharelog_lock);
+
+		JSON_CPACK(subval, "{si,sI,sI,sI,si,si}", "count", objects, "generated", sharelogs,
+			   "stalls", stalls, "stallms", stall_ms, "files", files,
+			   "fsync", ckp->sharelog_fsync);
+		json_set_object(val, "sharelog", subval);
+	}
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	LOGNOTICE("Stratifier stats: %s", buf);
@@ -3612,11 +4843,11 @@ static void userclients(sdata_t *sdata, const char *buf, int *sockd)
 	user = get_user(sdata, username);
 	client_arr = json_array();
 
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	DL_FOREACH(user->clients, client) {
 		json_array_append_new(client_arr, json_integer(client->id));
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
 	JSON_CPACK(val, "{ss,so}", "user", username, "clients", client_arr);
 out:
@@ -3651,13 +4882,13 @@ static void workerclients(sdata_t *sdata, const char *buf, int *sockd)
 	user = get_user(sdata, username);
 	client_arr = json_array();
 
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	DL_FOREACH(user->clients, client) {
 		if (strcmp(client->workername, workername))
 			continue;
 		json_array_append_new(client_arr, json_integer(client->id));
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
 	JSON_CPACK(val, "{ss,so}", "worker", workername, "clients", client_arr);
 out:
@@ -3718,13 +4949,13 @@ static void getworkers(sdata_t *sdata, int *sockd)
 
 	worker_arr = json_array();
 
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	for (user = sdata->user_instances; user; user = user->hh.next) {
 		DL_FOREACH(user->worker_instances, worker) {
 			json_array_append_new(worker_arr, workerinfo(user, worker));
 		}
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
 	JSON_CPACK(val, "{so}", "workers", worker_arr);
 	send_api_response(val, *sockd);
@@ -3738,11 +4969,11 @@ static void getusers(sdata_t *sdata, int *sockd)
 
 	user_array = json_array();
 
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	for (user = sdata->user_instances; user; user = user->hh.next) {
 		json_array_append_new(user_array, userinfo(user));
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
 	JSON_CPACK(val, "{so}", "users", user_array);
 	send_api_response(val, *sockd);
@@ -3813,14 +5044,19 @@ static void getclients(sdata_t *sdata, int *sockd)
 {
 	json_t *val = NULL, *client_arr;
 	stratum_instance_t *client;
+	int i;
 
 	client_arr = json_array();
 
-	ck_rlock(&sdata->instance_lock);
-	for (client = sdata->stratum_instances; client; client = client->hh.next) {
-		json_array_append_new(client_arr, clientinfo(client));
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &sdata->shards[i];
+
+		ck_rlock(&shard->lock);
+		for (client = shard->instances; client; client = client->hh.next) {
+			json_array_append_new(client_arr, clientinfo(client));
+		}
+		ck_runlock(&shard->lock);
 	}
-	ck_runlock(&sdata->instance_lock);
 
 	JSON_CPACK(val, "{so}", "clients", client_arr);
 	send_api_response(val, *sockd);
@@ -3851,11 +5087,11 @@ static void user_clientinfo(sdata_t *sdata, const char *buf, int *sockd)
 	user = get_user(sdata, username);
 	client_arr = json_array();
 
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	DL_FOREACH(user->clients, client) {
 		json_array_append_new(client_arr, clientinfo(client));
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
 	JSON_CPACK(val, "{ss,so}", "user", username, "clients", client_arr);
 out:
@@ -3890,13 +5126,13 @@ static void worker_clientinfo(sdata_t *sdata, const char *buf, int *sockd)
 	user = get_user(sdata, username);
 	client_arr = json_array();
 
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	DL_FOREACH(user->clients, client) {
 		if (strcmp(client->workername, workername))
 			continue;
 		json_array_append_new(client_arr, clientinfo(client));
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
 	JSON_CPACK(val, "{ss,so}", "worker", workername, "clients", client_arr);
 out:
@@ -4043,25 +5279,10 @@ static void get_poolstats(sdata_t *sdata, int *sockd)
 	_Close(sockd);
 }
 
-static void srecv_process(ckpool_t *ckp, json_t *val);
-
 /* For emergency use only, flushes all pending ckdbq messages */
 static void ckdbq_flush(sdata_t *sdata)
 {
-	ckmsgq_t *ckdbq = sdata->ckdbq;
-	int flushed = 0;
-
-	mutex_lock(ckdbq->lock);
-	while (ckdbq->msgs) {
-		ckmsg_t *msg = ckdbq->msgs;
-
-		DL_DELETE(ckdbq->msgs, msg);
-		free(msg->data);
-		free(msg);
-		ckdbq->messages--;
-		flushed++;
-	}
-	mutex_unlock(ckdbq->lock);
+	int flushed = ckmsgq_flush(sdata->ckdbq);
 
 	LOGWARNING("Flushed %d messages from ckdb queue", flushed);
 }
@@ -4105,7 +5326,7 @@ retry:
 
 		/* This is a message for a node */
 		Close(umsg->sockd);
-		ckmsgq_add(sdata->srecvs, val);
+		stratifier_add_recv(ckp, val);
 		goto retry;
 	}
 	if (cmdmatch(buf, "ping")) {
@@ -4222,7 +5443,10 @@ retry:
 	} else if (cmdmatch(buf, "delproxy")) {
 		del_proxy(ckp, sdata, buf);
 	} else if (cmdmatch(buf, "loglevel")) {
-		sscanf(buf, "loglevel=%d", &ckp->loglevel);
+		if (sscanf(buf, "loglevel=%d", &ckp->loglevel) == 1)
+			log_setlevel(ckp->loglevel);
+	} else if (cmdmatch(buf, "clientloglevel")) {
+		client_loglevel(sdata, buf);
 	} else if (cmdmatch(buf, "ckdbflush")) {
 		ckdbq_flush(sdata);
 	} else
@@ -4247,11 +5471,19 @@ static void *blockupdate(void *arg)
 
 	while (42) {
 		dealloc(buf);
+		/* Block changes come with their templates by longpoll */
+		if (generator_longpolling(ckp)) {
+			cksleep_ms(ckp->blockpoll);
+			continue;
+		}
 		buf = send_recv_generator(ckp, request, GEN_LAX);
 		if (buf && cmdmatch(buf, "notify"))
 			cksleep_ms(5000);
-		else if (buf && strcmp(buf, sdata->lastswaphash) && !cmdmatch(buf, "failed"))
+		else if (buf && strcmp(buf, sdata->lastswaphash) && !cmdmatch(buf, "failed")) {
+			if (ckp->emptyjobs)
+				empty_base(ckp, buf);
 			update_base(ckp, GEN_PRIORITY);
+		}
 		else
 			cksleep_ms(ckp->blockpoll);
 	}
@@ -4300,7 +5532,7 @@ static bool new_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata, strat
 	 * number ensures that no matter how many of the bits we take from the
 	 * left depending on nonce2 length, we'll always get a changing value
 	 * for every next client.*/
-	ck_wlock(&ckp_sdata->instance_lock);
+	ck_wlock_stat(&ckp_sdata->instance_lock, &ckp_sdata->instance_stat);
 	enonce1 = le64toh(ckp_sdata->enonce1_64);
 	enonce1++;
 	client->enonce1_64 = ckp_sdata->enonce1_64 = htole64(enonce1);
@@ -4416,7 +5648,7 @@ static int userid_from_sessionid(sdata_t *sdata, const int session_id)
 	session_t *session;
 	int ret = -1;
 
-	ck_wlock(&sdata->instance_lock);
+	ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
 	HASH_FIND_INT(sdata->disconnected_sessions, &session_id, session);
 	if (!session)
 		goto out_unlock;
@@ -4437,7 +5669,7 @@ static int userid_from_sessionip(sdata_t *sdata, const char *address)
 	session_t *session, *tmp;
 	int ret = -1;
 
-	ck_wlock(&sdata->instance_lock);
+	ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
 	HASH_ITER(hh, sdata->disconnected_sessions, session, tmp) {
 		if (!strcmp(session->address, address)) {
 			ret = session->userid;
@@ -4663,49 +5895,309 @@ static void decay_user(user_instance_t *user, double diff, tv_t *now_t)
 	copy_tv(&user->last_decay, now_t);
 }
 
-/* Enter holding a reference count */
-static void read_userstats(ckpool_t *ckp, user_instance_t *user)
+/* Find this thread's share accumulator, creating it on first use */
+static stat_accumulator_t *thread_accumulator(sdata_t *sdata)
+{
+	static __thread stat_accumulator_t *accumulator;
+
+	if (unlikely(!accumulator)) {
+		accumulator = ckzalloc(sizeof(stat_accumulator_t));
+		mutex_lock(&sdata->stats_lock);
+		accumulator->next = sdata->accumulators;
+		sdata->accumulators = accumulator;
+		mutex_unlock(&sdata->stats_lock);
+	}
+	return accumulator;
+}
+
+/* Count a share towards the pool stats without taking any lock. Only the
+ * owning thread writes to its accumulator so the stores can't be lost. */
+static void account_share(sdata_t *sdata, const double diff, const bool valid)
+{
+	stat_accumulator_t *accumulator = thread_accumulator(sdata);
+	double total;
+
+	if (valid) {
+		__atomic_store_n(&accumulator->shares, accumulator->shares + 1, __ATOMIC_RELAXED);
+		total = accumulator->diff_shares + diff;
+		__atomic_store(&accumulator->diff_shares, &total, __ATOMIC_RELAXED);
+	} else {
+		total = accumulator->rejects + diff;
+		__atomic_store(&accumulator->rejects, &total, __ATOMIC_RELAXED);
+	}
+}
+
+/* Move everything counted by each thread since the last fold into the
+ * unaccounted pool stats. Fractions of diff are left in the accumulators to
+ * be folded once they add up to whole shares. Must hold stats_lock. */
+static void __fold_accumulators(sdata_t *sdata)
+{
+	pool_stats_t *stats = &sdata->stats;
+	stat_accumulator_t *accumulator;
+	double dtotal;
+	int64_t total;
+
+	for (accumulator = sdata->accumulators; accumulator; accumulator = accumulator->next) {
+		total = __atomic_load_n(&accumulator->shares, __ATOMIC_RELAXED);
+		stats->unaccounted_shares += total - accumulator->folded_shares;
+		accumulator->folded_shares = total;
+
+		__atomic_load(&accumulator->diff_shares, &dtotal, __ATOMIC_RELAXED);
+		total = dtotal - accumulator->folded_diff_shares;
+		stats->unaccounted_diff_shares += total;
+		accumulator->folded_diff_shares += total;
+
+		__atomic_load(&accumulator->rejects, &dtotal, __ATOMIC_RELAXED);
+		total = dtotal - accumulator->folded_rejects;
+		stats->unaccounted_rejects += total;
+		accumulator->folded_rejects += total;
+	}
+}
+
+/* How far the budget controller may raise the diff each client aims for */
+#define RATE_SCALE_MAX 64
+/* Fraction of the way the scale moves towards its target each tick */
+#define RATE_SCALE_DAMPING 0.25
+
+/* Raise the diff vardiff aims for across the pool once the pool's share rate
+ * goes over the maxsps budget. The target is the larger of how far sps1 is
+ * over budget and the scale the client count needs, as converged clients
+ * each send about 0.3 shares a second. sps1 lags clients changing diff by
+ * minutes so the scale only moves part of the way to the target each tick.
+ * Workers is the stats.workers count read under user_lock. Must hold
+ * stats_lock. */
+static void __update_rate_budget(ckpool_t *ckp, sdata_t *sdata, const int workers)
+{
+	double scale = 1, target;
+
+	if (!ckp->maxsps)
+		return;
+	if (sdata->stats.sps1 > ckp->maxsps || sdata->rate_scale > 1) {
+		target = MAX(sdata->stats.sps1, workers * 0.3) / ckp->maxsps;
+		target = MIN(target, RATE_SCALE_MAX);
+		scale = sdata->rate_scale + (target - sdata->rate_scale) * RATE_SCALE_DAMPING;
+		/* Settle back to no scaling once close to it */
+		if (scale < 1.05)
+			scale = 1;
+	}
+	scale = MIN(scale, RATE_SCALE_MAX);
+	scale = MAX(scale, 1);
+	/* Ignore small changes to not churn client diffs */
+	if (scale > 1 && fabs(scale / sdata->rate_scale - 1) < 0.1)
+		return;
+	if (scale == sdata->rate_scale)
+		return;
+	LOGNOTICE("Pool share rate %.0f/s budget %d/s, scaling client diff targets by %.2f",
+		  sdata->stats.sps1, ckp->maxsps, scale);
+	sdata->rate_scale = scale;
+	sdata->rate_adjustments++;
+}
+
+/* Add diff to a worker or user's pending diff from any share processing
+ * thread without a lock */
+static void add_pending_diff(double *pending_diff, const double diff)
+{
+	double pending, total;
+
+	__atomic_load(pending_diff, &pending, __ATOMIC_RELAXED);
+	do {
+		total = pending + diff;
+	} while (!__atomic_compare_exchange(pending_diff, &pending, &total, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Apply the diff each worker and user accumulated since the last tick,
+ * decaying each of them at most once per tick instead of once per share.
+ * Only statsupdate decays workers and users once they're in use. */
+static void fold_user_stats(sdata_t *sdata)
+{
+	worker_instance_t *worker;
+	user_instance_t *user, *tmp;
+	double pending, zero = 0;
+	tv_t now;
+
+	tv_time(&now);
+	ck_rlock(&sdata->user_lock);
+	HASH_ITER(hh, sdata->user_instances, user, tmp) {
+		DL_FOREACH(user->worker_instances, worker) {
+			if (!worker->pending_diff)
+				continue;
+			__atomic_exchange(&worker->pending_diff, &zero, &pending, __ATOMIC_RELAXED);
+			decay_worker(worker, pending, &now);
+		}
+		if (!user->pending_diff)
+			continue;
+		__atomic_exchange(&user->pending_diff, &zero, &pending, __ATOMIC_RELAXED);
+		decay_user(user, pending, &now);
+	}
+	ck_runlock(&sdata->user_lock);
+}
+
+/* Open the stats store and index the records in it by name in one pass */
+static void load_statstore(ckpool_t *ckp, sdata_t *sdata)
+{
+	stats_index_t *index;
+	stats_record_t *record;
+	int64_t id;
+	char *path;
+
+	ASPRINTF(&path, "%s/userstats.dat", ckp->logdir);
+	sdata->statstore = statstore_open(path, false);
+	if (!sdata->statstore) {
+		LOGWARNING("Unable to use stats store %s, user and worker stats will not be saved",
+			   path);
+		free(path);
+		return;
+	}
+	free(path);
+
+	for (id = 1; (record = statstore_record(sdata->statstore, id)) != NULL; id++) {
+		index = ckalloc(sizeof(stats_index_t));
+		index->name = strndup(record->name, STATSTORE_NAMELEN - 1);
+		index->id = id;
+		if (record->type == STATS_USER)
+			HASH_ADD_KEYPTR(hh, sdata->stored_users, index->name, strlen(index->name), index);
+		else
+			HASH_ADD_KEYPTR(hh, sdata->stored_workers, index->name, strlen(index->name), index);
+	}
+	LOGNOTICE("Loaded %u user and %u worker stats records",
+		  HASH_COUNT(sdata->stored_users), HASH_COUNT(sdata->stored_workers));
+}
+
+static void stats_user_record(const user_instance_t *user, stats_record_t *record)
+{
+	memset(record, 0, sizeof(stats_record_t));
+	strncpy(record->name, user->username, STATSTORE_NAMELEN - 1);
+	record->type = STATS_USER;
+	record->workers = user->workers + user->remote_workers;
+	record->lastupdate = user->last_update.tv_sec;
+	record->shares = user->shares;
+	record->dsps1 = user->dsps1;
+	record->dsps5 = user->dsps5;
+	record->dsps60 = user->dsps60;
+	record->dsps1440 = user->dsps1440;
+	record->dsps10080 = user->dsps10080;
+	record->bestshare = user->best_diff;
+}
+
+static void stats_worker_record(const worker_instance_t *worker, stats_record_t *record)
+{
+	memset(record, 0, sizeof(stats_record_t));
+	strncpy(record->name, worker->workername, STATSTORE_NAMELEN - 1);
+	record->type = STATS_WORKER;
+	record->lastupdate = worker->last_update.tv_sec;
+	record->shares = worker->shares;
+	record->lastdiff = worker->lastdiff;
+	record->dsps1 = worker->dsps1;
+	record->dsps5 = worker->dsps5;
+	record->dsps60 = worker->dsps60;
+	record->dsps1440 = worker->dsps1440;
+	record->dsps10080 = worker->dsps10080;
+	record->bestshare = worker->best_diff;
+}
+
+/* Copy a user's or worker's current stats into its record in the store,
+ * adding a record the first time it is stored */
+static void store_stats_record(sdata_t *sdata, int64_t *id, const char *name,
+			       const stats_record_t *record)
+{
+	if (!sdata->statstore)
+		return;
+	mutex_lock(&sdata->statstore_lock);
+	if (!*id)
+		*id = statstore_add(sdata->statstore, record->type, name);
+	if (*id)
+		memcpy(statstore_record(sdata->statstore, *id), record, sizeof(stats_record_t));
+	mutex_unlock(&sdata->statstore_lock);
+}
+
+/* Copy the stored record of name into record, returning its id or 0 if it
+ * has none */
+static int64_t stored_stats_record(sdata_t *sdata, stats_index_t *indices, const char *name,
+				   stats_record_t *record)
+{
+	stats_index_t *index;
+	int64_t id = 0;
+
+	if (!sdata->statstore)
+		return id;
+	mutex_lock(&sdata->statstore_lock);
+	HASH_FIND_STR(indices, name, index);
+	if (index) {
+		id = index->id;
+		memcpy(record, statstore_record(sdata->statstore, id), sizeof(stats_record_t));
+	}
+	mutex_unlock(&sdata->statstore_lock);
+	return id;
+}
+
+/* Stats from the per user log files used before the stats store, read to
+ * carry stats over the first time a user is seen with the store. */
+static bool read_userstats_file(ckpool_t *ckp, user_instance_t *user)
 {
-	int tvsec_diff = 0, ret;
 	char s[512];
 	json_t *val;
 	FILE *fp;
-	tv_t now;
+	int ret;
 
 	snprintf(s, 511, "%s/users/%s", ckp->logdir, user->username);
 	fp = fopen(s, "re");
 	if (!fp) {
 		LOGINFO("User %s does not have a logfile to read", user->username);
-		return;
+		return false;
 	}
 	memset(s, 0, 512);
 	ret = fread(s, 1, 511, fp);
 	fclose(fp);
 	if (ret < 1) {
 		LOGINFO("Failed to read user %s logfile", user->username);
-		return;
+		return false;
 	}
 	val = json_loads(s, 0, NULL);
 	if (!val) {
 		LOGINFO("Failed to json decode user %s logfile: %s", user->username, s);
+		return false;
+	}
+
+	user->dsps1 = dsps_from_key(val, "hashrate1m");
+	user->dsps5 = dsps_from_key(val, "hashrate5m");
+	user->dsps60 = dsps_from_key(val, "hashrate1hr");
+	user->dsps1440 = dsps_from_key(val, "hashrate1d");
+	user->dsps10080 = dsps_from_key(val, "hashrate7d");
+	json_get_int64(&user->last_update.tv_sec, val, "lastupdate");
+	json_get_int64(&user->shares, val, "shares");
+	json_get_double(&user->best_diff, val, "bestshare");
+	json_decref(val);
+	return true;
+}
+
+/* Enter holding a reference count */
+static void read_userstats(ckpool_t *ckp, user_instance_t *user)
+{
+	sdata_t *sdata = ckp->sdata;
+	stats_record_t record;
+	int tvsec_diff = 0;
+	tv_t now;
+
+	user->stats_id = stored_stats_record(sdata, sdata->stored_users, user->username, &record);
+	if (user->stats_id) {
+		user->dsps1 = record.dsps1;
+		user->dsps5 = record.dsps5;
+		user->dsps60 = record.dsps60;
+		user->dsps1440 = record.dsps1440;
+		user->dsps10080 = record.dsps10080;
+		user->last_update.tv_sec = record.lastupdate;
+		user->shares = record.shares;
+		user->best_diff = record.bestshare;
+	} else if (!read_userstats_file(ckp, user))
 		return;
-	}
 
 	tv_time(&now);
 	copy_tv(&user->last_share, &now);
 	copy_tv(&user->last_decay, &now);
-	user->dsps1 = dsps_from_key(val, "hashrate1m");
-	user->dsps5 = dsps_from_key(val, "hashrate5m");
-	user->dsps60 = dsps_from_key(val, "hashrate1hr");
-	user->dsps1440 = dsps_from_key(val, "hashrate1d");
-	user->dsps10080 = dsps_from_key(val, "hashrate7d");
-	json_get_int64(&user->last_update.tv_sec, val, "lastupdate");
-	json_get_int64(&user->shares, val, "shares");
-	json_get_double(&user->best_diff, val, "bestshare");
 	LOGINFO("Successfully read user %s stats %f %f %f %f %f %f", user->username,
 		user->dsps1, user->dsps5, user->dsps60, user->dsps1440,
 		user->dsps10080, user->best_diff);
-	json_decref(val);
 	if (user->last_update.tv_sec)
 		tvsec_diff = now.tv_sec - user->last_update.tv_sec - 60;
 	if (tvsec_diff > 60) {
@@ -4715,37 +6207,33 @@ static void read_userstats(ckpool_t *ckp, user_instance_t *user)
 	}
 }
 
-/* Enter holding a reference count */
-static void read_workerstats(ckpool_t *ckp, worker_instance_t *worker)
+/* As per read_userstats_file */
+static bool read_workerstats_file(ckpool_t *ckp, worker_instance_t *worker)
 {
-	int tvsec_diff = 0, ret;
 	char s[512];
 	json_t *val;
 	FILE *fp;
-	tv_t now;
+	int ret;
 
 	snprintf(s, 511, "%s/workers/%s", ckp->logdir, worker->workername);
 	fp = fopen(s, "re");
 	if (!fp) {
 		LOGINFO("Worker %s does not have a logfile to read", worker->workername);
-		return;
+		return false;
 	}
 	memset(s, 0, 512);
 	ret = fread(s, 1, 511, fp);
 	fclose(fp);
 	if (ret < 1) {
 		LOGINFO("Failed to read worker %s logfile", worker->workername);
-		return;
+		return false;
 	}
 	val = json_loads(s, 0, NULL);
 	if (!val) {
 		LOGINFO("Failed to json decode worker %s logfile: %s", worker->workername, s);
-		return;
+		return false;
 	}
 
-	tv_time(&now);
-	copy_tv(&worker->last_share, &now);
-	copy_tv(&worker->last_decay, &now);
 	worker->dsps1 = dsps_from_key(val, "hashrate1m");
 	worker->dsps5 = dsps_from_key(val, "hashrate5m");
 	worker->dsps60 = dsps_from_key(val, "hashrate1hr");
@@ -4754,9 +6242,39 @@ static void read_workerstats(ckpool_t *ckp, worker_instance_t *worker)
 	json_get_double(&worker->best_diff, val, "bestshare");
 	json_get_int64(&worker->last_update.tv_sec, val, "lastupdate");
 	json_get_int64(&worker->shares, val, "shares");
+	json_get_int64(&worker->lastdiff, val, "lastdiff");
+	json_decref(val);
+	return true;
+}
+
+/* Enter holding a reference count */
+static void read_workerstats(ckpool_t *ckp, worker_instance_t *worker)
+{
+	sdata_t *sdata = ckp->sdata;
+	stats_record_t record;
+	int tvsec_diff = 0;
+	tv_t now;
+
+	worker->stats_id = stored_stats_record(sdata, sdata->stored_workers, worker->workername,
+					       &record);
+	if (worker->stats_id) {
+		worker->dsps1 = record.dsps1;
+		worker->dsps5 = record.dsps5;
+		worker->dsps60 = record.dsps60;
+		worker->dsps1440 = record.dsps1440;
+		worker->dsps10080 = record.dsps10080;
+		worker->best_diff = record.bestshare;
+		worker->last_update.tv_sec = record.lastupdate;
+		worker->shares = record.shares;
+		worker->lastdiff = record.lastdiff;
+	} else if (!read_workerstats_file(ckp, worker))
+		return;
+
+	tv_time(&now);
+	copy_tv(&worker->last_share, &now);
+	copy_tv(&worker->last_decay, &now);
 	LOGINFO("Successfully read worker %s stats %f %f %f %f %f", worker->workername,
 		worker->dsps1, worker->dsps5, worker->dsps60, worker->dsps1440, worker->best_diff);
-	json_decref(val);
 	if (worker->last_update.tv_sec)
 		tvsec_diff = now.tv_sec - worker->last_update.tv_sec - 60;
 	if (tvsec_diff > 60) {
@@ -4785,13 +6303,19 @@ static user_instance_t *get_create_user(ckpool_t *ckp, sdata_t *sdata, const cha
 {
 	user_instance_t *user;
 
-	ck_wlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
+	HASH_FIND_STR(sdata->user_instances, username, user);
+	ck_runlock(&sdata->user_lock);
+	if (likely(user))
+		return user;
+
+	ck_wlock_stat(&sdata->user_lock, &sdata->user_stat);
 	HASH_FIND_STR(sdata->user_instances, username, user);
 	if (unlikely(!user)) {
 		user = __create_user(sdata, username);
 		*new_user = true;
 	}
-	ck_wunlock(&sdata->instance_lock);
+	ck_wunlock(&sdata->user_lock);
 
 	if (CKP_STANDALONE(ckp) && *new_user)
 		read_userstats(ckp, user);
@@ -4837,13 +6361,19 @@ static worker_instance_t *get_create_worker(ckpool_t *ckp, sdata_t *sdata, user_
 {
 	worker_instance_t *worker;
 
-	ck_wlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
+	worker = __get_worker(user, workername);
+	ck_runlock(&sdata->user_lock);
+	if (likely(worker))
+		return worker;
+
+	ck_wlock_stat(&sdata->user_lock, &sdata->user_stat);
 	worker = __get_worker(user, workername);
 	if (!worker) {
 		worker = __create_worker(user, workername);
 		*new_worker = true;
 	}
-	ck_wunlock(&sdata->instance_lock);
+	ck_wunlock(&sdata->user_lock);
 
 	if (CKP_STANDALONE(ckp) && *new_worker)
 		read_workerstats(ckp, worker);
@@ -4883,12 +6413,12 @@ static user_instance_t *generate_user(ckpool_t *ckp, stratum_instance_t *client,
 
 	/* Create one worker instance for combined data from workers of the
 	 * same name */
-	ck_wlock(&sdata->instance_lock);
+	ck_wlock_stat(&sdata->user_lock, &sdata->user_stat);
 	client->user_instance = user;
 	client->worker_instance = worker;
 	DL_APPEND(user->clients, client);
 	__inc_worker(sdata,user, worker);
-	ck_wunlock(&sdata->instance_lock);
+	ck_wunlock(&sdata->user_lock);
 
 	/* Is this a btc address based username? */
 	if (!ckp->proxy && (new_user || !user->btcaddress) && (len > 26 && len < 35))
@@ -4932,7 +6462,7 @@ static void set_worker_mindiff(ckpool_t *ckp, const char *workername, int mindif
 	 * matching worker that are currently live and send them a new diff
 	 * if we can. Otherwise it will only act as a clamp on next share
 	 * submission. */
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	DL_FOREACH(user->clients, client) {
 		if (client->worker_instance != worker)
 			continue;
@@ -4946,7 +6476,7 @@ static void set_worker_mindiff(ckpool_t *ckp, const char *workername, int mindif
 		client->diff = mindiff;
 		stratum_send_diff(sdata, client);
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 }
 
 static void parse_worker_diffs(ckpool_t *ckp, json_t *worker_array)
@@ -5287,23 +6817,17 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 {
 	sdata_t *ckp_sdata = ckp->sdata, *sdata = client->sdata;
 	worker_instance_t *worker = client->worker_instance;
-	double tdiff, bdiff, dsps, drr, network_diff, bias;
+	double tdiff, bdiff, dsps, drr, network_diff, bias, scale;
 	user_instance_t *user = client->user_instance;
 	int64_t next_blockid, optimal, mindiff;
 	tv_t now_t;
 
-	mutex_lock(&ckp_sdata->stats_lock);
-	if (valid) {
-		ckp_sdata->stats.unaccounted_shares++;
-		ckp_sdata->stats.unaccounted_diff_shares += diff;
-	} else
-		ckp_sdata->stats.unaccounted_rejects += diff;
-	mutex_unlock(&ckp_sdata->stats_lock);
+	account_share(ckp_sdata, diff, valid);
 
 	/* Count only accepted and stale rejects in diff calculation. */
 	if (valid) {
-		worker->shares += diff;
-		user->shares += diff;
+		__sync_add_and_fetch(&worker->shares, (int64_t)diff);
+		__sync_add_and_fetch(&user->shares, (int64_t)diff);
 		/* Send shares to the upstream pool in trusted remote node */
 		if (ckp->remote)
 			upstream_shares(ckp, worker->workername, diff, sdiff);
@@ -5325,14 +6849,16 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		copy_tv(&client->ldc, &now_t);
 	}
 
+	/* Vardiff needs the client's own rate current on every share, while
+	 * worker and user rates are decayed once per tick by statsupdate */
 	decay_client(client, diff, &now_t);
 	copy_tv(&client->last_share, &now_t);
 
-	decay_worker(worker, diff, &now_t);
+	add_pending_diff(&worker->pending_diff, diff);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	add_pending_diff(&user->pending_diff, diff);
 	copy_tv(&user->last_share, &now_t);
 	client->idle = false;
 
@@ -5360,8 +6886,10 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 	dsps = client->dsps5 / bias;
 	drr = dsps / (double)client->diff;
 
-	/* Optimal rate product is 0.3, allow some hysteresis. */
-	if (drr > 0.15 && drr < 0.4)
+	/* Optimal rate product is 0.3, allow some hysteresis. The pool share
+	 * rate budget lowers the rate each client aims for. */
+	scale = ckp_sdata->rate_scale;
+	if (drr > 0.15 / scale && drr < 0.4 / scale)
 		return;
 
 	/* Client suggest diff overrides worker mindiff */
@@ -5371,11 +6899,11 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		mindiff = worker->mindiff;
 	/* Allow slightly lower diffs when users choose their own mindiff */
 	if (mindiff) {
-		if (drr < 0.5)
+		if (drr < 0.5 / scale)
 			return;
-		optimal = lround(dsps * 2.4);
+		optimal = lround(dsps * 2.4 * scale);
 	} else
-		optimal = lround(dsps * 3.33);
+		optimal = lround(dsps * 3.33 * scale);
 
 	/* Clamp to mindiff ~ network_diff */
 
@@ -5405,13 +6933,14 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 
 	client->ssdc = 0;
 
-	LOGINFO("Client %s biased dsps %.2f dsps %.2f drr %.2f adjust diff from %"PRId64" to: %"PRId64" ",
-		client->identity, dsps, client->dsps5, drr, client->diff, optimal);
+	LOGCLIENT(client, LOG_INFO, "Client %s biased dsps %.2f dsps %.2f drr %.2f adjust diff from %"PRId64" to: %"PRId64" ",
+		  client->identity, dsps, client->dsps5, drr, client->diff, optimal);
 
 	copy_tv(&client->ldc, &now_t);
 	client->diff_change_job_id = next_blockid;
 	client->old_diff = client->diff;
 	client->diff = optimal;
+	worker->lastdiff = optimal;
 	stratum_send_diff(sdata, client);
 }
 
@@ -5419,16 +6948,17 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
  * client holding a ref count. */
 static void
 test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uchar *data,
-		const uchar *hash, const double diff, const char *coinbase, int cblen,
-		const char *nonce2, const char *nonce, const uint32_t ntime32)
+		const uchar *hash, const double diff, const char *nonce2, const char *nonce,
+		const uint32_t ntime32, const ts_t *received)
 {
-	char blockhash[68], cdfield[64];
+	char blockhash[68], cdfield[64], *coinbase;
 	sdata_t *sdata = client->sdata;
 	json_t *val = NULL, *val_copy;
 	ckpool_t *ckp = wb->ckp;
 	ckmsg_t *block_ckmsg;
 	uchar swap32[32];
 	ts_t ts_now;
+	int cblen;
 
 	/* Submit anything over 99.9% of the diff in case of rounding errors */
 	if (diff < sdata->current_workbase->network_diff * 0.999)
@@ -5442,7 +6972,13 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	ts_realtime(&ts_now);
 	sprintf(cdfield, "%lu,%lu", ts_now.tv_sec, ts_now.tv_nsec);
 
-	process_block(ckp, wb, coinbase, cblen, data, hash, swap32, blockhash);
+	/* Shares are hashed from coinbase midstates so only assemble the whole
+	 * coinbase for possible blocks */
+	coinbase = ckalloc(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen +
+			   wb->enonce2varlen + wb->coinb2len);
+	cblen = share_coinbase(coinbase, client->enonce1bin, wb, nonce2);
+	process_block(ckp, wb, coinbase, cblen, data, hash, swap32, blockhash, received);
+	free(coinbase);
 
 	send_node_block(sdata, client->enonce1, nonce, nonce2, ntime32, wb->id,
 			diff, client->id);
@@ -5475,48 +7011,322 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	ckdbq_add(ckp, ID_BLOCK, val);
 }
 
-/* Needs to be entered with client holding a ref count. */
-static double submission_diff(const stratum_instance_t *client, const workbase_t *wb, const char *nonce2,
-			      const uint32_t ntime32, const char *nonce, uchar *hash)
+/* Copy the client's coinbase midstate for wb into ctx, extending the coinb1
+ * midstate of wb with the client's enonce1 if it's not already cached. */
+static void client_midstate(stratum_instance_t *client, const workbase_t *wb, sha256_ctx *ctx)
 {
-	char *coinbase;
-	uchar swap[80];
-	double ret;
-	int cblen;
+	const int enonce1len = wb->enonce1constlen + wb->enonce1varlen;
 
-	coinbase = ckalloc(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len);
+	mutex_lock(&client->cbmid_lock);
+	if (client->cbmid_generation != wb->generation ||
+	    memcmp(client->cbmid_enonce1, client->enonce1bin, enonce1len)) {
+		memcpy(&client->cbmid, &wb->coinb1ctx, sizeof(sha256_ctx));
+		sha256_update(&client->cbmid, client->enonce1bin, enonce1len);
+		memcpy(client->cbmid_enonce1, client->enonce1bin, enonce1len);
+		client->cbmid_generation = wb->generation;
+	}
+	memcpy(ctx, &client->cbmid, sizeof(sha256_ctx));
+	mutex_unlock(&client->cbmid_lock);
+}
 
-	/* Calculate the diff of the share here */
-	ret = share_diff(coinbase, client->enonce1bin, wb, nonce2, ntime32, nonce, hash, swap, &cblen);
+/* Set up the coinbase midstate of a share and the tail left to hash after it,
+ * made of the unhashed partial block, nonce2 and as much of coinb2 as fits. */
+static void submission_tail(submission_t *sub)
+{
+	const workbase_t *wb = sub->wb;
+	sha256_ctx *ctx = &sub->cbctx;
+	uchar nonce2bin[16];
+	int skip;
 
-	/* Test we haven't solved a block regardless of share status */
-	test_blocksolve(client, wb, swap, hash, ret, coinbase, cblen, nonce2, nonce, ntime32);
+	client_midstate(sub->client, wb, ctx);
+	hex2bin(nonce2bin, sub->nonce2, wb->enonce2varlen);
+	sha256_update(ctx, nonce2bin, wb->enonce2varlen);
+	/* Hash enough whole blocks of an oversized coinb2 into the midstate for
+	 * the rest to fit in the tail */
+	skip = ctx->len + wb->coinb2len - SUBMISSION_TAIL_LEN;
+	if (unlikely(skip > 0)) {
+		skip = ((skip + SHA256_BLOCK_SIZE - 1) & ~(SHA256_BLOCK_SIZE - 1)) - ctx->len;
+		sha256_update(ctx, wb->coinb2bin, skip);
+	} else
+		skip = 0;
+	memcpy(sub->cbtail, ctx->block, ctx->len);
+	memcpy(sub->cbtail + ctx->len, wb->coinb2bin + skip, wb->coinb2len - skip);
+	sub->cbtaillen = ctx->len + wb->coinb2len - skip;
+}
 
-	free(coinbase);
+/* Hash the shares, finishing each coinbase from its midstate, and calculate
+ * their diffs. Every stage of all the shares is hashed together with the multi
+ * buffer sha256d, grouping shares with coinbase tails or merkle branches of
+ * different lengths. Needs to be entered with workbase_lock held and clients
+ * holding a ref count. */
+static void submission_diffs(submission_t **subs, const int count)
+{
+	const unsigned char *msgs[count];
+	const uint32_t *mids[count];
+	unsigned char *digests[count];
+	uchar merkle_sha[count][64];
+	int i, j, hashes, level;
+	bool done[count];
+
+	for (i = 0; i < count; i++) {
+		submission_tail(subs[i]);
+		done[i] = false;
+	}
+	for (i = 0; i < count; i++) {
+		const submission_t *sub = subs[i];
+
+		if (done[i])
+			continue;
+		for (hashes = 0, j = i; j < count; j++) {
+			if (done[j] || subs[j]->cbtaillen != sub->cbtaillen ||
+			    subs[j]->cbctx.tot_len != sub->cbctx.tot_len)
+				continue;
+			mids[hashes] = subs[j]->cbctx.h;
+			msgs[hashes] = subs[j]->cbtail;
+			digests[hashes++] = merkle_sha[j];
+			done[j] = true;
+		}
+		sha256d_multi_mid(mids, sub->cbctx.tot_len, msgs, sub->cbtaillen, digests, hashes);
+	}
+	for (level = 0; ; level++) {
+		for (hashes = 0, i = 0; i < count; i++) {
+			if (level >= subs[i]->wb->merkles)
+				continue;
+			memcpy(merkle_sha[i] + 32, &subs[i]->wb->merklebin[level], 32);
+			msgs[hashes] = merkle_sha[i];
+			digests[hashes++] = merkle_sha[i];
+		}
+		if (!hashes)
+			break;
+		/* Digests are only written after all the lanes are hashed so
+		 * hashing in place is safe */
+		sha256d_multi(msgs, 64, digests, hashes);
+	}
+	for (i = 0; i < count; i++) {
+		submission_t *sub = subs[i];
+
+		share_header(sub->wb, merkle_sha[i], sub->ntime32, sub->nonce, sub->swap);
+		msgs[i] = sub->swap;
+		digests[i] = sub->hash;
+	}
+	sha256d_multi(msgs, 80, digests, count);
+	for (i = 0; i < count; i++)
+		subs[i]->sdiff = diff_from_target(subs[i]->hash);
+}
+
+/* Hash a single share and calculate its diff */
+static void submission_diff(submission_t *sub)
+{
+	submission_diffs(&sub, 1);
+}
+
+/* The genesis block's coinbase and header, mined as a share by splitting the
+ * coinbase around an enonce1 and nonce2 */
+static const char *genesis_coinbase = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff4d04ffff001d0104455468652054696d65732030332f4a616e2f32303039204368616e63656c6c6f72206f6e206272696e6b206f66207365636f6e64206261696c6f757420666f722062616e6b73ffffffff0100f2052a01000000434104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac00000000";
+static const char *genesis_header = "0000000100000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000495fab291d00ffff00000000";
+static const char *genesis_hash = "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f";
+
+#define SHARETEST_WORKBASES 16
+#define SHARETEST_CLIENTS 32
+#define SHARETEST_SHARES 512
+#define SHARETEST_BATCH 32
+
+static void random_bin(uchar *bin, const int len, unsigned int *seed)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		bin[i] = rand_r(seed);
+}
+
+/* Check that hashing shares in batches gives exactly the hashes, headers and
+ * diffs of hashing each one alone with share_diff. The genesis block is
+ * tested as a share against its known hash, followed by random shares on
+ * workbases with coinbases and merkle branches of every length that batches
+ * are grouped by, including coinb2s too large for the share tail. */
+bool stratifier_share_test(void)
+{
+	stratum_instance_t *clients = ckzalloc(sizeof(stratum_instance_t) * SHARETEST_CLIENTS);
+	submission_t *subs = ckzalloc(sizeof(submission_t) * SHARETEST_SHARES);
+	uchar (*hashes)[32] = ckalloc(32 * SHARETEST_SHARES);
+	uchar (*swaps)[80] = ckalloc(80 * SHARETEST_SHARES);
+	char (*nonces)[12] = ckalloc(12 * SHARETEST_SHARES);
+	double *sdiffs = ckalloc(sizeof(double) * SHARETEST_SHARES);
+	workbase_t wbs[SHARETEST_WORKBASES];
+	submission_t *hashing[SHARETEST_BATCH];
+	unsigned int seed = 42;
+	char hexhash[68];
+	bool ret = false;
+	int i, j, cblen;
+	uchar hash[32];
+
+	memset(wbs, 0, sizeof(wbs));
+	for (i = 0; i < SHARETEST_WORKBASES; i++) {
+		workbase_t *wb = &wbs[i];
+
+		if (!i) {
+			/* coinb1, 4 bytes enonce1, 8 bytes nonce2, coinb2 */
+			wb->coinb1len = 50;
+			wb->enonce1varlen = 4;
+			wb->enonce2varlen = 8;
+			wb->coinb2len = 204 - 62;
+			wb->coinb1bin = ckalloc(204);
+			hex2bin(wb->coinb1bin, genesis_coinbase, 204);
+			wb->coinb2bin = wb->coinb1bin + 62;
+			hex2bin(wb->headerbin, genesis_header, 80);
+		} else {
+			wb->coinb1len = 41 + rand_r(&seed) % 100;
+			wb->enonce1constlen = rand_r(&seed) % 2 ? 0 : 1 + rand_r(&seed) % 4;
+			wb->enonce1varlen = rand_r(&seed) % 2 ? 4 : 8;
+			wb->enonce2varlen = rand_r(&seed) % 2 ? 4 : 8;
+			wb->coinb2len = 8 + rand_r(&seed) % 500;
+			wb->merkles = rand_r(&seed) % 13;
+			wb->coinb1bin = ckalloc(wb->coinb1len + wb->coinb2len);
+			random_bin(wb->coinb1bin, wb->coinb1len + wb->coinb2len, &seed);
+			wb->coinb2bin = wb->coinb1bin + wb->coinb1len;
+			wb->merklebin = ckalloc(32 * (wb->merkles + 1));
+			random_bin((uchar *)wb->merklebin, 32 * wb->merkles, &seed);
+			random_bin((uchar *)wb->headerbin, 80, &seed);
+		}
+		sha256_init(&wb->coinb1ctx);
+		sha256_update(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
+		wb->generation = i + 1;
+	}
+	for (i = 0; i < SHARETEST_CLIENTS; i++) {
+		mutex_init(&clients[i].cbmid_lock);
+		if (i)
+			random_bin(clients[i].enonce1bin, 16, &seed);
+		else
+			memcpy(clients[i].enonce1bin, wbs[0].coinb1bin + 50, 4);
+	}
+
+	/* Work out each share's hash alone first */
+	for (i = 0; i < SHARETEST_SHARES; i++) {
+		char coinbase[1024];
+		submission_t *sub = &subs[i];
+		uchar bin[16];
+
+		sub->client = &clients[i % SHARETEST_CLIENTS];
+		sub->wb = &wbs[i ? rand_r(&seed) % SHARETEST_WORKBASES : 0];
+		sub->nonce2 = sub->nonce2buf;
+		if (i) {
+			random_bin(bin, sub->wb->enonce2varlen, &seed);
+			__bin2hex(sub->nonce2buf, bin, sub->wb->enonce2varlen);
+			random_bin(bin, 4, &seed);
+			__bin2hex(nonces[i], bin, 4);
+			sub->ntime32 = rand_r(&seed);
+		} else {
+			__bin2hex(sub->nonce2buf, wbs[0].coinb1bin + 54, 8);
+			strcpy(nonces[i], "7c2bac1d");
+			sub->ntime32 = 0x495fab29;
+		}
+		sub->nonce = nonces[i];
+		sdiffs[i] = share_diff(coinbase, sub->client->enonce1bin, sub->wb, sub->nonce2,
+				       sub->ntime32, sub->nonce, hashes[i], swaps[i], &cblen);
+	}
+	bswap_256(hash, hashes[0]);
+	__bin2hex(hexhash, hash, 32);
+	if (unlikely(strcmp(hexhash, genesis_hash))) {
+		LOGERR("Genesis block share hashed to %s", hexhash);
+		goto out;
+	}
+
+	for (i = 0; i < SHARETEST_SHARES; i += j) {
+		for (j = 0; j < SHARETEST_BATCH && i + j < SHARETEST_SHARES; j++)
+			hashing[j] = &subs[i + j];
+		submission_diffs(hashing, j);
+	}
+	for (i = 0; i < SHARETEST_SHARES; i++) {
+		submission_t *sub = &subs[i];
 
+		if (unlikely(memcmp(sub->hash, hashes[i], 32) || memcmp(sub->swap, swaps[i], 80) ||
+			     sub->sdiff != sdiffs[i])) {
+			LOGERR("Batched share %d hash differs from share_diff, %d merkles %d coinb2len",
+			       i, sub->wb->merkles, sub->wb->coinb2len);
+			goto out;
+		}
+	}
+	ret = true;
+out:
+	for (i = 0; i < SHARETEST_WORKBASES; i++) {
+		free(wbs[i].coinb1bin);
+		free(wbs[i].merklebin);
+	}
+	free(clients);
+	free(subs);
+	free(hashes);
+	free(swaps);
+	free(nonces);
+	free(sdiffs);
 	return ret;
 }
 
-/* Optimised for the common case where shares are new */
-static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+/* Double the slots of a share shard and reinsert its hashes. Must be entered
+ * with the shard lock held. */
+static void __grow_share_shard(share_shard_t *shard)
 {
-	share_t *share = ckzalloc(sizeof(share_t)), *match = NULL;
-	bool ret = true;
+	uint64_t (*old)[4] = shard->hashes;
+	const int oldslots = shard->slots;
+	int i, slot;
+
+	shard->slots <<= 1;
+	shard->hashes = ckzalloc(sizeof(*shard->hashes) * shard->slots);
+	for (i = 0; i < oldslots; i++) {
+		if (!(old[i][0] | old[i][1] | old[i][2] | old[i][3]))
+			continue;
+		slot = old[i][1] & (shard->slots - 1);
+		while (shard->hashes[slot][0] | shard->hashes[slot][1] |
+		       shard->hashes[slot][2] | shard->hashes[slot][3])
+			slot = (slot + 1) & (shard->slots - 1);
+		memcpy(shard->hashes[slot], old[i], 32);
+	}
+	free(old);
+}
+
+/* Optimised for the common case where shares are new. The low bytes of the
+ * hash are random so they pick the shard and the first slot probed. */
+static enum share_check new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+{
+	share_table_t *table;
+	share_shard_t *shard;
+	uint64_t key[4];
+	enum share_check ret = SHARE_NEW;
+	int slot;
 
-	memcpy(share->hash, hash, 32);
-	share->workbase_id = wb_id;
+	memcpy(key, hash, 32);
 
-	mutex_lock(&sdata->share_lock);
-	sdata->shares_generated++;
-	HASH_FIND(hh, sdata->shares, hash, 32, match);
-	if (likely(!match))
-		HASH_ADD(hh, sdata->shares, hash, 32, share);
-	mutex_unlock(&sdata->share_lock);
+	rd_lock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_tables, &wb_id, table);
+	/* Tables outlive the latency of every node so a share can only get
+	 * here without one if it's too late to be checked */
+	if (unlikely(!table)) {
+		ret = SHARE_NOTABLE;
+		goto out_unlock;
+	}
+	shard = &table->shards[key[0] & (SHARE_SHARDS - 1)];
+	mutex_lock(&shard->lock);
+	shard->generated++;
+	if (unlikely(shard->count * 2 >= shard->slots))
+		__grow_share_shard(shard);
+	slot = key[1] & (shard->slots - 1);
+	while (42) {
+		uint64_t *match = shard->hashes[slot];
 
-	if (unlikely(match)) {
-		dealloc(share);
-		ret = false;
+		if (!(match[0] | match[1] | match[2] | match[3])) {
+			memcpy(match, key, 32);
+			shard->count++;
+			break;
+		}
+		if (unlikely(!memcmp(match, key, 32))) {
+			ret = SHARE_DUPE;
+			break;
+		}
+		slot = (slot + 1) & (shard->slots - 1);
 	}
+	mutex_unlock(&shard->lock);
+out_unlock:
+	rd_unlock(&sdata->share_lock);
+
 	return ret;
 }
 
@@ -5538,20 +7348,29 @@ static void submit_share(stratum_instance_t *client, const int64_t jobid, const
 	generator_add_send(ckp, json_msg);
 }
 
+/* Workers and users span clients on different share processing threads so
+ * raise their best diff without a lock, returning true if sdiff is the best */
+static bool raise_best_diff(double *best_diff, const double sdiff)
+{
+	double best;
+
+	__atomic_load(best_diff, &best, __ATOMIC_RELAXED);
+	while (sdiff > best) {
+		if (__atomic_compare_exchange(best_diff, &best, (double *)&sdiff, true,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
 static void check_best_diff(ckpool_t *ckp, sdata_t *sdata, user_instance_t *user,
 			    worker_instance_t *worker, const double sdiff, stratum_instance_t *client)
 {
+	bool best_worker, best_user;
 	char buf[512];
-	bool best_worker = false, best_user = false;
 
-	if (sdiff > worker->best_diff) {
-		worker->best_diff = sdiff;
-		best_worker = true;
-	}
-	if (sdiff > user->best_diff) {
-		user->best_diff = sdiff;
-		best_user = true;
-	}
+	best_worker = raise_best_diff(&worker->best_diff, sdiff);
+	best_user = raise_best_diff(&user->best_diff, sdiff);
 	if (likely(!CKP_STANDALONE(ckp) || (!best_user && !best_worker) || !client))
 		return;
 	snprintf(buf, 511, "New best share for %s: %lf", best_user ? "user" : "worker", sdiff);
@@ -5560,219 +7379,268 @@ static void check_best_diff(ckpool_t *ckp, sdata_t *sdata, user_instance_t *user
 
 #define JSON_ERR(err) json_string(SHARE_ERR(err))
 
-/* Needs to be entered with client holding a ref count. */
-static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
-			    const json_t *params_val, json_t **err_val)
+/* The share is timed from when it was received rather than when it came off
+ * the queues. */
+static void init_submission(submission_t *sub, stratum_instance_t *client, json_t *json_msg,
+			    const json_t *params_val, const ts_t *received)
 {
-	bool share = false, result = false, invalid = true, submit = false;
-	user_instance_t *user = client->user_instance;
-	double diff = client->diff, wdiff = 0, sdiff = -1;
-	char hexhash[68] = {}, sharehash[32], cdfield[64];
-	const char *workername, *job_id, *ntime, *nonce;
-	char *fname = NULL, *s, *nonce2;
-	sdata_t *sdata = client->sdata;
-	enum share_err err = SE_NONE;
-	ckpool_t *ckp = client->ckp;
-	char idstring[20] = {};
-	workbase_t *wb = NULL;
-	uint32_t ntime32;
-	uchar hash[32];
-	int nlen, len;
-	time_t now_t;
-	json_t *val;
-	int64_t id;
-	ts_t now;
-	FILE *fp;
+	memset(sub, 0, sizeof(submission_t));
+	sub->client = client;
+	sub->json_msg = json_msg;
+	sub->params_val = params_val;
+	sub->invalid = true;
+	sub->err = SE_NONE;
+	sub->sdiff = -1;
 
-	ts_realtime(&now);
-	now_t = now.tv_sec;
-	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
+	sub->now = *received;
+	sprintf(sub->cdfield, "%lu,%lu", sub->now.tv_sec, sub->now.tv_nsec);
+}
+
+/* Check the mining.submit parameters are well formed, setting err_val if
+ * not. */
+static bool submission_params(submission_t *sub)
+{
+	const json_t *params_val = sub->params_val;
+	stratum_instance_t *client = sub->client;
+	char *nonce2;
 
 	if (unlikely(!json_is_array(params_val))) {
-		err = SE_NOT_ARRAY;
-		*err_val = JSON_ERR(err);
-		goto out;
+		sub->err = SE_NOT_ARRAY;
+		sub->err_val = JSON_ERR(sub->err);
+		return false;
 	}
 	if (unlikely(json_array_size(params_val) < 5)) {
-		err = SE_INVALID_SIZE;
-		*err_val = JSON_ERR(err);
-		goto out;
+		sub->err = SE_INVALID_SIZE;
+		sub->err_val = JSON_ERR(sub->err);
+		return false;
 	}
-	workername = json_string_value(json_array_get(params_val, 0));
-	if (unlikely(!workername || !strlen(workername))) {
-		err = SE_NO_USERNAME;
-		*err_val = JSON_ERR(err);
-		goto out;
+	sub->workername = json_string_value(json_array_get(params_val, 0));
+	if (unlikely(!sub->workername || !strlen(sub->workername))) {
+		sub->err = SE_NO_USERNAME;
+		sub->err_val = JSON_ERR(sub->err);
+		return false;
 	}
-	job_id = json_string_value(json_array_get(params_val, 1));
-	if (unlikely(!job_id || !strlen(job_id))) {
-		err = SE_NO_JOBID;
-		*err_val = JSON_ERR(err);
-		goto out;
+	sub->job_id = json_string_value(json_array_get(params_val, 1));
+	if (unlikely(!sub->job_id || !strlen(sub->job_id))) {
+		sub->err = SE_NO_JOBID;
+		sub->err_val = JSON_ERR(sub->err);
+		return false;
 	}
 	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
 	if (unlikely(!nonce2 || !strlen(nonce2) || !validhex(nonce2))) {
-		err = SE_NO_NONCE2;
-		*err_val = JSON_ERR(err);
-		goto out;
+		sub->err = SE_NO_NONCE2;
+		sub->err_val = JSON_ERR(sub->err);
+		return false;
 	}
-	ntime = json_string_value(json_array_get(params_val, 3));
-	if (unlikely(!ntime || !strlen(ntime) || !validhex(ntime))) {
-		err = SE_NO_NTIME;
-		*err_val = JSON_ERR(err);
-		goto out;
+	sub->nonce2 = nonce2;
+	sub->ntime = json_string_value(json_array_get(params_val, 3));
+	if (unlikely(!sub->ntime || !strlen(sub->ntime) || !validhex(sub->ntime))) {
+		sub->err = SE_NO_NTIME;
+		sub->err_val = JSON_ERR(sub->err);
+		return false;
 	}
-	nonce = json_string_value(json_array_get(params_val, 4));
-	if (unlikely(!nonce || !strlen(nonce) || !validhex(nonce))) {
-		err = SE_NO_NONCE;
-		*err_val = JSON_ERR(err);
-		goto out;
+	sub->nonce = json_string_value(json_array_get(params_val, 4));
+	if (unlikely(!sub->nonce || !strlen(sub->nonce) || !validhex(sub->nonce))) {
+		sub->err = SE_NO_NONCE;
+		sub->err_val = JSON_ERR(sub->err);
+		return false;
 	}
-	if (safecmp(workername, client->workername)) {
-		err = SE_WORKER_MISMATCH;
-		*err_val = JSON_ERR(err);
-		goto out;
+	if (safecmp(sub->workername, client->workername)) {
+		sub->err = SE_WORKER_MISMATCH;
+		sub->err_val = JSON_ERR(sub->err);
+		return false;
 	}
-	sscanf(job_id, "%lx", &id);
-	sscanf(ntime, "%x", &ntime32);
+	sscanf(sub->job_id, "%lx", &sub->id);
+	sscanf(sub->ntime, "%x", &sub->ntime32);
 
-	share = true;
+	sub->share = true;
+	return true;
+}
 
-	ck_rlock(&sdata->workbase_lock);
-	HASH_FIND_I64(sdata->workbases, &id, wb);
-	if (unlikely(!wb)) {
-		if (!sdata->current_workbase) {
-			ck_runlock(&sdata->workbase_lock);
+/* Find the workbase this share was submitted against and prepare it for
+ * hashing. Must be entered with workbase_lock held. Returns false if there is
+ * no workbase at all to test it against. */
+static bool __submission_workbase(sdata_t *sdata, submission_t *sub)
+{
+	workbase_t *wb;
+	int nlen, len;
 
-			return json_boolean(false);
-		}
-		id = sdata->current_workbase->id;
-		err = SE_INVALID_JOBID;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
-		strncpy(idstring, job_id, 19);
-		ASPRINTF(&fname, "%s.sharelog", sdata->current_workbase->logdir);
-		goto out_unlock;
-	}
-	wdiff = wb->diff;
-	strncpy(idstring, wb->idstring, 19);
-	ASPRINTF(&fname, "%s.sharelog", wb->logdir);
+	HASH_FIND_I64(sdata->workbases, &sub->id, wb);
+	if (unlikely(!wb)) {
+		if (!sdata->current_workbase)
+			return false;
+		sub->id = sdata->current_workbase->id;
+		sub->err = SE_INVALID_JOBID;
+		json_set_string(sub->json_msg, "reject-reason", SHARE_ERR(sub->err));
+		strncpy(sub->idstring, sub->job_id, 19);
+		ASPRINTF(&sub->fname, "%s.sharelog", sdata->current_workbase->logdir);
+		return true;
+	}
+	sub->wb = wb;
+	sub->wdiff = wb->diff;
+	strncpy(sub->idstring, wb->idstring, 19);
+	ASPRINTF(&sub->fname, "%s.sharelog", wb->logdir);
 	/* Fix broken clients sending too many chars. Nonce2 is part of the
 	 * read only json so use a temporary variable and modify it. */
 	len = wb->enonce2varlen * 2;
-	nlen = strlen(nonce2);
+	nlen = strlen(sub->nonce2);
 	if (nlen > len) {
-		nonce2 = strdupa(nonce2);
-		nonce2[len] = '\0';
+		memcpy(sub->nonce2buf, sub->nonce2, len);
+		sub->nonce2buf[len] = '\0';
+		sub->nonce2 = sub->nonce2buf;
 	} else if (nlen < len) {
-		char *tmp = nonce2;
-
-		nonce2 = strdupa("0000000000000000");
-		memcpy(nonce2, tmp, nlen);
-		nonce2[len] = '\0';
+		strcpy(sub->nonce2buf, "0000000000000000");
+		memcpy(sub->nonce2buf, sub->nonce2, nlen);
+		sub->nonce2buf[len] = '\0';
+		sub->nonce2 = sub->nonce2buf;
 	}
-	sdiff = submission_diff(client, wb, nonce2, ntime32, nonce, hash);
-	if (sdiff > client->best_diff) {
+	return true;
+}
+
+/* Test a hashed share for block solves, best diff, staleness and ntime.
+ * Must be entered with workbase_lock held and client holding a ref count. */
+static void __submission_test(sdata_t *sdata, submission_t *sub)
+{
+	stratum_instance_t *client = sub->client;
+	user_instance_t *user = client->user_instance;
+	workbase_t *wb = sub->wb;
+	char sharehash[32];
+
+	if (unlikely(!wb))
+		return;
+
+	/* Test we haven't solved a block regardless of share status */
+	test_blocksolve(client, wb, sub->swap, sub->hash, sub->sdiff, sub->nonce2, sub->nonce,
+			sub->ntime32, &sub->now);
+
+	if (sub->sdiff > client->best_diff) {
 		worker_instance_t *worker = client->worker_instance;
 
-		client->best_diff = sdiff;
+		client->best_diff = sub->sdiff;
 		LOGINFO("User %s worker %s client %s new best diff %lf", user->username,
-			worker->workername, client->identity, sdiff);
-		check_best_diff(ckp, sdata, user, worker, sdiff, client);
+			worker->workername, client->identity, sub->sdiff);
+		check_best_diff(client->ckp, sdata, user, worker, sub->sdiff, client);
 	}
-	bswap_256(sharehash, hash);
-	__bin2hex(hexhash, sharehash, 32);
+	bswap_256(sharehash, sub->hash);
+	__bin2hex(sub->hexhash, sharehash, 32);
 
-	if (id < sdata->blockchange_id) {
+	if (sub->id < sdata->blockchange_id) {
 		/* Accept shares if they're received on remote nodes before the
 		 * workbase was retired. */
 		if (client->latency) {
 			int latency;
 			tv_t now_tv;
 
-			ts_to_tv(&now_tv, &now);
+			ts_to_tv(&now_tv, &sub->now);
 			latency = ms_tvdiff(&now_tv, &wb->retired);
 			if (latency < client->latency) {
-				LOGDEBUG("Accepting %dms late share from client %s",
-					 latency, client->identity);
+				LOGCLIENT(client, LOG_DEBUG, "Accepting %dms late share from client %s",
+					  latency, client->identity);
 				goto no_stale;
 			}
 		}
-		err = SE_STALE;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
+		sub->err = SE_STALE;
+		json_set_string(sub->json_msg, "reject-reason", SHARE_ERR(sub->err));
 		goto out_submit;
 	}
 no_stale:
 	/* Ntime cannot be less, but allow forward ntime rolling up to max */
-	if (ntime32 < wb->ntime32 || ntime32 > wb->ntime32 + 7000) {
-		err = SE_NTIME_INVALID;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
-		goto out_unlock;
+	if (sub->ntime32 < wb->ntime32 || sub->ntime32 > wb->ntime32 + 7000) {
+		sub->err = SE_NTIME_INVALID;
+		json_set_string(sub->json_msg, "reject-reason", SHARE_ERR(sub->err));
+		return;
 	}
-	invalid = false;
+	sub->invalid = false;
 out_submit:
-	if (sdiff >= wdiff)
-		submit = true;
-out_unlock:
-	ck_runlock(&sdata->workbase_lock);
+	if (sub->sdiff >= sub->wdiff)
+		sub->submit = true;
+}
+
+/* Account for a share once it has been tested, outside of workbase_lock.
+ * Needs to be entered with client holding a ref count. */
+static json_t *submission_result(submission_t *sub)
+{
+	stratum_instance_t *client = sub->client;
+	user_instance_t *user = client->user_instance;
+	double diff = client->diff, sdiff = sub->sdiff;
+	sdata_t *sdata = client->sdata;
+	ckpool_t *ckp = client->ckp;
+	json_t *json_msg = sub->json_msg;
+	enum share_err err = sub->err;
+	bool result = false;
+	time_t now_t;
+	json_t *val;
+
+	now_t = sub->now.tv_sec;
+	if (!sub->share)
+		goto out;
 
 	/* Accept shares of the old diff until the next update */
-	if (id < client->diff_change_job_id)
+	if (sub->id < client->diff_change_job_id)
 		diff = client->old_diff;
-	if (!invalid) {
-		char wdiffsuffix[16];
+	if (!sub->invalid) {
+		char wdiffsuffix[16] = "";
 
-		suffix_string(wdiff, wdiffsuffix, 16, 0);
+		if (CLIENT_LOG_WANTED(client, LOG_INFO))
+			suffix_string(sub->wdiff, wdiffsuffix, 16, 0);
 		if (sdiff >= diff) {
-			if (new_share(sdata, hash, id)) {
-				LOGINFO("Accepted client %s share diff %.1f/%.0f/%s: %s",
-					client->identity, sdiff, diff, wdiffsuffix, hexhash);
+			enum share_check check = new_share(sdata, sub->hash, sub->id);
+
+			if (likely(check == SHARE_NEW)) {
+				LOGCLIENT(client, LOG_INFO, "Accepted client %s share diff %.1f/%.0f/%s: %s",
+					  client->identity, sdiff, diff, wdiffsuffix, sub->hexhash);
 				result = true;
-			} else {
+			} else if (check == SHARE_DUPE) {
 				err = SE_DUPE;
 				json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
-				LOGINFO("Rejected client %s dupe diff %.1f/%.0f/%s: %s",
-					client->identity, sdiff, diff, wdiffsuffix, hexhash);
-				submit = false;
+				LOGCLIENT(client, LOG_INFO, "Rejected client %s dupe diff %.1f/%.0f/%s: %s",
+					  client->identity, sdiff, diff, wdiffsuffix, sub->hexhash);
+				sub->submit = false;
+			} else {
+				err = SE_STALE;
+				json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
+				LOGCLIENT(client, LOG_INFO, "Rejected client %s late diff %.1f/%.0f/%s: %s",
+					  client->identity, sdiff, diff, wdiffsuffix, sub->hexhash);
 			}
 		} else {
 			err = SE_HIGH_DIFF;
-			LOGINFO("Rejected client %s high diff %.1f/%.0f/%s: %s",
-				client->identity, sdiff, diff, wdiffsuffix, hexhash);
+			LOGCLIENT(client, LOG_INFO, "Rejected client %s high diff %.1f/%.0f/%s: %s",
+				  client->identity, sdiff, diff, wdiffsuffix, sub->hexhash);
 			json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
-			submit = false;
+			sub->submit = false;
 		}
 	}  else
-		LOGINFO("Rejected client %s invalid share %s", client->identity, SHARE_ERR(err));
+		LOGCLIENT(client, LOG_INFO, "Rejected client %s invalid share %s", client->identity, SHARE_ERR(err));
 
 	/* Submit share to upstream pool in proxy mode. We submit valid and
 	 * stale shares and filter out the rest. */
-	if (wb && wb->proxy && submit) {
-		LOGINFO("Submitting share upstream: %s", hexhash);
-		submit_share(client, id, nonce2, ntime, nonce);
+	if (sub->wb && sub->wb->proxy && sub->submit) {
+		LOGINFO("Submitting share upstream: %s", sub->hexhash);
+		submit_share(client, sub->id, sub->nonce2, sub->ntime, sub->nonce);
 	}
 
-	add_submit(ckp, client, diff, result, submit, sdiff);
+	add_submit(ckp, client, diff, result, sub->submit, sdiff);
 
 	/* Now write to the pool's sharelog. */
 	val = json_object();
-	json_set_int(val, "workinfoid", id);
+	json_set_int(val, "workinfoid", sub->id);
 	json_set_int(val, "clientid", client->id);
 	json_set_string(val, "enonce1", client->enonce1);
 	if (!CKP_STANDALONE(ckp))
 		json_set_string(val, "secondaryuserid", user->secondaryuserid);
-	json_set_string(val, "nonce2", nonce2);
-	json_set_string(val, "nonce", nonce);
-	json_set_string(val, "ntime", ntime);
+	json_set_string(val, "nonce2", sub->nonce2);
+	json_set_string(val, "nonce", sub->nonce);
+	json_set_string(val, "ntime", sub->ntime);
 	json_set_double(val, "diff", diff);
 	json_set_double(val, "sdiff", sdiff);
-	json_set_string(val, "hash", hexhash);
+	json_set_string(val, "hash", sub->hexhash);
 	json_set_bool(val, "result", result);
 	json_object_set(val, "reject-reason", json_object_get(json_msg, "reject-reason"));
-	json_object_set(val, "error", *err_val);
+	json_object_set(val, "error", sub->err_val);
 	json_set_int(val, "errn", err);
-	json_set_string(val, "createdate", cdfield);
+	json_set_string(val, "createdate", sub->cdfield);
 	json_set_string(val, "createby", "code");
-	json_set_string(val, "createcode", __func__);
+	json_set_string(val, "createcode", "parse_submit");
 	json_set_string(val, "createinet", ckp->serverurl[client->server]);
 	json_set_string(val, "workername", client->workername);
 	json_set_string(val, "username", user->username);
@@ -5780,21 +7648,12 @@ out_unlock:
         json_set_string(val, "agent", client->useragent);
 
 	if (ckp->logshares) {
-		fp = fopen(fname, "ae");
-		if (likely(fp)) {
-			s = json_dumps(val, JSON_EOL);
-			len = strlen(s);
-			len = fprintf(fp, "%s", s);
-			free(s);
-			fclose(fp);
-			if (unlikely(len < 0))
-				LOGERR("Failed to fwrite to %s", fname);
-		} else
-			LOGERR("Failed to fopen %s", fname);
+		queue_sharelog(ckp, sub->fname, json_dumps(val, JSON_EOL));
+		sub->fname = NULL;
 	}
 	ckdbq_add(ckp, ID_SHARES, val);
 out:
-	if (!sdata->wbincomplete && ((!result && !submit) || !share)) {
+	if (!sdata->wbincomplete && ((!result && !sub->submit) || !sub->share)) {
 		/* Is this the first in a run of invalids? */
 		if (client->first_invalid < client->last_share.tv_sec || !client->first_invalid)
 			client->first_invalid = now_t;
@@ -5820,7 +7679,7 @@ out:
 		client->reject = 0;
 	}
 
-	if (!share) {
+	if (!sub->share) {
 		if (!CKP_STANDALONE(ckp)) {
 			val = json_object();
 			json_set_int(val, "clientid", client->id);
@@ -5829,20 +7688,45 @@ out:
 			json_set_int(val, "workinfoid", sdata->current_workbase->id);
 			json_set_string(val, "workername", client->workername);
 			json_set_string(val, "username", user->username);
-			json_object_set(val, "error", *err_val);
+			json_object_set(val, "error", sub->err_val);
 			json_set_int(val, "errn", err);
-			json_set_string(val, "createdate", cdfield);
+			json_set_string(val, "createdate", sub->cdfield);
 			json_set_string(val, "createby", "code");
-			json_set_string(val, "createcode", __func__);
+			json_set_string(val, "createcode", "parse_submit");
 			json_set_string(val, "createinet", ckp->serverurl[client->server]);
 			ckdbq_add(ckp, ID_SHAREERR, val);
 		}
-		LOGINFO("Invalid share from client %s: %s", client->identity, client->workername);
+		LOGCLIENT(client, LOG_INFO, "Invalid share from client %s: %s", client->identity, client->workername);
 	}
-	free(fname);
+	free(sub->fname);
 	return json_boolean(result);
 }
 
+/* Needs to be entered with client holding a ref count. */
+static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
+			    const json_t *params_val, const ts_t *received, json_t **err_val)
+{
+	sdata_t *sdata = client->sdata;
+	submission_t sub;
+	json_t *ret;
+
+	init_submission(&sub, client, json_msg, params_val, received);
+	if (submission_params(&sub)) {
+		ck_rlock(&sdata->workbase_lock);
+		if (unlikely(!__submission_workbase(sdata, &sub))) {
+			ck_runlock(&sdata->workbase_lock);
+			return json_boolean(false);
+		}
+		if (sub.wb)
+			submission_diff(&sub);
+		__submission_test(sdata, &sub);
+		ck_runlock(&sdata->workbase_lock);
+	}
+	ret = submission_result(&sub);
+	*err_val = sub.err_val;
+	return ret;
+}
+
 /* Must enter with workbase_lock held */
 static json_t *__stratum_notify(const workbase_t *wb, const bool clean)
 {
@@ -5915,7 +7799,7 @@ static void update_client(const stratum_instance_t *client, const int64_t client
 
 static json_params_t
 *create_json_params(const int64_t client_id, const json_t *method, const json_t *params,
-		    const json_t *id_val)
+		    const json_t *id_val, const ts_t *received)
 {
 	json_params_t *jp = ckalloc(sizeof(json_params_t));
 
@@ -5923,9 +7807,19 @@ static json_params_t
 	jp->params = json_deep_copy(params);
 	jp->id_val = json_deep_copy(id_val);
 	jp->client_id = client_id;
+	jp->received = *received;
 	return jp;
 }
 
+/* Shares from any one client always go to the same processing thread so the
+ * client's share and vardiff state is only ever touched by one thread */
+static void add_share_params(sdata_t *sdata, json_params_t *jp)
+{
+	uint64_t id = jp->client_id;
+
+	ckmsgq_add(sdata->sshareqs[id % sdata->sshareq_count], jp);
+}
+
 /* Implement support for the diff in the params as well as the originally
  * documented form of placing diff within the method. Needs to be entered with
  * client holding a ref count. */
@@ -5978,7 +7872,13 @@ static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 
 	ck_rlock(&sdata->workbase_lock);
 	HASH_ITER(hh, sdata->txns, txn, tmp) {
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", txn->hash, "data", txn->data);
+		char hashhex[68];
+		char *data;
+
+		txn_hashhex(txn, hashhex);
+		data = bin2hex(txn->data, txn->len);
+		JSON_CPACK(txn_val, "{ss,ss}", "hash", hashhex, "data", data);
+		free(data);
 		json_array_append_new(txn_array, txn_val);
 	}
 	ck_runlock(&sdata->workbase_lock);
@@ -6001,6 +7901,13 @@ static void *setup_node(void *arg)
 	client->latency = round_trip(client->address) / 2;
 	LOGNOTICE("Node client %s %s latency set to %dms", client->identity,
 		  client->address, client->latency);
+	while (42) {
+		int max = __atomic_load_n(&client->sdata->latency_max, __ATOMIC_RELAXED);
+
+		if (client->latency <= max ||
+		    __sync_bool_compare_and_swap(&client->sdata->latency_max, max, client->latency))
+			break;
+	}
 	send_node_all_txns(client->sdata, client);
 	dec_instance_ref(client->sdata, client);
 	return NULL;
@@ -6012,13 +7919,16 @@ static void *setup_node(void *arg)
  * finished. */
 static void add_mining_node(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *client)
 {
+	instance_shard_t *shard = id_shard(sdata, client->id);
 	pthread_t pth;
 
-	ck_wlock(&sdata->instance_lock);
+	shard_wlock(shard);
+	__inc_instance_ref(client);
+	ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
 	client->node = true;
 	DL_APPEND(sdata->node_instances, client);
-	__inc_instance_ref(client);
 	ck_wunlock(&sdata->instance_lock);
+	shard_wunlock(shard);
 
 	LOGWARNING("Added client %s %s as mining node on server %d:%s", client->identity,
 		   client->address, client->server, ckp->serverurl[client->server]);
@@ -6028,7 +7938,7 @@ static void add_mining_node(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *c
 
 static void add_remote_server(sdata_t *sdata, stratum_instance_t *client)
 {
-	ck_wlock(&sdata->instance_lock);
+	ck_wlock_stat(&sdata->instance_lock, &sdata->instance_stat);
 	client->remote = true;
 	DL_APPEND(sdata->remote_instances, client);
 	ck_wunlock(&sdata->instance_lock);
@@ -6037,7 +7947,7 @@ static void add_remote_server(sdata_t *sdata, stratum_instance_t *client)
 /* Enter with client holding ref count */
 static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *client,
 			 const int64_t client_id, json_t *id_val, json_t *method_val,
-			 json_t *params_val)
+			 json_t *params_val, const ts_t *received)
 {
 	const char *method;
 
@@ -6046,9 +7956,11 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	 * most common messages will be shares so look for those first */
 	method = json_string_value(method_val);
 	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
-		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
+		json_params_t *jp;
 
-		ckmsgq_add(sdata->sshareq, jp);
+		jp = create_json_params(client_id, method_val, params_val, id_val, received);
+
+		add_share_params(sdata, jp);
 		return;
 	}
 
@@ -6151,7 +8063,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 				  client->identity, client->address);
 			return;
 		}
-		jp = create_json_params(client_id, method_val, params_val, id_val);
+		jp = create_json_params(client_id, method_val, params_val, id_val, received);
 		ckmsgq_add(sdata->sauthq, jp);
 		return;
 	}
@@ -6179,7 +8091,9 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 
 	/* Covers both get_transactions and get_txnhashes */
 	if (cmdmatch(method, "mining.get")) {
-		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
+		json_params_t *jp;
+
+		jp = create_json_params(client_id, method_val, params_val, id_val, received);
 
 		ckmsgq_add(sdata->stxnq, jp);
 		return;
@@ -6193,6 +8107,8 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 static void free_smsg(smsg_t *msg)
 {
 	json_decref(msg->json_msg);
+	free(msg->buf);
+	free(msg->client_ids);
 	free(msg);
 }
 
@@ -6222,7 +8138,7 @@ static void parse_diff(stratum_instance_t *client, json_t *val)
 {
 	double diff = json_number_value(json_array_get(val, 0));
 
-	LOGINFO("Set client %s to diff %lf", client->identity, diff);
+	LOGCLIENT(client, LOG_INFO, "Set client %s to diff %lf", client->identity, diff);
 	client->diff = diff;
 }
 
@@ -6342,20 +8258,17 @@ static void parse_remote_shares(ckpool_t *ckp, sdata_t *sdata, json_t *val, cons
 	worker = get_worker(sdata, user, workername);
 	check_best_diff(ckp, sdata, user, worker, sdiff, NULL);
 
-	mutex_lock(&sdata->stats_lock);
-	sdata->stats.unaccounted_shares++;
-	sdata->stats.unaccounted_diff_shares += diff;
-	mutex_unlock(&sdata->stats_lock);
+	account_share(sdata, diff, true);
 
-	worker->shares += diff;
-	user->shares += diff;
+	__sync_add_and_fetch(&worker->shares, diff);
+	__sync_add_and_fetch(&user->shares, diff);
 	tv_time(&now_t);
 
-	decay_worker(worker, diff, &now_t);
+	add_pending_diff(&worker->pending_diff, diff);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	add_pending_diff(&user->pending_diff, diff);
 	copy_tv(&user->last_share, &now_t);
 
 	LOGINFO("Added %"PRId64" remote shares to worker %s", diff, workername);
@@ -6477,6 +8390,7 @@ static void add_node_txns(sdata_t *sdata, const json_t *val)
 
 	ck_wlock(&sdata->workbase_lock);
 	for (i = 0; i < arr_size; i++) {
+		uchar binswap[32], bin[32];
 		const char *hash, *data;
 
 		txn_val = json_array_get(txn_array, i);
@@ -6488,19 +8402,27 @@ static void add_node_txns(sdata_t *sdata, const json_t *val)
 			LOGERR("Failed to get hash/data in add_node_txns");
 			continue;
 		}
-		HASH_FIND_STR(sdata->txns, hash, txn);
-		if (txn) {
-			txn->refcount = 100;
+		txn = __find_txn(sdata, hash);
+		if (txn) {
+			txn->refcount = 100;
+			continue;
+		}
+		if (unlikely(!hex2bin(binswap, hash, 32))) {
+			LOGERR("Failed to hex2bin hash in add_node_txns");
+			continue;
+		}
+		bswap_256(bin, binswap);
+		/* Nodes only send the hash which is used as the txid */
+		txn = new_txn(bin, bin, data, strlen(data));
+		if (unlikely(!txn)) {
+			LOGERR("Failed to hex2bin data in add_node_txns");
 			continue;
 		}
-		txn = ckzalloc(sizeof(txntable_t));
-		memcpy(txn->hash, hash, 65);
-		txn->data = strdup(data);
 		/* Set the refcount for node transactions greater than the
 		 * upstream pool to ensure we never age them faster than the
 		 * pool does. */
 		txn->refcount = 100;
-		HASH_ADD_STR(sdata->txns, hash, txn);
+		HASH_ADD(hh, sdata->txns, hash, 32, txn);
 		added++;
 	}
 	ck_wunlock(&sdata->workbase_lock);
@@ -6510,7 +8432,8 @@ static void add_node_txns(sdata_t *sdata, const json_t *val)
 }
 
 /* Entered with client holding ref count */
-static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *client)
+static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *client,
+			    const ts_t *received)
 {
 	json_t *params, *method, *res_val, *id_val, *err_val = NULL;
 	int msg_type = node_msg_type(val);
@@ -6531,8 +8454,8 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *clie
 	res_val = json_object_get(val, "result");
 	switch (msg_type) {
 		case SM_SHARE:
-			jp = create_json_params(client->id, method, params, id_val);
-			ckmsgq_add(sdata->sshareq, jp);
+			jp = create_json_params(client->id, method, params, id_val, received);
+			add_share_params(sdata, jp);
 			break;
 		case SM_SHARERESULT:
 			parse_share_result(ckp, client, res_val);
@@ -6643,20 +8566,19 @@ static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, strat
 		if (!(++delays % 50))
 			LOGWARNING("%d Second delay waiting for bitcoind at startup", delays / 10);
 	}
-	parse_method(ckp, sdata, client, client_id, id_val, method, params);
+	parse_method(ckp, sdata, client, client_id, id_val, method, params, &msg->received);
 }
 
-static void srecv_process(ckpool_t *ckp, json_t *val)
+static void srecv_process(ckpool_t *ckp, smsg_t *msg)
 {
 	char address[INET6_ADDRSTRLEN], *buf = NULL;
 	bool noid = false, dropped = false;
 	sdata_t *sdata = ckp->sdata;
 	stratum_instance_t *client;
-	smsg_t *msg;
+	instance_shard_t *shard;
+	json_t *val;
 	int server;
 
-	msg = ckzalloc(sizeof(smsg_t));
-	msg->json_msg = val;
 	val = json_object_get(msg->json_msg, "client_id");
 	if (unlikely(!val)) {
 		buf = json_dumps(val, JSON_COMPACT);
@@ -6689,17 +8611,18 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 	json_object_clear(val);
 
 	/* Parse the message here */
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, msg->client_id);
+	shard = id_shard(sdata, msg->client_id);
+	shard_wlock(shard);
+	client = __instance_by_id(shard, msg->client_id);
 	/* If client_id instance doesn't exist yet, create one */
 	if (unlikely(!client)) {
 		noid = true;
-		client = __stratum_add_instance(ckp, msg->client_id, address, server);
+		client = __stratum_add_instance(ckp, shard, msg->client_id, address, server);
 	} else if (unlikely(client->dropped))
 		dropped = true;
 	if (likely(!dropped))
 		__inc_instance_ref(client);
-	ck_wunlock(&sdata->instance_lock);
+	shard_wunlock(shard);
 
 	if (unlikely(dropped)) {
 		/* Client may be NULL here */
@@ -6708,13 +8631,16 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 		connector_drop_client(ckp, msg->client_id);
 		goto out;
 	}
-	if (unlikely(noid))
+	if (unlikely(noid)) {
+		if (passthrough_subclient(client->id))
+			inherit_node(sdata, client);
 		LOGINFO("Stratifier added instance %s server %d", client->identity, server);
+	}
 
 	if (client->remote)
 		parse_trusted_msg(ckp, sdata, msg->json_msg, client);
 	else if (ckp->node)
-		node_client_msg(ckp, msg->json_msg, client);
+		node_client_msg(ckp, msg->json_msg, client, &msg->received);
 	else
 		parse_instance_msg(ckp, sdata, msg, client);
 	dec_instance_ref(sdata, client);
@@ -6723,26 +8649,45 @@ out:
 	free(buf);
 }
 
+/* Messages are stamped on receipt so shares can be timed from when they
+ * arrived rather than from when they came off the queues. */
 void stratifier_add_recv(ckpool_t *ckp, json_t *val)
 {
+	smsg_t *msg = ckzalloc(sizeof(smsg_t));
 	sdata_t *sdata = ckp->sdata;
 
-	ckmsgq_add(sdata->srecvs, val);
+	msg->json_msg = val;
+	ts_realtime(&msg->received);
+	ckmsgq_add(sdata->srecvs, msg);
 }
 
 static void ssend_process(ckpool_t *ckp, smsg_t *msg)
 {
+	char *buf;
+
+	/* The connector takes the rendered buffer and client list */
+	if (msg->buf) {
+		connector_add_broadcast(ckp, msg->buf, msg->client_ids, msg->clients);
+		free(msg);
+		return;
+	}
 	if (unlikely(!msg->json_msg)) {
 		LOGERR("Sent null json msg to stratum_sender");
 		free(msg);
 		return;
 	}
 
-	/* Add client_id to the json message and send it to the
-	 * connector process to be delivered */
-	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
-	connector_add_message(ckp, msg->json_msg);
-	/* The connector will free msg->json_msg */
+	/* Render the message here on the ssender threads and hand the bytes to
+	 * the connector to be delivered. A passthrough subclient gets its
+	 * upstream client_id instead of the passthrough's. */
+	if (msg->client_id > 0xffffffffll)
+		json_set_int64(msg->json_msg, "client_id", msg->client_id & 0xffffffffll);
+	buf = json_dumps(msg->json_msg, JSON_EOL | JSON_COMPACT);
+	json_decref(msg->json_msg);
+	if (likely(buf))
+		connector_add_rendered(ckp, msg->client_id, buf);
+	else
+		LOGWARNING("Failed to render stratum message to client %"PRId64, msg->client_id);
 	free(msg);
 }
 
@@ -6781,7 +8726,7 @@ static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 		goto out_decref;
 	}
 	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
+	result_val = parse_submit(client, json_msg, jp->params, &jp->received, &err_val);
 	json_object_set_new_nocheck(json_msg, "result", result_val);
 	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
 	steal_json_id(json_msg, jp);
@@ -6792,14 +8737,102 @@ out:
 	discard_json_params(jp);
 }
 
+/* Process shares in batches of as many as are queued, hashing them together
+ * with the multi buffer sha256d. Results are identical to processing each
+ * share with sshare_process. */
+static void sshare_process_batch(ckpool_t *ckp, json_params_t **jps, const int count)
+{
+	submission_t subs[count], *hashing[count];
+	stratum_instance_t *clients[count];
+	bool tested[count], aborted[count];
+	sdata_t *sdata = ckp->sdata;
+	int i, j, hashes;
+
+	if (count == 1) {
+		sshare_process(ckp, jps[0]);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		stratum_instance_t *client;
+
+		tested[i] = aborted[i] = false;
+		client = clients[i] = ref_instance_by_id(sdata, jps[i]->client_id);
+		if (unlikely(!client)) {
+			LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!",
+				jps[i]->client_id);
+			continue;
+		}
+		if (unlikely(!client->authorised)) {
+			LOGDEBUG("Client %s no longer authorised to submit shares", client->identity);
+			dec_instance_ref(sdata, client);
+			clients[i] = NULL;
+			continue;
+		}
+		init_submission(&subs[i], client, json_object(), jps[i]->params,
+				&jps[i]->received);
+		if (!submission_params(&subs[i]))
+			tested[i] = true;
+	}
+
+	/* Clients may be bound to different sdata in proxy mode so test each
+	 * group under its own workbase_lock */
+	for (i = 0; i < count; i++) {
+		sdata_t *wbsdata;
+
+		if (!clients[i] || tested[i])
+			continue;
+		wbsdata = clients[i]->sdata;
+		hashes = 0;
+
+		ck_rlock(&wbsdata->workbase_lock);
+		for (j = i; j < count; j++) {
+			if (!clients[j] || tested[j] || clients[j]->sdata != wbsdata)
+				continue;
+			if (unlikely(!__submission_workbase(wbsdata, &subs[j])))
+				aborted[j] = true;
+			else if (subs[j].wb)
+				hashing[hashes++] = &subs[j];
+		}
+		submission_diffs(hashing, hashes);
+		for (j = i; j < count; j++) {
+			if (!clients[j] || tested[j] || clients[j]->sdata != wbsdata)
+				continue;
+			if (!aborted[j])
+				__submission_test(wbsdata, &subs[j]);
+			tested[j] = true;
+		}
+		ck_runlock(&wbsdata->workbase_lock);
+	}
+
+	for (i = 0; i < count; i++) {
+		json_t *result_val, *json_msg;
+
+		if (clients[i]) {
+			json_msg = subs[i].json_msg;
+			if (unlikely(aborted[i]))
+				result_val = json_boolean(false);
+			else
+				result_val = submission_result(&subs[i]);
+			json_object_set_new_nocheck(json_msg, "result", result_val);
+			json_object_set_new_nocheck(json_msg, "error", subs[i].err_val ? : json_null());
+			steal_json_id(json_msg, jps[i]);
+			stratum_add_send(sdata, json_msg, jps[i]->client_id, SM_SHARERESULT);
+			dec_instance_ref(sdata, clients[i]);
+		}
+		discard_json_params(jps[i]);
+	}
+}
+
 /* As ref_instance_by_id but only returns clients not authorising or authorised,
  * and sets the authorising flag */
 static stratum_instance_t *preauth_ref_instance_by_id(sdata_t *sdata, const int64_t id)
 {
+	instance_shard_t *shard = id_shard(sdata, id);
 	stratum_instance_t *client;
 
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, id);
+	shard_wlock(shard);
+	client = __instance_by_id(shard, id);
 	if (client) {
 		if (client->dropped || client->authorising || client->authorised)
 			client = NULL;
@@ -6808,11 +8841,55 @@ static stratum_instance_t *preauth_ref_instance_by_id(sdata_t *sdata, const int6
 			client->authorising = true;
 		}
 	}
-	ck_wunlock(&sdata->instance_lock);
+	shard_wunlock(shard);
 
 	return client;
 }
 
+/* With a share rate budget set, start a client reconnecting as a worker
+ * vardiff has already settled on the same diff instead of startdiff so it
+ * doesn't flood shares while converging. Only called without a mindiff or
+ * suggested diff. */
+static void budget_startdiff(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *client)
+{
+	worker_instance_t *worker = client->worker_instance;
+	int64_t optimal = worker->lastdiff;
+	double network_diff = 0;
+	int instances;
+
+	if (!ckp->maxsps || optimal <= client->diff)
+		return;
+	/* Worker names can be shared by rigs of any size, so only assume the
+	 * last diff suits a client that is the worker's only one */
+	ck_rlock(&sdata->user_lock);
+	instances = worker->instance_count;
+	ck_runlock(&sdata->user_lock);
+	if (instances != 1)
+		return;
+	if (ckp->maxdiff)
+		optimal = MIN(optimal, ckp->maxdiff);
+
+	ck_rlock(&sdata->workbase_lock);
+	if (likely(sdata->current_workbase)) {
+		if (ckp->proxy)
+			network_diff = sdata->current_workbase->diff;
+		else
+			network_diff = sdata->current_workbase->network_diff;
+	}
+	ck_runlock(&sdata->workbase_lock);
+
+	if (network_diff)
+		optimal = MIN(optimal, network_diff);
+	if (optimal <= client->diff)
+		return;
+
+	LOGINFO("Client %s starting at worker %s diff %"PRId64, client->identity,
+		client->workername, optimal);
+	client->diff = optimal;
+	__sync_add_and_fetch(&sdata->rate_faststarts, 1);
+	stratum_send_diff(sdata, client);
+}
+
 static void sauth_process(ckpool_t *ckp, json_params_t *jp)
 {
 	json_t *result_val, *json_msg, *err_val = NULL;
@@ -6858,8 +8935,10 @@ static void sauth_process(ckpool_t *ckp, json_params_t *jp)
 		mindiff = client->suggest_diff;
 	else
 		mindiff = client->worker_instance->mindiff;
-	if (!mindiff)
+	if (!mindiff) {
+		budget_startdiff(ckp, sdata, client);
 		goto out;
+	}
 	mindiff = MAX(ckp->mindiff, mindiff);
 	if (mindiff != client->diff) {
 		client->diff = mindiff;
@@ -6923,10 +9002,41 @@ static bool test_and_clear(bool *val, mutex_t *lock)
 	return ret;
 }
 
+/* Process any requests from ckdb that are heartbeat responses with specific
+ * requests. */
+static void ckdb_response(ckpool_t *ckp, const char *buf)
+{
+	size_t responselen = strlen(buf);
+	char *response;
+	int offset = 0;
+
+	if (unlikely(responselen < 2))
+		return;
+	response = alloca(responselen);
+	memset(response, 0, responselen);
+	if (likely(sscanf(buf, "%*d.%*d.%c%n", response, &offset) > 0)) {
+		strcpy(response + 1, buf + offset);
+		if (likely(safecmp(response, "ok"))) {
+			char *cmd;
+
+			cmd = response;
+			strsep(&cmd, ".");
+			LOGDEBUG("Got ckdb response: %s cmd %s", response, cmd);
+			if (cmdmatch(cmd, "heartbeat=")) {
+				strsep(&cmd, "=");
+				parse_ckdb_cmd(ckp, cmd);
+			}
+		} else
+			LOGWARNING("Got ckdb failure response: %s", buf);
+	} else
+		LOGWARNING("Got bad ckdb response: %s", buf);
+}
+
+/* Send one message on its own connection to ckdb, for ckdb versions that
+ * don't support streams */
 static void ckdbq_process(ckpool_t *ckp, char *msg)
 {
 	sdata_t *sdata = ckp->sdata;
-	size_t responselen;
 	char *buf = NULL;
 
 	while (!buf) {
@@ -6944,32 +9054,268 @@ static void ckdbq_process(ckpool_t *ckp, char *msg)
 	if (test_and_clear(&sdata->ckdb_offline, &sdata->ckdb_lock))
 		LOGWARNING("Successfully resumed talking to ckdb");
 
-	/* Process any requests from ckdb that are heartbeat responses with
-	 * specific requests. */
-	responselen = strlen(buf);
-	if (likely(responselen > 1)) {
-		char *response = alloca(responselen);
-		int offset = 0;
+	ckdb_response(ckp, buf);
+	free(buf);
+}
 
-		memset(response, 0, responselen);
-		if (likely(sscanf(buf, "%*d.%*d.%c%n", response, &offset) > 0)) {
-			strcpy(response + 1, buf + offset);
-			if (likely(safecmp(response, "ok"))) {
-				char *cmd;
-
-				cmd = response;
-				strsep(&cmd, ".");
-				LOGDEBUG("Got ckdb response: %s cmd %s", response, cmd);
-				if (cmdmatch(cmd, "heartbeat=")) {
-					strsep(&cmd, "=");
-					parse_ckdb_cmd(ckp, cmd);
-				}
-			} else
-				LOGWARNING("Got ckdb failure response: %s", buf);
-		} else
-			LOGWARNING("Got bad ckdb response: %s", buf);
+/* Join the pending messages from first onwards into one newline separated
+ * frame. Must be called with ckdb_stream_lock held. */
+static char *__ckdb_frame(ckdb_pending_t *first, int *count)
+{
+	ckdb_pending_t *pending;
+	size_t len = 0, ofs = 0;
+	char *buf;
+
+	*count = 0;
+	for (pending = first; pending; pending = pending->next)
+		len += pending->len + 1;
+	buf = ckalloc(len);
+	for (pending = first; pending; pending = pending->next) {
+		memcpy(buf + ofs, pending->msg, pending->len);
+		ofs += pending->len;
+		buf[ofs++] = '\n';
+		(*count)++;
+	}
+	buf[ofs - 1] = '\0';
+	return buf;
+}
+
+/* Match a reply on the ckdb stream to its message by the seqall it starts
+ * with and discard the message */
+static void ckdb_stream_reply(sdata_t *sdata, const char *buf)
+{
+	ckdb_pending_t *pending;
+	int64_t seqall;
+	char *end;
+
+	seqall = strtoll(buf, &end, 10);
+	if (unlikely(end == buf || *end != '.')) {
+		LOGWARNING("Got unmatched ckdb stream reply: %s", buf);
+		return;
+	}
+	mutex_lock(&sdata->ckdb_stream_lock);
+	HASH_FIND_I64(sdata->ckdb_pending_hash, &seqall, pending);
+	if (likely(pending)) {
+		HASH_DEL(sdata->ckdb_pending_hash, pending);
+		DL_DELETE(sdata->ckdb_pending, pending);
+		sdata->ckdb_inflight--;
+		pthread_cond_signal(&sdata->ckdb_stream_cond);
+	}
+	sdata->ckdb_stream_replies++;
+	mutex_unlock(&sdata->ckdb_stream_lock);
+
+	if (likely(pending)) {
+		free(pending->msg);
+		free(pending);
+	} else /* Resent messages may be answered twice */
+		LOGINFO("Got ckdb stream reply to unknown seqall %"PRId64, seqall);
+}
+
+/* Reads replies from the ckdb stream until it drops */
+static void *ckdb_stream_reader(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+	int sockd, ret;
+	char *buf;
+
+	pthread_detach(pthread_self());
+	rename_proc("ckdbstream");
+
+	/* The fd won't change till we flag the stream dead */
+	mutex_lock(&sdata->ckdb_stream_lock);
+	sockd = sdata->ckdb_stream_fd;
+	mutex_unlock(&sdata->ckdb_stream_lock);
+
+	while (42) {
+		ret = wait_read_select(sockd, 5);
+		if (!ret)
+			continue;
+		if (unlikely(ret < 0))
+			break;
+		buf = recv_unix_frame(sockd, UNIX_READ_TIMEOUT, UNIX_READ_TIMEOUT);
+		if (unlikely(!buf))
+			break;
+		ckdb_stream_reply(sdata, buf);
+		ckdb_response(ckp, buf);
+		free(buf);
+	}
+
+	mutex_lock(&sdata->ckdb_stream_lock);
+	sdata->ckdb_stream_dead = true;
+	pthread_cond_signal(&sdata->ckdb_stream_cond);
+	mutex_unlock(&sdata->ckdb_stream_lock);
+
+	LOGWARNING("Lost stream connection to ckdb");
+	return NULL;
+}
+
+/* Connect the ckdb stream and resend anything unanswered on a previous
+ * connection. Returns false if ckdb can't be reached or doesn't support
+ * streams. */
+static bool ckdb_stream_open(ckpool_t *ckp, sdata_t *sdata)
+{
+	char *buf, *frame = NULL;
+	int sockd, count = 0;
+	pthread_t pth;
+	bool ret;
+
+	/* Wait for any old reader to finish with its fd before closing it */
+	mutex_lock(&sdata->ckdb_stream_lock);
+	if (sdata->ckdb_stream_fd >= 0) {
+		while (!sdata->ckdb_stream_dead)
+			cond_wait(&sdata->ckdb_stream_cond, &sdata->ckdb_stream_lock);
+		Close(sdata->ckdb_stream_fd);
+	}
+	mutex_unlock(&sdata->ckdb_stream_lock);
+
+	sockd = open_unix_client(ckp->ckdb_sockname);
+	if (sockd < 0)
+		return false;
+	if (unlikely(!send_unix_frame(sockd, CKDB_STREAM))) {
+		Close(sockd);
+		return false;
+	}
+	buf = recv_unix_frame(sockd, UNIX_READ_TIMEOUT, UNIX_READ_TIMEOUT);
+	if (unlikely(!buf)) {
+		Close(sockd);
+		return false;
+	}
+	if (safecmp(buf, CKDB_STREAM_OK)) {
+		LOGWARNING("ckdb does not support streams, using a connection per message");
+		sdata->ckdb_stream_unsupported = true;
+		free(buf);
+		Close(sockd);
+		return false;
 	}
 	free(buf);
+
+	mutex_lock(&sdata->ckdb_stream_lock);
+	sdata->ckdb_stream_fd = sockd;
+	sdata->ckdb_stream_dead = false;
+	sdata->ckdb_stream_connects++;
+	if (sdata->ckdb_pending) {
+		frame = __ckdb_frame(sdata->ckdb_pending, &count);
+		sdata->ckdb_stream_frames++;
+		sdata->ckdb_stream_sent += count;
+	}
+	mutex_unlock(&sdata->ckdb_stream_lock);
+
+	create_pthread(&pth, ckdb_stream_reader, ckp);
+	LOGNOTICE("Connected stream to ckdb");
+	if (!frame)
+		return true;
+
+	LOGNOTICE("Resending %d unanswered messages to ckdb", count);
+	ret = send_unix_frame(sockd, frame);
+	free(frame);
+	if (unlikely(!ret))
+		shutdown(sockd, SHUT_RDWR);
+	return ret;
+}
+
+/* Add messages to the pending list, waiting for ckdb to make room if too many
+ * are unanswered, and return them as a frame if the stream is connected. */
+static char *ckdb_stream_queue(sdata_t *sdata, char **msgs, const int count, int *sockd)
+{
+	ckdb_pending_t *pending, *first = NULL;
+	char *frame = NULL;
+	int64_t replies;
+	ts_t abstime;
+	int i, sent;
+
+	mutex_lock(&sdata->ckdb_stream_lock);
+	while (sdata->ckdb_inflight >= CKDB_STREAM_INFLIGHT && sdata->ckdb_stream_fd >= 0 &&
+	       !sdata->ckdb_stream_dead) {
+		replies = sdata->ckdb_stream_replies;
+		ts_realtime(&abstime);
+		abstime.tv_sec += CKDB_STREAM_STALL;
+		cond_timedwait(&sdata->ckdb_stream_cond, &sdata->ckdb_stream_lock, &abstime);
+		if (replies == sdata->ckdb_stream_replies && !sdata->ckdb_stream_dead) {
+			LOGWARNING("ckdb stream stalled with %d unanswered messages, reconnecting",
+				   sdata->ckdb_inflight);
+			shutdown(sdata->ckdb_stream_fd, SHUT_RDWR);
+			break;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		pending = ckzalloc(sizeof(ckdb_pending_t));
+		pending->msg = msgs[i];
+		pending->len = strlen(msgs[i]);
+		pending->seqall = strtoll(strchr(msgs[i], '.') + 1, NULL, 10);
+		HASH_ADD_I64(sdata->ckdb_pending_hash, seqall, pending);
+		DL_APPEND(sdata->ckdb_pending, pending);
+		sdata->ckdb_inflight++;
+		if (!first)
+			first = pending;
+	}
+	*sockd = sdata->ckdb_stream_fd;
+	if (*sockd >= 0 && !sdata->ckdb_stream_dead) {
+		frame = __ckdb_frame(first, &sent);
+		sdata->ckdb_stream_frames++;
+		sdata->ckdb_stream_sent += sent;
+	}
+	mutex_unlock(&sdata->ckdb_stream_lock);
+
+	return frame;
+}
+
+/* Hand every pending message to the one connection per message path */
+static void ckdb_stream_fallback(ckpool_t *ckp, sdata_t *sdata)
+{
+	ckdb_pending_t *pendings, *pending, *tmp;
+
+	mutex_lock(&sdata->ckdb_stream_lock);
+	pendings = sdata->ckdb_pending;
+	HASH_CLEAR(hh, sdata->ckdb_pending_hash);
+	sdata->ckdb_pending = NULL;
+	sdata->ckdb_inflight = 0;
+	mutex_unlock(&sdata->ckdb_stream_lock);
+
+	DL_FOREACH_SAFE(pendings, pending, tmp) {
+		ckdbq_process(ckp, pending->msg);
+		free(pending);
+	}
+}
+
+/* Send a batch of queued messages to ckdb on the persistent stream. Replies are
+ * matched by the reader thread so many batches can be in flight at once. The
+ * messages are held till answered and resent if the stream drops, and further
+ * messages keep queueing in the ckdbq while ckdb is offline. */
+static void ckdbq_process_batch(ckpool_t *ckp, void **msgs, int count)
+{
+	sdata_t *sdata = ckp->sdata;
+	bool sent = false;
+	char *frame;
+	int sockd;
+
+	if (unlikely(sdata->ckdb_stream_unsupported)) {
+		int i;
+
+		for (i = 0; i < count; i++)
+			ckdbq_process(ckp, msgs[i]);
+		return;
+	}
+
+	frame = ckdb_stream_queue(sdata, (char **)msgs, count, &sockd);
+	if (frame) {
+		sent = send_unix_frame(sockd, frame);
+		free(frame);
+		if (unlikely(!sent))
+			shutdown(sockd, SHUT_RDWR);
+	}
+	while (!sent) {
+		sent = ckdb_stream_open(ckp, sdata);
+		if (unlikely(sdata->ckdb_stream_unsupported))
+			return ckdb_stream_fallback(ckp, sdata);
+		if (!sent) {
+			if (!test_and_set(&sdata->ckdb_offline, &sdata->ckdb_lock))
+				LOGWARNING("Failed to talk to ckdb, queueing messages");
+			sleep(5);
+		}
+	}
+	if (test_and_clear(&sdata->ckdb_offline, &sdata->ckdb_lock))
+		LOGWARNING("Successfully resumed talking to ckdb");
 }
 
 static int transactions_by_jobid(sdata_t *sdata, const int64_t id)
@@ -7097,7 +9443,7 @@ static void update_workerstats(ckpool_t *ckp, sdata_t *sdata)
 	sprintf(cdfield, "%lu,%lu", ts_now.tv_sec, ts_now.tv_nsec);
 	now_t = ts_now.tv_sec;
 
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	HASH_ITER(hh, sdata->user_instances, user, tmp) {
 		worker_instance_t *worker;
 		uint8_t cycle_mask;
@@ -7146,9 +9492,9 @@ static void update_workerstats(ckpool_t *ckp, sdata_t *sdata)
 			DL_APPEND(json_list, entry);
 		}
 	}
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
-	/* Add all entries outside of the instance lock */
+	/* Add all entries outside of the user lock */
 	DL_FOREACH_SAFE(json_list, entry, tmpentry) {
 		ckdbq_add(ckp, ID_WORKERSTATS, entry->val);
 		DL_DELETE(json_list, entry);
@@ -7156,36 +9502,6 @@ static void update_workerstats(ckpool_t *ckp, sdata_t *sdata)
 	}
 }
 
-static void add_log_entry(log_entry_t **entries, char **fname, char **buf)
-{
-	log_entry_t *entry = ckalloc(sizeof(log_entry_t));
-
-	entry->fname = *fname;
-	*fname = NULL;
-	entry->buf = *buf;
-	*buf = NULL;
-	DL_APPEND(*entries, entry);
-}
-
-static void dump_log_entries(log_entry_t **entries)
-{
-	log_entry_t *entry, *tmpentry;
-	FILE *fp;
-
-	DL_FOREACH_SAFE(*entries, entry, tmpentry) {
-		DL_DELETE(*entries, entry);
-		fp = fopen(entry->fname, "we");
-		if (likely(fp)) {
-			fprintf(fp, "%s", entry->buf);
-			fclose(fp);
-		} else
-			LOGERR("Failed to fopen %s in dump_log_entries", entry->fname);
-		free(entry->fname);
-		free(entry->buf);
-		free(entry);
-	}
-}
-
 static void upstream_workers(ckpool_t *ckp, user_instance_t *user)
 {
 	char buf[256];
@@ -7201,12 +9517,12 @@ static void upstream_workers(ckpool_t *ckp, user_instance_t *user)
  * Allows us to grab and drop the lock on each iteration. */
 static user_instance_t *next_user(sdata_t *sdata, user_instance_t *user)
 {
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	if (unlikely(!user))
 		user = sdata->user_instances;
 	else
 		user = user->hh.next;
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
 	return user;
 }
@@ -7214,16 +9530,76 @@ static user_instance_t *next_user(sdata_t *sdata, user_instance_t *user)
 /* Ditto for worker */
 static worker_instance_t *next_worker(sdata_t *sdata, user_instance_t *user, worker_instance_t *worker)
 {
-	ck_rlock(&sdata->instance_lock);
+	ck_rlock(&sdata->user_lock);
 	if (!worker)
 		worker = user->worker_instances;
 	else
 		worker = worker->next;
-	ck_runlock(&sdata->instance_lock);
+	ck_runlock(&sdata->user_lock);
 
 	return worker;
 }
 
+/* Decay and test the liveness of each client on this shard, returning how
+ * many are idle */
+static int update_shard_clients(ckpool_t *ckp, instance_shard_t *shard)
+{
+	stratum_instance_t *client;
+	int idle_workers = 0;
+	double per_tdiff;
+	tv_t now;
+
+	shard_wlock(shard);
+	/* Grab the first entry */
+	client = shard->instances;
+	if (likely(client))
+		__inc_instance_ref(client);
+	shard_wunlock(shard);
+
+	while (client) {
+		tv_time(&now);
+		/* Look for clients that may have been dropped which the
+		 * stratifier has not been informed about and ask the
+		 * connector if they still exist */
+		if (client->dropped)
+			connector_test_client(ckp, client->id);
+		else if (client->node || client->remote) {
+			/* Do nothing to these */
+		} else if (!client->authorised) {
+			/* Test for clients that haven't authed in over a minute
+			 * and drop them lazily */
+			if (now.tv_sec > client->start_time + 60) {
+				client->dropped = true;
+				connector_drop_client(ckp, client->id);
+			}
+		} else {
+			per_tdiff = tvdiff(&now, &client->last_share);
+			/* Decay times per connected instance */
+			if (per_tdiff > 60) {
+				/* No shares for over a minute, decay to 0 */
+				decay_client(client, 0, &now);
+				idle_workers++;
+				if (per_tdiff > 600)
+					client->idle = true;
+				/* Test idle clients are still connected */
+				connector_test_client(ckp, client->id);
+			}
+		}
+
+		shard_wlock(shard);
+		/* Drop the reference of the last entry we examined,
+		 * then grab the next client. */
+		__dec_instance_ref(client);
+		client = client->hh.next;
+		/* Grab a reference to this client allowing us to examine
+		 * it without holding the lock */
+		if (likely(client))
+			__inc_instance_ref(client);
+		shard_wunlock(shard);
+	}
+	return idle_workers;
+}
+
 static void *statsupdate(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
@@ -7238,12 +9614,11 @@ static void *statsupdate(void *arg)
 	sleep(1);
 
 	while (42) {
-		double ghs, ghs1, ghs5, ghs15, ghs60, ghs360, ghs1440, ghs10080, per_tdiff;
+		double ghs1, ghs5, ghs15, ghs60, ghs360, ghs1440, ghs10080, per_tdiff;
 		char suffix1[16], suffix5[16], suffix15[16], suffix60[16], cdfield[64];
 		char suffix360[16], suffix1440[16], suffix10080[16];
-		log_entry_t *log_entries = NULL;
 		char_entry_t *char_list = NULL;
-		stratum_instance_t *client;
+		stats_record_t record;
 		user_instance_t *user;
 		int idle_workers = 0;
 		char *fname, *s, *sp;
@@ -7256,54 +9631,10 @@ static void *statsupdate(void *arg)
 		tv_time(&now);
 		timersub(&now, &stats->start_time, &diff);
 
-		ck_wlock(&sdata->instance_lock);
-		/* Grab the first entry */
-		client = sdata->stratum_instances;
-		if (likely(client))
-			__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
-
-		while (client) {
-			tv_time(&now);
-			/* Look for clients that may have been dropped which the
-			 * stratifier has not been informed about and ask the
-			 * connector if they still exist */
-			if (client->dropped)
-				connector_test_client(ckp, client->id);
-			else if (client->node || client->remote) {
-				/* Do nothing to these */
-			} else if (!client->authorised) {
-				/* Test for clients that haven't authed in over a minute
-				 * and drop them lazily */
-				if (now.tv_sec > client->start_time + 60) {
-					client->dropped = true;
-					connector_drop_client(ckp, client->id);
-				}
-			} else {
-				per_tdiff = tvdiff(&now, &client->last_share);
-				/* Decay times per connected instance */
-				if (per_tdiff > 60) {
-					/* No shares for over a minute, decay to 0 */
-					decay_client(client, 0, &now);
-					idle_workers++;
-					if (per_tdiff > 600)
-						client->idle = true;
-					/* Test idle clients are still connected */
-					connector_test_client(ckp, client->id);
-				}
-			}
-
-			ck_wlock(&sdata->instance_lock);
-			/* Drop the reference of the last entry we examined,
-			 * then grab the next client. */
-			__dec_instance_ref(client);
-			client = client->hh.next;
-			/* Grab a reference to this client allowing us to examine
-			 * it without holding the lock */
-			if (likely(client))
-				__inc_instance_ref(client);
-			ck_wunlock(&sdata->instance_lock);
-		}
+		/* Walk each shard in turn so only one shard's lock is ever
+		 * briefly held */
+		for (i = 0; i < INSTANCE_SHARDS; i++)
+			idle_workers += update_shard_clients(ckp, &sdata->shards[i]);
 
 		user = NULL;
 
@@ -7324,37 +9655,9 @@ static void *statsupdate(void *arg)
 					decay_worker(worker, 0, &now);
 					worker->idle = true;
 				}
-				ghs = worker->dsps1 * nonces;
-				suffix_string(ghs, suffix1, 16, 0);
-
-				ghs = worker->dsps5 * nonces;
-				suffix_string(ghs, suffix5, 16, 0);
-
-				ghs = worker->dsps60 * nonces;
-				suffix_string(ghs, suffix60, 16, 0);
-
-				ghs = worker->dsps1440 * nonces;
-				suffix_string(ghs, suffix1440, 16, 0);
-
-				ghs = worker->dsps10080 * nonces;
-				suffix_string(ghs, suffix10080, 16, 0);
-
 				copy_tv(&worker->last_update, &now);
-
-				JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,sI,sf}",
-						"hashrate1m", suffix1,
-						"hashrate5m", suffix5,
-						"hashrate1hr", suffix60,
-						"hashrate1d", suffix1440,
-						"hashrate7d", suffix10080,
-						"lastupdate", now.tv_sec,
-						"shares", worker->shares,
-						"bestshare", worker->best_diff);
-
-				ASPRINTF(&fname, "%s/workers/%s", ckp->logdir, worker->workername);
-				s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL);
-				add_log_entry(&log_entries, &fname, &s);
-				json_decref(val);
+				stats_worker_record(worker, &record);
+				store_stats_record(sdata, &worker->stats_id, worker->workername, &record);
 			}
 
 			/* Decay times per user */
@@ -7363,53 +9666,30 @@ static void *statsupdate(void *arg)
 				decay_user(user, 0, &now);
 				idle = true;
 			}
-			ghs = user->dsps1 * nonces;
-			suffix_string(ghs, suffix1, 16, 0);
-
-			ghs = user->dsps5 * nonces;
-			suffix_string(ghs, suffix5, 16, 0);
-
-			ghs = user->dsps60 * nonces;
-			suffix_string(ghs, suffix60, 16, 0);
-
-			ghs = user->dsps1440 * nonces;
-			suffix_string(ghs, suffix1440, 16, 0);
-
-			ghs = user->dsps10080 * nonces;
-			suffix_string(ghs, suffix10080, 16, 0);
-
 			copy_tv(&user->last_update, &now);
-
-			JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,si,sI,sf}",
-					"hashrate1m", suffix1,
-					"hashrate5m", suffix5,
-					"hashrate1hr", suffix60,
-					"hashrate1d", suffix1440,
-					"hashrate7d", suffix10080,
-					"lastupdate", now.tv_sec,
-					"workers", user->workers + user->remote_workers,
-					"shares", user->shares,
-					"bestshare", user->best_diff);
+			stats_user_record(user, &record);
+			store_stats_record(sdata, &user->stats_id, user->username, &record);
 
 			/* Reset the remote_workers count once per minute */
 			user->remote_workers = 0;
 
-			ASPRINTF(&fname, "%s/users/%s", ckp->logdir, user->username);
-			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL);
-			add_log_entry(&log_entries, &fname, &s);
 			if (!idle) {
+				val = stats_record_json(&record);
 				s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 				ASPRINTF(&sp, "User %s:%s", user->username, s);
 				dealloc(s);
 				add_msg_entry(&char_list, &sp);
+				json_decref(val);
 			}
-			json_decref(val);
 			if (ckp->remote)
 				upstream_workers(ckp, user);
 		}
 
-		/* Dump log entries out of instance_lock */
-		dump_log_entries(&log_entries);
+		if (sdata->statstore) {
+			mutex_lock(&sdata->statstore_lock);
+			statstore_sync(sdata->statstore);
+			mutex_unlock(&sdata->statstore_lock);
+		}
 		notice_msg_entries(&char_list);
 
 		ghs1 = stats->dsps1 * nonces;
@@ -7545,11 +9825,20 @@ static void *statsupdate(void *arg)
 		/* Update stats 32 times per minute to divide up userstats for
 		 * ckdb, displaying status every minute. */
 		for (i = 0; i < 32; i++) {
+			int workers;
+
 			cksleep_ms_r(&stats->last_update, 1875);
 			cksleep_prepare_r(&stats->last_update);
+			fold_user_stats(sdata);
 			update_workerstats(ckp, sdata);
 
+			/* stats.workers is protected by user_lock */
+			ck_rlock(&sdata->user_lock);
+			workers = stats->workers;
+			ck_runlock(&sdata->user_lock);
+
 			mutex_lock(&sdata->stats_lock);
+			__fold_accumulators(sdata);
 			stats->accounted_shares += stats->unaccounted_shares;
 			stats->accounted_diff_shares += stats->unaccounted_diff_shares;
 			stats->accounted_rejects += stats->unaccounted_rejects;
@@ -7567,6 +9856,8 @@ static void *statsupdate(void *arg)
 			decay_time(&stats->dsps1440, stats->unaccounted_diff_shares, 1.875, DAY);
 			decay_time(&stats->dsps10080, stats->unaccounted_diff_shares, 1.875, WEEK);
 
+			__update_rate_budget(ckp, sdata, workers);
+
 			stats->unaccounted_shares =
 			stats->unaccounted_diff_shares =
 			stats->unaccounted_rejects = 0;
@@ -7594,6 +9885,8 @@ static void *ckdb_heartbeat(void *arg)
 		json_t *val;
 
 		cksleep_ms(1000);
+		if (sdata->ckdb_log)
+			rotating_log_flush(sdata->ckdb_log);
 		if (unlikely(!ckmsgq_empty(sdata->ckdbq))) {
 			LOGDEBUG("Witholding heartbeat due to ckdb messages being queued");
 			continue;
@@ -7709,16 +10002,18 @@ static bool script_address(const char *btcaddress)
 void *stratifier(void *arg)
 {
 	proc_instance_t *pi = (proc_instance_t *)arg;
-	pthread_t pth_blockupdate, pth_statsupdate, pth_heartbeat;
+	pthread_t pth_blockupdate, pth_statsupdate, pth_heartbeat, pth_sharelogger;
 	ckpool_t *ckp = pi->ckp;
 	int64_t randomiser;
 	char *buf = NULL;
 	sdata_t *sdata;
-	int threads;
+	int threads, lanes, i;
 
 	rename_proc(pi->processname);
 	LOGWARNING("%s stratifier starting", ckp->name);
 	sdata = ckzalloc(sizeof(sdata_t));
+	/* Templates may be handed to the stratifier as soon as it's set */
+	cklock_init(&sdata->workbase_lock);
 	ckp->sdata = sdata;
 	sdata->ckp = ckp;
 	sdata->verbose = true;
@@ -7767,25 +10062,60 @@ void *stratifier(void *arg)
 	if (!ckp->proxy)
 		sdata->blockchange_id = sdata->workbase_id = randomiser;
 
+	for (i = 0; i < INSTANCE_SHARDS; i++)
+		cklock_init(&sdata->shards[i].lock);
 	cklock_init(&sdata->instance_lock);
+	cklock_init(&sdata->user_lock);
+	sdata->rate_scale = 1;
 	cksem_init(&sdata->update_sem);
 	cksem_post(&sdata->update_sem);
 
 	mutex_init(&sdata->ckdb_lock);
 	mutex_init(&sdata->ckdb_msg_lock);
-	/* Create half as many share processing and receiving threads as there
-	 * are CPUs */
+	mutex_init(&sdata->ckdb_stream_lock);
+	cond_init(&sdata->ckdb_stream_cond);
+	sdata->ckdb_stream_fd = -1;
+	if (!CKP_STANDALONE(ckp)) {
+		char logname[512];
+
+		snprintf(logname, 511, "%s%s", ckp->logdir, ckp->ckdb_name);
+		sdata->ckdb_log = create_rotating_log(logname, true);
+	}
+	/* Create half as many share processing threads as there are CPUs */
 	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
-	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
+	/* Hash shares in batches if the multi buffer sha256d is available and
+	 * matches the scalar code */
+	lanes = sha256_lanes();
+	if (lanes > 1 && (!sha256d_multi_test() || !stratifier_share_test())) {
+		LOGWARNING("Multi buffer sha256d does not match scalar results, disabling");
+		lanes = 1;
+	}
+	if (lanes > 1)
+		LOGNOTICE("Processing shares in batches of up to %d", lanes);
+	sdata->sshareq_count = threads;
+	sdata->sshareqs = ckalloc(sizeof(ckmsgq_t *) * threads);
+	for (i = 0; i < threads; i++) {
+		char name[16];
+
+		snprintf(name, 15, "sprocessor%x", i);
+		if (lanes > 1)
+			sdata->sshareqs[i] = create_ckmsgqs_batch(ckp, name, &sshare_process_batch,
+								  1, lanes);
+		else
+			sdata->sshareqs[i] = create_ckmsgq(ckp, name, &sshare_process);
+	}
+	/* Sends and receives to each client must stay in order so they get
+	 * one consumer each */
+	sdata->ssends = create_ckmsgq(ckp, "ssender", &ssend_process);
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
-	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
-	sdata->ckdbq = create_ckmsgqs(ckp, "ckdbqueue", &ckdbq_process, threads);
+	sdata->srecvs = create_ckmsgq(ckp, "sreceiver", &srecv_process);
+	/* One ordered sender feeds the ckdb stream, replies arrive separately */
+	sdata->ckdbq = create_ckmsgqs_batch(ckp, "ckdbqueue", &ckdbq_process_batch, 1,
+					    CKDB_STREAM_BATCH);
 	create_pthread(&pth_heartbeat, ckdb_heartbeat, ckp);
 	read_poolstats(ckp);
 
-	cklock_init(&sdata->workbase_lock);
 	if (!ckp->proxy)
 		create_pthread(&pth_blockupdate, blockupdate, ckp);
 	else {
@@ -7793,11 +10123,22 @@ void *stratifier(void *arg)
 	}
 
 	mutex_init(&sdata->stats_lock);
+	mutex_init(&sdata->statstore_lock);
+	load_statstore(ckp, sdata);
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
-	mutex_init(&sdata->share_lock);
+	rwlock_init(&sdata->share_lock);
 	mutex_init(&sdata->block_lock);
+	mutex_init(&sdata->postponed_lock);
+	mutex_init(&sdata->merkle_lock);
+
+	if (ckp->logshares) {
+		mutex_init(&sdata->sharelog_lock);
+		cond_init(&sdata->sharelog_cond);
+		cond_init(&sdata->sharelog_space_cond);
+		create_pthread(&pth_sharelogger, sharelogger, ckp);
+	}
 
 	LOGWARNING("%s stratifier ready", ckp->name);
 
@@ -7805,6 +10146,8 @@ void *stratifier(void *arg)
 out:
 	/* We should never get here unless there's a fatal error */
 	LOGEMERG("Stratifier failure, shutting down");
+	if (sdata->ckdb_log)
+		rotating_log_flush(sdata->ckdb_log);
 	exit(1);
 	return NULL;
 }
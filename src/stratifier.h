@@ -10,7 +10,11 @@
 #ifndef STRATIFIER_H
 #define STRATIFIER_H
 
+#include "bitcoin.h"
+
 void stratifier_add_recv(ckpool_t *ckp, json_t *val);
+void stratifier_template(ckpool_t *ckp, gbttemplate_t *tmpl);
+bool stratifier_share_test(void);
 void *stratifier(void *arg);
 
 #endif /* STRATIFIER_H */
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Check new blocks reach the pool through getblocktemplate longpoll instead of
+# polling, against a mock bitcoind finding a block every 2 seconds.
+command -v python3 >/dev/null 2>&1 || exit 77
+command -v timeout >/dev/null 2>&1 || exit 77
+
+dir="${TMPDIR:-/tmp}/ckpool-longpoll.$$"
+port=$((20000 + $$ % 20000))
+rm -rf "$dir"
+mkdir -p "$dir"
+
+python3 "${srcdir:-.}/test/mockbitcoind.py" $port 2 >"$dir/mock.log" 2>&1 &
+mock=$!
+trap 'kill $mock 2>/dev/null; rm -rf "$dir"' EXIT
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	grep -q READY "$dir/mock.log" && break
+	sleep 1
+done
+
+cat >"$dir/ckpool.conf" <<EOF
+{
+"btcd" : [{"url" : "127.0.0.1:$port", "auth" : "user", "pass" : "pass"}],
+"btcaddress" : "1BitcoinEaterAddressDontSendf59kuE",
+"serverurl" : ["127.0.0.1:$((port + 1))"],
+"logdir" : "$dir/logs",
+"longpoll" : true
+}
+EOF
+timeout 9 ./ckpool -c "$dir/ckpool.conf" -s "$dir/sock" -n longpolltest >/dev/null 2>&1
+
+blocks=$(grep -c "Block hash changed" "$dir/logs/longpolltest.log")
+longpolls=$(grep -c "CALL getblocktemplate longpoll" "$dir/mock.log")
+polls=$(grep -c "CALL getbestblockhash" "$dir/mock.log")
+echo "blocks $blocks longpolls $longpolls getbestblockhash $polls"
+# Polling every 100ms would call getbestblockhash dozens of times
+[ "$blocks" -ge 3 ] && [ "$longpolls" -ge 3 ] && [ "$polls" -lt 20 ]
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+# Minimal bitcoind JSON-RPC mock for the tests. It finds a new empty block
+# every PERIOD seconds and answers the calls ckpool makes in pool mode,
+# holding getblocktemplate longpolls until the tip changes. Each call is
+# logged as "CALL <method>" and each new block as "NEWBLOCK <height>".
+#
+# Usage: mockbitcoind.py PORT PERIOD [nolongpoll]
+
+import json
+import socket
+import sys
+import threading
+import time
+
+port = int(sys.argv[1])
+period = float(sys.argv[2])
+longpoll = len(sys.argv) < 4 or sys.argv[3] != "nolongpoll"
+
+lock = threading.Condition()
+tip = {"height": 800000, "times": {800000: int(time.time())}}
+out = threading.Lock()
+
+
+def log(msg):
+    with out:
+        print(msg, flush=True)
+
+
+def blockhash(height):
+    return "%064x" % height
+
+
+def template():
+    height = tip["height"]
+    gbt = {"version": 536870912, "rules": ["csv", "!segwit"],
+           "previousblockhash": blockhash(height), "transactions": [],
+           "coinbaseaux": {"flags": ""}, "coinbasevalue": 625000000,
+           "target": "0" * 19 + "f" * 45, "curtime": int(time.time()),
+           "bits": "17053894", "height": height + 1}
+    if longpoll:
+        gbt["longpollid"] = blockhash(height) + "1"
+    return gbt
+
+
+def blocks():
+    while True:
+        time.sleep(period)
+        with lock:
+            tip["height"] += 1
+            tip["times"][tip["height"]] = int(time.time())
+            log("NEWBLOCK %d" % tip["height"])
+            lock.notify_all()
+
+
+def call(method, params):
+    if method == "getblocktemplate":
+        lpid = params[0].get("longpollid") if params else None
+        if lpid and longpoll:
+            with lock:
+                while lpid == blockhash(tip["height"]) + "1":
+                    lock.wait()
+        return template()
+    if method == "validateaddress":
+        return {"isvalid": True}
+    if method in ("getbestblockhash", "getblockhash"):
+        return blockhash(tip["height"])
+    if method == "getblockcount":
+        return tip["height"]
+    if method == "getblockheader":
+        height = int(params[0], 16)
+        return {"hash": params[0], "height": height, "bits": "17053894",
+                "time": tip["times"].get(height, 0),
+                "previousblockhash": blockhash(height - 1)}
+    return None
+
+
+def serve(conn):
+    rfile = conn.makefile("rb")
+    while rfile.readline():
+        headers = {}
+        while True:
+            line = rfile.readline()
+            if line in (b"\r\n", b"\n", b""):
+                break
+            key, value = line.decode().split(":", 1)
+            headers[key.lower()] = value.strip()
+        req = json.loads(rfile.read(int(headers["content-length"])))
+        method = req["method"]
+        log("CALL %s%s" % (method, " longpoll" if method == "getblocktemplate" and
+                           req.get("params") and "longpollid" in req["params"][0] else ""))
+        res = json.dumps({"result": call(method, req.get("params", [])),
+                          "error": None, "id": req.get("id")}).encode()
+        conn.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n" % len(res) + res)
+
+
+sock = socket.socket()
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+sock.bind(("127.0.0.1", port))
+sock.listen(50)
+threading.Thread(target=blocks, daemon=True).start()
+log("READY")
+while True:
+    conn, _ = sock.accept()
+    threading.Thread(target=serve, args=(conn,), daemon=True).start()
@@ -0,0 +1,4 @@
+#!/bin/sh
+# Check shares hashed in batches match shares hashed one at a time, as run
+# before the benchmark.
+exec ./ckpool -B -s "${TMPDIR:-/tmp}/ckpool-test" >/dev/null